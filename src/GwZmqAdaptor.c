@@ -13,10 +13,189 @@
 * specific language governing permissions and limitations under the License.
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "GwZmqAdaptor.h"
+#include "GwZmqMetrics.h"
+#include "GwZmqSubscriptions.h"
+#include "GwZmqSpool.h"
+#include "GwZmqConsumers.h"
+#include "GwZmqCoalescer.h"
+#include "GwZmqCompressor.h"
+#include "GwZmqRouter.h"
+#include "GwZmqAggregator.h"
+#include "GwZmqRing.h"
+#include "GwZmqMonitor.h"
+#include "GwZmqShm.h"
+#include "GwZmqHistogram.h"
+#include "GwZmqReplay.h"
+#include "GwZmqBalancer.h"
+#include "GwZmqHandover.h"
 #include "czmq.h"
 #include "time.h"
 
+typedef struct _gw_listener_t gw_listener_t;
+
+/**
+* Frames received in one wakeup of a forwarding thread.
+* The slots are initialized once: zmq_msg_recv releases the previous content of a slot and zmq_msg_send leaves it
+* empty, so they're reused for the lifetime of the thread without any allocation.
+*/
+typedef struct {
+    int size;
+    zmq_msg_t *slots;
+    int *flags;
+    /** trace stamp of each slot, only used when the listener traces messages, or the time it was received */
+    uint64_t *stamps;
+    /** records the time each message forwarded spent in the thread, from its receipt until it's sent */
+    gw_histogram_t *latency;
+} gw_batch_t;
+
+/**
+* Token bucket limiting the messages a shard accepts from its ingress endpoint: it holds up to one second worth of
+* tokens, refilled at rate tokens per second, and each message takes one. A rate of 0 doesn't limit anything.
+*/
+typedef struct {
+    double rate;
+    double tokens;
+    uint64_t refilled_at;
+} gw_token_bucket_t;
+
+typedef struct {
+    gw_listener_t *listener;
+    int index;
+    int cpu;
+    char endpoint[256];
+    /** XSUB socket bound to the shard's ingress endpoint, NULL for a shared memory endpoint */
+    void *frontend;
+    /** rings the gateway workers write to when the endpoint is a shm:// one */
+    gw_shm_reader_t *shm;
+    /** the XPUB socket when there's a single shard, otherwise the inproc PAIR the subscriptions come back on */
+    void *backend;
+    /** carries the messages to the egress thread when there are several shards */
+    gw_ring_t *ring;
+    pthread_t thread;
+    gw_metrics_t *metrics;
+    gw_shard_stats_t reported;
+    gw_token_bucket_t bucket;
+    /** messages left before the next traced one */
+    int trace_countdown;
+    /** set by the shard thread once it let go of its ingress endpoint, and once it forwarded what was left */
+    volatile int released;
+    volatile int drained;
+    uint64_t released_at;
+} gw_shard_t;
+
+/**
+* A trace stamp packs the monotonic time a sampled message was received at, in microseconds, with the index of its
+* ingress shard in the low GW_TRACE_SHARD_BITS bits, so it fits the 64 bits a ring carries along with a frame.
+* Stamps are never 0, which is what the frames which aren't traced carry.
+*/
+#define GW_TRACE_SHARD_BITS 8
+
+#define GW_TRACE_STAMP(usec, shard) (((uint64_t) (usec) << GW_TRACE_SHARD_BITS) | (uint64_t) (shard))
+
+/**
+* Minimum spin of GW_WAIT_SPIN, when spinning pays off at all.
+*/
+#define GW_MIN_SPIN_USEC 5
+
+/**
+* Weight of the latest wait in the moving average of the waits of a thread: 1 / GW_WAIT_AVERAGE_WEIGHT.
+*/
+#define GW_WAIT_AVERAGE_WEIGHT 8
+
+/**
+* Wait strategy of a forwarding thread, along with what it learnt about the arrival of its messages.
+*/
+typedef struct {
+    int strategy;
+    int max_spin_usec;
+    /** how long the next wait spins before sleeping, in microseconds */
+    int spin_budget;
+    /** moving average of the time the thread waited for its messages, in microseconds */
+    double average_wait;
+    /** end of the previous wait: the time until the next one is spent forwarding */
+    uint64_t woke_at;
+    gw_metrics_t *metrics;
+} gw_waiter_t;
+
+struct _gw_listener_t {
+    int id;
+    zctx_t *ctx;
+    volatile int running;
+    /** the shards stop taking messages in, set by gw_zmq_drain */
+    volatile int draining;
+    /** what's left is spooled instead of published, once the drain deadline passed */
+    volatile int spilling;
+    void *publisher;
+    int shard_count;
+    gw_shard_t shards[GW_MAX_SHARDS];
+    /** egress side of the inproc PAIRs sending the subscriptions to the shards, owned by the egress thread */
+    void *egress_pipes[GW_MAX_SHARDS];
+    int egress_cpu;
+    int batch_size;
+    int wait_strategy;
+    int spin_usec;
+    int has_egress_thread;
+    /** some of the shards read from shared memory */
+    int has_shm_shards;
+    pthread_t egress_thread;
+    gw_metrics_t *egress_metrics;
+    gw_metrics_reporter_t *reporter;
+    /** topics subscribed on the XPUB, owned by the thread owning the XPUB */
+    gw_subscriptions_t *subscriptions;
+    /** optional disk spool for the messages consumers can't take, owned by the thread owning the XPUB */
+    gw_spool_t *spool;
+    /** optional packing of small messages, owned by the thread owning the XPUB */
+    gw_coalescer_t *coalescer;
+    /** compresses messages for the consumers of compressed topics, NULL when compression is off */
+    gw_compressor_t *compressor;
+    /** optional content based routing to additional egress sockets, owned by the thread owning the XPUB */
+    gw_router_t *router;
+    /** optional rollup of the usage records, owned by the thread owning the XPUB */
+    gw_aggregator_t *aggregator;
+    /** optional window of the last messages consumers catch up from, owned by the thread owning the XPUB */
+    gw_replay_t *replay;
+    /** optional egress spreading the messages over competing workers, owned by the thread owning the XPUB */
+    gw_balancer_t *balancer;
+    /** the aggregated records are only published as rollups */
+    int aggregate_only;
+    /** connections of the consumers to the XPUB, owned by the monitor thread */
+    gw_consumers_t *consumers;
+    /** bytes published and messages refused by the XPUB when the consumers were last sampled, by the monitor thread */
+    uint64_t sampled_bytes;
+    uint64_t sampled_refused;
+    int64_t sampled_at;
+    /** watches the socket monitors, NULL when no socket is monitored */
+    gw_monitor_t *monitor;
+    /** the XSUBs are connected to upstream adaptors, whose trailing frames are stripped */
+    int relay;
+    /** milliseconds a message waits for the XPUB to take its first frame, 0 when it's refused right away */
+    int send_timeout;
+    /** latency of the hop from each upstream adaptor, owned by the thread owning the XPUB */
+    gw_histogram_t *relay_hops[GW_MAX_SHARDS];
+    /** one message in trace_sample is traced, 0 when the tracing is off */
+    int trace_sample;
+    int trace_envelope;
+    /** residence times of the traced messages per ingress shard and on the XPUB, owned by the thread owning the XPUB */
+    gw_histogram_t *trace_ingress[GW_MAX_SHARDS];
+    gw_histogram_t *trace_egress;
+    char publisher_address[256];
+    int64_t reported_at;
+    gw_listener_t *next;
+};
+
+/**
+* Listeners started with start_gateway_listener, so that gw_zmq_destroy can stop their threads
+* before the sockets are closed with the context.
+*/
+static gw_listener_t *gw_listeners = NULL;
+
+static int gw_listener_count = 0;
+
 char*
 timestamp() {
     time_t rawtime;
@@ -34,6 +213,14 @@ timestamp() {
     return result;
 }
 
+static uint64_t
+monotonic_usecs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
 zctx_t *
 gw_zmq_init()
 {
@@ -42,182 +229,2336 @@ gw_zmq_init()
     return ctx;
 }
 
+/**
+* Creates the context with the I/O threads set in the options.
+* The I/O threads are started with the first socket so they can't be changed afterwards.
+*/
+zctx_t *
+gw_zmq_init_with_options(gw_listener_options_t *options)
+{
+    zctx_t *ctx = gw_zmq_init();
+
+    if (options->io_threads != GW_SOCKET_OPTION_DEFAULT) {
+        zctx_set_iothreads(ctx, options->io_threads);
+    }
+    fprintf(stderr, "[%s] - Using %d ZMQ I/O thread(s)\n", timestamp(),
+            options->io_threads != GW_SOCKET_OPTION_DEFAULT ? options->io_threads : 1);
+    return ctx;
+}
+
+static void
+stop_gateway_listeners(zctx_t *ctx);
+
+static void
+stop_gateway_pushers(zctx_t *ctx);
+
 void
 gw_zmq_destroy( zctx_t **ctx )
 {
+    // The forwarding threads own their sockets so they have to stop before the context closes them
+    stop_gateway_listeners(*ctx);
+    stop_gateway_pushers(*ctx);
     //  Tell attached threads to exit
     zctx_destroy(ctx);
 }
 
+/**
+* The XPUB is owned by the thread forwarding to it; the counters of that thread tell how fast it's fed.
+*/
+static gw_metrics_t *
+publisher_metrics(gw_listener_t *listener)
+{
+    return listener->has_egress_thread ? listener->egress_metrics : listener->shards[0].metrics;
+}
+
 static int
-read_message(void* socket, zmq_event_t* event, char* endpoint) {
-    zmq_msg_t binary;
+listeners_drained(zctx_t *ctx)
+{
+    gw_listener_t *listener;
+    int i;
+    for (listener = gw_listeners; listener != NULL; listener = listener->next) {
+        if (listener->ctx != ctx) {
+            continue;
+        }
+        for (i = 0; i < listener->shard_count; i++) {
+            gw_shard_t *shard = &listener->shards[i];
+            if (!shard->drained || (shard->ring != NULL && gw_ring_depth(shard->ring) > 0)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
 
-    zmq_msg_init(&binary);
+static int
+wait_for_drain(zctx_t *ctx, int64_t deadline)
+{
+    int drained;
+    while (!(drained = listeners_drained(ctx)) && zclock_time() < deadline) {
+        zclock_sleep(GW_DRAIN_CHECK_MSEC);
+    }
+    return drained;
+}
 
-    int result = zmq_msg_recv(&binary, socket, 0);
+/**
+* Adds up the counters of the threads owning the XPUBs of ctx; the frames still in the rings are counted as left.
+*/
+static void
+drain_counters(zctx_t *ctx, gw_drain_stats_t *stats)
+{
+    gw_listener_t *listener;
+    int i;
 
-    if (result == -1) {
-        return -1;
+    memset(stats, 0, sizeof(*stats));
+    for (listener = gw_listeners; listener != NULL; listener = listener->next) {
+        if (listener->ctx != ctx) {
+            continue;
+        }
+        gw_metrics_t *metrics = publisher_metrics(listener);
+        stats->drained += GW_COUNTER_GET(metrics->messages_out);
+        stats->dropped += GW_COUNTER_GET(metrics->dropped_hwm) + GW_COUNTER_GET(metrics->dropped_unsubscribed);
+        if (listener->spool != NULL) {
+            stats->spilled += gw_spool_spooled(listener->spool);
+        }
+        for (i = 0; i < listener->shard_count; i++) {
+            if (listener->shards[i].ring != NULL) {
+                stats->left += gw_ring_depth(listener->shards[i].ring);
+            }
+        }
     }
+}
 
-    assert(zmq_msg_more(&binary) != 0);
-
-    zmq_msg_t address;
+int
+gw_zmq_drain(zctx_t *ctx, int timeoutMsec, gw_drain_stats_t *stats)
+{
+    gw_listener_t *listener;
+    gw_drain_stats_t before;
+    gw_drain_stats_t after;
+    int64_t startedAt = zclock_time();
+    int spillable = 0;
 
-    zmq_msg_init(&address);
-    result = zmq_msg_recv(&address, socket, 0);
+    drain_counters(ctx, &before);
+    for (listener = gw_listeners; listener != NULL; listener = listener->next) {
+        if (listener->ctx == ctx) {
+            listener->draining = 1;
+            spillable |= listener->spool != NULL;
+        }
+    }
+    int drained = wait_for_drain(ctx, startedAt + timeoutMsec);
+    if (!drained && spillable) {
+        // the consumers can't take the rest in time, the next run replays it from the spool
+        fprintf(stderr, "[%s] - Drain deadline of %d ms passed, spooling the messages left\n", timestamp(),
+                timeoutMsec);
+        for (listener = gw_listeners; listener != NULL; listener = listener->next) {
+            if (listener->ctx == ctx) {
+                listener->spilling = 1;
+            }
+        }
+        drained = wait_for_drain(ctx, zclock_time() + GW_DRAIN_SPILL_MSEC);
+    }
+    drain_counters(ctx, &after);
 
-    if (result == -1) {
-        return -1;
+    gw_drain_stats_t report;
+    report.drained = after.drained - before.drained;
+    report.spilled = after.spilled - before.spilled;
+    report.dropped = after.dropped - before.dropped;
+    report.left = after.left;
+    report.elapsed_msec = (uint64_t) (zclock_time() - startedAt);
+    report.rate = report.elapsed_msec > 0 ? report.drained * 1000.0 / report.elapsed_msec : 0;
+    fprintf(stderr, "[%s] - %s in %llu ms: %llu messages published ( %.0f msg/s ), %llu spooled, %llu dropped%s\n",
+            timestamp(), drained ? "Drained" : "Gave up draining", (unsigned long long) report.elapsed_msec,
+            (unsigned long long) report.drained, report.rate, (unsigned long long) report.spilled,
+            (unsigned long long) report.dropped, drained ? "" : ", the rest of the ingress queues is lost");
+    if (stats != NULL) {
+        *stats = report;
     }
 
-    assert(zmq_msg_more(&address) == 0);
+    // what's queued for the consumers goes out while the sockets close, within what's left of the deadline
+    int64_t remaining = startedAt + timeoutMsec - zclock_time();
+    zctx_set_linger(ctx, remaining > 0 ? (int) remaining : 0);
+    return drained ? 0 : -1;
+}
+
+/**
+* Samples the queues of the consumers every GW_CONSUMER_SAMPLE_INTERVAL_MSEC, on the monitor thread.
+*/
+static void
+sample_consumers(void *args)
+{
+    gw_listener_t *listener = (gw_listener_t *) args;
+    int64_t now = zclock_time();
 
-    const char* binary_data = (char*)zmq_msg_data(&binary);
+    if (now - listener->sampled_at < GW_CONSUMER_SAMPLE_INTERVAL_MSEC) {
+        return;
+    }
+    uint64_t bytes = GW_COUNTER_GET(publisher_metrics(listener)->bytes_out);
+    uint64_t refused = GW_COUNTER_GET(publisher_metrics(listener)->dropped_hwm);
+    gw_consumers_sample(listener->consumers, (bytes - listener->sampled_bytes) * 1000.0 / (now - listener->sampled_at),
+                        refused - listener->sampled_refused);
+    listener->sampled_bytes = bytes;
+    listener->sampled_refused = refused;
+    listener->sampled_at = now;
+}
 
-    memcpy(&(event->event), binary_data, sizeof(event->event));
-    memcpy(&(event->value), binary_data + sizeof(event->event), sizeof(event->value));
+static void
+track_consumer(void *args, int event, int value, const char *address)
+{
+    gw_consumers_event((gw_consumers_t *) args, event, value, address);
+}
 
-    const size_t len = zmq_msg_size(&address);
+static void
+pin_current_thread(int cpu, const char *name)
+{
+    if (cpu < 0) {
+        return;
+    }
+#ifdef __linux__
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
 
-    endpoint = memcpy(endpoint, zmq_msg_data(&address), len);
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+    if (result != 0) {
+        fprintf(stderr, "[%s] - Could not pin %s to CPU %d: %s\n", timestamp(), name, cpu, strerror(result));
+        return;
+    }
+    fprintf(stderr, "[%s] - Pinned %s to CPU %d\n", timestamp(), name, cpu);
+#else
+    fprintf(stderr, "[%s] - CPU affinity is not supported on this platform, %s is not pinned\n", timestamp(), name);
+#endif
+}
 
-    *(endpoint + len) = 0;
+static const char *gw_wait_strategies[] = { "block", "spin", "busy-poll" };
 
-    return 0;
+/**
+* Returns the GW_WAIT_* strategy called name, or -1 if there's none.
+*/
+int
+gw_wait_strategy(const char *name)
+{
+    int i;
+    for (i = 0; i < (int) (sizeof(gw_wait_strategies) / sizeof(gw_wait_strategies[0])); i++) {
+        if (strcmp(name, gw_wait_strategies[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
 }
 
-static void*
-monitor_generic_socket(void* ctx, const char* endpoint) {
-    fprintf(stderr, "[%s] - Monitoring endpoint %s...\n", timestamp(), endpoint);
+const char *
+gw_wait_strategy_name(int strategy)
+{
+    return gw_wait_strategies[strategy];
+}
 
-    void* socket = zsocket_new(ctx, ZMQ_PAIR);
+static void
+waiter_init(gw_waiter_t *waiter, gw_listener_t *listener, gw_metrics_t *metrics)
+{
+    memset(waiter, 0, sizeof(gw_waiter_t));
+    waiter->strategy = listener->wait_strategy;
+    waiter->max_spin_usec = listener->spin_usec;
+    // start by spinning as long as allowed, the waits tell soon enough if it pays off
+    waiter->spin_budget = waiter->strategy == GW_WAIT_SPIN ? waiter->max_spin_usec : 0;
+    waiter->average_wait = waiter->spin_budget / 2.0;
+    waiter->woke_at = monotonic_usecs();
+    waiter->metrics = metrics;
+    GW_COUNTER_SET(metrics->spin_budget_usec, waiter->spin_budget);
+}
 
-    assert(socket);
-    fprintf(stderr, "[%s] - Created PAIR socket for endpoint %s\n", timestamp(), endpoint);
+/**
+* Polls the sockets of a forwarding thread once, along with its shared memory rings when shm is given.
+* The gateway workers writing to shared memory can't wake up zmq_poll, so the thread sleeps on the rings instead,
+* for up to GW_SHM_SOCKET_CHECK_MSEC, and only checks its sockets in between.
+* Returns the number of sources ready, or -1 on failure in which case zmq_errno() tells why.
+*/
+static int
+poll_once(gw_shm_reader_t *shm, zmq_pollitem_t *items, int count, int timeout)
+{
+    int ready = 0;
 
-    int result = zmq_connect(socket, endpoint);
+    if (shm != NULL) {
+        ready = gw_shm_reader_wait(shm, timeout < GW_SHM_SOCKET_CHECK_MSEC ? timeout : GW_SHM_SOCKET_CHECK_MSEC);
+        timeout = 0;
+    }
+    int result = zmq_poll(items, count, timeout);
+    return result == -1 ? -1 : result + ready;
+}
 
-    assert(result == 0);
-    fprintf(stderr, "[%s] - Connected PAIR socket to endpoint %s\n", timestamp(), endpoint);
+/**
+* Waits up to timeout milliseconds for the sources of a forwarding thread, following its wait strategy:
+* GW_WAIT_BLOCK sleeps right away, GW_WAIT_BUSY_POLL polls without ever sleeping and GW_WAIT_SPIN polls for its spin
+* budget, then sleeps. The spin budget follows twice the average wait: when messages keep arriving within the
+* longest spin, waking up from zmq_poll costs more than polling, otherwise the thread doesn't spin at all.
+* The time spent forwarding since the previous wait, spinning and sleeping is added to the metrics of the thread.
+* Returns the number of sources ready, or -1 on failure in which case zmq_errno() tells why.
+*/
+static int
+wait_for_events(gw_waiter_t *waiter, gw_shm_reader_t *shm, zmq_pollitem_t *items, int count, int timeout)
+{
+    uint64_t start = monotonic_usecs();
+    uint64_t deadline = start + (uint64_t) timeout * 1000;
+    uint64_t spinUntil = start;
+    uint64_t now = start;
+    int result = 0;
 
-    zmq_event_t event;
-    static char address[512];
+    GW_COUNTER_ADD(waiter->metrics->busy_usec, start - waiter->woke_at);
 
-    while(!read_message(socket, &event, address)) {
-        int code = event.event;
-        int value = event.value;
+    if (waiter->strategy == GW_WAIT_BUSY_POLL) {
+        spinUntil = deadline;
+    } else if (waiter->strategy == GW_WAIT_SPIN && waiter->spin_budget > 0) {
+        spinUntil = start + waiter->spin_budget < deadline ? start + waiter->spin_budget : deadline;
+    }
+    while (result == 0 && now < spinUntil) {
+        result = poll_once(shm, items, count, 0);
+        now = monotonic_usecs();
+    }
+    uint64_t spun = now - start;
+    if (result == 0) {
+        int remaining = waiter->strategy == GW_WAIT_BUSY_POLL || now >= deadline ? 0
+                : (int) ((deadline - now + 999) / 1000);
+        result = poll_once(shm, items, count, remaining);
+        now = monotonic_usecs();
+    }
+    GW_COUNTER_ADD(waiter->metrics->spin_usec, spun);
+    GW_COUNTER_ADD(waiter->metrics->blocked_usec, now - start - spun);
 
-        switch(code) {
-            case ZMQ_EVENT_CONNECTED:
-                fprintf(stderr, "[%s] - Received ZMQ_EVENT_CONNECTED event %d with value=%d for address=%s\n", timestamp(), code, value, address);
-                break;
-            case ZMQ_EVENT_CONNECT_DELAYED:
-                fprintf(stderr, "[%s] - Received ZMQ_EVENT_CONNECT_DELAYED event %d with value=%d for address=%s\n", timestamp(), code, value, address);
-                break;
-            case ZMQ_EVENT_CONNECT_RETRIED:
-                fprintf(stderr, "[%s] - Received ZMQ_EVENT_CONNECT_RETRIED event %d with value=%d for address=%s\n", timestamp(), code, value, address);
-                break;
-            case ZMQ_EVENT_LISTENING:
-                fprintf(stderr, "[%s] - Received ZMQ_EVENT_LISTENING event %d with value=%d for address=%s\n", timestamp(), code, value, address);
-                break;
-            case ZMQ_EVENT_BIND_FAILED:
-                fprintf(stderr, "[%s] - Received ZMQ_EVENT_BIND_FAILED event %d with value=%d for address=%s\n", timestamp(), code, value, address);
-                break;
-            case ZMQ_EVENT_ACCEPTED:
-                fprintf(stderr, "[%s] - Received ZMQ_EVENT_ACCEPTED event %d with value=%d for address=%s\n", timestamp(), code, value, address);
-                break;
-            case ZMQ_EVENT_ACCEPT_FAILED:
-                fprintf(stderr, "[%s] - Received ZMQ_EVENT_ACCEPT_FAILED event %d with value=%d for address=%s\n", timestamp(), code, value, address);
-                break;
-            case ZMQ_EVENT_CLOSED:
-                fprintf(stderr, "[%s] - Received ZMQ_EVENT_CLOSED event %d with value=%d for address=%s\n", timestamp(), code, value, address);
-                break;
-            case ZMQ_EVENT_CLOSE_FAILED:
-                fprintf(stderr, "[%s] - Received ZMQ_EVENT_CLOSE_FAILED event %d with value=%d for address=%s\n", timestamp(), code, value, address);
-                break;
-            case ZMQ_EVENT_DISCONNECTED:
-                fprintf(stderr, "[%s] - Received ZMQ_EVENT_DISCONNECTED event %d with value=%d for address=%s\n", timestamp(), code, value, address);
-                break;
-            default:
-                fprintf(stderr, "[%s] - Received unknown ZMQ event %d with value=%d for address=%s\n", timestamp(), code, value, address);
+    if (waiter->strategy == GW_WAIT_SPIN) {
+        // a wait that timed out counts as a long one
+        double waited = result > 0 ? (double) (now - start) : (double) timeout * 1000;
+        waiter->average_wait += (waited - waiter->average_wait) / GW_WAIT_AVERAGE_WEIGHT;
+        int budget = (int) (waiter->average_wait * 2);
+        if (budget > waiter->max_spin_usec) {
+            budget = 0;
+        } else if (budget < GW_MIN_SPIN_USEC) {
+            budget = GW_MIN_SPIN_USEC;
         }
+        waiter->spin_budget = budget;
+        GW_COUNTER_SET(waiter->metrics->spin_budget_usec, waiter->spin_budget);
+    }
+    waiter->woke_at = now;
+    return result;
+}
+
+/**
+* Applies a frame sent by a consumer to the XPUB to the subscription index of the listener.
+* Returns 1 when the frame has to go upstream to the gateway, 0 otherwise.
+*
+* Only the first subscription to a topic and the removal of a topic go upstream, so the gateway sees the merged set
+* of topics of all the consumers. Without ZMQ_XPUB_VERBOSER the XPUB reports every subscription but only the last
+* unsubscription of a topic, so forwarding every subscription would leave references on the XSUB nothing releases.
+* New gateway publishers get the whole set from the XSUB, which replays its subscriptions to every peer it accepts.
+*/
+static int
+update_subscriptions(gw_listener_t *listener, gw_metrics_t *metrics, zmq_msg_t *frame)
+{
+    const unsigned char *data = (const unsigned char *) zmq_msg_data(frame);
+    size_t size = zmq_msg_size(frame);
+    int result = gw_subscriptions_update(listener->subscriptions, data, size);
+
+    GW_COUNTER_SET(metrics->subscriptions, (int64_t) gw_subscriptions_count(listener->subscriptions));
+
+    switch (result) {
+        case GW_SUBSCRIPTION_ADDED:
+        case GW_SUBSCRIPTION_REMOVED:
+            if (listener->compressor != NULL) {
+                // the gateway only publishes raw topics
+                gw_compressor_strip_prefix(frame);
+            }
+            return 1;
+        case GW_SUBSCRIPTION_REFERENCED:
+        case GW_SUBSCRIPTION_RELEASED:
+            return 0;
+        default:
+            // unsubscribing from an unknown topic is dropped, anything else isn't a subscription and passes through
+            return size == 0 || data[0] > 1;
     }
+}
+
+/**
+* Moves a subscription message from the XPUB side up to an XSUB.
+* When the calling thread owns the XPUB, listener is given so the subscription index is updated on the way and
+* only the changes of the merged subscription set are forwarded. Shared memory shards have no socket to forward them
+* to, to is NULL: the gateway workers write every message and the ones nobody subscribed to are dropped here.
+* zmq_msg_send takes ownership of the frame so the payload is never copied.
+* Returns 0 on success or -1 on failure, in which case zmq_errno() tells why.
+*/
+static int
+forward_subscription(void *from, void *to, gw_listener_t *listener, gw_metrics_t *metrics)
+{
+    zmq_msg_t frame;
+    int more;
+    int first = 1;
+    int upstream = 1;
+
+    do {
+        zmq_msg_init(&frame);
+        if (zmq_msg_recv(&frame, from, 0) == -1) {
+            zmq_msg_close(&frame);
+            return -1;
+        }
+        more = zmq_msg_more(&frame);
+        if (first && listener != NULL) {
+            upstream = update_subscriptions(listener, metrics, &frame);
+        }
+        first = 0;
 
-    zmq_close(socket);
+        if (!upstream || to == NULL) {
+            zmq_msg_close(&frame);
+            continue;
+        }
+        if (zmq_msg_send(&frame, to, more ? ZMQ_SNDMORE : 0) == -1) {
+            zmq_msg_close(&frame);
+            return -1;
+        }
+    } while (more);
 
     return 0;
 }
 
-static void*
-monitor_xpub_socket(void *ctx) {
-    monitor_generic_socket(ctx, DEFAULT_INPROC_XPUB_MONITOR_ENDPOINT);
-    return NULL;
+static gw_batch_t *
+gw_batch_new(int size)
+{
+    gw_batch_t *batch = (gw_batch_t *) calloc(1, sizeof(gw_batch_t));
+    assert( batch );
+    batch->size = size;
+    batch->slots = (zmq_msg_t *) calloc(size, sizeof(zmq_msg_t));
+    batch->flags = (int *) calloc(size, sizeof(int));
+    batch->stamps = (uint64_t *) calloc(size, sizeof(uint64_t));
+    assert( batch->slots && batch->flags && batch->stamps );
+
+    int i;
+    for (i = 0; i < size; i++) {
+        zmq_msg_init(&batch->slots[i]);
+    }
+    return batch;
 }
 
-static void*
-monitor_xsub_socket(void *ctx) {
-    monitor_generic_socket(ctx, DEFAULT_INPROC_XSUB_MONITOR_ENDPOINT);
-    return NULL;
+static void
+gw_batch_destroy(gw_batch_t **batch)
+{
+    int i;
+    for (i = 0; i < (*batch)->size; i++) {
+        zmq_msg_close(&(*batch)->slots[i]);
+    }
+    free((*batch)->slots);
+    free((*batch)->flags);
+    free((*batch)->stamps);
+    free(*batch);
+    *batch = NULL;
 }
 
-/*
+/**
+* Adds the tokens earned since the previous refill; called once per wakeup rather than once per message.
+*/
+static void
+token_bucket_refill(gw_token_bucket_t *bucket)
+{
+    uint64_t now = monotonic_usecs();
+    bucket->tokens += (now - bucket->refilled_at) * bucket->rate / 1000000.0;
+    if (bucket->tokens > bucket->rate) {
+        bucket->tokens = bucket->rate;
+    }
+    bucket->refilled_at = now;
+}
 
-Espresso Pattern impl
-@see http://zguide.zeromq.org/page:all#header-116
---------------------------------------
-   XPUB           ->       XSUB
-  public address     ->    internal address
-   BIND           ->       BIND
----------------------------------------
+static inline int
+token_bucket_take(gw_token_bucket_t *bucket)
+{
+    if (bucket->tokens < 1) {
+        return 0;
+    }
+    bucket->tokens -= 1;
+    return 1;
+}
 
-This method starts a new thread subscribing to the messages sent by the Gateway on XSUB
-and proxying them to a local IP address on XPUB . Remote consumers should connect to the XPUB's socket address.
+/**
+* Counts a message received by a shard; returns 1 for the one message in trace_sample which gets traced.
+*/
+static inline int
+trace_sampled(gw_listener_t *listener, gw_shard_t *shard)
+{
+    if (listener->trace_sample == 0 || --shard->trace_countdown > 0) {
+        return 0;
+    }
+    shard->trace_countdown = listener->trace_sample;
+    return 1;
+}
+
+static void
+write_uint64(unsigned char *data, uint64_t value)
+{
+    int i;
+    for (i = 7; i >= 0; i--) {
+        data[i] = (unsigned char) value;
+        value >>= 8;
+    }
+}
 
+/**
+* Called once the XPUB took the last frame of a traced message: records how long the message stayed in the adaptor,
+* from the shard which received it to the XPUB, then publishes its envelope if the listener was asked to; more tells
+* if the sequence frame follows it.
 */
+static void
+trace_message(gw_listener_t *listener, void *publisher, uint64_t stamp, int more)
+{
+    uint64_t now = monotonic_usecs();
+    uint64_t receivedAt = stamp >> GW_TRACE_SHARD_BITS;
+    uint64_t residence = now > receivedAt ? now - receivedAt : 0;
 
-void
-start_gateway_listener(zctx_t *ctx, char *subscriberAddress, char *publisherAddress, int debugFlag)
+    gw_histogram_record(listener->trace_ingress[stamp & ((1 << GW_TRACE_SHARD_BITS) - 1)], residence);
+    gw_histogram_record(listener->trace_egress, residence);
+
+    if (listener->trace_envelope) {
+        struct timespec wallClock;
+        clock_gettime(CLOCK_REALTIME, &wallClock);
+        uint64_t publishedAt = (uint64_t) wallClock.tv_sec * 1000000 + wallClock.tv_nsec / 1000;
+
+        zmq_msg_t envelope;
+        zmq_msg_init_size(&envelope, GW_TRACE_ENVELOPE_SIZE);
+        unsigned char *data = (unsigned char *) zmq_msg_data(&envelope);
+        memcpy(data, GW_TRACE_MAGIC, 4);
+        write_uint64(data + 4, publishedAt - residence);
+        write_uint64(data + 12, publishedAt);
+        // the XPUB already took the rest of the message, it takes its last frame too
+        if (zmq_msg_send(&envelope, publisher, more ? ZMQ_SNDMORE : 0) == -1) {
+            zmq_msg_close(&envelope);
+        }
+    }
+}
+
+/**
+* Receives the next frame of a forwarding thread into slot: from the ring of a shard when ring is given, from the
+* shared memory rings of the gateway workers when shm is given, otherwise from a socket. Frames of the shared memory
+* rings are copied once, from the ring into the slot.
+* Returns the size of the frame and sets more, or -1 in which case zmq_errno() tells why.
+*/
+static inline int
+receive_frame(void *from, gw_ring_t *ring, gw_shm_reader_t *shm, zmq_msg_t *slot, int wait, int *more)
 {
-    fprintf(stderr,"[%s] - Starting Gateway Listener \n", timestamp());
+    int size;
 
-    void *subscriber = zsocket_new (ctx, ZMQ_XSUB);
-    int subscriberSocketResult = zsocket_bind (subscriber, "%s", subscriberAddress);
-    assert( subscriberSocketResult >= 0 );
+    if (shm != NULL) {
+        const void *data;
+        size_t frameSize;
+        if (!gw_shm_reader_peek(shm, &data, &frameSize, more)) {
+            errno = EAGAIN;
+            return -1;
+        }
+        zmq_msg_close(slot);
+        zmq_msg_init_size(slot, frameSize);
+        memcpy(zmq_msg_data(slot), data, frameSize);
+        gw_shm_reader_release(shm);
+        return (int) frameSize;
+    }
+    size = ring != NULL ? gw_ring_pop(ring, slot, wait) : zmq_msg_recv(slot, from, ZMQ_DONTWAIT);
+    if (size != -1) {
+        *more = zmq_msg_more(slot);
+    }
+    return size;
+}
 
-    // Start XPUB Proxy -> remote consumers connect here
-    void *publisher = zsocket_new (ctx, ZMQ_XPUB);
-    zsocket_set_xpub_verbose (publisher, 1);
-    int publisherBindResult = zsocket_bind (publisher, "%s", publisherAddress);
-    assert( publisherBindResult >= 0 );
+/**
+* Flag of the batch slots whose frame was dropped by strip_trailers.
+*/
+#define GW_FRAME_STRIPPED -1
+
+/**
+* Messages relayed from an upstream adaptor may end with the envelope of a traced message and with a sequence frame,
+* which only make sense on the hop they were published on: they're dropped before the message goes through the
+* pipeline of the relay, and the frame before them becomes the last one. The envelopes give the latency of the hop,
+* from the upstream XPUB to the relay, which assumes the clocks of both hosts are synchronized.
+* Only the messages whose last frame was received in this round are looked at; a message larger than the batch keeps
+* its trailing frames, and so does a message made of a single frame.
+*/
+static void
+strip_trailers(gw_listener_t *listener, gw_ring_t *ring, gw_batch_t *batch, int received, int atMessageStart)
+{
+    // index of the first frame of the current message, -1 when it was received in a previous round
+    int first = atMessageStart ? 0 : -1;
+    int shardIndex = -1;
+    uint64_t now = 0;
+    int i;
+
+    for (i = 0; i < received; i++) {
+        if (batch->flags[i] != 0) {
+            continue;
+        }
+        int last = i;
+        int lowest = first >= 0 ? first : 0;
+        while (last > lowest) {
+            zmq_msg_t *slot = &batch->slots[last];
+            size_t size = zmq_msg_size(slot);
+            const unsigned char *data = (const unsigned char *) zmq_msg_data(slot);
+            int envelope = size == GW_TRACE_ENVELOPE_SIZE && memcmp(data, GW_TRACE_MAGIC, 4) == 0;
+            if (!envelope && !(size == GW_SEQUENCE_FRAME_SIZE && memcmp(data, GW_SEQUENCE_MAGIC, 4) == 0)) {
+                break;
+            }
+            if (envelope) {
+                if (shardIndex == -1) {
+                    for (shardIndex = 0; ring != NULL && listener->shards[shardIndex].ring != ring; shardIndex++) {
+                    }
+                    struct timespec wallClock;
+                    clock_gettime(CLOCK_REALTIME, &wallClock);
+                    now = (uint64_t) wallClock.tv_sec * 1000000 + wallClock.tv_nsec / 1000;
+                }
+                uint64_t publishedAt = 0;
+                int j;
+                for (j = 12; j < 20; j++) {
+                    publishedAt = (publishedAt << 8) | data[j];
+                }
+                gw_histogram_record(listener->relay_hops[shardIndex], now > publishedAt ? now - publishedAt : 0);
+            }
+            zmq_msg_close(slot);
+            zmq_msg_init(slot);
+            batch->flags[last] = GW_FRAME_STRIPPED;
+            batch->flags[last - 1] = 0;
+            // a trace stamp goes with the last frame
+            batch->stamps[last - 1] = batch->stamps[last];
+            batch->stamps[last] = 0;
+            last--;
+        }
+        first = i + 1;
+    }
+}
+
+#define GW_FRAME_SEND 0
+#define GW_FRAME_DROP 1
+#define GW_FRAME_SPOOL 2
+/** taken by a pipeline stage instead of being published */
+#define GW_FRAME_CONSUME 3
+/** over the rate limit of the ingress endpoint */
+#define GW_FRAME_LIMITED 4
+/** the destination refused the first frame, the rest of the message goes with it */
+#define GW_FRAME_REFUSED 5
+
+/**
+* What forward_batch does with the frames of a message, decided on its first frame.
+*/
+typedef struct {
+    int action;
+    /** published under its own topic, as opposed to only under its compressed topic */
+    int raw;
+    int compress;
+    /** egresses of the routes it matches */
+    uint32_t routes;
+    int balanced;
+    /** recorded in the replay window, and given a sequence number */
+    int recording;
+} gw_message_plan_t;
 
-    fprintf(stderr, "[%s] - Starting XPUB->XSUB Proxy [%s] -> [%s] \n", timestamp(), subscriberAddress, publisherAddress);
-    zproxy_t *xpub_xsub_thread = zproxy_new(ctx, subscriber, publisher);
-    assert( xpub_xsub_thread );
+/**
+* Decides on the first frame of a message what becomes of it: rate limited, consumed by the aggregator, spooled,
+* dropped when nobody subscribed to it, or published raw and / or compressed; and whether it's also routed, balanced
+* and recorded. Without owner, the message is only sent on.
+*/
+static void
+classify_message(gw_listener_t *owner, gw_token_bucket_t *bucket, int spooling, zmq_msg_t *frame, int lastFrame,
+                 gw_message_plan_t *plan)
+{
+    void *data = zmq_msg_data(frame);
+    size_t size = zmq_msg_size(frame);
 
-    if(!debugFlag) {
+    plan->action = GW_FRAME_SEND;
+    plan->raw = 1;
+    plan->compress = 0;
+    plan->routes = 0;
+    plan->balanced = 0;
+    plan->recording = 0;
+    if (bucket != NULL && !token_bucket_take(bucket)) {
+        plan->action = GW_FRAME_LIMITED;
+        return;
+    }
+    if (owner == NULL) {
         return;
     }
 
-    int result;
+    if (owner->router != NULL) {
+        plan->routes = gw_router_match(owner->router, data, size);
+    }
+    plan->balanced = owner->balancer != NULL;
+    int aggregated = owner->aggregator != NULL && lastFrame && gw_aggregator_add(owner->aggregator, data, size);
+    if (aggregated && owner->aggregate_only) {
+        plan->action = GW_FRAME_CONSUME;
+    } else if (spooling) {
+        plan->action = GW_FRAME_SPOOL;
+    } else {
+        plan->raw = owner->subscriptions == NULL || gw_subscriptions_match(owner->subscriptions, data, size) > 0;
+        plan->compress = owner->compressor != NULL && lastFrame && gw_compressor_wants(owner->compressor, data, size);
+        plan->action = plan->raw || plan->compress ? GW_FRAME_SEND : GW_FRAME_DROP;
+    }
+    // messages nobody subscribed to are kept for the consumers catching up
+    plan->recording = owner->replay != NULL && (plan->action == GW_FRAME_SEND || plan->action == GW_FRAME_DROP);
+}
+
+/**
+* Drains up to batch->size messages from one socket, from the ring of a shard when ring is given, or from the shared
+* memory rings of the gateway workers when shm is given, and forwards them, moving the payloads with zmq_msg_send.
+* When the calling thread owns the XPUB, owner is given and each message goes where classify_message decides.
+* Returns the number of messages forwarded, or -1 on failure in which case zmq_errno() tells why.
+*/
+static int
+forward_batch(void *from, gw_ring_t *ring, gw_shm_reader_t *shm, void *to, gw_batch_t *batch, gw_metrics_t *metrics,
+              gw_listener_t *owner, gw_token_bucket_t *bucket)
+{
+    int messages = 0;
+    int error = 0;
+    int inMessage = 0;
+    int atMessageStart = 1;
+    gw_message_plan_t plan = { GW_FRAME_SEND, 1, 0, 0, 0, 0 };
+    gw_spool_t *spool = owner != NULL ? owner->spool : NULL;
+    gw_coalescer_t *coalescer = owner != NULL ? owner->coalescer : NULL;
+    gw_compressor_t *compressor = owner != NULL ? owner->compressor : NULL;
+    gw_router_t *router = owner != NULL ? owner->router : NULL;
+    gw_replay_t *replay = owner != NULL ? owner->replay : NULL;
+    gw_balancer_t *balancer = owner != NULL ? owner->balancer : NULL;
+    int tracing = owner != NULL && owner->trace_sample > 0;
+    uint64_t traced = 0;
+    uint64_t receivedAt = 0;
+    // decided once per wakeup so that messages are never replayed out of order
+    int spooling = spool != NULL
+            && (owner->spilling || gw_subscriptions_count(owner->subscriptions) == 0 || gw_spool_pending(spool));
+    // counters are accumulated locally and published once per wakeup
+    uint64_t bytesIn = 0;
+    uint64_t messagesOut = 0;
+    uint64_t bytesOut = 0;
+    uint64_t dropped = 0;
+    uint64_t unsubscribed = 0;
+    uint64_t rateLimited = 0;
+
+    if (bucket != NULL) {
+        token_bucket_refill(bucket);
+    }
 
-    fprintf(stderr, "[%s] - Creating socket monitor for %s using %s\n", timestamp(), publisherAddress, DEFAULT_INPROC_XPUB_MONITOR_ENDPOINT);
-    result = zmq_socket_monitor(publisher, DEFAULT_INPROC_XPUB_MONITOR_ENDPOINT, ZMQ_EVENT_ALL);
-    assert(result == 0);
+    while (messages < batch->size && error == 0) {
+        int received = 0;
 
-    fprintf(stderr, "[%s] - Creating socket monitor for %s using %s\n", timestamp(), subscriberAddress, DEFAULT_INPROC_XSUB_MONITOR_ENDPOINT);
-    result = zmq_socket_monitor(subscriber, DEFAULT_INPROC_XSUB_MONITOR_ENDPOINT, ZMQ_EVENT_ALL);
-    assert(result == 0);
+        while (received < batch->size && (messages < batch->size || inMessage)) {
+            zmq_msg_t *slot = &batch->slots[received];
+            int firstFrame = !inMessage;
+            // the rest of a message being committed to the ring is only a few frames away
+            int size = receive_frame(from, ring, shm, slot, inMessage, &inMessage);
+            if (size == -1) {
+                error = zmq_errno();
+                break;
+            }
+            if (tracing) {
+                if (ring != NULL) {
+                    batch->stamps[received] = gw_ring_popped_stamp(ring);
+                } else {
+                    // the single shard, receiving straight from its ingress endpoint
+                    if (firstFrame) {
+                        traced = trace_sampled(owner, &owner->shards[0]) ? GW_TRACE_STAMP(monotonic_usecs(), 0) : 0;
+                    }
+                    batch->stamps[received] = inMessage ? 0 : traced;
+                }
+            } else if (batch->latency != NULL) {
+                if (firstFrame) {
+                    receivedAt = monotonic_usecs();
+                }
+                batch->stamps[received] = receivedAt;
+            }
+            batch->flags[received++] = inMessage ? ZMQ_SNDMORE : 0;
 
-    pthread_t thread;
+            bytesIn += size;
+            if (!inMessage) {
+                messages++;
+            }
+        }
+
+        if (owner != NULL && owner->relay) {
+            strip_trailers(owner, ring, batch, received, atMessageStart);
+        }
+
+        int i;
+        for (i = 0; i < received; i++) {
+            if (batch->flags[i] == GW_FRAME_STRIPPED) {
+                continue;
+            }
+            size_t size = zmq_msg_size(&batch->slots[i]);
+            int lastFrame = batch->flags[i] == 0;
+            uint64_t stamp = tracing ? batch->stamps[i] : 0;
+
+            if (atMessageStart) {
+                classify_message(owner, bucket, spooling, &batch->slots[i], lastFrame, &plan);
+            }
+            int firstFrame = atMessageStart;
+            atMessageStart = lastFrame;
+
+            if (plan.routes != 0) {
+                // the copies share the payload of the frame
+                gw_router_send(router, plan.routes, &batch->slots[i], !lastFrame);
+            }
+            if (plan.balanced) {
+                gw_balancer_send(balancer, &batch->slots[i], !lastFrame);
+            }
+
+            uint64_t sequence = 0;
+            if (plan.recording) {
+                // copied before the payload moves to the XPUB
+                gw_replay_append(replay, zmq_msg_data(&batch->slots[i]), size, !lastFrame);
+                if (lastFrame) {
+                    sequence = gw_replay_commit(replay);
+                }
+            }
+
+            if (plan.action == GW_FRAME_SEND && coalescer != NULL && firstFrame && lastFrame) {
+                if (gw_coalescer_add(coalescer, to, zmq_msg_data(&batch->slots[i]), size, plan.compress) == -1
+                        && error == 0) {
+                    error = zmq_errno();
+                }
+                zmq_msg_close(&batch->slots[i]);
+                zmq_msg_init(&batch->slots[i]);
+                bytesOut += size;
+                messagesOut++;
+                continue;
+            }
+            if (plan.action == GW_FRAME_SEND && plan.compress) {
+                size_t topicSize = gw_compressor_topic_size(compressor);
+                gw_compressor_offer(compressor, zmq_msg_data(&batch->slots[i]), size < topicSize ? size : topicSize,
+                                    &batch->slots[i]);
+                if (!plan.raw) {
+                    // only consumers of the compressed topic want it
+                    zmq_msg_close(&batch->slots[i]);
+                    zmq_msg_init(&batch->slots[i]);
+                    bytesOut += size;
+                    messagesOut++;
+                    continue;
+                }
+            }
+            // the envelope of a traced message and the sequence frame follow the last frame; only the first frame of
+            // a message can be refused at the HWM, and it waits up to the send timeout of the socket unless the XPUB
+            // has none, while the inbound PUSH always waits for a gateway worker
+            int sendFlags = batch->flags[i]
+                    | (firstFrame && owner != NULL && owner->send_timeout == 0 ? ZMQ_DONTWAIT : 0)
+                    | ((stamp != 0 && owner->trace_envelope) || sequence != 0 ? ZMQ_SNDMORE : 0);
+            if (plan.action == GW_FRAME_SEND && zmq_msg_send(&batch->slots[i], to, sendFlags) == -1) {
+                int sendError = zmq_errno();
+                if (sendError == EAGAIN && spool != NULL && firstFrame) {
+                    // the whole message goes to the spool, along with the ones following it in this wakeup
+                    plan.action = GW_FRAME_SPOOL;
+                    spooling = 1;
+                    if (plan.recording) {
+                        // it's published when the spool is replayed
+                        gw_replay_cancel(replay);
+                        plan.recording = 0;
+                    }
+                } else {
+                    // the frames left can't be sent on their own, the consumers would take the next one for a topic
+                    plan.action = GW_FRAME_REFUSED;
+                    if (sendError == EAGAIN) {
+                        dropped += firstFrame;
+                    } else if (error == 0) {
+                        error = sendError;
+                    }
+                }
+            }
+            if (plan.action != GW_FRAME_SEND) {
+                if (plan.action == GW_FRAME_SPOOL) {
+                    gw_spool_append(spool, zmq_msg_data(&batch->slots[i]), size, !lastFrame);
+                } else if (plan.action == GW_FRAME_DROP) {
+                    unsubscribed += lastFrame;
+                } else if (plan.action == GW_FRAME_LIMITED) {
+                    rateLimited += lastFrame;
+                }
+                zmq_msg_close(&batch->slots[i]);
+                zmq_msg_init(&batch->slots[i]);
+                continue;
+            }
+            bytesOut += size;
+            messagesOut += lastFrame;
+            if (stamp != 0) {
+                trace_message(owner, to, stamp, sequence != 0);
+            }
+            if (batch->latency != NULL && lastFrame) {
+                gw_histogram_record(batch->latency, monotonic_usecs() - batch->stamps[i]);
+            }
+            if (sequence != 0) {
+                zmq_msg_t sequenceFrame;
+                gw_replay_sequence_frame(&sequenceFrame, sequence);
+                if (zmq_msg_send(&sequenceFrame, to, 0) == -1) {
+                    zmq_msg_close(&sequenceFrame);
+                }
+            }
+        }
+
+        if (received < batch->size && !inMessage) {
+            // the socket has been drained
+            break;
+        }
+    }
+
+    if (metrics != NULL && messages > 0) {
+        GW_COUNTER_ADD(metrics->messages_in, messages);
+        GW_COUNTER_ADD(metrics->bytes_in, bytesIn);
+        GW_COUNTER_ADD(metrics->messages_out, messagesOut);
+        GW_COUNTER_ADD(metrics->bytes_out, bytesOut);
+        if (dropped > 0) {
+            GW_COUNTER_ADD(metrics->dropped_hwm, dropped);
+        }
+        if (unsubscribed > 0) {
+            GW_COUNTER_ADD(metrics->dropped_unsubscribed, unsubscribed);
+        }
+        if (rateLimited > 0) {
+            GW_COUNTER_ADD(metrics->dropped_rate_limited, rateLimited);
+        }
+        gw_metrics_record_batch(metrics, messages);
+    }
 
-    fprintf(stderr, "[%s] - Creating thread for %s socket monitor\n", timestamp(), publisherAddress);
-    result = pthread_create(&thread, NULL, monitor_xpub_socket, ctx);
-    assert (result == 0);
+    if (error != 0 && error != EAGAIN) {
+        errno = error;
+        return -1;
+    }
+    return messages;
+}
+
+/**
+* Drains up to batch->size messages from the XSUB of a shard, or from its shared memory rings, into the ring of the
+* shard, and commits them at once so the egress
+* thread is woken up at most once per wakeup of the shard. Messages the ring drops are counted as dropped at the HWM.
+* When bucket is given, messages over the rate limit of the ingress endpoint are dropped instead of being queued.
+* The last frame of the sampled messages carries a trace stamp through the ring when the listener traces messages.
+* Returns the number of messages received, or -1 on failure in which case zmq_errno() tells why.
+*/
+static int
+forward_to_ring(gw_shard_t *shard, gw_batch_t *batch, gw_token_bucket_t *bucket)
+{
+    void *from = shard->frontend;
+    gw_shm_reader_t *shm = shard->shm;
+    gw_ring_t *ring = shard->ring;
+    gw_metrics_t *metrics = shard->metrics;
+    int tracing = shard->listener->trace_sample > 0;
+    uint64_t traced = 0;
+    zmq_msg_t *frame = &batch->slots[0];
+    int messages = 0;
+    int inMessage = 0;
+    int error = 0;
+    uint64_t bytesIn = 0;
+    uint64_t messagesOut = 0;
+    uint64_t bytesOut = 0;
+    uint64_t dropped = 0;
+    uint64_t rateLimited = 0;
+    int limited = 0;
+
+    if (bucket != NULL) {
+        token_bucket_refill(bucket);
+    }
+
+    while (messages < batch->size || inMessage) {
+        int atMessageStart = !inMessage;
+        int size = receive_frame(from, NULL, shm, frame, 0, &inMessage);
+        if (size == -1) {
+            error = zmq_errno();
+            break;
+        }
+        bytesIn += size;
+        messages += !inMessage;
+
+        if (atMessageStart) {
+            limited = bucket != NULL && !token_bucket_take(bucket);
+            traced = tracing && !limited && trace_sampled(shard->listener, shard)
+                    ? GW_TRACE_STAMP(monotonic_usecs(), shard->index) : 0;
+        }
+        if (limited) {
+            zmq_msg_close(frame);
+            zmq_msg_init(frame);
+            rateLimited += !inMessage;
+            continue;
+        }
+
+        int result = gw_ring_push(ring, frame);
+        if (result == -1) {
+            error = ETERM;
+            break;
+        }
+        if (result == 0) {
+            bytesOut += size;
+            messagesOut += !inMessage;
+            if (traced != 0 && !inMessage) {
+                gw_ring_stamp(ring, traced);
+            }
+        } else {
+            dropped += !inMessage;
+        }
+    }
+    gw_ring_commit(ring);
+
+    if (messages > 0) {
+        GW_COUNTER_ADD(metrics->messages_in, messages);
+        GW_COUNTER_ADD(metrics->bytes_in, bytesIn);
+        GW_COUNTER_ADD(metrics->messages_out, messagesOut);
+        GW_COUNTER_ADD(metrics->bytes_out, bytesOut);
+        if (dropped > 0) {
+            GW_COUNTER_ADD(metrics->dropped_hwm, dropped);
+        }
+        if (rateLimited > 0) {
+            GW_COUNTER_ADD(metrics->dropped_rate_limited, rateLimited);
+        }
+        gw_metrics_record_batch(metrics, messages);
+    }
 
-    fprintf(stderr, "[%s] - Creating thread for %s socket monitor\n", timestamp(), subscriberAddress);
-    result = pthread_create(&thread, NULL, monitor_xsub_socket, ctx);
-    assert (result == 0);
+    if (error != 0 && error != EAGAIN) {
+        errno = error;
+        return -1;
+    }
+    return messages;
 }
 
+/**
+* Sends the changes of the subscription set received on the XPUB to every shard, so that each XSUB forwards them upstream.
+*/
+static int
+broadcast_subscription(gw_listener_t *listener)
+{
+    zmq_msg_t frame;
+    int more;
+    int first = 1;
+    int upstream = 1;
+
+    do {
+        zmq_msg_init(&frame);
+        if (zmq_msg_recv(&frame, listener->publisher, 0) == -1) {
+            zmq_msg_close(&frame);
+            return -1;
+        }
+        if (first) {
+            upstream = update_subscriptions(listener, listener->egress_metrics, &frame);
+        }
+        first = 0;
+        more = zmq_msg_more(&frame);
+
+        int i;
+        for (i = 0; upstream && i < listener->shard_count; i++) {
+            zmq_msg_t copy;
+            zmq_msg_init(&copy);
+            zmq_msg_copy(&copy, &frame);
+            if (zmq_msg_send(&copy, listener->egress_pipes[i], more ? ZMQ_SNDMORE : 0) == -1) {
+                zmq_msg_close(&copy);
+            }
+        }
+        zmq_msg_close(&frame);
+    } while (more);
+
+    return 0;
+}
+
+#define GW_SOCKET_PUBLISHER 0
+#define GW_SOCKET_SUBSCRIBER 1
+#define GW_SOCKET_PIPE 2
+
+/**
+* Applies the tuning options to a socket; they have to be set before the socket binds or connects.
+*/
+static void
+configure_socket(void *socket, gw_listener_options_t *options, int role)
+{
+    if (options->send_hwm != GW_SOCKET_OPTION_DEFAULT && role != GW_SOCKET_SUBSCRIBER) {
+        zsocket_set_sndhwm(socket, options->send_hwm);
+    }
+    if (options->receive_hwm != GW_SOCKET_OPTION_DEFAULT && role != GW_SOCKET_PUBLISHER) {
+        zsocket_set_rcvhwm(socket, options->receive_hwm);
+    }
+    if (role == GW_SOCKET_PIPE) {
+        return;
+    }
+
+    uint64_t affinity = role == GW_SOCKET_PUBLISHER ? options->publisher_affinity : options->subscriber_affinity;
+    if (affinity != 0) {
+        int result = zmq_setsockopt(socket, ZMQ_AFFINITY, &affinity, sizeof(affinity));
+        assert( result == 0 );
+    }
+
+    if (role == GW_SOCKET_SUBSCRIBER) {
+        if (options->receive_buffer != GW_SOCKET_OPTION_DEFAULT) {
+            zsocket_set_rcvbuf(socket, options->receive_buffer);
+        }
+        return;
+    }
+
+    if (options->xpub_nodrop) {
+#ifdef ZMQ_XPUB_NODROP
+        int nodrop = 1;
+        int result = zmq_setsockopt(socket, ZMQ_XPUB_NODROP, &nodrop, sizeof(nodrop));
+        assert( result == 0 );
+#else
+        fprintf(stderr, "[%s] - ZMQ_XPUB_NODROP isn't supported by this version of ZeroMQ, the XPUB drops messages at its HWM\n", timestamp());
+#endif
+    }
+    if (options->send_buffer != GW_SOCKET_OPTION_DEFAULT) {
+        zsocket_set_sndbuf(socket, options->send_buffer);
+    }
+    if (options->send_timeout != GW_SOCKET_OPTION_DEFAULT) {
+        zsocket_set_sndtimeo(socket, options->send_timeout);
+    }
+    if (options->tcp_keepalive != GW_SOCKET_OPTION_DEFAULT) {
+        zsocket_set_tcp_keepalive(socket, options->tcp_keepalive);
+    }
+    if (options->tcp_keepalive_idle != GW_SOCKET_OPTION_DEFAULT) {
+        zsocket_set_tcp_keepalive_idle(socket, options->tcp_keepalive_idle);
+    }
+    if (options->tcp_keepalive_cnt != GW_SOCKET_OPTION_DEFAULT) {
+        zsocket_set_tcp_keepalive_cnt(socket, options->tcp_keepalive_cnt);
+    }
+    if (options->tcp_keepalive_intvl != GW_SOCKET_OPTION_DEFAULT) {
+        zsocket_set_tcp_keepalive_intvl(socket, options->tcp_keepalive_intvl);
+    }
+}
+
+/**
+* Prints the settings a socket ended up with, defaults included.
+*/
+static void
+log_socket_options(void *socket, const char *name, const char *address)
+{
+    uint64_t affinity = 0;
+    size_t affinitySize = sizeof(affinity);
+    zmq_getsockopt(socket, ZMQ_AFFINITY, &affinity, &affinitySize);
+
+    fprintf(stderr, "[%s] - %s [%s]: sndhwm=%d rcvhwm=%d sndbuf=%d rcvbuf=%d affinity=0x%llx sndtimeo=%d "
+                    "tcp_keepalive=%d tcp_keepalive_idle=%d tcp_keepalive_cnt=%d tcp_keepalive_intvl=%d\n",
+            timestamp(), name, address,
+            zsocket_sndhwm(socket), zsocket_rcvhwm(socket), zsocket_sndbuf(socket), zsocket_rcvbuf(socket),
+            (unsigned long long) affinity, zsocket_sndtimeo(socket),
+            zsocket_tcp_keepalive(socket), zsocket_tcp_keepalive_idle(socket),
+            zsocket_tcp_keepalive_cnt(socket), zsocket_tcp_keepalive_intvl(socket));
+}
+
+/**
+* Replays spooled messages once consumers are subscribed again, batch_size messages per wakeup so the ingress
+* isn't starved. Returns 1 when messages are left in the spool, in which case the caller polls without waiting.
+*/
+static int
+replay_spool(gw_listener_t *listener)
+{
+    if (listener->spool == NULL || listener->spilling || gw_subscriptions_count(listener->subscriptions) == 0
+            || !gw_spool_pending(listener->spool)) {
+        return 0;
+    }
+    gw_spool_replay(listener->spool, listener->publisher, listener->batch_size);
+    return gw_spool_pending(listener->spool);
+}
+
+/**
+* Runs the periodic work of the thread owning the XPUB before it polls again: reloading the routing rules when they
+* changed, replaying the spool, publishing the coalesced messages which waited long enough and the rollups of the
+* windows which are over, and sending the consumers catching up the next messages of the replay window.
+* Returns how long the thread can wait in zmq_poll.
+*/
+static int
+prepare_egress(gw_listener_t *listener)
+{
+    int timeout = GW_POLL_TIMEOUT_MSEC;
+
+    if (listener->router != NULL) {
+        gw_router_check(listener->router);
+    }
+    if (replay_spool(listener)) {
+        timeout = 0;
+    }
+    if (listener->replay != NULL && gw_replay_serve(listener->replay, listener->batch_size)) {
+        timeout = 0;
+    }
+    if (listener->coalescer != NULL) {
+        gw_coalescer_flush_expired(listener->coalescer, listener->publisher);
+        int deadline = gw_coalescer_timeout(listener->coalescer);
+        if (deadline >= 0 && deadline < timeout) {
+            timeout = deadline;
+        }
+    }
+    if (listener->aggregator != NULL) {
+        gw_aggregator_flush_expired(listener->aggregator, listener->publisher);
+        int deadline = gw_aggregator_timeout(listener->aggregator);
+        if (deadline < timeout) {
+            timeout = deadline;
+        }
+    }
+    return timeout;
+}
+
+/**
+* Stops taking messages in: the XSUB lets go of its endpoint and of the connections made to it, and the messages they
+* already delivered are still read. A shared memory shard keeps reading its rings until it stops.
+*/
+static void
+release_ingress(gw_shard_t *shard)
+{
+    if (shard->frontend != NULL) {
+        int result = shard->listener->relay
+                ? zmq_disconnect(shard->frontend, shard->endpoint)
+                : zmq_unbind(shard->frontend, shard->endpoint);
+        if (result == -1) {
+            fprintf(stderr, "[%s] - Could not release %s: %s\n", timestamp(), shard->endpoint,
+                    zmq_strerror(zmq_errno()));
+        }
+    }
+    shard->released_at = monotonic_usecs();
+    shard->released = 1;
+}
+
+/**
+* Forwarding loop of a shard: messages from the shard's XSUB go to the XPUB, or to its ring when there are several
+* shards, subscriptions coming back from the backend go up to the XSUB. A shared memory shard reads its rings instead
+* of the XSUB ( see poll_once ).
+*/
+static void*
+gateway_shard_thread(void *args)
+{
+    gw_shard_t *shard = (gw_shard_t *) args;
+    gw_listener_t *listener = shard->listener;
+    char name[64];
+
+    snprintf(name, sizeof(name), "shard %d", shard->index);
+    pin_current_thread(shard->cpu, name);
+
+    gw_batch_t *batch = gw_batch_new(listener->batch_size);
+    gw_waiter_t waiter;
+    waiter_init(&waiter, listener, shard->metrics);
+
+    zmq_pollitem_t items[] = {
+        { shard->frontend, 0, ZMQ_POLLIN, 0 },
+        { shard->backend, 0, ZMQ_POLLIN, 0 },
+        { NULL, 0, ZMQ_POLLIN, 0 },
+        { NULL, 0, ZMQ_POLLIN, 0 },
+        { NULL, 0, ZMQ_POLLIN, 0 }
+    };
+    int itemCount = 2;
+    int compressedItem = -1;
+    int replayItem = -1;
+    int balancerItem = -1;
+    if (listener->shard_count == 1 && listener->compressor != NULL) {
+        compressedItem = itemCount;
+        items[itemCount++].socket = gw_compressor_results(listener->compressor);
+    }
+    if (listener->shard_count == 1 && listener->replay != NULL) {
+        replayItem = itemCount;
+        items[itemCount++].socket = gw_replay_socket(listener->replay);
+    }
+    if (listener->shard_count == 1 && listener->balancer != NULL && gw_balancer_socket(listener->balancer) != NULL) {
+        balancerItem = itemCount;
+        items[itemCount++].socket = gw_balancer_socket(listener->balancer);
+    }
+    // a shared memory shard has no XSUB to poll
+    int firstItem = shard->shm != NULL ? 1 : 0;
+
+    while (listener->running) {
+        if (listener->draining && !shard->released) {
+            release_ingress(shard);
+        }
+        int timeout = listener->shard_count == 1 ? prepare_egress(listener) : GW_POLL_TIMEOUT_MSEC;
+        if (wait_for_events(&waiter, shard->shm, items + firstItem, itemCount - firstItem, timeout) == -1) {
+            if (zmq_errno() == ETERM) {
+                break;
+            }
+            continue;
+        }
+        // the rings are cheap to look at, and reading them is the only way to know which ones are ready
+        int forwarded = 0;
+        if (shard->shm != NULL || (items[0].revents & ZMQ_POLLIN)) {
+            gw_token_bucket_t *bucket = shard->bucket.rate > 0 ? &shard->bucket : NULL;
+            int result = shard->ring != NULL
+                    ? forward_to_ring(shard, batch, bucket)
+                    : forward_batch(shard->frontend, NULL, shard->shm, shard->backend, batch, shard->metrics, listener,
+                                    bucket);
+            if (result == -1 && zmq_errno() == ETERM) {
+                break;
+            }
+            forwarded = result > 0;
+        }
+        // the connections released close asynchronously, what they had is in once nothing came for a poll timeout
+        if (shard->released && !shard->drained && !forwarded
+                && monotonic_usecs() - shard->released_at >= GW_POLL_TIMEOUT_MSEC * 1000) {
+            shard->drained = 1;
+        }
+        if ((items[1].revents & ZMQ_POLLIN)
+                && forward_subscription(shard->backend, shard->frontend,
+                                        listener->shard_count == 1 ? listener : NULL, shard->metrics) == -1
+                && zmq_errno() == ETERM) {
+            break;
+        }
+        if (compressedItem > 0 && (items[compressedItem].revents & ZMQ_POLLIN)) {
+            gw_compressor_publish(listener->compressor, listener->publisher, listener->batch_size);
+        }
+        if (replayItem > 0 && (items[replayItem].revents & ZMQ_POLLIN)) {
+            gw_replay_handle_request(listener->replay);
+        }
+        if (balancerItem > 0 && (items[balancerItem].revents & ZMQ_POLLIN)) {
+            gw_balancer_handle_request(listener->balancer);
+        }
+    }
+
+    if (listener->shard_count == 1 && listener->coalescer != NULL) {
+        gw_coalescer_flush(listener->coalescer, listener->publisher);
+    }
+    if (listener->shard_count == 1 && listener->aggregator != NULL) {
+        gw_aggregator_flush(listener->aggregator, listener->publisher);
+    }
+    gw_batch_destroy(&batch);
+    return NULL;
+}
+
+/**
+* Owns the XPUB socket when the listener runs more than one shard.
+* libzmq sockets can't be shared between threads, so each shard hands its messages over through its own
+* single producer, single consumer ring ( see GwZmqRing.h ); no lock is shared between the shards. The thread only
+* sleeps in zmq_poll when all the rings are empty, and the subscriptions go back to the shards over inproc PAIRs.
+*/
+static void*
+gateway_egress_thread(void *args)
+{
+    gw_listener_t *listener = (gw_listener_t *) args;
+    int count = listener->shard_count;
+    zmq_pollitem_t items[GW_MAX_SHARDS + 4];
+    int itemCount = count + 1;
+    int compressedItem = -1;
+    int replayItem = -1;
+    int balancerItem = -1;
+    int i;
+
+    pin_current_thread(listener->egress_cpu, "egress");
+
+    gw_batch_t *batch = gw_batch_new(listener->batch_size);
+    gw_waiter_t waiter;
+    waiter_init(&waiter, listener, listener->egress_metrics);
+
+    for (i = 0; i < count; i++) {
+        zmq_pollitem_t item = { NULL, gw_ring_fd(listener->shards[i].ring), ZMQ_POLLIN, 0 };
+        items[i] = item;
+    }
+    zmq_pollitem_t publisherItem = { listener->publisher, 0, ZMQ_POLLIN, 0 };
+    items[count] = publisherItem;
+    if (listener->compressor != NULL) {
+        zmq_pollitem_t item = { gw_compressor_results(listener->compressor), 0, ZMQ_POLLIN, 0 };
+        compressedItem = itemCount;
+        items[itemCount++] = item;
+    }
+    if (listener->replay != NULL) {
+        zmq_pollitem_t item = { gw_replay_socket(listener->replay), 0, ZMQ_POLLIN, 0 };
+        replayItem = itemCount;
+        items[itemCount++] = item;
+    }
+    if (listener->balancer != NULL && gw_balancer_socket(listener->balancer) != NULL) {
+        zmq_pollitem_t item = { gw_balancer_socket(listener->balancer), 0, ZMQ_POLLIN, 0 };
+        balancerItem = itemCount;
+        items[itemCount++] = item;
+    }
+
+    while (listener->running) {
+        int timeout = prepare_egress(listener);
+        for (i = 0; i < count; i++) {
+            if (gw_ring_prepare_wait(listener->shards[i].ring)) {
+                timeout = 0;
+            }
+        }
+        if (wait_for_events(&waiter, NULL, items, itemCount, timeout) == -1) {
+            if (zmq_errno() == ETERM) {
+                break;
+            }
+            continue;
+        }
+        int terminated = 0;
+        for (i = 0; i < count && !terminated; i++) {
+            gw_ring_t *ring = listener->shards[i].ring;
+            gw_ring_clear_wakeup(ring, items[i].revents & ZMQ_POLLIN);
+            terminated = forward_batch(NULL, ring, NULL, listener->publisher, batch, listener->egress_metrics,
+                                       listener, NULL) == -1
+                    && zmq_errno() == ETERM;
+        }
+        if (terminated) {
+            break;
+        }
+        if ((items[count].revents & ZMQ_POLLIN)
+                && broadcast_subscription(listener) == -1
+                && zmq_errno() == ETERM) {
+            break;
+        }
+        if (compressedItem > 0 && (items[compressedItem].revents & ZMQ_POLLIN)) {
+            gw_compressor_publish(listener->compressor, listener->publisher, listener->batch_size);
+        }
+        if (replayItem > 0 && (items[replayItem].revents & ZMQ_POLLIN)) {
+            gw_replay_handle_request(listener->replay);
+        }
+        if (balancerItem > 0 && (items[balancerItem].revents & ZMQ_POLLIN)) {
+            gw_balancer_handle_request(listener->balancer);
+        }
+    }
+
+    if (listener->coalescer != NULL) {
+        gw_coalescer_flush(listener->coalescer, listener->publisher);
+    }
+    if (listener->aggregator != NULL) {
+        gw_aggregator_flush(listener->aggregator, listener->publisher);
+    }
+    gw_batch_destroy(&batch);
+    return NULL;
+}
+
+/**
+* Metrics collector for the rings between the shards and the egress thread.
+*/
+static void
+render_rings(FILE *out, void *self)
+{
+    gw_listener_t *listener = (gw_listener_t *) self;
+    int i;
+
+    fprintf(out, "# TYPE gw_zmq_ring_depth gauge\n");
+    for (i = 0; i < listener->shard_count; i++) {
+        fprintf(out, "gw_zmq_ring_depth{shard=\"%d\"} %zu\n", i, gw_ring_depth(listener->shards[i].ring));
+    }
+    fprintf(out, "# TYPE gw_zmq_ring_dropped_total counter\n");
+    for (i = 0; i < listener->shard_count; i++) {
+        fprintf(out, "gw_zmq_ring_dropped_total{shard=\"%d\"} %llu\n", i,
+                (unsigned long long) gw_ring_dropped(listener->shards[i].ring));
+    }
+    fprintf(out, "# TYPE gw_zmq_ring_full_waits_total counter\n");
+    for (i = 0; i < listener->shard_count; i++) {
+        fprintf(out, "gw_zmq_ring_full_waits_total{shard=\"%d\"} %llu\n", i,
+                (unsigned long long) gw_ring_full_waits(listener->shards[i].ring));
+    }
+}
+
+/**
+* Metrics collector for the shared memory rings of the gateway workers.
+*/
+static void
+render_shm_rings(FILE *out, void *self)
+{
+    gw_listener_t *listener = (gw_listener_t *) self;
+    int i;
+
+    fprintf(out, "# TYPE gw_zmq_shm_writers gauge\n");
+    for (i = 0; i < listener->shard_count; i++) {
+        if (listener->shards[i].shm != NULL) {
+            fprintf(out, "gw_zmq_shm_writers{endpoint=\"%s\"} %d\n", listener->shards[i].endpoint,
+                    gw_shm_reader_workers(listener->shards[i].shm));
+        }
+    }
+    fprintf(out, "# TYPE gw_zmq_shm_depth_bytes gauge\n");
+    for (i = 0; i < listener->shard_count; i++) {
+        if (listener->shards[i].shm != NULL) {
+            fprintf(out, "gw_zmq_shm_depth_bytes{endpoint=\"%s\"} %zu\n", listener->shards[i].endpoint,
+                    gw_shm_reader_depth(listener->shards[i].shm));
+        }
+    }
+    fprintf(out, "# TYPE gw_zmq_shm_dropped_total counter\n");
+    for (i = 0; i < listener->shard_count; i++) {
+        if (listener->shards[i].shm != NULL) {
+            fprintf(out, "gw_zmq_shm_dropped_total{endpoint=\"%s\"} %llu\n", listener->shards[i].endpoint,
+                    (unsigned long long) gw_shm_reader_dropped(listener->shards[i].shm));
+        }
+    }
+    fprintf(out, "# TYPE gw_zmq_shm_corrupted_total counter\n");
+    for (i = 0; i < listener->shard_count; i++) {
+        if (listener->shards[i].shm != NULL) {
+            fprintf(out, "gw_zmq_shm_corrupted_total{endpoint=\"%s\"} %llu\n", listener->shards[i].endpoint,
+                    (unsigned long long) gw_shm_reader_corrupted(listener->shards[i].shm));
+        }
+    }
+}
+
+/**
+* Metrics collector for the residence times of the traced messages.
+*/
+static void
+render_traces(FILE *out, void *self)
+{
+    gw_listener_t *listener = (gw_listener_t *) self;
+    char labels[320];
+    int i;
+
+    fprintf(out, "# HELP gw_zmq_trace_ingress_residence_microseconds Time the traced messages of an ingress endpoint spent in the adaptor\n");
+    fprintf(out, "# TYPE gw_zmq_trace_ingress_residence_microseconds summary\n");
+    for (i = 0; i < listener->shard_count; i++) {
+        snprintf(labels, sizeof(labels), "ingress=\"%s\"", listener->shards[i].endpoint);
+        gw_histogram_render(out, "gw_zmq_trace_ingress_residence_microseconds", labels, listener->trace_ingress[i]);
+    }
+    fprintf(out, "# HELP gw_zmq_trace_egress_residence_microseconds Time the traced messages published on an egress socket spent in the adaptor\n");
+    fprintf(out, "# TYPE gw_zmq_trace_egress_residence_microseconds summary\n");
+    snprintf(labels, sizeof(labels), "egress=\"%s\"", listener->publisher_address);
+    gw_histogram_render(out, "gw_zmq_trace_egress_residence_microseconds", labels, listener->trace_egress);
+}
+
+/**
+* Metrics collector for the latency of the hops from the upstream adaptors of a relay.
+*/
+static void
+render_relay_hops(FILE *out, void *self)
+{
+    gw_listener_t *listener = (gw_listener_t *) self;
+    char labels[320];
+    int i;
+
+    fprintf(out, "# HELP gw_zmq_relay_hop_microseconds Time the traced messages of an upstream adaptor took from its XPUB to the relay\n");
+    fprintf(out, "# TYPE gw_zmq_relay_hop_microseconds summary\n");
+    for (i = 0; i < listener->shard_count; i++) {
+        snprintf(labels, sizeof(labels), "upstream=\"%s\"", listener->shards[i].endpoint);
+        gw_histogram_render(out, "gw_zmq_relay_hop_microseconds", labels, listener->relay_hops[i]);
+    }
+}
+
+static void
+stop_gateway_listeners(zctx_t *ctx)
+{
+    gw_listener_t **link = &gw_listeners;
+
+    while (*link != NULL) {
+        gw_listener_t *listener = *link;
+        if (listener->ctx != ctx) {
+            link = &listener->next;
+            continue;
+        }
+
+        listener->running = 0;
+        if (listener->reporter != NULL) {
+            gw_metrics_reporter_stop(&listener->reporter);
+        }
+        int i;
+        for (i = 0; i < listener->shard_count; i++) {
+            if (listener->shards[i].ring != NULL) {
+                // a shard waiting for room in its ring can't count on the egress thread anymore
+                gw_ring_shutdown(listener->shards[i].ring);
+            }
+        }
+        for (i = 0; i < listener->shard_count; i++) {
+            pthread_join(listener->shards[i].thread, NULL);
+            gw_metrics_destroy(&listener->shards[i].metrics);
+        }
+        if (listener->has_shm_shards) {
+            gw_metrics_remove_collector(render_shm_rings, listener);
+            for (i = 0; i < listener->shard_count; i++) {
+                if (listener->shards[i].shm != NULL) {
+                    gw_shm_reader_destroy(&listener->shards[i].shm);
+                }
+            }
+        }
+        if (listener->has_egress_thread) {
+            pthread_join(listener->egress_thread, NULL);
+            gw_metrics_destroy(&listener->egress_metrics);
+            gw_metrics_remove_collector(render_rings, listener);
+            for (i = 0; i < listener->shard_count; i++) {
+                gw_ring_destroy(&listener->shards[i].ring);
+            }
+        }
+        if (listener->trace_sample > 0) {
+            gw_metrics_remove_collector(render_traces, listener);
+            for (i = 0; i < listener->shard_count; i++) {
+                gw_histogram_destroy(&listener->trace_ingress[i]);
+            }
+            gw_histogram_destroy(&listener->trace_egress);
+        }
+        if (listener->relay) {
+            gw_metrics_remove_collector(render_relay_hops, listener);
+            for (i = 0; i < listener->shard_count; i++) {
+                gw_histogram_destroy(&listener->relay_hops[i]);
+            }
+        }
+        if (listener->monitor != NULL) {
+            gw_metrics_remove_collector(gw_monitor_render, listener->monitor);
+            gw_monitor_destroy(&listener->monitor);
+        }
+        if (listener->consumers != NULL) {
+            gw_metrics_remove_collector(gw_consumers_render, listener->consumers);
+            gw_consumers_destroy(&listener->consumers);
+        }
+        if (listener->compressor != NULL) {
+            // the compressor matches against the subscription index
+            gw_metrics_remove_collector(gw_compressor_render, listener->compressor);
+            gw_compressor_destroy(&listener->compressor);
+        }
+        if (listener->aggregator != NULL) {
+            gw_metrics_remove_collector(gw_aggregator_render, listener->aggregator);
+            gw_aggregator_destroy(&listener->aggregator);
+        }
+        if (listener->replay != NULL) {
+            gw_metrics_remove_collector(gw_replay_render, listener->replay);
+            gw_replay_destroy(&listener->replay);
+        }
+        if (listener->balancer != NULL) {
+            gw_metrics_remove_collector(gw_balancer_render, listener->balancer);
+            gw_balancer_destroy(&listener->balancer);
+        }
+        if (listener->router != NULL) {
+            gw_metrics_remove_collector(gw_router_render, listener->router);
+            gw_router_destroy(&listener->router);
+        }
+        gw_metrics_remove_collector(gw_subscriptions_render, listener->subscriptions);
+        gw_subscriptions_destroy(&listener->subscriptions);
+        if (listener->coalescer != NULL) {
+            gw_metrics_remove_collector(gw_coalescer_render, listener->coalescer);
+            gw_coalescer_destroy(&listener->coalescer);
+        }
+        if (listener->spool != NULL) {
+            gw_metrics_remove_collector(gw_spool_render, listener->spool);
+            gw_spool_destroy(&listener->spool);
+        }
+
+        *link = listener->next;
+        free(listener);
+    }
+}
+
+void
+gw_listener_options_init(gw_listener_options_t *options)
+{
+    memset(options, 0, sizeof(gw_listener_options_t));
+    options->subscriber_address = DEFAULT_XSUB;
+    options->publisher_address = DEFAULT_XPUB;
+    options->shard_count = DEFAULT_SHARD_COUNT;
+    options->egress_cpu = -1;
+    options->batch_size = DEFAULT_BATCH_SIZE;
+    options->ring_size = DEFAULT_RING_SIZE;
+    options->wait_strategy = GW_WAIT_BLOCK;
+    options->spin_usec = DEFAULT_SPIN_USEC;
+    options->ring_policy = GW_RING_BLOCK;
+    options->spool_segment_size = DEFAULT_SPOOL_SEGMENT_SIZE;
+    options->spool_segments = DEFAULT_SPOOL_SEGMENTS;
+    options->spool_retention_secs = DEFAULT_SPOOL_RETENTION_SECS;
+    options->spool_sync_interval_msec = DEFAULT_SPOOL_SYNC_INTERVAL_MSEC;
+    options->replay_window_bytes = DEFAULT_REPLAY_WINDOW_BYTES;
+    options->replay_window_secs = DEFAULT_REPLAY_WINDOW_SECS;
+    options->balance_mode = GW_BALANCE_ROUND_ROBIN;
+    options->balance_key_size = DEFAULT_BALANCE_KEY_SIZE;
+    options->io_threads = GW_SOCKET_OPTION_DEFAULT;
+    options->send_hwm = GW_SOCKET_OPTION_DEFAULT;
+    options->receive_hwm = GW_SOCKET_OPTION_DEFAULT;
+    options->send_buffer = GW_SOCKET_OPTION_DEFAULT;
+    options->receive_buffer = GW_SOCKET_OPTION_DEFAULT;
+    options->tcp_keepalive = GW_SOCKET_OPTION_DEFAULT;
+    options->tcp_keepalive_idle = GW_SOCKET_OPTION_DEFAULT;
+    options->tcp_keepalive_cnt = GW_SOCKET_OPTION_DEFAULT;
+    options->tcp_keepalive_intvl = GW_SOCKET_OPTION_DEFAULT;
+    options->send_timeout = GW_SOCKET_OPTION_DEFAULT;
+    options->slow_consumer_samples = DEFAULT_SLOW_CONSUMER_SAMPLES;
+    options->coalesce_delay_usec = DEFAULT_COALESCE_DELAY_USEC;
+    options->coalesce_topic_size = DEFAULT_COALESCE_TOPIC_SIZE;
+    options->compress_workers = DEFAULT_COMPRESSION_WORKERS;
+    options->compress_level = DEFAULT_COMPRESSION_LEVEL;
+    options->aggregate_delimiter = DEFAULT_AGGREGATE_DELIMITER;
+    options->aggregate_key_field_count = 1;
+    options->aggregate_value_field = -1;
+    options->aggregate_window_msec = DEFAULT_AGGREGATE_WINDOW_MSEC;
+    options->aggregate_topic = DEFAULT_AGGREGATE_TOPIC;
+    options->monitor_log_rate = DEFAULT_MONITOR_LOG_RATE;
+    options->shm_workers = DEFAULT_SHM_WORKERS;
+    options->shm_ring_size = DEFAULT_SHM_RING_SIZE;
+
+    int i;
+    for (i = 0; i < GW_MAX_SHARDS; i++) {
+        options->shard_cpus[i] = -1;
+    }
+}
+
+/**
+* Computes the ingress endpoint of a shard from the address given with -b.
+* When it's a comma separated list of endpoints, i.e. "ipc:///tmp/nginx_queue_listen,ipc://@canary,tcp://127.0.0.1:5001",
+* shard N binds the Nth endpoint of the list. Otherwise it's a base address: shard 0 binds the base address itself so
+* a single shard behaves as before, and the other shards use:
+*   tcp://host:port          ->  tcp://host:(port + shardIndex)
+*   ipc:///tmp/queue         ->  ipc:///tmp/queue-shardIndex
+*   ipc://@queue             ->  ipc://@queue-shardIndex
+* Gateway workers spread themselves over the shards by hashing their worker id to a shard index.
+* Returns 0 on success, -1 if the endpoint can't be derived or doesn't fit in the buffer.
+*/
+int
+gw_zmq_shard_endpoint(const char *baseAddress, int shardIndex, char *endpoint, size_t size)
+{
+    int written;
+
+    if (strchr(baseAddress, ',') != NULL) {
+        const char *cursor = baseAddress;
+        int i;
+        for (i = 0; i < shardIndex && cursor != NULL; i++) {
+            cursor = strchr(cursor, ',');
+            cursor = cursor != NULL ? cursor + 1 : NULL;
+        }
+        if (cursor == NULL) {
+            return -1;
+        }
+        const char *end = strchr(cursor, ',');
+        int length = end != NULL ? (int) (end - cursor) : (int) strlen(cursor);
+        if (length == 0) {
+            return -1;
+        }
+        written = snprintf(endpoint, size, "%.*s", length, cursor);
+    } else if (shardIndex == 0) {
+        written = snprintf(endpoint, size, "%s", baseAddress);
+    } else if (strncmp(baseAddress, "tcp://", 6) == 0) {
+        const char *port = strrchr(baseAddress, ':');
+        char *end;
+        long portNumber = port == NULL ? 0 : strtol(port + 1, &end, 10);
+
+        // wildcard ports ( tcp://*:* ) can't be derived
+        if (port == NULL || port < baseAddress + 6 || *end != 0 || portNumber <= 0) {
+            return -1;
+        }
+        written = snprintf(endpoint, size, "%.*s:%ld", (int)(port - baseAddress), baseAddress, portNumber + shardIndex);
+    } else {
+        written = snprintf(endpoint, size, "%s-%d", baseAddress, shardIndex);
+    }
+
+    return (written < 0 || (size_t) written >= size) ? -1 : 0;
+}
+
+/**
+* Returns the number of endpoints of an address given with -b: 1 for a base address, or the length of the list.
+*/
+int
+gw_zmq_endpoint_count(const char *addresses)
+{
+    int count = 1;
+    const char *cursor;
+    for (cursor = strchr(addresses, ','); cursor != NULL; cursor = strchr(cursor + 1, ',')) {
+        count++;
+    }
+    return count;
+}
+
+/**
+* Parses a list of CPUs such as "2,3,6-9" into cpus.
+* Returns the number of CPUs parsed or -1 if the list is malformed or longer than maxCpus.
+*/
+int
+gw_parse_cpu_list(const char *list, int *cpus, int maxCpus)
+{
+    int count = 0;
+    const char *cursor = list;
+
+    while (*cursor != 0) {
+        char *end;
+        long first = strtol(cursor, &end, 10);
+        long last = first;
+
+        if (end == cursor || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            cursor = end + 1;
+            last = strtol(cursor, &end, 10);
+            if (end == cursor || last < first) {
+                return -1;
+            }
+        }
+
+        long cpu;
+        for (cpu = first; cpu <= last; cpu++) {
+            if (count >= maxCpus) {
+                return -1;
+            }
+            cpus[count++] = (int) cpu;
+        }
+
+        if (*end == ',') {
+            end++;
+        } else if (*end != 0) {
+            return -1;
+        }
+        cursor = end;
+    }
+    return count;
+}
+
+static gw_listener_t *
+find_gateway_listener(zctx_t *ctx)
+{
+    gw_listener_t *listener;
+    for (listener = gw_listeners; listener != NULL; listener = listener->next) {
+        if (listener->ctx == ctx) {
+            return listener;
+        }
+    }
+    return NULL;
+}
+
+/**
+* Copies the counters of a shard of the first listener started on ctx.
+* Returns 0 on success, -1 if there's no such shard.
+*/
+int
+gw_zmq_shard_stats(zctx_t *ctx, int shardIndex, gw_shard_stats_t *stats)
+{
+    gw_listener_t *listener = find_gateway_listener(ctx);
+
+    if (listener == NULL || shardIndex < 0 || shardIndex >= listener->shard_count) {
+        return -1;
+    }
+    gw_metrics_t *source = listener->shards[shardIndex].metrics;
+    stats->messages = GW_COUNTER_GET(source->messages_in);
+    stats->bytes = GW_COUNTER_GET(source->bytes_in);
+    stats->messages_out = GW_COUNTER_GET(source->messages_out);
+    stats->dropped = GW_COUNTER_GET(source->dropped_hwm);
+    stats->batches = GW_COUNTER_GET(source->batches);
+    stats->rate_limited = GW_COUNTER_GET(source->dropped_rate_limited);
+    stats->busy_usec = GW_COUNTER_GET(source->busy_usec);
+    stats->spin_usec = GW_COUNTER_GET(source->spin_usec);
+    stats->blocked_usec = GW_COUNTER_GET(source->blocked_usec);
+    return 0;
+}
+
+/**
+* Prints the throughput of each shard since the previous report.
+*/
+void
+gw_zmq_report_shards(zctx_t *ctx)
+{
+    gw_listener_t *listener;
+
+    for (listener = gw_listeners; listener != NULL; listener = listener->next) {
+        if (listener->ctx != ctx) {
+            continue;
+        }
+        int64_t now = zclock_time();
+        double seconds = (now - listener->reported_at) / 1000.0;
+        if (seconds <= 0) {
+            continue;
+        }
+
+        int i;
+        for (i = 0; i < listener->shard_count; i++) {
+            gw_shard_t *shard = &listener->shards[i];
+            gw_shard_stats_t current;
+            gw_zmq_shard_stats(ctx, i, &current);
+
+            uint64_t batches = current.batches - shard->reported.batches;
+            uint64_t messages = current.messages - shard->reported.messages;
+
+            fprintf(stderr, "[%s] - Shard %d [%s]: %.0f msg/s, %.3f MB/s, %.1f messages per wakeup, %llu messages in total, "
+                            "%llu over the rate limit, %.0f%% busy, %.0f%% spinning\n",
+                    timestamp(), i, shard->endpoint,
+                    messages / seconds,
+                    (current.bytes - shard->reported.bytes) / seconds / (1024 * 1024),
+                    batches > 0 ? (double) messages / batches : 0.0,
+                    (unsigned long long) current.messages,
+                    (unsigned long long) (current.rate_limited - shard->reported.rate_limited),
+                    (current.busy_usec - shard->reported.busy_usec) / seconds / 10000,
+                    (current.spin_usec - shard->reported.spin_usec) / seconds / 10000);
+            shard->reported = current;
+        }
+        listener->reported_at = now;
+    }
+}
+
+/*
+
+Espresso Pattern impl
+@see http://zguide.zeromq.org/page:all#header-116
+--------------------------------------
+   XPUB           ->       XSUB
+  public address     ->    internal address
+   BIND           ->       BIND
+---------------------------------------
+
+This method starts a new thread subscribing to the messages sent by the Gateway on XSUB
+and proxying them to a local IP address on XPUB . Remote consumers should connect to the XPUB's socket address.
+
+*/
+
+void
+start_gateway_listener(zctx_t *ctx, char *subscriberAddress, char *publisherAddress, int debugFlag)
+{
+    gw_listener_options_t options;
+
+    gw_listener_options_init(&options);
+    options.subscriber_address = subscriberAddress;
+    options.publisher_address = publisherAddress;
+    options.debug_flag = debugFlag;
+
+    start_gateway_listener_with_options(ctx, &options);
+}
+
+void
+start_gateway_listener_with_options(zctx_t *ctx, gw_listener_options_t *options)
+{
+    char *subscriberAddress = options->subscriber_address;
+    char *publisherAddress = options->publisher_address;
+    int shardCount = options->shard_count;
+    int endpointCount = gw_zmq_endpoint_count(subscriberAddress);
+
+    fprintf(stderr,"[%s] - Starting Gateway Listener%s\n", timestamp(), options->relay ? " relaying upstream adaptors " : " ");
+    if (endpointCount > 1 || options->relay) {
+        // each endpoint of the list gets its own shard, and so does each upstream adaptor
+        assert( shardCount == 1 || shardCount == endpointCount );
+        shardCount = endpointCount;
+    }
+    assert( shardCount >= 1 && shardCount <= GW_MAX_SHARDS );
+    assert( options->batch_size >= 1 && options->batch_size <= GW_MAX_BATCH_SIZE );
+
+    gw_listener_t *listener = (gw_listener_t *) calloc(1, sizeof(gw_listener_t));
+    assert( listener );
+    listener->id = ++gw_listener_count;
+    listener->ctx = ctx;
+    listener->running = 1;
+    listener->shard_count = shardCount;
+    listener->egress_cpu = options->egress_cpu;
+    listener->batch_size = options->batch_size;
+    listener->wait_strategy = options->wait_strategy;
+    listener->spin_usec = options->spin_usec;
+    listener->relay = options->relay;
+    listener->send_timeout = options->send_timeout == GW_SOCKET_OPTION_DEFAULT ? 0 : options->send_timeout;
+    listener->reported_at = zclock_time();
+
+    // Start XPUB Proxy -> remote consumers connect here
+    void *publisher = zsocket_new (ctx, ZMQ_XPUB);
+    zsocket_set_xpub_verbose (publisher, 1);
+#ifdef ZMQ_XPUB_VERBOSER
+    // every unsubscription too, so the index knows how many subscribers each topic has left
+    int verboser = 1;
+    int verboserResult = zmq_setsockopt(publisher, ZMQ_XPUB_VERBOSER, &verboser, sizeof(verboser));
+    assert( verboserResult == 0 );
+#endif
+    configure_socket(publisher, options, GW_SOCKET_PUBLISHER);
+    log_socket_options(publisher, "XPUB", publisherAddress);
+    int publisherBindResult = gw_handover_bind (publisher, publisherAddress);
+    assert( publisherBindResult >= 0 );
+    listener->publisher = publisher;
+    listener->subscriptions = gw_subscriptions_new();
+    gw_metrics_add_collector(gw_subscriptions_render, listener->subscriptions);
+
+    if (options->spool_directory != NULL) {
+        fprintf(stderr, "[%s] - Spooling to %s when consumers can't keep up: %d segments of %zu bytes, kept for %ds, synced every %dms\n",
+                timestamp(), options->spool_directory, options->spool_segments, options->spool_segment_size,
+                options->spool_retention_secs, options->spool_sync_interval_msec);
+        listener->spool = gw_spool_new(options->spool_directory, options->spool_segment_size, options->spool_segments,
+                                       options->spool_retention_secs, options->spool_sync_interval_msec);
+        assert( listener->spool );
+        gw_metrics_add_collector(gw_spool_render, listener->spool);
+    }
+
+    if (options->coalesce_bytes > 0) {
+        fprintf(stderr, "[%s] - Coalescing messages by their first %zu bytes, up to %zu bytes or %dus\n", timestamp(),
+                options->coalesce_topic_size, options->coalesce_bytes, options->coalesce_delay_usec);
+        listener->coalescer = gw_coalescer_new(options->coalesce_topic_size, options->coalesce_bytes,
+                                               options->coalesce_delay_usec);
+        gw_metrics_add_collector(gw_coalescer_render, listener->coalescer);
+    }
+
+    if (options->routes_file != NULL) {
+        fprintf(stderr, "[%s] - Routing messages with the rules of %s\n", timestamp(), options->routes_file);
+        listener->router = gw_router_new(ctx, options->routes_file);
+        assert( listener->router );
+        gw_metrics_add_collector(gw_router_render, listener->router);
+    }
+
+    if (options->aggregate_prefix != NULL) {
+        gw_aggregate_format_t format;
+        format.prefix = options->aggregate_prefix;
+        format.delimiter = options->aggregate_delimiter;
+        memcpy(format.key_fields, options->aggregate_key_fields, sizeof(format.key_fields));
+        format.key_field_count = options->aggregate_key_field_count;
+        format.value_field = options->aggregate_value_field;
+        fprintf(stderr, "[%s] - Aggregating the records starting with %s every %dms on %s%s\n", timestamp(),
+                options->aggregate_prefix, options->aggregate_window_msec, options->aggregate_topic,
+                options->aggregate_only ? ", without publishing them" : "");
+        listener->aggregator = gw_aggregator_new(&format, options->aggregate_window_msec, options->aggregate_topic);
+        listener->aggregate_only = options->aggregate_only;
+        gw_metrics_add_collector(gw_aggregator_render, listener->aggregator);
+    }
+
+    if (options->replay_endpoint != NULL) {
+        fprintf(stderr, "[%s] - Keeping the last %zu bytes or %d seconds of messages for the consumers catching up on %s\n",
+                timestamp(), options->replay_window_bytes, options->replay_window_secs, options->replay_endpoint);
+        listener->replay = gw_replay_new(ctx, options->replay_endpoint, options->replay_window_bytes,
+                                         options->replay_window_secs);
+        assert( listener->replay );
+        gw_metrics_add_collector(gw_replay_render, listener->replay);
+    }
+
+    if (options->balance_endpoint != NULL) {
+        if (options->balance_mode == GW_BALANCE_HASH) {
+            fprintf(stderr, "[%s] - Spreading the messages over the workers registered on %s by their first %zu bytes\n",
+                    timestamp(), options->balance_endpoint, options->balance_key_size);
+        } else {
+            fprintf(stderr, "[%s] - Spreading the messages round robin over the workers connected to %s\n",
+                    timestamp(), options->balance_endpoint);
+        }
+        listener->balancer = gw_balancer_new(ctx, options->balance_endpoint, options->balance_mode,
+                                             options->balance_key_size);
+        assert( listener->balancer );
+        gw_metrics_add_collector(gw_balancer_render, listener->balancer);
+    }
+
+    if (options->compress_enabled) {
+        size_t topicSize = options->coalesce_bytes > 0 ? options->coalesce_topic_size : DEFAULT_COALESCE_TOPIC_SIZE;
+        fprintf(stderr, "[%s] - Compressing messages for the %s topics with %d workers at level %d, dictionary: %s\n",
+                timestamp(), GW_COMPRESSED_TOPIC_PREFIX, options->compress_workers, options->compress_level,
+                options->compress_dictionary != NULL ? options->compress_dictionary : "none");
+        listener->compressor = gw_compressor_new(ctx, listener->id, options->compress_workers, options->compress_level,
+                                                 options->compress_dictionary, listener->subscriptions, topicSize);
+        if (listener->compressor != NULL) {
+            gw_metrics_add_collector(gw_compressor_render, listener->compressor);
+            if (listener->coalescer != NULL) {
+                gw_coalescer_set_compressor(listener->coalescer, listener->compressor);
+            }
+        }
+    }
+
+    int i;
+    for (i = 0; i < shardCount; i++) {
+        gw_shard_t *shard = &listener->shards[i];
+        shard->listener = listener;
+        shard->index = i;
+        shard->cpu = options->shard_cpus[i];
+
+        int endpointResult = gw_zmq_shard_endpoint(subscriberAddress, i, shard->endpoint, sizeof(shard->endpoint));
+        assert( endpointResult == 0 );
+
+        if (strncmp(shard->endpoint, GW_SHM_SCHEME, strlen(GW_SHM_SCHEME)) == 0) {
+            fprintf(stderr, "[%s] - Reading %s from shared memory: %d rings of %zu bytes, spinning %dus before sleeping\n",
+                    timestamp(), shard->endpoint, options->shm_workers, options->shm_ring_size, options->shm_spin_usec);
+            shard->shm = gw_shm_reader_new(shard->endpoint, options->shm_workers, options->shm_ring_size);
+            if (shard->shm == NULL) {
+                fprintf(stderr, "[%s] - Can't create the shared memory of %s: %s\n", timestamp(), shard->endpoint,
+                        strerror(errno));
+            }
+            assert( shard->shm );
+            gw_shm_reader_set_spin(shard->shm, options->shm_spin_usec);
+            listener->has_shm_shards = 1;
+        } else if (options->relay) {
+            // the subscriptions of the consumers go up to the upstream XPUB, which only sends what they want
+            void *subscriber = zsocket_new (ctx, ZMQ_XSUB);
+            configure_socket(subscriber, options, GW_SOCKET_SUBSCRIBER);
+            if (i == 0) {
+                log_socket_options(subscriber, "XSUB", shard->endpoint);
+            }
+            int subscriberSocketResult = zsocket_connect (subscriber, "%s", shard->endpoint);
+            assert( subscriberSocketResult == 0 );
+            shard->frontend = subscriber;
+            listener->relay_hops[i] = gw_histogram_new();
+        } else {
+            void *subscriber = zsocket_new (ctx, ZMQ_XSUB);
+            configure_socket(subscriber, options, GW_SOCKET_SUBSCRIBER);
+            if (i == 0) {
+                log_socket_options(subscriber, "XSUB", shard->endpoint);
+            }
+            int subscriberSocketResult = gw_handover_bind (subscriber, shard->endpoint);
+            assert( subscriberSocketResult >= 0 );
+            shard->frontend = subscriber;
+        }
+
+        char threadName[32];
+        snprintf(threadName, sizeof(threadName), "shard-%d", i);
+        shard->metrics = gw_metrics_new(threadName, shard->endpoint);
+
+        if (options->ingress_rates[i] > 0) {
+            fprintf(stderr, "[%s] - Accepting up to %d msg/s from %s\n", timestamp(), options->ingress_rates[i],
+                    shard->endpoint);
+            shard->bucket.rate = options->ingress_rates[i];
+            shard->bucket.tokens = shard->bucket.rate;
+            shard->bucket.refilled_at = monotonic_usecs();
+        }
+
+        if (shardCount == 1) {
+            shard->backend = publisher;
+        } else {
+            char pipeEndpoint[128];
+            snprintf(pipeEndpoint, sizeof(pipeEndpoint), DEFAULT_INPROC_SHARD_ENDPOINT, listener->id, i);
+
+            shard->backend = zsocket_new (ctx, ZMQ_PAIR);
+            configure_socket(shard->backend, options, GW_SOCKET_PIPE);
+            int pipeBindResult = zsocket_bind (shard->backend, "%s", pipeEndpoint);
+            assert( pipeBindResult >= 0 );
+
+            listener->egress_pipes[i] = zsocket_new (ctx, ZMQ_PAIR);
+            configure_socket(listener->egress_pipes[i], options, GW_SOCKET_PIPE);
+            int pipeConnectResult = zsocket_connect (listener->egress_pipes[i], "%s", pipeEndpoint);
+            assert( pipeConnectResult == 0 );
+
+            shard->ring = gw_ring_new(options->ring_size, options->ring_policy);
+        }
+    }
+
+    if (listener->has_shm_shards) {
+        gw_metrics_add_collector(render_shm_rings, listener);
+    }
+    if (listener->relay) {
+        gw_metrics_add_collector(render_relay_hops, listener);
+    }
+
+    if (options->trace_sample > 0) {
+        fprintf(stderr, "[%s] - Tracing one message in %d from its ingress endpoint to the XPUB%s\n", timestamp(),
+                options->trace_sample, options->trace_envelope ? ", published with an envelope frame" : "");
+        listener->trace_sample = options->trace_sample;
+        listener->trace_envelope = options->trace_envelope;
+        snprintf(listener->publisher_address, sizeof(listener->publisher_address), "%s", publisherAddress);
+        for (i = 0; i < shardCount; i++) {
+            listener->shards[i].trace_countdown = options->trace_sample;
+            listener->trace_ingress[i] = gw_histogram_new();
+            if (listener->shards[i].ring != NULL) {
+                gw_ring_enable_stamps(listener->shards[i].ring);
+            }
+        }
+        listener->trace_egress = gw_histogram_new();
+        gw_metrics_add_collector(render_traces, listener);
+    }
+
+    if (shardCount > 1) {
+        fprintf(stderr, "[%s] - Handing the messages over to the egress thread through rings of %zu frames, %s when full\n",
+                timestamp(), gw_ring_size(listener->shards[0].ring), gw_ring_policy_name(options->ring_policy));
+        listener->egress_metrics = gw_metrics_new("egress", publisherAddress);
+        gw_metrics_add_collector(render_rings, listener);
+    }
+
+    if (options->wait_strategy != GW_WAIT_BLOCK) {
+        fprintf(stderr, "[%s] - The forwarding threads wait for messages with the %s strategy%s\n", timestamp(),
+                gw_wait_strategy_name(options->wait_strategy),
+                options->wait_strategy == GW_WAIT_BUSY_POLL ? ", each one keeps its CPU busy: pin them with -a" : "");
+    }
+
+    // socket monitors have to be set up before the sockets are handed over to the forwarding threads
+    if (options->slow_consumer_bytes > 0) {
+        fprintf(stderr, "[%s] - Reporting consumers with more than %zu bytes queued for %d seconds\n", timestamp(),
+                options->slow_consumer_bytes, options->slow_consumer_samples * GW_CONSUMER_SAMPLE_INTERVAL_MSEC / 1000);
+        listener->consumers = gw_consumers_new(options->slow_consumer_bytes, options->slow_consumer_samples);
+        gw_metrics_add_collector(gw_consumers_render, listener->consumers);
+    }
+    int monitorEvents = options->debug_flag || options->monitor_events;
+    if (monitorEvents || listener->consumers != NULL) {
+        // the consumers only need the events of the XPUB, which aren't logged unless asked for
+        listener->monitor = gw_monitor_new(ctx, monitorEvents ? options->monitor_log_rate : 0);
+
+        char endpoint[128];
+        snprintf(endpoint, sizeof(endpoint), "%s/%d", DEFAULT_INPROC_XPUB_MONITOR_ENDPOINT, listener->id);
+        int publisherIndex = gw_monitor_add(listener->monitor, publisher, publisherAddress, endpoint);
+        if (listener->consumers != NULL) {
+            listener->sampled_at = zclock_time();
+            gw_monitor_set_handler(listener->monitor, publisherIndex, track_consumer, listener->consumers);
+            gw_monitor_set_tick(listener->monitor, sample_consumers, listener);
+        }
+        for (i = 0; monitorEvents && i < shardCount; i++) {
+            if (listener->shards[i].frontend == NULL) {
+                continue;
+            }
+            snprintf(endpoint, sizeof(endpoint), "%s/%d/%d", DEFAULT_INPROC_XSUB_MONITOR_ENDPOINT, listener->id, i);
+            gw_monitor_add(listener->monitor, listener->shards[i].frontend, listener->shards[i].endpoint, endpoint);
+        }
+        if (monitorEvents) {
+            fprintf(stderr, "[%s] - Monitoring the XPUB and %d XSUB sockets, logging up to %d events per second\n",
+                    timestamp(), shardCount, options->monitor_log_rate);
+        }
+        gw_monitor_start(listener->monitor);
+        gw_metrics_add_collector(gw_monitor_render, listener->monitor);
+    }
+
+    for (i = 0; i < shardCount; i++) {
+        gw_shard_t *shard = &listener->shards[i];
+        fprintf(stderr, "[%s] - Starting XPUB->XSUB Proxy shard %d [%s] -> [%s] %s\n", timestamp(), i, shard->endpoint,
+                publisherAddress, listener->relay ? "relaying the upstream adaptor" : "");
+        int result = pthread_create(&shard->thread, NULL, gateway_shard_thread, shard);
+        assert( result == 0 );
+    }
+
+    if (shardCount > 1) {
+        int result = pthread_create(&listener->egress_thread, NULL, gateway_egress_thread, listener);
+        assert( result == 0 );
+        listener->has_egress_thread = 1;
+    }
+
+    if (options->metrics_endpoint != NULL) {
+        fprintf(stderr, "[%s] - Serving metrics on %s\n", timestamp(), options->metrics_endpoint);
+        listener->reporter = gw_metrics_reporter_start(ctx, options->metrics_endpoint);
+    }
+
+    listener->next = gw_listeners;
+    gw_listeners = listener;
+}
+
+/*
+
+Black Box Pattern impl
+@see http://zguide.zeromq.org/page:all#header-119
+-------------------------------------
+    SUB        ->      PUSH
+ public address  ->  internal address
+  CONNECT      ->      BIND
+-------------------------------------
+
+The inbound channel carries messages from the outside, i.e. rate limiting and blocking decisions, back to the
+gateway workers. Each gateway worker connects a PULL socket to the PUSH, which deals the messages round robin to
+the workers that are not at their high water mark.
+
+*/
+
+typedef struct _gw_pusher_t gw_pusher_t;
+
+struct _gw_pusher_t {
+    zctx_t *ctx;
+    volatile int running;
+    int batch_size;
+    int cpu;
+    void *frontend;
+    void *backend;
+    pthread_t thread;
+    gw_metrics_t *metrics;
+    /** time each message spent in the inbound thread, recorded by that thread only */
+    gw_histogram_t *latency;
+    char push_address[256];
+    gw_pusher_t *next;
+};
+
+/**
+* Pushers started with start_gateway_pusher, stopped by gw_zmq_destroy like the listeners.
+*/
+static gw_pusher_t *gw_pushers = NULL;
+
+/**
+* Metrics collector for the forwarding latency of the inbound thread.
+*/
+static void
+render_pusher_latency(FILE *out, void *self)
+{
+    gw_pusher_t *pusher = (gw_pusher_t *) self;
+    char labels[320];
+
+    fprintf(out, "# HELP gw_zmq_inbound_latency_microseconds Time messages spent in the adaptor from their receipt until a gateway worker took them\n");
+    fprintf(out, "# TYPE gw_zmq_inbound_latency_microseconds summary\n");
+    snprintf(labels, sizeof(labels), "socket=\"%s\"", pusher->push_address);
+    gw_histogram_render(out, "gw_zmq_inbound_latency_microseconds", labels, pusher->latency);
+}
+
+/**
+* Forwarding loop of the inbound channel: messages from the SUB are pushed to the gateway workers.
+* A message no worker takes within the send timeout is dropped, so the thread never blocks for long.
+*/
+static void*
+gateway_pusher_thread(void *args)
+{
+    gw_pusher_t *pusher = (gw_pusher_t *) args;
+
+    pin_current_thread(pusher->cpu, "inbound");
+
+    gw_batch_t *batch = gw_batch_new(pusher->batch_size);
+    batch->latency = pusher->latency;
+    zmq_pollitem_t items[] = { { pusher->frontend, 0, ZMQ_POLLIN, 0 } };
+
+    while (pusher->running) {
+        if (zmq_poll(items, 1, GW_POLL_TIMEOUT_MSEC) == -1) {
+            if (zmq_errno() == ETERM) {
+                break;
+            }
+            continue;
+        }
+        if (!(items[0].revents & ZMQ_POLLIN)) {
+            continue;
+        }
+        int messages = forward_batch(pusher->frontend, NULL, NULL, pusher->backend, batch, pusher->metrics, NULL, NULL);
+        if (messages == -1 && zmq_errno() == ETERM) {
+            break;
+        }
+    }
+
+    gw_batch_destroy(&batch);
+    return NULL;
+}
+
+static void
+stop_gateway_pushers(zctx_t *ctx)
+{
+    gw_pusher_t **link = &gw_pushers;
+
+    while (*link != NULL) {
+        gw_pusher_t *pusher = *link;
+        if (pusher->ctx != ctx) {
+            link = &pusher->next;
+            continue;
+        }
+
+        pusher->running = 0;
+        pthread_join(pusher->thread, NULL);
+        gw_metrics_remove_collector(render_pusher_latency, pusher);
+        gw_metrics_destroy(&pusher->metrics);
+        gw_histogram_destroy(&pusher->latency);
+
+        *link = pusher->next;
+        free(pusher);
+    }
+}
+
+void
+gw_pusher_options_init(gw_pusher_options_t *options)
+{
+    memset(options, 0, sizeof(gw_pusher_options_t));
+    options->listener_address = DEFAULT_SUB;
+    options->push_address = DEFAULT_PUSH;
+    options->receive_hwm = GW_SOCKET_OPTION_DEFAULT;
+    options->send_hwm = GW_SOCKET_OPTION_DEFAULT;
+    options->send_timeout = DEFAULT_PUSHER_SEND_TIMEOUT_MSEC;
+    options->batch_size = DEFAULT_BATCH_SIZE;
+    options->cpu = -1;
+}
+
+/**
+* Starts the inbound channel on its own thread: a SUB receiving every message published on listener_address,
+* forwarded to the gateway workers connected to the PUSH bound on push_address.
+*/
+void
+start_gateway_pusher(zctx_t *ctx, gw_pusher_options_t *options)
+{
+    assert( options->batch_size >= 1 && options->batch_size <= GW_MAX_BATCH_SIZE );
+
+    gw_pusher_t *pusher = (gw_pusher_t *) calloc(1, sizeof(gw_pusher_t));
+    assert( pusher );
+    pusher->ctx = ctx;
+    pusher->running = 1;
+    pusher->batch_size = options->batch_size;
+    pusher->cpu = options->cpu;
+
+    void *subscriber = zsocket_new(ctx, ZMQ_SUB);
+    if (options->receive_hwm != GW_SOCKET_OPTION_DEFAULT) {
+        zsocket_set_rcvhwm(subscriber, options->receive_hwm);
+    }
+    int subscriberResult = options->bind_listener
+            ? gw_handover_bind(subscriber, options->listener_address)
+            : zsocket_connect(subscriber, "%s", options->listener_address);
+    assert( subscriberResult >= 0 );
+    // NOTE: Don't miss this directive, otherwise the SUB doesn't get anything
+    zsocket_set_subscribe(subscriber, "");
+    pusher->frontend = subscriber;
+
+    void *pushSocket = zsocket_new(ctx, ZMQ_PUSH);
+    if (options->send_hwm != GW_SOCKET_OPTION_DEFAULT) {
+        zsocket_set_sndhwm(pushSocket, options->send_hwm);
+    }
+    zsocket_set_sndtimeo(pushSocket, options->send_timeout);
+    int pushResult = gw_handover_bind(pushSocket, options->push_address);
+    assert( pushResult >= 0 );
+    pusher->backend = pushSocket;
+
+    log_socket_options(subscriber, "SUB", options->listener_address);
+    log_socket_options(pushSocket, "PUSH", options->push_address);
+
+    pusher->metrics = gw_metrics_new("inbound", options->push_address);
+    pusher->latency = gw_histogram_new();
+    snprintf(pusher->push_address, sizeof(pusher->push_address), "%s", options->push_address);
+    gw_metrics_add_collector(render_pusher_latency, pusher);
+
+    fprintf(stderr, "[%s] - Starting SUB->PUSH Proxy [%s] -> [%s] \n", timestamp(), options->listener_address,
+            options->push_address);
+    int result = pthread_create(&pusher->thread, NULL, gateway_pusher_thread, pusher);
+    assert( result == 0 );
+
+    pusher->next = gw_pushers;
+    gw_pushers = pusher;
+}
+
+/**
+* Copies the counters of the first inbound channel started on ctx.
+* Returns 0 on success, -1 if there's none.
+*/
+int
+gw_zmq_pusher_stats(zctx_t *ctx, gw_pusher_stats_t *stats)
+{
+    gw_pusher_t *pusher;
+
+    for (pusher = gw_pushers; pusher != NULL; pusher = pusher->next) {
+        if (pusher->ctx != ctx) {
+            continue;
+        }
+        stats->messages_in = GW_COUNTER_GET(pusher->metrics->messages_in);
+        stats->messages_out = GW_COUNTER_GET(pusher->metrics->messages_out);
+        stats->dropped = GW_COUNTER_GET(pusher->metrics->dropped_hwm);
+        stats->latency_count = gw_histogram_count(pusher->latency);
+        stats->latency_p99_usec = gw_histogram_quantile(pusher->latency, 0.99);
+        stats->latency_max_usec = gw_histogram_max(pusher->latency);
+        return 0;
+    }
+    return -1;
+}
@@ -24,19 +24,353 @@
 */
 #define DEFAULT_PUSH "ipc:///tmp/nginx_queue_push"
 
+/**
+* Internal endpoints of the socket monitors, suffixed with the listener id and, for the XSUBs, the shard index.
+*/
 #define DEFAULT_INPROC_XPUB_MONITOR_ENDPOINT "inproc://monitor/xpub"
 
 #define DEFAULT_INPROC_XSUB_MONITOR_ENDPOINT "inproc://monitor/xsub"
 
+/**
+* Internal endpoint pairing a forwarding shard with the thread owning the XPUB socket.
+* The first %d is the listener id, the second one is the shard index.
+*/
+#define DEFAULT_INPROC_SHARD_ENDPOINT "inproc://gateway/%d/shard/%d"
+
+/**
+* Default number of forwarding shards. Each shard binds its own XSUB endpoint and runs in its own thread.
+*/
+#define DEFAULT_SHARD_COUNT 1
+
+#define GW_MAX_SHARDS 64
+
+/**
+* Default number of messages a forwarding thread drains from a socket on each wakeup before polling again.
+*/
+#define DEFAULT_BATCH_SIZE 256
+
+#define GW_MAX_BATCH_SIZE 65536
+
+/**
+* How often ( in milliseconds ) the forwarding threads wake up when idle to check if they should stop.
+*/
+#define GW_POLL_TIMEOUT_MSEC 100
+
+/**
+* How often ( in milliseconds ) gw_zmq_drain checks if the shards forwarded everything they accepted.
+*/
+#define GW_DRAIN_CHECK_MSEC 10
+
+/**
+* Default time ( in milliseconds ) the adaptor takes to forward the messages it accepted when it stops, 0 not to.
+*/
+#define DEFAULT_DRAIN_TIMEOUT_MSEC 5000
+
+/**
+* Longest time ( in milliseconds ) spent spooling what's left when the drain deadline passed.
+*/
+#define GW_DRAIN_SPILL_MSEC 1000
+
+/**
+* How long ( in milliseconds ) a shard reading from shared memory sleeps on its rings before checking its sockets.
+*/
+#define GW_SHM_SOCKET_CHECK_MSEC 10
+
+/**
+* How the forwarding threads wait for their messages.
+*/
+/** sleep in zmq_poll until messages arrive */
+#define GW_WAIT_BLOCK 0
+/** poll without sleeping for a while before sleeping, for as long as messages usually take to arrive */
+#define GW_WAIT_SPIN 1
+/** never sleep; the threads should be pinned to their own cores */
+#define GW_WAIT_BUSY_POLL 2
+
+/**
+* Default upper bound ( in microseconds ) of the time the spin strategy polls before sleeping.
+*/
+#define DEFAULT_SPIN_USEC 100
+
+/**
+* Envelope frame appended to the traced messages when the listener publishes them ( trace_envelope ):
+* "GWT1", then the wall clock times the adaptor received and published the message, in microseconds since the epoch,
+* as 64 bits big endian integers. Consumers which don't know about it should ignore the frames starting with it.
+*/
+#define GW_TRACE_MAGIC "GWT1"
+
+#define GW_TRACE_ENVELOPE_SIZE 20
+
+/**
+* Value of the socket tuning options meaning "keep the libzmq default".
+*/
+#define GW_SOCKET_OPTION_DEFAULT -1
+
 #include "czmq.h"
+#include "GwZmqAggregator.h"
+
+/**
+* Options used to start the Gateway listener.
+* Initialize them with gw_listener_options_init() and then override what's needed.
+*/
+typedef struct {
+    /** a base address the shard endpoints are derived from, or a comma separated list of endpoints, one per shard;
+        shm:// endpoints are read from shared memory instead of an XSUB */
+    char *subscriber_address;
+    /** relay mode: subscriber_address lists the XPUBs of upstream adaptors, which the XSUBs connect to */
+    int relay;
+    char *publisher_address;
+    /** prints the messages and monitors every socket, like monitor_events */
+    int debug_flag;
+    /** counts the events of every socket and logs them, up to monitor_log_rate per second */
+    int monitor_events;
+    int monitor_log_rate;
+    /** number of forwarding shards; shard 0 binds subscriber_address, shard N binds gw_zmq_shard_endpoint(N) */
+    int shard_count;
+    /** CPU each shard thread is pinned to, -1 to leave it to the scheduler */
+    int shard_cpus[GW_MAX_SHARDS];
+    /** CPU for the thread owning the XPUB socket when shard_count > 1, -1 to leave it to the scheduler */
+    int egress_cpu;
+    /** maximum number of messages drained on each poll wakeup */
+    int batch_size;
+    /** how the shard and egress threads wait: GW_WAIT_BLOCK, GW_WAIT_SPIN or GW_WAIT_BUSY_POLL */
+    int wait_strategy;
+    /** longest spin of GW_WAIT_SPIN, in microseconds */
+    int spin_usec;
+    /** messages per second each shard accepts from its ingress endpoint, 0 for no limit */
+    int ingress_rates[GW_MAX_SHARDS];
+    /** frames each shard can queue for the egress thread when shard_count > 1, rounded up to a power of 2 */
+    size_t ring_size;
+    /** what a shard does when its ring is full: GW_RING_BLOCK, GW_RING_DROP_NEWEST or GW_RING_DROP_OLDEST */
+    int ring_policy;
+    /** rings of a shm:// ingress endpoint, i.e. gateway workers writing to it at the same time ( see GwZmqShm.h ) */
+    int shm_workers;
+    /** bytes of each of those rings, rounded up to a power of 2 */
+    size_t shm_ring_size;
+    /** time a shared memory shard keeps polling its rings before sleeping, in microseconds */
+    int shm_spin_usec;
+    /** where to serve the metrics in the Prometheus text format: HTTP for tcp:// endpoints, REP otherwise. NULL disables it */
+    char *metrics_endpoint;
+    /** directory of the disk spool holding the messages consumers can't take, NULL disables it */
+    char *spool_directory;
+    size_t spool_segment_size;
+    /** segments kept on disk; the oldest one is dropped when they're all full */
+    int spool_segments;
+    /** spooled messages older than this are dropped */
+    int spool_retention_secs;
+    /** interval between two syncs of the spooled messages to disk */
+    int spool_sync_interval_msec;
+    /** ROUTER endpoint serving the replay window to the consumers catching up ( see GwZmqReplay.h ), NULL disables it */
+    char *replay_endpoint;
+    /** the replay window keeps the last replay_window_bytes of messages, for up to replay_window_secs */
+    size_t replay_window_bytes;
+    int replay_window_secs;
+    /** endpoint spreading the messages over a group of workers ( see GwZmqBalancer.h ), NULL disables it */
+    char *balance_endpoint;
+    /** GW_BALANCE_ROUND_ROBIN or GW_BALANCE_HASH */
+    int balance_mode;
+    /** messages with the same first balance_key_size bytes go to the same worker in hash mode */
+    size_t balance_key_size;
+
+    /**
+    * Socket tuning, GW_SOCKET_OPTION_DEFAULT keeps the libzmq default.
+    */
+    /** number of libzmq I/O threads, applied by gw_zmq_init_with_options */
+    int io_threads;
+    /** ZMQ_SNDHWM of the XPUB and of the subscription pipes between the egress thread and the shards; 0 means no limit */
+    int send_hwm;
+    /** ZMQ_RCVHWM of the XSUBs and of the subscription pipes between the egress thread and the shards; 0 means no limit */
+    int receive_hwm;
+    /** SO_SNDBUF of the XPUB connections, in bytes */
+    int send_buffer;
+    /** SO_RCVBUF of the XSUB connections, in bytes */
+    int receive_buffer;
+    /** ZMQ_AFFINITY bitmask of the I/O threads serving the XPUB, 0 for any of them */
+    uint64_t publisher_affinity;
+    /** ZMQ_AFFINITY bitmask of the I/O threads serving the XSUBs, 0 for any of them */
+    uint64_t subscriber_affinity;
+    /** TCP keepalive of the XPUB connections: 1 to enable it, 0 to disable it */
+    int tcp_keepalive;
+    int tcp_keepalive_idle;
+    int tcp_keepalive_cnt;
+    int tcp_keepalive_intvl;
+    /** how long a message waits for the XPUB to take it, in milliseconds; by default it's refused right away */
+    int send_timeout;
+    /** ZMQ_XPUB_NODROP: the XPUB refuses messages when a consumer reaches its HWM instead of dropping them silently */
+    int xpub_nodrop;
+    /** bytes queued for a consumer above which it's considered slow, 0 disables the tracking of the consumers */
+    size_t slow_consumer_bytes;
+    /** consecutive samples a consumer has to stay above slow_consumer_bytes to be reported as slow */
+    int slow_consumer_samples;
+    /** size of the coalesced messages small messages are packed into, 0 publishes every message on its own */
+    size_t coalesce_bytes;
+    /** maximum time a message waits to be coalesced, in microseconds */
+    int coalesce_delay_usec;
+    /** messages are coalesced by their first coalesce_topic_size bytes */
+    size_t coalesce_topic_size;
+    /** compresses messages for the consumers subscribing to GW_COMPRESSED_TOPIC_PREFIX topics, needs libzstd */
+    int compress_enabled;
+    /** number of compression worker threads */
+    int compress_workers;
+    /** zstd compression level */
+    int compress_level;
+    /** optional zstd dictionary, reloaded when the file changes */
+    char *compress_dictionary;
+    /** rule file routing slices of the stream to additional egress sockets ( see GwZmqRouter.h ), NULL disables it */
+    char *routes_file;
+    /** prefix of the usage records rolled up per key ( see GwZmqAggregator.h ), NULL disables the aggregation */
+    char *aggregate_prefix;
+    char aggregate_delimiter;
+    /** fields making the key of a record, 0 being the first one; the default key is the first field */
+    int aggregate_key_fields[GW_AGGREGATE_MAX_KEY_FIELDS];
+    int aggregate_key_field_count;
+    /** field summed in the rollups, -1 only counts the records */
+    int aggregate_value_field;
+    int aggregate_window_msec;
+    char *aggregate_topic;
+    /** publish the rollups instead of the aggregated records */
+    int aggregate_only;
+    /** one message in trace_sample is timed from its ingress to the XPUB, 0 disables the tracing */
+    int trace_sample;
+    /** the traced messages are published with a GW_TRACE_MAGIC envelope as their last frame */
+    int trace_envelope;
+} gw_listener_options_t;
+
+/**
+* Default time ( in milliseconds ) the inbound PUSH waits for a gateway worker to take a message before dropping it.
+* It also bounds how long stopping the inbound thread can take.
+*/
+#define DEFAULT_PUSHER_SEND_TIMEOUT_MSEC 100
+
+/**
+* Options of the inbound SUB -> PUSH channel, carrying messages from the outside back to the gateway workers.
+* Initialize them with gw_pusher_options_init() and then override what's needed.
+*/
+typedef struct {
+    /** public address the SUB connects to ( or binds to, with bind_listener ) */
+    char *listener_address;
+    /** address the PUSH binds, the gateway workers connect their PULL sockets to it */
+    char *push_address;
+    int bind_listener;
+    /** ZMQ_RCVHWM of the SUB, GW_SOCKET_OPTION_DEFAULT keeps the libzmq default */
+    int receive_hwm;
+    /** ZMQ_SNDHWM of each gateway worker connected to the PUSH; a worker at its HWM is skipped by the round robin */
+    int send_hwm;
+    /** how long a message waits for a gateway worker to take it, in milliseconds */
+    int send_timeout;
+    int batch_size;
+    /** CPU the inbound thread is pinned to, -1 to leave it to the scheduler */
+    int cpu;
+} gw_pusher_options_t;
+
+/**
+* Snapshot of the counters of the inbound thread.
+*/
+typedef struct {
+    uint64_t messages_in;
+    uint64_t messages_out;
+    /** messages no gateway worker took within the send timeout */
+    uint64_t dropped;
+    /** forwarding latencies observed, one per message, from its receipt until a gateway worker took it */
+    uint64_t latency_count;
+    uint64_t latency_p99_usec;
+    uint64_t latency_max_usec;
+} gw_pusher_stats_t;
+
+/**
+* What a drain did ( see gw_zmq_drain ).
+*/
+typedef struct {
+    /** messages published after the ingress endpoints were released */
+    uint64_t drained;
+    /** messages spooled, either because no consumer took them or once the deadline passed */
+    uint64_t spilled;
+    /** messages the XPUBs refused, or which no consumer subscribed to */
+    uint64_t dropped;
+    /** frames still queued in the rings when the drain gave up */
+    uint64_t left;
+    uint64_t elapsed_msec;
+    /** messages published per second */
+    double rate;
+} gw_drain_stats_t;
+
+/**
+* Snapshot of the ingress counters of a forwarding shard.
+*/
+typedef struct {
+    uint64_t messages;
+    uint64_t bytes;
+    /** messages the shard published, and the ones the XPUB refused at its HWM, when it publishes itself */
+    uint64_t messages_out;
+    uint64_t dropped;
+    /** poll wakeups that drained at least one message; messages / batches is the average batch size */
+    uint64_t batches;
+    /** messages dropped over the rate limit of the shard's endpoint */
+    uint64_t rate_limited;
+    /** time the shard thread spent forwarding, spinning and sleeping, in microseconds */
+    uint64_t busy_usec;
+    uint64_t spin_usec;
+    uint64_t blocked_usec;
+} gw_shard_stats_t;
+
+char *
+timestamp();
 
 zctx_t *
 gw_zmq_init();
 
+zctx_t *
+gw_zmq_init_with_options(gw_listener_options_t *options);
+
 void
 gw_zmq_destroy( zctx_t **ctx );
 
+/**
+* Stops taking messages in on the listeners of ctx and waits, up to timeoutMsec, for the shards to forward the ones
+* they accepted, before gw_zmq_destroy. The listeners with a spool then spool what's left, for up to
+* GW_DRAIN_SPILL_MSEC, and the sockets linger for the rest of timeoutMsec when they close, so the consumers get what's
+* queued for them. The counters of the drain are logged, and copied to stats when it isn't NULL.
+* Returns 0 once everything accepted was forwarded or spooled, -1 on timeout.
+*/
+int
+gw_zmq_drain(zctx_t *ctx, int timeoutMsec, gw_drain_stats_t *stats);
+
+void
+gw_listener_options_init(gw_listener_options_t *options);
+
 void
 start_gateway_listener(zctx_t *ctx, char *subscriberAddress, char *publisherAddress, int debugFlag);
 
+void
+start_gateway_listener_with_options(zctx_t *ctx, gw_listener_options_t *options);
+
+int
+gw_zmq_shard_endpoint(const char *baseAddress, int shardIndex, char *endpoint, size_t size);
+
+int
+gw_zmq_endpoint_count(const char *addresses);
+
+int
+gw_parse_cpu_list(const char *list, int *cpus, int maxCpus);
+
+int
+gw_wait_strategy(const char *name);
+
+const char *
+gw_wait_strategy_name(int strategy);
+
+int
+gw_zmq_shard_stats(zctx_t *ctx, int shardIndex, gw_shard_stats_t *stats);
+
+void
+gw_zmq_report_shards(zctx_t *ctx);
+
+void
+gw_pusher_options_init(gw_pusher_options_t *options);
+
+void
+start_gateway_pusher(zctx_t *ctx, gw_pusher_options_t *options);
+
+int
+gw_zmq_pusher_stats(zctx_t *ctx, gw_pusher_stats_t *stats);
+
 #endif
@@ -0,0 +1,416 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqAggregator.h"
+#include "GwZmqMetrics.h"
+#include "czmq.h"
+
+#define GW_AGGREGATE_INITIAL_CAPACITY 1024
+
+#define GW_ARENA_BLOCK_SIZE (64 * 1024)
+
+/**
+* Memory the keys are allocated from. Blocks are only released when the aggregator is destroyed; resetting the arena
+* makes them available again.
+*/
+typedef struct _gw_arena_block_t gw_arena_block_t;
+
+struct _gw_arena_block_t {
+    gw_arena_block_t *next;
+    size_t used;
+    unsigned char data[GW_ARENA_BLOCK_SIZE];
+};
+
+typedef struct {
+    /** 0 marks an empty slot */
+    uint64_t hash;
+    const unsigned char *key;
+    size_t key_size;
+    uint64_t records;
+    int64_t sum;
+} gw_aggregate_entry_t;
+
+struct _gw_aggregator_t {
+    gw_aggregate_format_t format;
+    size_t prefix_size;
+    char *topic;
+    int window_msec;
+    int64_t window_start;
+
+    gw_aggregate_entry_t *entries;
+    size_t capacity;
+    size_t count;
+    gw_arena_block_t *blocks;
+    gw_arena_block_t *current;
+
+    uint64_t records;
+    uint64_t rejected;
+    uint64_t rollups;
+    uint64_t rollup_keys;
+    uint64_t dropped;
+    int64_t keys;
+};
+
+static void *
+arena_alloc(gw_aggregator_t *aggregator, size_t size)
+{
+    gw_arena_block_t *block = aggregator->current;
+
+    if (block == NULL || block->used + size > GW_ARENA_BLOCK_SIZE) {
+        // reuse the blocks kept from the previous windows before allocating new ones
+        block = block != NULL ? block->next : aggregator->blocks;
+        if (block == NULL) {
+            block = (gw_arena_block_t *) malloc(sizeof(gw_arena_block_t));
+            assert( block );
+            block->next = NULL;
+            if (aggregator->current != NULL) {
+                aggregator->current->next = block;
+            } else {
+                aggregator->blocks = block;
+            }
+        }
+        block->used = 0;
+        aggregator->current = block;
+    }
+    void *result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+static uint64_t
+hash_key(const unsigned char *key, size_t size)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        hash ^= key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash == 0 ? 1 : hash;
+}
+
+static void
+grow(gw_aggregator_t *aggregator)
+{
+    gw_aggregate_entry_t *previous = aggregator->entries;
+    size_t previousCapacity = aggregator->capacity;
+    size_t i;
+
+    aggregator->capacity = previousCapacity * 2;
+    aggregator->entries = (gw_aggregate_entry_t *) calloc(aggregator->capacity, sizeof(gw_aggregate_entry_t));
+    assert( aggregator->entries );
+
+    size_t mask = aggregator->capacity - 1;
+    for (i = 0; i < previousCapacity; i++) {
+        if (previous[i].hash == 0) {
+            continue;
+        }
+        size_t slot = previous[i].hash & mask;
+        while (aggregator->entries[slot].hash != 0) {
+            slot = (slot + 1) & mask;
+        }
+        aggregator->entries[slot] = previous[i];
+    }
+    free(previous);
+}
+
+/**
+* Finds the entry of a key, adding it if it's not in the table yet.
+*/
+static gw_aggregate_entry_t *
+find_entry(gw_aggregator_t *aggregator, const unsigned char *key, size_t size)
+{
+    uint64_t hash = hash_key(key, size);
+
+    // keep the load factor under 3/4 so that probing stays short
+    if ((aggregator->count + 1) * 4 > aggregator->capacity * 3) {
+        grow(aggregator);
+    }
+    size_t mask = aggregator->capacity - 1;
+    size_t slot = hash & mask;
+    while (aggregator->entries[slot].hash != 0) {
+        gw_aggregate_entry_t *entry = &aggregator->entries[slot];
+        if (entry->hash == hash && entry->key_size == size && memcmp(entry->key, key, size) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    gw_aggregate_entry_t *entry = &aggregator->entries[slot];
+    unsigned char *copy = (unsigned char *) arena_alloc(aggregator, size);
+    memcpy(copy, key, size);
+    entry->hash = hash;
+    entry->key = copy;
+    entry->key_size = size;
+    aggregator->count++;
+    return entry;
+}
+
+static int64_t
+window_start(gw_aggregator_t *aggregator, int64_t now)
+{
+    return now - now % aggregator->window_msec;
+}
+
+gw_aggregator_t *
+gw_aggregator_new(const gw_aggregate_format_t *format, int windowMsec, const char *topic)
+{
+    assert( format->prefix != NULL );
+    assert( format->key_field_count >= 1 && format->key_field_count <= GW_AGGREGATE_MAX_KEY_FIELDS );
+    assert( windowMsec >= 1 );
+
+    gw_aggregator_t *aggregator = (gw_aggregator_t *) calloc(1, sizeof(gw_aggregator_t));
+    assert( aggregator );
+    aggregator->format = *format;
+    aggregator->format.prefix = strdup(format->prefix);
+    aggregator->prefix_size = strlen(format->prefix);
+    aggregator->topic = strdup(topic);
+    aggregator->window_msec = windowMsec;
+    aggregator->window_start = window_start(aggregator, zclock_time());
+    aggregator->capacity = GW_AGGREGATE_INITIAL_CAPACITY;
+    aggregator->entries = (gw_aggregate_entry_t *) calloc(aggregator->capacity, sizeof(gw_aggregate_entry_t));
+    assert( aggregator->entries );
+    return aggregator;
+}
+
+void
+gw_aggregator_destroy(gw_aggregator_t **aggregator)
+{
+    gw_aggregator_t *self = *aggregator;
+    gw_arena_block_t *block = self->blocks;
+
+    while (block != NULL) {
+        gw_arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(self->entries);
+    free((char *) self->format.prefix);
+    free(self->topic);
+    free(self);
+    *aggregator = NULL;
+}
+
+static int
+parse_value(const unsigned char *data, size_t size, int64_t *value)
+{
+    size_t i = 0;
+    int negative = 0;
+    int64_t result = 0;
+
+    if (size > 0 && data[0] == '-') {
+        negative = 1;
+        i++;
+    }
+    if (i == size) {
+        return -1;
+    }
+    for (; i < size; i++) {
+        if (data[i] < '0' || data[i] > '9') {
+            return -1;
+        }
+        result = result * 10 + (data[i] - '0');
+    }
+    *value = negative ? -result : result;
+    return 0;
+}
+
+/**
+* Adds a record to the current window if it starts with the prefix of the format.
+* Returns 1 if the record was aggregated, 0 if it isn't a usage record or it's malformed.
+*/
+int
+gw_aggregator_add(gw_aggregator_t *aggregator, const void *data, size_t size)
+{
+    const gw_aggregate_format_t *format = &aggregator->format;
+    const unsigned char *bytes = (const unsigned char *) data;
+    const unsigned char *fieldStart[GW_AGGREGATE_MAX_KEY_FIELDS + 1];
+    size_t fieldSize[GW_AGGREGATE_MAX_KEY_FIELDS + 1];
+    int wanted = format->key_field_count + (format->value_field >= 0);
+    int found = 0;
+    int field = 0;
+    int i;
+
+    if (size < aggregator->prefix_size || memcmp(bytes, format->prefix, aggregator->prefix_size) != 0) {
+        return 0;
+    }
+
+    // one pass over the fields, memchr finds the delimiters
+    const unsigned char *cursor = bytes;
+    const unsigned char *end = bytes + size;
+    while (cursor <= end && found < wanted) {
+        const unsigned char *next = (const unsigned char *) memchr(cursor, format->delimiter, end - cursor);
+        if (next == NULL) {
+            next = end;
+        }
+        for (i = 0; i < format->key_field_count; i++) {
+            if (format->key_fields[i] == field) {
+                fieldStart[i] = cursor;
+                fieldSize[i] = next - cursor;
+                found++;
+            }
+        }
+        if (format->value_field == field) {
+            fieldStart[GW_AGGREGATE_MAX_KEY_FIELDS] = cursor;
+            fieldSize[GW_AGGREGATE_MAX_KEY_FIELDS] = next - cursor;
+            found++;
+        }
+        cursor = next + 1;
+        field++;
+    }
+
+    int64_t value = 1;
+    if (found < wanted || (format->value_field >= 0
+            && parse_value(fieldStart[GW_AGGREGATE_MAX_KEY_FIELDS], fieldSize[GW_AGGREGATE_MAX_KEY_FIELDS], &value) == -1)) {
+        GW_COUNTER_ADD(aggregator->rejected, 1);
+        return 0;
+    }
+
+    unsigned char key[GW_AGGREGATE_MAX_KEY_SIZE];
+    size_t keySize = 0;
+    for (i = 0; i < format->key_field_count; i++) {
+        if (keySize + fieldSize[i] + 1 > sizeof(key)) {
+            GW_COUNTER_ADD(aggregator->rejected, 1);
+            return 0;
+        }
+        if (i > 0) {
+            key[keySize++] = (unsigned char) format->delimiter;
+        }
+        memcpy(key + keySize, fieldStart[i], fieldSize[i]);
+        keySize += fieldSize[i];
+    }
+
+    gw_aggregate_entry_t *entry = find_entry(aggregator, key, keySize);
+    entry->records++;
+    entry->sum += value;
+    GW_COUNTER_ADD(aggregator->records, 1);
+    GW_COUNTER_SET(aggregator->keys, (int64_t) aggregator->count);
+    return 1;
+}
+
+static int
+send_rollup(gw_aggregator_t *aggregator, void *socket, const char *body, size_t size)
+{
+    if (zmq_send(socket, aggregator->topic, strlen(aggregator->topic), ZMQ_SNDMORE | ZMQ_DONTWAIT) == -1
+            || zmq_send(socket, body, size, ZMQ_DONTWAIT) == -1) {
+        GW_COUNTER_ADD(aggregator->dropped, 1);
+        return zmq_errno() == EAGAIN ? 0 : -1;
+    }
+    GW_COUNTER_ADD(aggregator->rollups, 1);
+    return 0;
+}
+
+/**
+* Publishes the rollup of the current window and starts the next one.
+* Returns 0 on success or -1 if publishing failed, in which case zmq_errno() tells why.
+*/
+int
+gw_aggregator_flush(gw_aggregator_t *aggregator, void *socket)
+{
+    char body[GW_AGGREGATE_MAX_ROLLUP_SIZE];
+    int result = 0;
+    size_t i;
+
+    if (aggregator->count > 0) {
+        int headerSize = snprintf(body, sizeof(body), "%lld %d\n", (long long) aggregator->window_start,
+                                  aggregator->window_msec);
+        size_t size = headerSize;
+
+        for (i = 0; i < aggregator->capacity; i++) {
+            gw_aggregate_entry_t *entry = &aggregator->entries[i];
+            if (entry->hash == 0) {
+                continue;
+            }
+            char counters[64];
+            int countersSize = snprintf(counters, sizeof(counters), "\t%llu\t%lld\n",
+                                        (unsigned long long) entry->records, (long long) entry->sum);
+            size_t lineSize = entry->key_size + countersSize;
+            if (size + lineSize > sizeof(body) && size > (size_t) headerSize) {
+                if (send_rollup(aggregator, socket, body, size) == -1) {
+                    result = -1;
+                }
+                size = headerSize;
+            }
+            memcpy(body + size, entry->key, entry->key_size);
+            memcpy(body + size + entry->key_size, counters, countersSize);
+            size += lineSize;
+            GW_COUNTER_ADD(aggregator->rollup_keys, 1);
+        }
+        if (send_rollup(aggregator, socket, body, size) == -1) {
+            result = -1;
+        }
+
+        memset(aggregator->entries, 0, aggregator->capacity * sizeof(gw_aggregate_entry_t));
+        aggregator->count = 0;
+        aggregator->current = NULL;
+        GW_COUNTER_SET(aggregator->keys, 0);
+    }
+    aggregator->window_start = window_start(aggregator, zclock_time());
+    return result;
+}
+
+/**
+* Publishes the rollup of the current window once it's over.
+*/
+int
+gw_aggregator_flush_expired(gw_aggregator_t *aggregator, void *socket)
+{
+    if (zclock_time() < aggregator->window_start + aggregator->window_msec) {
+        return 0;
+    }
+    return gw_aggregator_flush(aggregator, socket);
+}
+
+/**
+* Returns how long ( in milliseconds ) the owning thread can wait before the current window is over.
+*/
+int
+gw_aggregator_timeout(gw_aggregator_t *aggregator)
+{
+    int64_t remaining = aggregator->window_start + aggregator->window_msec - zclock_time();
+    return remaining <= 0 ? 0 : (int) remaining;
+}
+
+/**
+* Returns the number of keys of the current window.
+*/
+size_t
+gw_aggregator_keys(gw_aggregator_t *aggregator)
+{
+    return aggregator->count;
+}
+
+/**
+* Metrics collector for the aggregator.
+*/
+void
+gw_aggregator_render(FILE *out, void *self)
+{
+    gw_aggregator_t *aggregator = (gw_aggregator_t *) self;
+
+    fprintf(out, "# TYPE gw_zmq_aggregated_records_total counter\ngw_zmq_aggregated_records_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(aggregator->records));
+    fprintf(out, "# TYPE gw_zmq_aggregate_rejected_total counter\ngw_zmq_aggregate_rejected_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(aggregator->rejected));
+    fprintf(out, "# TYPE gw_zmq_aggregate_keys gauge\ngw_zmq_aggregate_keys %lld\n",
+            (long long) GW_COUNTER_GET(aggregator->keys));
+    fprintf(out, "# TYPE gw_zmq_rollups_total counter\ngw_zmq_rollups_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(aggregator->rollups));
+    fprintf(out, "# TYPE gw_zmq_rollup_keys_total counter\ngw_zmq_rollup_keys_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(aggregator->rollup_keys));
+    fprintf(out, "# TYPE gw_zmq_rollups_dropped_total counter\ngw_zmq_rollups_dropped_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(aggregator->dropped));
+}
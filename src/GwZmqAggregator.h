@@ -0,0 +1,79 @@
+#ifndef GW_AGGREGATOR_H
+#define GW_AGGREGATOR_H
+
+#include "czmq.h"
+
+/**
+* Default topic the rollups are published on.
+*/
+#define DEFAULT_AGGREGATE_TOPIC "rollup/"
+
+/**
+* Default field separator of the usage records.
+*/
+#define DEFAULT_AGGREGATE_DELIMITER ';'
+
+/**
+* Default length ( in milliseconds ) of an aggregation window.
+*/
+#define DEFAULT_AGGREGATE_WINDOW_MSEC 1000
+
+#define GW_AGGREGATE_MAX_KEY_FIELDS 4
+
+#define GW_AGGREGATE_MAX_KEY_SIZE 256
+
+/**
+* Rollups larger than this are split into several messages.
+*/
+#define GW_AGGREGATE_MAX_ROLLUP_SIZE (64 * 1024)
+
+/**
+* Describes the usage records to aggregate: records starting with prefix, made of fields separated by delimiter.
+* The key of a record is made of key_fields, in that order; value_field is summed, -1 only counts the records.
+*/
+typedef struct {
+    const char *prefix;
+    char delimiter;
+    int key_fields[GW_AGGREGATE_MAX_KEY_FIELDS];
+    int key_field_count;
+    int value_field;
+} gw_aggregate_format_t;
+
+typedef struct _gw_aggregator_t gw_aggregator_t;
+
+/**
+* Sums usage records per key over fixed windows and publishes one rollup per window.
+*
+* A rollup has 2 frames: the topic, then a header line "<window start, epoch ms> <window length, ms>" followed by
+* one "<key>\t<records>\t<sum>" line per key. Windows are aligned on the wall clock. Rollups larger than
+* GW_AGGREGATE_MAX_ROLLUP_SIZE are split in several messages, each starting with the header line.
+*
+* The keys live in an open addressing hash table whose key bytes are allocated from an arena; both are reset after
+* each window without freeing their memory, so a steady stream doesn't allocate. The aggregator belongs to the
+* thread owning the XPUB.
+*/
+gw_aggregator_t *
+gw_aggregator_new(const gw_aggregate_format_t *format, int windowMsec, const char *topic);
+
+void
+gw_aggregator_destroy(gw_aggregator_t **aggregator);
+
+int
+gw_aggregator_add(gw_aggregator_t *aggregator, const void *data, size_t size);
+
+int
+gw_aggregator_flush_expired(gw_aggregator_t *aggregator, void *socket);
+
+int
+gw_aggregator_flush(gw_aggregator_t *aggregator, void *socket);
+
+int
+gw_aggregator_timeout(gw_aggregator_t *aggregator);
+
+size_t
+gw_aggregator_keys(gw_aggregator_t *aggregator);
+
+void
+gw_aggregator_render(FILE *out, void *aggregator);
+
+#endif
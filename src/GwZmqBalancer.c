@@ -0,0 +1,414 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqBalancer.h"
+#include "GwZmqAdaptor.h"
+#include "GwZmqMetrics.h"
+#include "GwZmqHandover.h"
+#include "czmq.h"
+
+#define GW_BALANCE_MAX_IDENTITY_SIZE 256
+
+typedef struct {
+    unsigned char identity[GW_BALANCE_MAX_IDENTITY_SIZE];
+    size_t identity_size;
+    char name[GW_BALANCE_MAX_NAME_SIZE];
+    /** messages the worker can still take */
+    int64_t credits;
+    uint64_t messages;
+    /** couldn't be reached anymore, forgotten once the message being sent is over */
+    int gone;
+} gw_balance_worker_t;
+
+typedef struct {
+    uint64_t hash;
+    int worker;
+} gw_balance_point_t;
+
+static const char *gw_balance_modes[] = { "rr", "hash" };
+
+struct _gw_balancer_t {
+    zctx_t *ctx;
+    void *socket;
+    int mode;
+    size_t key_size;
+    /** the workers change in the thread owning the XPUB, and are read by the metrics collector */
+    pthread_mutex_t lock;
+    gw_balance_worker_t workers[GW_BALANCE_MAX_WORKERS];
+    int worker_count;
+    /** workers with credit left, so that a message nobody can take is dropped right away */
+    int ready_count;
+    int has_gone;
+    /** the hash ring, sorted by hash */
+    gw_balance_point_t points[GW_BALANCE_MAX_WORKERS * GW_BALANCE_VIRTUAL_NODES];
+    int point_count;
+    /** worker of the message being sent, -1 when it's dropped */
+    int target;
+    int in_message;
+    uint64_t messages;
+    uint64_t spilled;
+    uint64_t dropped;
+    uint64_t registrations;
+};
+
+int
+gw_balance_mode(const char *name)
+{
+    int i;
+    for (i = 0; i < (int) (sizeof(gw_balance_modes) / sizeof(gw_balance_modes[0])); i++) {
+        if (strcmp(name, gw_balance_modes[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *
+gw_balance_mode_name(int mode)
+{
+    return gw_balance_modes[mode];
+}
+
+/**
+* FNV-1a, finished with the splitmix64 mixer so that close keys land far apart on the ring.
+*/
+static uint64_t
+hash_bytes(const unsigned char *data, size_t size, uint64_t seed)
+{
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+static int
+compare_points(const void *left, const void *right)
+{
+    uint64_t a = ((const gw_balance_point_t *) left)->hash;
+    uint64_t b = ((const gw_balance_point_t *) right)->hash;
+    return a < b ? -1 : a > b;
+}
+
+/**
+* Places the points of every worker on the ring, called with the lock held whenever the group changes.
+*/
+static void
+build_ring(gw_balancer_t *balancer)
+{
+    int i, j;
+
+    balancer->point_count = 0;
+    balancer->ready_count = 0;
+    for (i = 0; i < balancer->worker_count; i++) {
+        gw_balance_worker_t *worker = &balancer->workers[i];
+        for (j = 0; j < GW_BALANCE_VIRTUAL_NODES; j++) {
+            gw_balance_point_t *point = &balancer->points[balancer->point_count++];
+            point->hash = hash_bytes(worker->identity, worker->identity_size, (uint64_t) j + 1);
+            point->worker = i;
+        }
+        balancer->ready_count += worker->credits > 0;
+    }
+    qsort(balancer->points, balancer->point_count, sizeof(gw_balance_point_t), compare_points);
+}
+
+static int
+find_worker(gw_balancer_t *balancer, zframe_t *identity)
+{
+    int i;
+    for (i = 0; i < balancer->worker_count; i++) {
+        gw_balance_worker_t *worker = &balancer->workers[i];
+        if (worker->identity_size == zframe_size(identity)
+                && memcmp(worker->identity, zframe_data(identity), worker->identity_size) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+* Forgets the workers which went away, keeping the others in order.
+*/
+static void
+purge_workers(gw_balancer_t *balancer)
+{
+    int kept = 0;
+    int i;
+
+    pthread_mutex_lock(&balancer->lock);
+    for (i = 0; i < balancer->worker_count; i++) {
+        if (balancer->workers[i].gone) {
+            fprintf(stderr, "[%s] - Balancing worker %s left\n", timestamp(), balancer->workers[i].name);
+            continue;
+        }
+        if (kept != i) {
+            balancer->workers[kept] = balancer->workers[i];
+        }
+        kept++;
+    }
+    balancer->worker_count = kept;
+    balancer->has_gone = 0;
+    build_ring(balancer);
+    pthread_mutex_unlock(&balancer->lock);
+}
+
+static void
+add_credits(gw_balancer_t *balancer, gw_balance_worker_t *worker, int64_t credits)
+{
+    int wasReady = worker->credits > 0;
+    GW_COUNTER_SET(worker->credits, worker->credits + credits);
+    balancer->ready_count += (worker->credits > 0) - wasReady;
+}
+
+gw_balancer_t *
+gw_balancer_new(zctx_t *ctx, const char *endpoint, int mode, size_t keySize)
+{
+    gw_balancer_t *balancer = (gw_balancer_t *) calloc(1, sizeof(gw_balancer_t));
+    assert( balancer );
+    balancer->ctx = ctx;
+    balancer->mode = mode;
+    balancer->key_size = keySize;
+    balancer->target = -1;
+    pthread_mutex_init(&balancer->lock, NULL);
+
+    balancer->socket = zsocket_new(ctx, mode == GW_BALANCE_HASH ? ZMQ_ROUTER : ZMQ_PUSH);
+    assert( balancer->socket );
+    if (mode == GW_BALANCE_HASH) {
+        // a worker which went away is reported instead of its messages being silently dropped
+        int mandatory = 1;
+        zmq_setsockopt(balancer->socket, ZMQ_ROUTER_MANDATORY, &mandatory, sizeof(mandatory));
+    }
+    if (gw_handover_bind(balancer->socket, endpoint) < 0) {
+        fprintf(stderr, "[%s] - Could not bind the balancing endpoint %s: %s\n", timestamp(), endpoint,
+                zmq_strerror(zmq_errno()));
+        zsocket_destroy(ctx, balancer->socket);
+        pthread_mutex_destroy(&balancer->lock);
+        free(balancer);
+        return NULL;
+    }
+    return balancer;
+}
+
+void
+gw_balancer_destroy(gw_balancer_t **balancer)
+{
+    gw_balancer_t *self = *balancer;
+    zsocket_destroy(self->ctx, self->socket);
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+    *balancer = NULL;
+}
+
+/**
+* Picks the worker of a message from its key and sends it the identity frame routing the message to it.
+* Returns the index of the worker, or -1 when no worker can take the message.
+*/
+static int
+start_message(gw_balancer_t *balancer, const unsigned char *data, size_t size)
+{
+    if (balancer->ready_count == 0) {
+        return -1;
+    }
+    uint64_t hash = hash_bytes(data, size < balancer->key_size ? size : balancer->key_size, 0);
+
+    // the first point at or after the hash of the key, wrapping around the ring
+    int low = 0;
+    int high = balancer->point_count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (balancer->points[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    int owner = balancer->points[low % balancer->point_count].worker;
+
+    int i;
+    for (i = 0; i < balancer->point_count && balancer->ready_count > 0; i++) {
+        int index = balancer->points[(low + i) % balancer->point_count].worker;
+        gw_balance_worker_t *worker = &balancer->workers[index];
+        if (worker->credits <= 0 || worker->gone) {
+            continue;
+        }
+        if (zmq_send(balancer->socket, worker->identity, worker->identity_size, ZMQ_SNDMORE | ZMQ_DONTWAIT) == -1) {
+            if (zmq_errno() == EHOSTUNREACH) {
+                worker->gone = 1;
+                balancer->has_gone = 1;
+                balancer->ready_count--;
+            }
+            // otherwise its connection is full, the credits it gave were more than it can buffer
+            continue;
+        }
+        if (index != owner) {
+            GW_COUNTER_ADD(balancer->spilled, 1);
+        }
+        add_credits(balancer, worker, -1);
+        GW_COUNTER_ADD(worker->messages, 1);
+        return index;
+    }
+    return -1;
+}
+
+void
+gw_balancer_send(gw_balancer_t *balancer, zmq_msg_t *frame, int more)
+{
+    if (!balancer->in_message) {
+        balancer->in_message = 1;
+        balancer->target = balancer->mode == GW_BALANCE_HASH
+                ? start_message(balancer, (const unsigned char *) zmq_msg_data(frame), zmq_msg_size(frame))
+                : 0;
+    }
+    if (balancer->target != -1) {
+        zmq_msg_t copy;
+        zmq_msg_init(&copy);
+        zmq_msg_copy(&copy, frame);
+        if (zmq_msg_send(&copy, balancer->socket, (more ? ZMQ_SNDMORE : 0) | ZMQ_DONTWAIT) == -1) {
+            // only the first frame can be refused, libzmq takes the rest of a message it accepted
+            zmq_msg_close(&copy);
+            balancer->target = -1;
+        }
+    }
+    if (more) {
+        return;
+    }
+    if (balancer->target != -1) {
+        GW_COUNTER_ADD(balancer->messages, 1);
+    } else {
+        GW_COUNTER_ADD(balancer->dropped, 1);
+    }
+    balancer->in_message = 0;
+    if (balancer->has_gone) {
+        purge_workers(balancer);
+    }
+}
+
+void *
+gw_balancer_socket(gw_balancer_t *balancer)
+{
+    return balancer->mode == GW_BALANCE_HASH ? balancer->socket : NULL;
+}
+
+/**
+* Reads a message of a worker from the ROUTER: READY [credits] [name], CREDIT credits or BYE.
+* Returns 0, or -1 when the message couldn't be read in which case zmq_errno() tells why.
+*/
+int
+gw_balancer_handle_request(gw_balancer_t *balancer)
+{
+    zmsg_t *request = zmsg_recv(balancer->socket);
+    if (request == NULL) {
+        return -1;
+    }
+    zframe_t *identity = zmsg_pop(request);
+    zframe_t *command = zmsg_pop(request);
+    char *value = zmsg_popstr(request);
+    char *name = zmsg_popstr(request);
+    int index = identity != NULL ? find_worker(balancer, identity) : -1;
+
+    if (command == NULL || zframe_size(identity) > GW_BALANCE_MAX_IDENTITY_SIZE) {
+        // not a worker
+    } else if (zframe_streq(command, "READY")) {
+        int64_t credits = value != NULL ? strtoll(value, NULL, 10) : DEFAULT_BALANCE_CREDITS;
+        if (index == -1 && balancer->worker_count == GW_BALANCE_MAX_WORKERS) {
+            fprintf(stderr, "[%s] - Refusing a balancing worker, there are already %d of them\n", timestamp(),
+                    GW_BALANCE_MAX_WORKERS);
+        } else {
+            pthread_mutex_lock(&balancer->lock);
+            if (index == -1) {
+                index = balancer->worker_count++;
+            }
+            // a worker registering again starts over, i.e. after a restart
+            gw_balance_worker_t *worker = &balancer->workers[index];
+            memset(worker, 0, sizeof(gw_balance_worker_t));
+            worker->identity_size = zframe_size(identity);
+            memcpy(worker->identity, zframe_data(identity), worker->identity_size);
+            worker->credits = credits;
+            if (name != NULL) {
+                snprintf(worker->name, sizeof(worker->name), "%s", name);
+            } else {
+                snprintf(worker->name, sizeof(worker->name), "worker-%d", (int) balancer->registrations);
+            }
+            GW_COUNTER_ADD(balancer->registrations, 1);
+            build_ring(balancer);
+            pthread_mutex_unlock(&balancer->lock);
+            fprintf(stderr, "[%s] - Balancing worker %s registered with %lld credits, %d workers\n", timestamp(),
+                    worker->name, (long long) credits, balancer->worker_count);
+        }
+    } else if (zframe_streq(command, "CREDIT") && index != -1 && value != NULL) {
+        add_credits(balancer, &balancer->workers[index], strtoll(value, NULL, 10));
+    } else if (zframe_streq(command, "BYE") && index != -1) {
+        balancer->workers[index].gone = 1;
+        purge_workers(balancer);
+    }
+
+    free(value);
+    free(name);
+    if (identity != NULL) {
+        zframe_destroy(&identity);
+    }
+    if (command != NULL) {
+        zframe_destroy(&command);
+    }
+    zmsg_destroy(&request);
+    return 0;
+}
+
+int
+gw_balancer_worker_count(gw_balancer_t *balancer)
+{
+    return balancer->worker_count;
+}
+
+/**
+* Metrics collector for the balancer.
+*/
+void
+gw_balancer_render(FILE *out, void *self)
+{
+    gw_balancer_t *balancer = (gw_balancer_t *) self;
+    int i;
+
+    fprintf(out, "# TYPE gw_zmq_balanced_messages_total counter\ngw_zmq_balanced_messages_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(balancer->messages));
+    fprintf(out, "# TYPE gw_zmq_balanced_spilled_total counter\ngw_zmq_balanced_spilled_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(balancer->spilled));
+    fprintf(out, "# TYPE gw_zmq_balanced_dropped_total counter\ngw_zmq_balanced_dropped_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(balancer->dropped));
+    if (balancer->mode != GW_BALANCE_HASH) {
+        return;
+    }
+
+    pthread_mutex_lock(&balancer->lock);
+    fprintf(out, "# TYPE gw_zmq_balance_workers gauge\ngw_zmq_balance_workers %d\n", balancer->worker_count);
+    fprintf(out, "# TYPE gw_zmq_balance_worker_messages_total counter\n");
+    for (i = 0; i < balancer->worker_count; i++) {
+        fprintf(out, "gw_zmq_balance_worker_messages_total{worker=\"%s\"} %llu\n", balancer->workers[i].name,
+                (unsigned long long) GW_COUNTER_GET(balancer->workers[i].messages));
+    }
+    fprintf(out, "# TYPE gw_zmq_balance_worker_credits gauge\n");
+    for (i = 0; i < balancer->worker_count; i++) {
+        fprintf(out, "gw_zmq_balance_worker_credits{worker=\"%s\"} %lld\n", balancer->workers[i].name,
+                (long long) GW_COUNTER_GET(balancer->workers[i].credits));
+    }
+    pthread_mutex_unlock(&balancer->lock);
+}
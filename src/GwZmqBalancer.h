@@ -0,0 +1,86 @@
+#ifndef GW_BALANCER_H
+#define GW_BALANCER_H
+
+#include "czmq.h"
+
+/**
+* How the balancer spreads the messages over its workers.
+*/
+/** a PUSH socket deals them round robin to the connected workers */
+#define GW_BALANCE_ROUND_ROBIN 0
+/** a ROUTER sends all the messages with the same key to the same registered worker */
+#define GW_BALANCE_HASH 1
+
+#define GW_BALANCE_MAX_WORKERS 64
+
+/**
+* Points each worker gets on the hash ring; more points spread the keys more evenly.
+*/
+#define GW_BALANCE_VIRTUAL_NODES 64
+
+/**
+* Default number of bytes at the start of a message making its key.
+*/
+#define DEFAULT_BALANCE_KEY_SIZE 16
+
+/**
+* Credits of a worker registering without telling how many messages it can take.
+*/
+#define DEFAULT_BALANCE_CREDITS 1000
+
+#define GW_BALANCE_MAX_NAME_SIZE 64
+
+typedef struct _gw_balancer_t gw_balancer_t;
+
+/**
+* Egress spreading the messages over a group of competing workers, next to the XPUB which broadcasts them, so that
+* each worker of a replicated service only gets its share of the stream.
+*
+* In round robin mode the endpoint is a PUSH socket the workers connect PULL sockets to. libzmq skips the workers
+* which reached their high water mark, which acts as their credit, and a message nobody can take is dropped.
+*
+* In hash mode the endpoint is a ROUTER. A worker connects a DEALER and registers with "READY", optionally followed by
+* the number of messages it can take and a name for the metrics. The messages are then sent to it as they are, and
+* it gives credit back with "CREDIT" and a number, usually once it's done with a batch, or leaves with "BYE".
+* The first keySize bytes of a message are hashed onto a ring holding GW_BALANCE_VIRTUAL_NODES points per worker,
+* so a key keeps going to the same worker as long as the group doesn't change, and only the keys of a worker which
+* joins or leaves move. A worker out of credit doesn't stall the others: its messages spill over to the next worker
+* of the ring with credit left, and are only dropped when none has any. A worker which went away without saying bye
+* is forgotten as soon as a message can't be routed to it.
+*
+* The balancer belongs to the thread owning the XPUB, which polls the ROUTER for the registrations and the credits.
+*/
+gw_balancer_t *
+gw_balancer_new(zctx_t *ctx, const char *endpoint, int mode, size_t keySize);
+
+void
+gw_balancer_destroy(gw_balancer_t **balancer);
+
+int
+gw_balance_mode(const char *name);
+
+const char *
+gw_balance_mode_name(int mode);
+
+/**
+* Sends a copy of a frame to the worker of its message, sharing its payload; the worker is picked on the first frame.
+*/
+void
+gw_balancer_send(gw_balancer_t *balancer, zmq_msg_t *frame, int more);
+
+/**
+* The ROUTER the workers register on, NULL in round robin mode where there's nothing to read.
+*/
+void *
+gw_balancer_socket(gw_balancer_t *balancer);
+
+int
+gw_balancer_handle_request(gw_balancer_t *balancer);
+
+int
+gw_balancer_worker_count(gw_balancer_t *balancer);
+
+void
+gw_balancer_render(FILE *out, void *balancer);
+
+#endif
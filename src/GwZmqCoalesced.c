@@ -0,0 +1,75 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqCoalesced.h"
+#include <string.h>
+
+static uint32_t
+read_uint32(const unsigned char *data)
+{
+    return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | data[3];
+}
+
+/**
+* Returns 1 when the frame holds coalesced records, 0 when it's a message published as the gateway sent it.
+*/
+int
+gw_coalesced_is_batch(const void *frame, size_t size)
+{
+    return size >= GW_COALESCED_HEADER_SIZE && memcmp(frame, GW_COALESCED_MAGIC, 4) == 0;
+}
+
+/**
+* Returns the number of records of a coalesced frame.
+*/
+uint32_t
+gw_coalesced_count(const void *frame, size_t size)
+{
+    return gw_coalesced_is_batch(frame, size) ? read_uint32((const unsigned char *) frame + 4) : 0;
+}
+
+/**
+* Calls callback for each record of a coalesced frame, in the order the adaptor received them.
+* The records point into the frame, they're valid as long as the frame is.
+* Returns the number of records decoded, or -1 if the frame is truncated or isn't a coalesced frame.
+*/
+int
+gw_coalesced_decode(const void *frame, size_t size, gw_coalesced_record_fn *callback, void *args)
+{
+    const unsigned char *data = (const unsigned char *) frame;
+
+    if (!gw_coalesced_is_batch(frame, size)) {
+        return -1;
+    }
+
+    uint32_t count = read_uint32(data + 4);
+    size_t offset = GW_COALESCED_HEADER_SIZE;
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        if (size - offset < GW_COALESCED_RECORD_HEADER_SIZE) {
+            return -1;
+        }
+        uint32_t recordSize = read_uint32(data + offset);
+        offset += GW_COALESCED_RECORD_HEADER_SIZE;
+        if (size - offset < recordSize) {
+            return -1;
+        }
+        if (callback(data + offset, recordSize, args) != 0) {
+            return (int) i + 1;
+        }
+        offset += recordSize;
+    }
+    return (int) count;
+}
@@ -0,0 +1,39 @@
+#ifndef GW_COALESCED_H
+#define GW_COALESCED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+* Format of the messages published when the adaptor coalesces small messages ( --coalesce-bytes ).
+*
+* A coalesced message has 2 frames:
+*   frame 0: the topic the records were grouped by, so consumers keep subscribing by prefix
+*   frame 1: "GWB1", the number of records as a 32 bits big endian integer, then each record as
+*            its size ( 32 bits big endian ) followed by its bytes
+* Each record is a whole message as the gateway sent it. Messages which weren't coalesced, i.e. multipart messages,
+* are published unchanged, so consumers should check each message with gw_coalesced_is_batch().
+*
+* This file and GwZmqCoalesced.c only depend on the C library so consumers can embed them as they are.
+*/
+#define GW_COALESCED_MAGIC "GWB1"
+
+#define GW_COALESCED_HEADER_SIZE 8
+
+#define GW_COALESCED_RECORD_HEADER_SIZE 4
+
+/**
+* Called for each record of a coalesced frame; returning a non zero value stops the decoding.
+*/
+typedef int (gw_coalesced_record_fn) (const void *record, size_t size, void *args);
+
+int
+gw_coalesced_is_batch(const void *frame, size_t size);
+
+uint32_t
+gw_coalesced_count(const void *frame, size_t size);
+
+int
+gw_coalesced_decode(const void *frame, size_t size, gw_coalesced_record_fn *callback, void *args);
+
+#endif
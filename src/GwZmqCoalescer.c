@@ -0,0 +1,302 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqCoalescer.h"
+#include "GwZmqCoalesced.h"
+#include "GwZmqMetrics.h"
+#include "czmq.h"
+
+typedef struct {
+    unsigned char topic[GW_COALESCE_MAX_TOPIC_SIZE];
+    size_t topic_size;
+    /** the coalesced frame being built, handed over to libzmq when it's published */
+    unsigned char *buffer;
+    size_t size;
+    size_t capacity;
+    uint32_t records;
+    int64_t first_at;
+    /** a consumer subscribed to the compressed topic of one of the records */
+    int compress;
+} gw_pending_t;
+
+struct _gw_coalescer_t {
+    size_t topic_size;
+    size_t max_bytes;
+    int max_delay_usec;
+    /** compresses the coalesced messages for the consumers who asked for it, NULL without compression */
+    gw_compressor_t *compressor;
+    gw_pending_t pending[GW_COALESCE_MAX_TOPICS];
+    int count;
+    /** consecutive messages usually share their topic */
+    int last;
+
+    uint64_t records;
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t flushed_full;
+    uint64_t flushed_expired;
+    uint64_t dropped;
+};
+
+static int64_t
+monotonic_usecs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void
+write_uint32(unsigned char *data, uint32_t value)
+{
+    data[0] = (unsigned char) (value >> 24);
+    data[1] = (unsigned char) (value >> 16);
+    data[2] = (unsigned char) (value >> 8);
+    data[3] = (unsigned char) value;
+}
+
+gw_coalescer_t *
+gw_coalescer_new(size_t topicSize, size_t maxBytes, int maxDelayUsec)
+{
+    assert( topicSize >= 1 && topicSize <= GW_COALESCE_MAX_TOPIC_SIZE );
+
+    gw_coalescer_t *coalescer = (gw_coalescer_t *) calloc(1, sizeof(gw_coalescer_t));
+    assert( coalescer );
+    coalescer->topic_size = topicSize;
+    coalescer->max_bytes = maxBytes;
+    coalescer->max_delay_usec = maxDelayUsec;
+    return coalescer;
+}
+
+void
+gw_coalescer_set_compressor(gw_coalescer_t *coalescer, gw_compressor_t *compressor)
+{
+    coalescer->compressor = compressor;
+}
+
+void
+gw_coalescer_destroy(gw_coalescer_t **coalescer)
+{
+    int i;
+    for (i = 0; i < (*coalescer)->count; i++) {
+        free((*coalescer)->pending[i].buffer);
+    }
+    free(*coalescer);
+    *coalescer = NULL;
+}
+
+static void
+free_buffer(void *data, void *hint)
+{
+    free(data);
+}
+
+/**
+* Publishes the records pending for a topic and forgets the topic.
+*/
+static int
+publish(gw_coalescer_t *coalescer, void *socket, int index)
+{
+    gw_pending_t *pending = &coalescer->pending[index];
+    int result = 0;
+
+    write_uint32(pending->buffer + 4, pending->records);
+
+    if (zmq_send(socket, pending->topic, pending->topic_size, ZMQ_SNDMORE | ZMQ_DONTWAIT) == -1) {
+        result = zmq_errno() == EAGAIN ? 0 : -1;
+        free(pending->buffer);
+        GW_COUNTER_ADD(coalescer->dropped, pending->records);
+    } else {
+        // the buffer is handed over to libzmq instead of being copied
+        zmq_msg_t frame;
+        zmq_msg_init_data(&frame, pending->buffer, pending->size, free_buffer, NULL);
+        if (pending->compress && coalescer->compressor != NULL) {
+            gw_compressor_offer(coalescer->compressor, pending->topic, pending->topic_size, &frame);
+        }
+        if (zmq_msg_send(&frame, socket, ZMQ_DONTWAIT) == -1) {
+            zmq_msg_close(&frame);
+            result = -1;
+        }
+        GW_COUNTER_ADD(coalescer->messages, 1);
+        GW_COUNTER_ADD(coalescer->bytes, pending->size);
+    }
+
+    coalescer->pending[index] = coalescer->pending[--coalescer->count];
+    coalescer->last = 0;
+    return result;
+}
+
+static int
+find_topic(gw_coalescer_t *coalescer, const unsigned char *topic, size_t size)
+{
+    int i;
+    gw_pending_t *last = &coalescer->pending[coalescer->last];
+
+    if (coalescer->last < coalescer->count && last->topic_size == size && memcmp(last->topic, topic, size) == 0) {
+        return coalescer->last;
+    }
+    for (i = 0; i < coalescer->count; i++) {
+        if (coalescer->pending[i].topic_size == size && memcmp(coalescer->pending[i].topic, topic, size) == 0) {
+            coalescer->last = i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+* Adds a message to the records pending for its topic, publishing them if they reached the size limit.
+* compress tells that a consumer subscribed to the compressed topic of the message.
+* Returns 0 on success or -1 if publishing failed, in which case zmq_errno() tells why.
+*/
+int
+gw_coalescer_add(gw_coalescer_t *coalescer, void *socket, const void *data, size_t size, int compress)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    size_t topicSize = size < coalescer->topic_size ? size : coalescer->topic_size;
+    int index = find_topic(coalescer, bytes, topicSize);
+    int result = 0;
+
+    if (index == -1) {
+        if (coalescer->count == GW_COALESCE_MAX_TOPICS) {
+            result = gw_coalescer_flush(coalescer, socket);
+        }
+        index = coalescer->count++;
+        gw_pending_t *pending = &coalescer->pending[index];
+        memcpy(pending->topic, bytes, topicSize);
+        pending->topic_size = topicSize;
+        pending->capacity = coalescer->max_bytes + GW_COALESCED_HEADER_SIZE;
+        pending->buffer = (unsigned char *) malloc(pending->capacity);
+        assert( pending->buffer );
+        memcpy(pending->buffer, GW_COALESCED_MAGIC, 4);
+        pending->size = GW_COALESCED_HEADER_SIZE;
+        pending->records = 0;
+        pending->compress = 0;
+        pending->first_at = monotonic_usecs();
+        coalescer->last = index;
+    }
+
+    gw_pending_t *pending = &coalescer->pending[index];
+    size_t needed = pending->size + GW_COALESCED_RECORD_HEADER_SIZE + size;
+    if (needed > pending->capacity) {
+        // a message larger than the limit is published alone
+        pending->capacity = needed;
+        pending->buffer = (unsigned char *) realloc(pending->buffer, pending->capacity);
+        assert( pending->buffer );
+    }
+    write_uint32(pending->buffer + pending->size, (uint32_t) size);
+    memcpy(pending->buffer + pending->size + GW_COALESCED_RECORD_HEADER_SIZE, data, size);
+    pending->size = needed;
+    pending->records++;
+    pending->compress |= compress;
+    GW_COUNTER_ADD(coalescer->records, 1);
+
+    if (pending->size >= coalescer->max_bytes) {
+        GW_COUNTER_ADD(coalescer->flushed_full, 1);
+        if (publish(coalescer, socket, index) == -1) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/**
+* Publishes the records pending for the topics whose first record waited for the maximum delay.
+* Returns 0 on success or -1 if publishing failed, in which case zmq_errno() tells why.
+*/
+int
+gw_coalescer_flush_expired(gw_coalescer_t *coalescer, void *socket)
+{
+    int result = 0;
+    int64_t now;
+    int i;
+
+    if (coalescer->count == 0) {
+        return 0;
+    }
+    now = monotonic_usecs();
+    for (i = coalescer->count - 1; i >= 0; i--) {
+        if (now - coalescer->pending[i].first_at >= coalescer->max_delay_usec) {
+            GW_COUNTER_ADD(coalescer->flushed_expired, 1);
+            if (publish(coalescer, socket, i) == -1) {
+                result = -1;
+            }
+        }
+    }
+    return result;
+}
+
+/**
+* Publishes all the pending records.
+*/
+int
+gw_coalescer_flush(gw_coalescer_t *coalescer, void *socket)
+{
+    int result = 0;
+
+    while (coalescer->count > 0) {
+        if (publish(coalescer, socket, coalescer->count - 1) == -1) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/**
+* Returns how long ( in milliseconds, rounded up ) the owning thread can wait before records have to be published,
+* or -1 when nothing is pending.
+*/
+int
+gw_coalescer_timeout(gw_coalescer_t *coalescer)
+{
+    int64_t oldest = INT64_MAX;
+    int i;
+
+    if (coalescer->count == 0) {
+        return -1;
+    }
+    for (i = 0; i < coalescer->count; i++) {
+        if (coalescer->pending[i].first_at < oldest) {
+            oldest = coalescer->pending[i].first_at;
+        }
+    }
+    int64_t remaining = oldest + coalescer->max_delay_usec - monotonic_usecs();
+    return remaining <= 0 ? 0 : (int) ((remaining + 999) / 1000);
+}
+
+/**
+* Metrics collector for the coalescer.
+*/
+void
+gw_coalescer_render(FILE *out, void *self)
+{
+    gw_coalescer_t *coalescer = (gw_coalescer_t *) self;
+    uint64_t records = GW_COUNTER_GET(coalescer->records);
+    uint64_t messages = GW_COUNTER_GET(coalescer->messages);
+
+    fprintf(out, "# TYPE gw_zmq_coalesced_records_total counter\ngw_zmq_coalesced_records_total %llu\n",
+            (unsigned long long) records);
+    fprintf(out, "# TYPE gw_zmq_coalesced_messages_total counter\ngw_zmq_coalesced_messages_total %llu\n",
+            (unsigned long long) messages);
+    fprintf(out, "# TYPE gw_zmq_coalesced_bytes_total counter\ngw_zmq_coalesced_bytes_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(coalescer->bytes));
+    fprintf(out, "# TYPE gw_zmq_coalesced_flushes_total counter\n"
+                 "gw_zmq_coalesced_flushes_total{reason=\"size\"} %llu\n"
+                 "gw_zmq_coalesced_flushes_total{reason=\"delay\"} %llu\n",
+            (unsigned long long) GW_COUNTER_GET(coalescer->flushed_full),
+            (unsigned long long) GW_COUNTER_GET(coalescer->flushed_expired));
+    fprintf(out, "# TYPE gw_zmq_coalesced_dropped_total counter\ngw_zmq_coalesced_dropped_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(coalescer->dropped));
+}
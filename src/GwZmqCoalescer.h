@@ -0,0 +1,56 @@
+#ifndef GW_COALESCER_H
+#define GW_COALESCER_H
+
+#include "czmq.h"
+#include "GwZmqCompressor.h"
+
+/**
+* Default size of the topic small messages are grouped by: "PUB-A" for the messages of the test publishers.
+*/
+#define DEFAULT_COALESCE_TOPIC_SIZE 5
+
+/**
+* Default delay ( in microseconds ) after which a coalesced message is published even if it isn't full.
+*/
+#define DEFAULT_COALESCE_DELAY_USEC 1000
+
+#define GW_COALESCE_MAX_TOPIC_SIZE 256
+
+/**
+* Topics coalesced at the same time; when there are more, all the pending messages are published.
+*/
+#define GW_COALESCE_MAX_TOPICS 1024
+
+typedef struct _gw_coalescer_t gw_coalescer_t;
+
+/**
+* Packs small single frame messages sharing the same topic - their first topicSize bytes - into one coalesced message
+* ( see GwZmqCoalesced.h ), published once it holds maxBytes or its first record waited maxDelayUsec.
+*
+* The coalescer belongs to the thread owning the XPUB socket.
+*/
+gw_coalescer_t *
+gw_coalescer_new(size_t topicSize, size_t maxBytes, int maxDelayUsec);
+
+void
+gw_coalescer_destroy(gw_coalescer_t **coalescer);
+
+void
+gw_coalescer_set_compressor(gw_coalescer_t *coalescer, gw_compressor_t *compressor);
+
+int
+gw_coalescer_add(gw_coalescer_t *coalescer, void *socket, const void *data, size_t size, int compress);
+
+int
+gw_coalescer_flush_expired(gw_coalescer_t *coalescer, void *socket);
+
+int
+gw_coalescer_flush(gw_coalescer_t *coalescer, void *socket);
+
+int
+gw_coalescer_timeout(gw_coalescer_t *coalescer);
+
+void
+gw_coalescer_render(FILE *out, void *coalescer);
+
+#endif
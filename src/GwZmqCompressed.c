@@ -0,0 +1,85 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqCompressed.h"
+#include <string.h>
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+static uint32_t
+read_uint32(const unsigned char *data)
+{
+    return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | data[3];
+}
+
+/**
+* Returns 1 when the frame is the compressed frame of a message.
+*/
+int
+gw_compressed_is_compressed(const void *frame, size_t size)
+{
+    return size >= GW_COMPRESSED_HEADER_SIZE && memcmp(frame, GW_COMPRESSED_MAGIC, 4) == 0;
+}
+
+/**
+* Returns the id of the dictionary a frame was compressed with, 0 without dictionary.
+*/
+uint32_t
+gw_compressed_dictionary_id(const void *frame, size_t size)
+{
+    return gw_compressed_is_compressed(frame, size) ? read_uint32((const unsigned char *) frame + 4) : 0;
+}
+
+/**
+* Returns the size of the frame once decompressed.
+*/
+uint32_t
+gw_compressed_raw_size(const void *frame, size_t size)
+{
+    return gw_compressed_is_compressed(frame, size) ? read_uint32((const unsigned char *) frame + 8) : 0;
+}
+
+int
+gw_compressed_decode(const void *frame, size_t size, void *raw, size_t capacity,
+                     const void *dictionary, size_t dictionarySize)
+{
+#ifndef HAVE_LIBZSTD
+    return -1;
+#else
+    if (!gw_compressed_is_compressed(frame, size)) {
+        return -1;
+    }
+    uint32_t dictionaryId = gw_compressed_dictionary_id(frame, size);
+    uint32_t rawSize = gw_compressed_raw_size(frame, size);
+    if (rawSize > capacity || (dictionaryId != 0 && (dictionary == NULL
+            || ZSTD_getDictID_fromDict(dictionary, dictionarySize) != dictionaryId))) {
+        return -1;
+    }
+
+    ZSTD_DCtx *context = ZSTD_createDCtx();
+    if (context == NULL) {
+        return -1;
+    }
+    size_t decompressed = ZSTD_decompress_usingDict(context, raw, capacity,
+                                                    (const unsigned char *) frame + GW_COMPRESSED_HEADER_SIZE,
+                                                    size - GW_COMPRESSED_HEADER_SIZE,
+                                                    dictionaryId != 0 ? dictionary : NULL,
+                                                    dictionaryId != 0 ? dictionarySize : 0);
+    ZSTD_freeDCtx(context);
+    return ZSTD_isError(decompressed) || decompressed != rawSize ? -1 : 0;
+#endif
+}
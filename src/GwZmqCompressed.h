@@ -0,0 +1,41 @@
+#ifndef GW_COMPRESSED_H
+#define GW_COMPRESSED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+* Format of the messages published compressed, for the consumers subscribing to compressed topics ( --compress ).
+*
+* A compressed message has 2 frames:
+*   frame 0: GW_COMPRESSED_TOPIC_PREFIX followed by the topic of the message
+*   frame 1: "GWZ1", the id of the zstd dictionary ( 0 without dictionary ) and the size of the raw frame, both
+*            as 32 bits big endian integers, then the zstd frame
+* The raw frame is the whole message for single frame messages, or the coalesced frame ( see GwZmqCoalesced.h ).
+*
+* This file and GwZmqCompressed.c only depend on the C library and libzstd ( HAVE_LIBZSTD ) so consumers can embed
+* them as they are; without libzstd gw_compressed_decode always fails.
+*/
+#define GW_COMPRESSED_MAGIC "GWZ1"
+
+#define GW_COMPRESSED_HEADER_SIZE 12
+
+int
+gw_compressed_is_compressed(const void *frame, size_t size);
+
+uint32_t
+gw_compressed_dictionary_id(const void *frame, size_t size);
+
+uint32_t
+gw_compressed_raw_size(const void *frame, size_t size);
+
+/**
+* Decompresses the second frame of a compressed message into raw, which holds capacity bytes and should hold at
+* least gw_compressed_raw_size() of them. dictionary is the one whose id the frame gives, NULL when that id is 0.
+* Returns 0 on success, or -1 if the frame is corrupted, isn't a compressed frame or needs another dictionary.
+*/
+int
+gw_compressed_decode(const void *frame, size_t size, void *raw, size_t capacity,
+                     const void *dictionary, size_t dictionarySize);
+
+#endif
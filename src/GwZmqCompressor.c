@@ -0,0 +1,436 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqCompressor.h"
+#include "GwZmqAdaptor.h"
+#include "GwZmqMetrics.h"
+#include "czmq.h"
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+/**
+* How often ( in milliseconds ) the workers check if the dictionary changed.
+*/
+#define GW_DICTIONARY_CHECK_INTERVAL_MSEC 1000
+
+typedef struct {
+    gw_compressor_t *compressor;
+    int index;
+    /** PULL socket receiving the messages to compress */
+    void *input;
+    /** PUSH socket sending the compressed messages back */
+    void *output;
+    pthread_t thread;
+
+    uint64_t messages;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t cpu_nsecs;
+    uint64_t failures;
+    uint64_t dictionary_loads;
+    uint32_t dictionary_id;
+} __attribute__((aligned(GW_CACHE_LINE_SIZE))) gw_compression_worker_t;
+
+struct _gw_compressor_t {
+    zctx_t *ctx;
+    int level;
+    char *dictionary_path;
+    size_t topic_size;
+    gw_subscriptions_t *subscriptions;
+    volatile int running;
+    /** owned by the thread owning the XPUB */
+    void *workers_input;
+    void *workers_output;
+    int worker_count;
+    gw_compression_worker_t workers[GW_MAX_COMPRESSION_WORKERS];
+    /** offers dropped because the workers couldn't keep up, and compressed messages the XPUB refused */
+    uint64_t dropped;
+};
+
+#ifdef HAVE_LIBZSTD
+
+static void
+write_uint32(unsigned char *data, uint32_t value)
+{
+    data[0] = (unsigned char) (value >> 24);
+    data[1] = (unsigned char) (value >> 16);
+    data[2] = (unsigned char) (value >> 8);
+    data[3] = (unsigned char) value;
+}
+
+static void
+free_buffer(void *data, void *hint)
+{
+    free(data);
+}
+
+static uint64_t
+thread_cpu_nsecs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+* Loads the dictionary if the file changed since it was loaded last.
+*/
+static void
+reload_dictionary(gw_compression_worker_t *worker, ZSTD_CDict **dictionary, time_t *loadedAt)
+{
+    gw_compressor_t *compressor = worker->compressor;
+    struct stat info;
+
+    if (compressor->dictionary_path == NULL || stat(compressor->dictionary_path, &info) == -1
+            || info.st_mtime == *loadedAt) {
+        return;
+    }
+
+    FILE *file = fopen(compressor->dictionary_path, "rb");
+    if (file == NULL) {
+        return;
+    }
+    void *content = malloc(info.st_size);
+    size_t size = content == NULL ? 0 : fread(content, 1, info.st_size, file);
+    fclose(file);
+
+    ZSTD_CDict *loaded = size == (size_t) info.st_size ? ZSTD_createCDict(content, size, compressor->level) : NULL;
+    if (loaded != NULL) {
+        ZSTD_freeCDict(*dictionary);
+        *dictionary = loaded;
+        *loadedAt = info.st_mtime;
+        GW_COUNTER_SET(worker->dictionary_id, ZSTD_getDictID_fromDict(content, size));
+        GW_COUNTER_ADD(worker->dictionary_loads, 1);
+        if (worker->index == 0) {
+            fprintf(stderr, "[%s] - Loaded compression dictionary %s ( id %u, %zu bytes )\n", timestamp(),
+                    compressor->dictionary_path, worker->dictionary_id, size);
+        }
+    }
+    free(content);
+}
+
+/**
+* Compresses the payload of a message, sending the topic and the compressed frame to the thread owning the XPUB.
+*/
+static void
+compress_message(gw_compression_worker_t *worker, ZSTD_CCtx *context, ZSTD_CDict *dictionary,
+                 zmq_msg_t *topic, zmq_msg_t *payload)
+{
+    size_t size = zmq_msg_size(payload);
+    size_t capacity = GW_COMPRESSED_HEADER_SIZE + ZSTD_compressBound(size);
+    unsigned char *buffer = (unsigned char *) malloc(capacity);
+    assert( buffer );
+
+    uint64_t startedAt = thread_cpu_nsecs();
+    size_t compressed = dictionary != NULL
+            ? ZSTD_compress_usingCDict(context, buffer + GW_COMPRESSED_HEADER_SIZE, capacity - GW_COMPRESSED_HEADER_SIZE,
+                                       zmq_msg_data(payload), size, dictionary)
+            : ZSTD_compressCCtx(context, buffer + GW_COMPRESSED_HEADER_SIZE, capacity - GW_COMPRESSED_HEADER_SIZE,
+                                zmq_msg_data(payload), size, worker->compressor->level);
+    GW_COUNTER_ADD(worker->cpu_nsecs, thread_cpu_nsecs() - startedAt);
+
+    if (ZSTD_isError(compressed)) {
+        free(buffer);
+        GW_COUNTER_ADD(worker->failures, 1);
+        return;
+    }
+    memcpy(buffer, GW_COMPRESSED_MAGIC, 4);
+    write_uint32(buffer + 4, dictionary != NULL ? worker->dictionary_id : 0);
+    write_uint32(buffer + 8, (uint32_t) size);
+
+    zmq_msg_t frame;
+    zmq_msg_init_data(&frame, buffer, GW_COMPRESSED_HEADER_SIZE + compressed, free_buffer, NULL);
+    if (zmq_msg_send(topic, worker->output, ZMQ_SNDMORE) == -1 || zmq_msg_send(&frame, worker->output, 0) == -1) {
+        zmq_msg_close(&frame);
+        GW_COUNTER_ADD(worker->failures, 1);
+        return;
+    }
+    GW_COUNTER_ADD(worker->messages, 1);
+    GW_COUNTER_ADD(worker->bytes_in, size);
+    GW_COUNTER_ADD(worker->bytes_out, GW_COMPRESSED_HEADER_SIZE + compressed);
+}
+
+static void*
+compression_worker_thread(void *args)
+{
+    gw_compression_worker_t *worker = (gw_compression_worker_t *) args;
+    gw_compressor_t *compressor = worker->compressor;
+    ZSTD_CCtx *context = ZSTD_createCCtx();
+    ZSTD_CDict *dictionary = NULL;
+    time_t loadedAt = 0;
+    int64_t checkedAt = 0;
+    zmq_pollitem_t items[] = { { worker->input, 0, ZMQ_POLLIN, 0 } };
+
+    assert( context );
+    while (compressor->running) {
+        if (zclock_time() - checkedAt >= GW_DICTIONARY_CHECK_INTERVAL_MSEC) {
+            reload_dictionary(worker, &dictionary, &loadedAt);
+            checkedAt = zclock_time();
+        }
+        int ready = zmq_poll(items, 1, GW_POLL_TIMEOUT_MSEC);
+        if (ready == -1 && zmq_errno() == ETERM) {
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
+        zmq_msg_t topic, payload;
+        zmq_msg_init(&topic);
+        zmq_msg_init(&payload);
+        if (zmq_msg_recv(&topic, worker->input, 0) != -1 && zmq_msg_more(&topic)
+                && zmq_msg_recv(&payload, worker->input, 0) != -1) {
+            compress_message(worker, context, dictionary, &topic, &payload);
+        }
+        zmq_msg_close(&topic);
+        zmq_msg_close(&payload);
+    }
+
+    ZSTD_freeCDict(dictionary);
+    ZSTD_freeCCtx(context);
+    return NULL;
+}
+
+#endif
+
+gw_compressor_t *
+gw_compressor_new(zctx_t *ctx, int listenerId, int workers, int level, const char *dictionaryPath,
+                  gw_subscriptions_t *subscriptions, size_t topicSize)
+{
+#ifndef HAVE_LIBZSTD
+    fprintf(stderr, "[%s] - Compression isn't available, the adaptor was built without libzstd\n", timestamp());
+    return NULL;
+#else
+    assert( workers >= 1 && workers <= GW_MAX_COMPRESSION_WORKERS );
+
+    gw_compressor_t *compressor = (gw_compressor_t *) calloc(1, sizeof(gw_compressor_t));
+    assert( compressor );
+    compressor->ctx = ctx;
+    compressor->level = level;
+    compressor->dictionary_path = dictionaryPath != NULL ? strdup(dictionaryPath) : NULL;
+    compressor->topic_size = topicSize;
+    compressor->subscriptions = subscriptions;
+    compressor->worker_count = workers;
+    compressor->running = 1;
+
+    char inputEndpoint[128], outputEndpoint[128];
+    snprintf(inputEndpoint, sizeof(inputEndpoint), DEFAULT_INPROC_COMPRESS_ENDPOINT, listenerId);
+    snprintf(outputEndpoint, sizeof(outputEndpoint), DEFAULT_INPROC_COMPRESSED_ENDPOINT, listenerId);
+
+    compressor->workers_input = zsocket_new(ctx, ZMQ_PUSH);
+    int result = zsocket_bind(compressor->workers_input, "%s", inputEndpoint);
+    assert( result >= 0 );
+    compressor->workers_output = zsocket_new(ctx, ZMQ_PULL);
+    result = zsocket_bind(compressor->workers_output, "%s", outputEndpoint);
+    assert( result >= 0 );
+
+    // the sockets are created here and handed over to the workers, like the shards do
+    int i;
+    for (i = 0; i < workers; i++) {
+        gw_compression_worker_t *worker = &compressor->workers[i];
+        worker->compressor = compressor;
+        worker->index = i;
+        worker->input = zsocket_new(ctx, ZMQ_PULL);
+        result = zsocket_connect(worker->input, "%s", inputEndpoint);
+        assert( result == 0 );
+        worker->output = zsocket_new(ctx, ZMQ_PUSH);
+        result = zsocket_connect(worker->output, "%s", outputEndpoint);
+        assert( result == 0 );
+    }
+    for (i = 0; i < workers; i++) {
+        result = pthread_create(&compressor->workers[i].thread, NULL, compression_worker_thread, &compressor->workers[i]);
+        assert( result == 0 );
+    }
+    return compressor;
+#endif
+}
+
+void
+gw_compressor_destroy(gw_compressor_t **compressor)
+{
+    gw_compressor_t *self = *compressor;
+    int i;
+
+    self->running = 0;
+    for (i = 0; i < self->worker_count; i++) {
+        pthread_join(self->workers[i].thread, NULL);
+    }
+    free(self->dictionary_path);
+    free(self);
+    *compressor = NULL;
+}
+
+static size_t
+compressed_topic(unsigned char *compressedTopic, const void *topic, size_t topicSize)
+{
+    if (topicSize > GW_MAX_COMPRESSED_TOPIC_SIZE) {
+        topicSize = GW_MAX_COMPRESSED_TOPIC_SIZE;
+    }
+    memcpy(compressedTopic, GW_COMPRESSED_TOPIC_PREFIX, GW_COMPRESSED_TOPIC_PREFIX_SIZE);
+    memcpy(compressedTopic + GW_COMPRESSED_TOPIC_PREFIX_SIZE, topic, topicSize);
+    return GW_COMPRESSED_TOPIC_PREFIX_SIZE + topicSize;
+}
+
+/**
+* Returns 1 when a consumer subscribed to the compressed topic of a message.
+*/
+int
+gw_compressor_wants(gw_compressor_t *compressor, const void *data, size_t size)
+{
+    unsigned char topic[GW_COMPRESSED_TOPIC_PREFIX_SIZE + GW_MAX_COMPRESSED_TOPIC_SIZE];
+    size_t topicSize = compressed_topic(topic, data, size);
+
+    return gw_subscriptions_match(compressor->subscriptions, topic, topicSize) > 0;
+}
+
+/**
+* Hands a copy of a frame over to the workers, to be published under the compressed topic.
+* The copy shares the payload of the frame, which can still be sent afterwards.
+* Returns 1 if the frame is compressed, 0 if the workers can't keep up.
+*/
+int
+gw_compressor_offer(gw_compressor_t *compressor, const void *topic, size_t topicSize, zmq_msg_t *frame)
+{
+    unsigned char compressedTopic[GW_COMPRESSED_TOPIC_PREFIX_SIZE + GW_MAX_COMPRESSED_TOPIC_SIZE];
+    size_t size = compressed_topic(compressedTopic, topic, topicSize);
+
+    zmq_msg_t copy;
+    zmq_msg_init(&copy);
+    zmq_msg_copy(&copy, frame);
+    if (zmq_send(compressor->workers_input, compressedTopic, size, ZMQ_SNDMORE | ZMQ_DONTWAIT) == -1) {
+        zmq_msg_close(&copy);
+        GW_COUNTER_ADD(compressor->dropped, 1);
+        return 0;
+    }
+    // the second frame of a message is always accepted once the first one was
+    if (zmq_msg_send(&copy, compressor->workers_input, 0) == -1) {
+        zmq_msg_close(&copy);
+    }
+    return 1;
+}
+
+void *
+gw_compressor_results(gw_compressor_t *compressor)
+{
+    return compressor->workers_output;
+}
+
+size_t
+gw_compressor_topic_size(gw_compressor_t *compressor)
+{
+    return compressor->topic_size;
+}
+
+/**
+* Publishes up to maxMessages compressed messages sent back by the workers, without copying them.
+* A message whose topic the XPUB refuses is dropped whole, its frame isn't published on its own.
+* Returns the number of messages published.
+*/
+int
+gw_compressor_publish(gw_compressor_t *compressor, void *publisher, int maxMessages)
+{
+    int messages = 0;
+    int dropping = 0;
+    zmq_msg_t frame;
+
+    while (messages < maxMessages || dropping) {
+        zmq_msg_init(&frame);
+        // the frames of a message are queued at once by the workers
+        if (zmq_msg_recv(&frame, compressor->workers_output, dropping ? 0 : ZMQ_DONTWAIT) == -1) {
+            zmq_msg_close(&frame);
+            break;
+        }
+        int more = zmq_msg_more(&frame);
+        if (dropping || zmq_msg_send(&frame, publisher, (more ? ZMQ_SNDMORE : 0) | ZMQ_DONTWAIT) == -1) {
+            zmq_msg_close(&frame);
+            dropping = more;
+            if (!more) {
+                GW_COUNTER_ADD(compressor->dropped, 1);
+            }
+            continue;
+        }
+        if (!more) {
+            messages++;
+        }
+    }
+    return messages;
+}
+
+/**
+* Turns the subscription of a consumer to a compressed topic into a subscription to the raw topic, which is what the
+* gateway publishes. Returns 1 if the subscription was changed.
+*/
+int
+gw_compressor_strip_prefix(zmq_msg_t *subscription)
+{
+    const unsigned char *data = (const unsigned char *) zmq_msg_data(subscription);
+    size_t size = zmq_msg_size(subscription);
+
+    if (size < 1 + GW_COMPRESSED_TOPIC_PREFIX_SIZE || data[0] > 1
+            || memcmp(data + 1, GW_COMPRESSED_TOPIC_PREFIX, GW_COMPRESSED_TOPIC_PREFIX_SIZE) != 0) {
+        return 0;
+    }
+
+    zmq_msg_t stripped;
+    zmq_msg_init_size(&stripped, size - GW_COMPRESSED_TOPIC_PREFIX_SIZE);
+    unsigned char *strippedData = (unsigned char *) zmq_msg_data(&stripped);
+    strippedData[0] = data[0];
+    memcpy(strippedData + 1, data + 1 + GW_COMPRESSED_TOPIC_PREFIX_SIZE, size - 1 - GW_COMPRESSED_TOPIC_PREFIX_SIZE);
+
+    zmq_msg_close(subscription);
+    zmq_msg_init(subscription);
+    zmq_msg_move(subscription, &stripped);
+    return 1;
+}
+
+/**
+* Metrics collector for the compression workers.
+*/
+void
+gw_compressor_render(FILE *out, void *self)
+{
+    gw_compressor_t *compressor = (gw_compressor_t *) self;
+    uint64_t messages = 0, bytesIn = 0, bytesOut = 0, cpuNsecs = 0, failures = 0, loads = 0;
+    int i;
+
+    for (i = 0; i < compressor->worker_count; i++) {
+        gw_compression_worker_t *worker = &compressor->workers[i];
+        messages += GW_COUNTER_GET(worker->messages);
+        bytesIn += GW_COUNTER_GET(worker->bytes_in);
+        bytesOut += GW_COUNTER_GET(worker->bytes_out);
+        cpuNsecs += GW_COUNTER_GET(worker->cpu_nsecs);
+        failures += GW_COUNTER_GET(worker->failures);
+        loads += GW_COUNTER_GET(worker->dictionary_loads);
+    }
+
+    fprintf(out, "# TYPE gw_zmq_compressed_messages_total counter\ngw_zmq_compressed_messages_total %llu\n",
+            (unsigned long long) messages);
+    fprintf(out, "# TYPE gw_zmq_compression_bytes_in_total counter\ngw_zmq_compression_bytes_in_total %llu\n",
+            (unsigned long long) bytesIn);
+    fprintf(out, "# TYPE gw_zmq_compression_bytes_out_total counter\ngw_zmq_compression_bytes_out_total %llu\n",
+            (unsigned long long) bytesOut);
+    fprintf(out, "# TYPE gw_zmq_compression_ratio gauge\ngw_zmq_compression_ratio %.3f\n",
+            bytesOut > 0 ? (double) bytesIn / bytesOut : 0.0);
+    fprintf(out, "# TYPE gw_zmq_compression_cpu_seconds_total counter\ngw_zmq_compression_cpu_seconds_total %.6f\n",
+            cpuNsecs / 1e9);
+    fprintf(out, "# TYPE gw_zmq_compression_failures_total counter\ngw_zmq_compression_failures_total %llu\n",
+            (unsigned long long) failures);
+    fprintf(out, "# TYPE gw_zmq_compression_dropped_total counter\ngw_zmq_compression_dropped_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(compressor->dropped));
+    fprintf(out, "# TYPE gw_zmq_compression_dictionary_loads_total counter\ngw_zmq_compression_dictionary_loads_total %llu\n",
+            (unsigned long long) loads);
+}
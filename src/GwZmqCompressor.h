@@ -0,0 +1,71 @@
+#ifndef GW_COMPRESSOR_H
+#define GW_COMPRESSOR_H
+
+#include "czmq.h"
+#include "GwZmqSubscriptions.h"
+#include "GwZmqCompressed.h"
+
+/**
+* Consumers get compressed messages by subscribing to their topic prefixed with this; the others keep getting
+* raw messages.
+*/
+#define GW_COMPRESSED_TOPIC_PREFIX "~z/"
+
+#define GW_COMPRESSED_TOPIC_PREFIX_SIZE 3
+
+#define GW_MAX_COMPRESSED_TOPIC_SIZE 256
+
+#define DEFAULT_COMPRESSION_LEVEL 3
+
+#define DEFAULT_COMPRESSION_WORKERS 2
+
+#define GW_MAX_COMPRESSION_WORKERS 16
+
+/**
+* Internal endpoints between the thread owning the XPUB and the compression workers, %d is the listener id.
+*/
+#define DEFAULT_INPROC_COMPRESS_ENDPOINT "inproc://gateway/%d/compress/in"
+
+#define DEFAULT_INPROC_COMPRESSED_ENDPOINT "inproc://gateway/%d/compress/out"
+
+typedef struct _gw_compressor_t gw_compressor_t;
+
+/**
+* Compresses messages for the consumers which subscribed to compressed topics, on worker threads.
+*
+* When a consumer subscribed to the compressed topic of a message, the thread owning the XPUB offers it: a copy
+* sharing the same payload goes to a worker through an inproc PUSH socket. The workers compress it with the
+* dictionary, which they reload when the file changes, and send it back through an inproc PULL socket which the
+* thread owning the XPUB polls and publishes from.
+*
+* Requires libzstd ( HAVE_LIBZSTD ); gw_compressor_new returns NULL without it.
+*/
+gw_compressor_t *
+gw_compressor_new(zctx_t *ctx, int listenerId, int workers, int level, const char *dictionaryPath,
+                  gw_subscriptions_t *subscriptions, size_t topicSize);
+
+void
+gw_compressor_destroy(gw_compressor_t **compressor);
+
+int
+gw_compressor_wants(gw_compressor_t *compressor, const void *data, size_t size);
+
+int
+gw_compressor_offer(gw_compressor_t *compressor, const void *topic, size_t topicSize, zmq_msg_t *frame);
+
+void *
+gw_compressor_results(gw_compressor_t *compressor);
+
+int
+gw_compressor_publish(gw_compressor_t *compressor, void *publisher, int maxMessages);
+
+size_t
+gw_compressor_topic_size(gw_compressor_t *compressor);
+
+int
+gw_compressor_strip_prefix(zmq_msg_t *subscription);
+
+void
+gw_compressor_render(FILE *out, void *compressor);
+
+#endif
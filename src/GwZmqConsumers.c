@@ -0,0 +1,262 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqConsumers.h"
+#include "GwZmqAdaptor.h"
+#include "czmq.h"
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+
+typedef struct {
+    int fd;
+    char peer[128];
+    char endpoint[256];
+    int64_t accepted_at;
+    /** bytes waiting in the kernel send queue at the last sample */
+    int64_t queued;
+    /** consecutive samples above the threshold */
+    int over_threshold;
+    int slow;
+    /** messages the XPUB refused while the consumer was above the threshold */
+    uint64_t dropped;
+} gw_consumer_t;
+
+struct _gw_consumers_t {
+    pthread_mutex_t lock;
+    size_t slow_bytes;
+    int slow_samples;
+    gw_consumer_t *connections;
+    size_t count;
+    size_t capacity;
+    uint64_t slow_total;
+    /** refused messages no consumer above the threshold could be charged with */
+    uint64_t unattributed_dropped;
+};
+
+gw_consumers_t *
+gw_consumers_new(size_t slowBytes, int slowSamples)
+{
+    gw_consumers_t *consumers = (gw_consumers_t *) calloc(1, sizeof(gw_consumers_t));
+    assert( consumers );
+    consumers->slow_bytes = slowBytes;
+    consumers->slow_samples = slowSamples;
+    pthread_mutex_init(&consumers->lock, NULL);
+    return consumers;
+}
+
+void
+gw_consumers_destroy(gw_consumers_t **consumers)
+{
+    pthread_mutex_destroy(&(*consumers)->lock);
+    free((*consumers)->connections);
+    free(*consumers);
+    *consumers = NULL;
+}
+
+static void
+peer_address(int fd, char *peer, size_t size)
+{
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+
+    if (getpeername(fd, (struct sockaddr *) &address, &length) == -1) {
+        snprintf(peer, size, "unknown");
+    } else if (address.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *) &address;
+        char host[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        snprintf(peer, size, "%s:%d", host, ntohs(in->sin_port));
+    } else if (address.ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &address;
+        char host[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        snprintf(peer, size, "[%s]:%d", host, ntohs(in6->sin6_port));
+    } else {
+        // peers of ipc sockets are anonymous, the descriptor tells them apart
+        snprintf(peer, size, "ipc#%d", fd);
+    }
+}
+
+static void
+add_consumer(gw_consumers_t *consumers, int fd, const char *endpoint)
+{
+    pthread_mutex_lock(&consumers->lock);
+    if (consumers->count == consumers->capacity) {
+        consumers->capacity = consumers->capacity == 0 ? 16 : consumers->capacity * 2;
+        consumers->connections = (gw_consumer_t *) realloc(consumers->connections, consumers->capacity * sizeof(gw_consumer_t));
+        assert( consumers->connections );
+    }
+    gw_consumer_t *consumer = &consumers->connections[consumers->count++];
+    memset(consumer, 0, sizeof(gw_consumer_t));
+    consumer->fd = fd;
+    consumer->accepted_at = zclock_time();
+    peer_address(fd, consumer->peer, sizeof(consumer->peer));
+    snprintf(consumer->endpoint, sizeof(consumer->endpoint), "%s", endpoint);
+    pthread_mutex_unlock(&consumers->lock);
+}
+
+static void
+remove_consumer(gw_consumers_t *consumers, int fd)
+{
+    size_t i;
+
+    pthread_mutex_lock(&consumers->lock);
+    for (i = 0; i < consumers->count; i++) {
+        if (consumers->connections[i].fd == fd) {
+            consumers->connections[i] = consumers->connections[--consumers->count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&consumers->lock);
+}
+
+/**
+* Applies an event of the XPUB socket monitor: accepted connections are tracked until they're closed.
+*/
+void
+gw_consumers_event(gw_consumers_t *consumers, int event, int value, const char *endpoint)
+{
+    switch (event) {
+        case ZMQ_EVENT_ACCEPTED:
+            // a descriptor reused before its previous connection was reported as closed
+            remove_consumer(consumers, value);
+            add_consumer(consumers, value, endpoint);
+            break;
+        case ZMQ_EVENT_CLOSED:
+        case ZMQ_EVENT_DISCONNECTED:
+            remove_consumer(consumers, value);
+            break;
+    }
+}
+
+static int64_t
+queued_bytes(int fd)
+{
+#ifdef SIOCOUTQ
+    int queued = 0;
+    if (ioctl(fd, SIOCOUTQ, &queued) == 0) {
+        return queued;
+    }
+#endif
+    return -1;
+}
+
+/**
+* Samples the send queue of each consumer; egressBytesPerSec is the rate the XPUB is fed at, for the reports, and
+* refused the number of messages it refused since the previous sample.
+* Returns the number of consumers which became slow with this sample.
+*/
+int
+gw_consumers_sample(gw_consumers_t *consumers, double egressBytesPerSec, uint64_t refused)
+{
+    int becameSlow = 0;
+    int holdingUp = 0;
+    size_t i;
+
+    if (consumers->slow_bytes == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&consumers->lock);
+    for (i = 0; i < consumers->count; i++) {
+        gw_consumer_t *consumer = &consumers->connections[i];
+        int64_t previous = consumer->queued;
+        int64_t queued = queued_bytes(consumer->fd);
+
+        consumer->queued = queued;
+        if (queued < (int64_t) consumers->slow_bytes) {
+            if (consumer->slow) {
+                fprintf(stderr, "[%s] - Consumer %s on %s caught up, %lld bytes queued\n",
+                        timestamp(), consumer->peer, consumer->endpoint, (long long) queued);
+            }
+            consumer->over_threshold = 0;
+            consumer->slow = 0;
+            continue;
+        }
+
+        consumer->over_threshold++;
+        consumer->dropped += refused;
+        holdingUp++;
+        if (consumer->slow || consumer->over_threshold < consumers->slow_samples) {
+            continue;
+        }
+
+        consumer->slow = 1;
+        consumers->slow_total++;
+        becameSlow++;
+        fprintf(stderr, "[%s] - Slow consumer %s on %s: %lld bytes queued ( %+lld bytes/s ) for %d samples while the XPUB is fed %.0f bytes/s\n",
+                timestamp(), consumer->peer, consumer->endpoint, (long long) queued,
+                (long long) ((queued - previous) * 1000 / GW_CONSUMER_SAMPLE_INTERVAL_MSEC),
+                consumer->over_threshold, egressBytesPerSec);
+    }
+    if (holdingUp == 0) {
+        consumers->unattributed_dropped += refused;
+    }
+    pthread_mutex_unlock(&consumers->lock);
+    return becameSlow;
+}
+
+size_t
+gw_consumers_count(gw_consumers_t *consumers)
+{
+    pthread_mutex_lock(&consumers->lock);
+    size_t count = consumers->count;
+    pthread_mutex_unlock(&consumers->lock);
+    return count;
+}
+
+/**
+* Metrics collector rendering the queue of each consumer.
+*/
+void
+gw_consumers_render(FILE *out, void *self)
+{
+    gw_consumers_t *consumers = (gw_consumers_t *) self;
+    size_t i;
+
+    pthread_mutex_lock(&consumers->lock);
+    fprintf(out, "# HELP gw_zmq_consumer_queued_bytes Bytes waiting in the kernel send queue of the consumer\n"
+                 "# TYPE gw_zmq_consumer_queued_bytes gauge\n");
+    for (i = 0; i < consumers->count; i++) {
+        gw_consumer_t *consumer = &consumers->connections[i];
+        fprintf(out, "gw_zmq_consumer_queued_bytes{peer=\"%s\",socket=\"%s\"} %lld\n",
+                consumer->peer, consumer->endpoint, (long long) consumer->queued);
+    }
+    fprintf(out, "# TYPE gw_zmq_consumer_slow gauge\n");
+    for (i = 0; i < consumers->count; i++) {
+        gw_consumer_t *consumer = &consumers->connections[i];
+        fprintf(out, "gw_zmq_consumer_slow{peer=\"%s\",socket=\"%s\"} %d\n",
+                consumer->peer, consumer->endpoint, consumer->slow);
+    }
+    fprintf(out, "# HELP gw_zmq_consumer_dropped_total Messages the XPUB refused while the consumer was above the slow limit\n"
+                 "# TYPE gw_zmq_consumer_dropped_total counter\n");
+    for (i = 0; i < consumers->count; i++) {
+        gw_consumer_t *consumer = &consumers->connections[i];
+        fprintf(out, "gw_zmq_consumer_dropped_total{peer=\"%s\",socket=\"%s\"} %llu\n",
+                consumer->peer, consumer->endpoint, (unsigned long long) consumer->dropped);
+    }
+    fprintf(out, "# TYPE gw_zmq_consumers gauge\ngw_zmq_consumers %zu\n", consumers->count);
+    fprintf(out, "# TYPE gw_zmq_slow_consumers_total counter\ngw_zmq_slow_consumers_total %llu\n",
+            (unsigned long long) consumers->slow_total);
+    fprintf(out, "# TYPE gw_zmq_consumer_unattributed_dropped_total counter\ngw_zmq_consumer_unattributed_dropped_total %llu\n",
+            (unsigned long long) consumers->unattributed_dropped);
+    pthread_mutex_unlock(&consumers->lock);
+}
@@ -0,0 +1,49 @@
+#ifndef GW_CONSUMERS_H
+#define GW_CONSUMERS_H
+
+#include "czmq.h"
+
+/**
+* Default number of consecutive samples a consumer's queue has to stay above the threshold to be reported as slow.
+*/
+#define DEFAULT_SLOW_CONSUMER_SAMPLES 3
+
+/**
+* How often ( in milliseconds ) the queues of the consumers are sampled.
+*/
+#define GW_CONSUMER_SAMPLE_INTERVAL_MSEC 1000
+
+typedef struct _gw_consumers_t gw_consumers_t;
+
+/**
+* Tracks the connections of the consumers to the XPUB socket, as reported by its socket monitor.
+*
+* libzmq doesn't expose the pipe of each XPUB peer, so each connection is sampled on its file descriptor: the bytes
+* waiting in the kernel send queue tell how far behind the consumer is. A consumer whose queue stays above
+* slowBytes for slowSamples samples in a row is reported as slow. The descriptors belong to libzmq, which may close
+* and reuse them at any time, so they're only ever looked at, never acted upon.
+*
+* Nor does libzmq tell which pipe made the XPUB refuse a message with ZMQ_XPUB_NODROP: the messages refused between
+* two samples are charged to the consumers whose queue is above slowBytes, the ones holding the XPUB up.
+*
+* The tracker belongs to the monitor thread of the XPUB; the lock only protects it against the metrics reporter.
+*/
+gw_consumers_t *
+gw_consumers_new(size_t slowBytes, int slowSamples);
+
+void
+gw_consumers_destroy(gw_consumers_t **consumers);
+
+void
+gw_consumers_event(gw_consumers_t *consumers, int event, int value, const char *endpoint);
+
+int
+gw_consumers_sample(gw_consumers_t *consumers, double egressBytesPerSec, uint64_t refused);
+
+size_t
+gw_consumers_count(gw_consumers_t *consumers);
+
+void
+gw_consumers_render(FILE *out, void *consumers);
+
+#endif
@@ -0,0 +1,528 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqHandover.h"
+#include "czmq.h"
+#include <stddef.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/**
+* Connections a listening socket queues while nobody accepts them, as libzmq's default ZMQ_BACKLOG.
+*/
+#define GW_HANDOVER_BACKLOG 100
+
+/**
+* How often ( in milliseconds ) the handover thread checks if it should stop.
+*/
+#define GW_HANDOVER_POLL_MSEC 100
+
+/**
+* How long ( in milliseconds ) a process connecting to the handover path has to say what it wants.
+*/
+#define GW_HANDOVER_REQUEST_MSEC 1000
+
+#define GW_HANDOVER_MESSAGE_SIZE (GW_HANDOVER_MAX_SOCKETS * GW_HANDOVER_MAX_ENDPOINT_SIZE + 64)
+
+typedef struct {
+    char endpoint[GW_HANDOVER_MAX_ENDPOINT_SIZE];
+    int fd;
+} gw_handover_socket_t;
+
+/**
+* There's a single handover per process, shared by the modules binding the endpoints.
+*/
+static struct {
+    int enabled;
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    /** listening sockets of this process, handed over to the next one */
+    gw_handover_socket_t sockets[GW_HANDOVER_MAX_SOCKETS];
+    int socket_count;
+    /** listening sockets taken over from the previous process, -1 once they're bound again */
+    gw_handover_socket_t inherited[GW_HANDOVER_MAX_SOCKETS];
+    int inherited_count;
+    /** serves the path */
+    int listener;
+    /** connection of the process which took over, answered once this one is done */
+    int peer;
+    volatile int running;
+    volatile int taken_over;
+    int has_thread;
+    pthread_t thread;
+    void (*on_takeover)(void);
+} gw_handover;
+
+static socklen_t
+unix_address(const char *path, struct sockaddr_un *address)
+{
+    size_t length = strlen(path);
+    if (length == 0 || length >= sizeof(address->sun_path)) {
+        return 0;
+    }
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, path, length);
+    if (path[0] == '@') {
+        // abstract namespace, which libzmq sizes to the name
+        address->sun_path[0] = '\0';
+        return (socklen_t) (offsetof(struct sockaddr_un, sun_path) + length);
+    }
+    return (socklen_t) sizeof(*address);
+}
+
+static socklen_t
+tcp_address(const char *hostPort, struct sockaddr_storage *address)
+{
+    char host[GW_HANDOVER_MAX_ENDPOINT_SIZE];
+    const char *colon = strrchr(hostPort, ':');
+    if (colon == NULL || colon == hostPort || (size_t) (colon - hostPort) >= sizeof(host)) {
+        return 0;
+    }
+    int port = atoi(colon + 1);
+    if (port <= 0 || port > 65535) {
+        return 0;
+    }
+    memcpy(host, hostPort, colon - hostPort);
+    host[colon - hostPort] = '\0';
+
+    size_t hostLength = strlen(host);
+    if (hostLength > 2 && host[0] == '[' && host[hostLength - 1] == ']') {
+        struct sockaddr_in6 *v6 = (struct sockaddr_in6 *) address;
+        host[hostLength - 1] = '\0';
+        if (inet_pton(AF_INET6, host + 1, &v6->sin6_addr) != 1) {
+            return 0;
+        }
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons((uint16_t) port);
+        return (socklen_t) sizeof(*v6);
+    }
+    struct sockaddr_in *v4 = (struct sockaddr_in *) address;
+    if (strcmp(host, "*") == 0) {
+        v4->sin_addr.s_addr = htonl(INADDR_ANY);
+    } else if (inet_pton(AF_INET, host, &v4->sin_addr) != 1) {
+        // interface and host names are left to libzmq
+        return 0;
+    }
+    v4->sin_family = AF_INET;
+    v4->sin_port = htons((uint16_t) port);
+    return (socklen_t) sizeof(*v4);
+}
+
+/**
+* Creates the listening socket libzmq would create for a tcp:// or ipc:// endpoint.
+*/
+static int
+open_listener(const char *endpoint)
+{
+    struct sockaddr_storage address;
+    socklen_t length = 0;
+
+    memset(&address, 0, sizeof(address));
+    if (strncmp(endpoint, "ipc://", 6) == 0) {
+        length = unix_address(endpoint + 6, (struct sockaddr_un *) &address);
+        if (length > 0 && endpoint[6] != '@') {
+            // a file left by a process which is gone, as libzmq does
+            unlink(endpoint + 6);
+        }
+    } else if (strncmp(endpoint, "tcp://", 6) == 0) {
+        length = tcp_address(endpoint + 6, &address);
+    }
+    if (length == 0) {
+        return -1;
+    }
+
+    int fd = socket(address.ss_family, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (address.ss_family != AF_UNIX) {
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+    if (bind(fd, (struct sockaddr *) &address, length) == -1 || listen(fd, GW_HANDOVER_BACKLOG) == -1) {
+        fprintf(stderr, "Could not listen on %s for the handover: %s\n", endpoint, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+write_all(int fd, const char *text)
+{
+    size_t length = strlen(text);
+    while (length > 0) {
+        ssize_t written = write(fd, text, length);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        text += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+* Reads what the old process sends until it says it's done, keeping the descriptors passed along.
+*/
+static int
+take_over(int fd)
+{
+    char buffer[GW_HANDOVER_MESSAGE_SIZE];
+    size_t received = 0;
+    int fds[GW_HANDOVER_MAX_SOCKETS];
+    int fdCount = 0;
+    int64_t deadline = zclock_time() + GW_HANDOVER_TIMEOUT_MSEC;
+    int i;
+
+    if (write_all(fd, "TAKEOVER\n") == -1) {
+        fprintf(stderr, "Could not ask the process serving %s to hand over: %s\n", gw_handover.path, strerror(errno));
+        return -1;
+    }
+    fprintf(stderr, "Taking over from the process serving %s\n", gw_handover.path);
+
+    buffer[0] = '\0';
+    while (received < sizeof(buffer) - 1 && strstr(buffer, "RELEASED\n") == NULL) {
+        struct pollfd item = { fd, POLLIN, 0 };
+        int timeout = (int) (deadline - zclock_time());
+        if (timeout <= 0 || poll(&item, 1, timeout) == 0) {
+            fprintf(stderr, "The previous process didn't finish draining within %d ms\n", GW_HANDOVER_TIMEOUT_MSEC);
+            break;
+        }
+        union {
+            struct cmsghdr header;
+            char space[CMSG_SPACE(sizeof(int) * GW_HANDOVER_MAX_SOCKETS)];
+        } control;
+        struct iovec vector = { buffer + received, sizeof(buffer) - 1 - received };
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = control.space;
+        message.msg_controllen = sizeof(control.space);
+
+        ssize_t count = recvmsg(fd, &message, 0);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            // the old process exited
+            break;
+        }
+        received += count;
+        buffer[received] = '\0';
+
+        struct cmsghdr *header;
+        for (header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            int *passed = (int *) CMSG_DATA(header);
+            int passedCount = (int) ((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (i = 0; i < passedCount; i++) {
+                if (fdCount < GW_HANDOVER_MAX_SOCKETS) {
+                    fds[fdCount++] = passed[i];
+                } else {
+                    close(passed[i]);
+                }
+            }
+        }
+    }
+
+    if (strncmp(buffer, "SOCKETS ", 8) != 0) {
+        fprintf(stderr, "The process serving %s didn't hand anything over\n", gw_handover.path);
+        for (i = 0; i < fdCount; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+
+    // "SOCKETS n", then the endpoint of each descriptor on its own line
+    int count = atoi(buffer + 8);
+    char *line = strchr(buffer, '\n');
+    for (i = 0; i < fdCount; i++) {
+        char *end = line != NULL && i < count ? strchr(line + 1, '\n') : NULL;
+        if (end == NULL || end - line - 1 >= GW_HANDOVER_MAX_ENDPOINT_SIZE) {
+            close(fds[i]);
+            continue;
+        }
+        gw_handover_socket_t *inherited = &gw_handover.inherited[gw_handover.inherited_count++];
+        memcpy(inherited->endpoint, line + 1, end - line - 1);
+        inherited->endpoint[end - line - 1] = '\0';
+        inherited->fd = fds[i];
+        line = end;
+    }
+    fprintf(stderr, "Took %d listening sockets over\n", gw_handover.inherited_count);
+    return 1;
+}
+
+int
+gw_handover_init(const char *path)
+{
+    struct sockaddr_un address;
+    socklen_t length = unix_address(path, &address);
+    if (length == 0) {
+        fprintf(stderr, "Invalid handover path %s\n", path);
+        return -1;
+    }
+
+    memset(&gw_handover, 0, sizeof(gw_handover));
+    strcpy(gw_handover.path, path);
+    gw_handover.listener = -1;
+    gw_handover.peer = -1;
+    gw_handover.enabled = 1;
+#ifndef ZMQ_USE_FD
+    fprintf(stderr, "ZeroMQ %d.%d can't bind on a descriptor it's given ( ZMQ_USE_FD, ZeroMQ 4.2+ ), "
+            "the endpoints are bound again when the adaptor is restarted\n", ZMQ_VERSION_MAJOR, ZMQ_VERSION_MINOR);
+#endif
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &address, length) == -1) {
+        // nobody serves the path, this is the first process
+        close(fd);
+        return 0;
+    }
+    int result = take_over(fd);
+    close(fd);
+    return result;
+}
+
+int
+gw_handover_listen(const char *endpoint)
+{
+    int i;
+    if (!gw_handover.enabled || strlen(endpoint) >= GW_HANDOVER_MAX_ENDPOINT_SIZE) {
+        return -1;
+    }
+    for (i = 0; i < gw_handover.socket_count; i++) {
+        if (strcmp(gw_handover.sockets[i].endpoint, endpoint) == 0) {
+            return gw_handover.sockets[i].fd;
+        }
+    }
+    if (gw_handover.socket_count == GW_HANDOVER_MAX_SOCKETS) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (i = 0; i < gw_handover.inherited_count; i++) {
+        if (gw_handover.inherited[i].fd != -1 && strcmp(gw_handover.inherited[i].endpoint, endpoint) == 0) {
+            fd = gw_handover.inherited[i].fd;
+            gw_handover.inherited[i].fd = -1;
+            break;
+        }
+    }
+    if (fd == -1) {
+        fd = open_listener(endpoint);
+    }
+    if (fd == -1) {
+        return -1;
+    }
+    gw_handover_socket_t *socket = &gw_handover.sockets[gw_handover.socket_count++];
+    strcpy(socket->endpoint, endpoint);
+    socket->fd = fd;
+    return fd;
+}
+
+int
+gw_handover_bind(void *socket, const char *endpoint)
+{
+#ifdef ZMQ_USE_FD
+    int fd = gw_handover_listen(endpoint);
+    if (fd != -1) {
+        // libzmq closes the descriptor it's given when the endpoint is unbound, the handover keeps its own
+        int zmqFd = dup(fd);
+        if (zmqFd != -1) {
+            zmq_setsockopt(socket, ZMQ_USE_FD, &zmqFd, sizeof(zmqFd));
+        }
+        int result = zsocket_bind(socket, "%s", endpoint);
+        int none = -1;
+        zmq_setsockopt(socket, ZMQ_USE_FD, &none, sizeof(none));
+        return result;
+    }
+#endif
+    return zsocket_bind(socket, "%s", endpoint);
+}
+
+static int
+read_request(int peer)
+{
+    char request[16];
+    struct pollfd item = { peer, POLLIN, 0 };
+    if (poll(&item, 1, GW_HANDOVER_REQUEST_MSEC) <= 0) {
+        return 0;
+    }
+    ssize_t count = read(peer, request, sizeof(request) - 1);
+    if (count <= 0) {
+        return 0;
+    }
+    request[count] = '\0';
+    return strncmp(request, "TAKEOVER\n", 9) == 0;
+}
+
+static int
+hand_over(int peer)
+{
+    char buffer[GW_HANDOVER_MESSAGE_SIZE];
+    int fds[GW_HANDOVER_MAX_SOCKETS];
+    int i;
+
+    int length = snprintf(buffer, sizeof(buffer), "SOCKETS %d\n", gw_handover.socket_count);
+    for (i = 0; i < gw_handover.socket_count; i++) {
+        length += snprintf(buffer + length, sizeof(buffer) - length, "%s\n", gw_handover.sockets[i].endpoint);
+        fds[i] = gw_handover.sockets[i].fd;
+    }
+
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int) * GW_HANDOVER_MAX_SOCKETS)];
+    } control;
+    struct iovec vector = { buffer, (size_t) length };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    memset(&control, 0, sizeof(control));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    if (gw_handover.socket_count > 0) {
+        message.msg_control = control.space;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * gw_handover.socket_count);
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int) * gw_handover.socket_count);
+        memcpy(CMSG_DATA(header), fds, sizeof(int) * gw_handover.socket_count);
+    }
+
+    // the descriptors ride on the first byte, the rest of a short message follows in the same write
+    ssize_t sent = sendmsg(peer, &message, 0);
+    if (sent == -1) {
+        fprintf(stderr, "Could not hand the sockets over: %s\n", strerror(errno));
+        return -1;
+    }
+    buffer[length] = '\0';
+    return sent == length ? 0 : write_all(peer, buffer + sent);
+}
+
+static void *
+handover_thread(void *args)
+{
+    while (gw_handover.running && !gw_handover.taken_over) {
+        struct pollfd item = { gw_handover.listener, POLLIN, 0 };
+        if (poll(&item, 1, GW_HANDOVER_POLL_MSEC) <= 0) {
+            continue;
+        }
+        int peer = accept(gw_handover.listener, NULL, NULL);
+        if (peer == -1) {
+            continue;
+        }
+        if (read_request(peer) && hand_over(peer) == 0) {
+            fprintf(stderr, "Handed %d listening sockets over, draining\n", gw_handover.socket_count);
+            gw_handover.peer = peer;
+            gw_handover.taken_over = 1;
+            if (gw_handover.on_takeover != NULL) {
+                gw_handover.on_takeover();
+            }
+        } else {
+            close(peer);
+        }
+    }
+    return NULL;
+}
+
+int
+gw_handover_serve(void (*onTakeover)(void))
+{
+    int i;
+    if (!gw_handover.enabled) {
+        return -1;
+    }
+    for (i = 0; i < gw_handover.inherited_count; i++) {
+        if (gw_handover.inherited[i].fd != -1) {
+            fprintf(stderr, "%s isn't bound any more, closing the socket taken over for it\n",
+                    gw_handover.inherited[i].endpoint);
+            close(gw_handover.inherited[i].fd);
+            gw_handover.inherited[i].fd = -1;
+        }
+    }
+
+    struct sockaddr_un address;
+    socklen_t length = unix_address(gw_handover.path, &address);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (gw_handover.path[0] != '@') {
+        // left by the previous process
+        unlink(gw_handover.path);
+    }
+    if (bind(fd, (struct sockaddr *) &address, length) == -1 || listen(fd, 1) == -1) {
+        fprintf(stderr, "Could not serve the handover on %s: %s\n", gw_handover.path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    gw_handover.listener = fd;
+    gw_handover.on_takeover = onTakeover;
+    gw_handover.running = 1;
+    int result = pthread_create(&gw_handover.thread, NULL, handover_thread, NULL);
+    assert( result == 0 );
+    gw_handover.has_thread = 1;
+    return 0;
+}
+
+int
+gw_handover_taken_over(void)
+{
+    return gw_handover.taken_over;
+}
+
+void
+gw_handover_close(void)
+{
+    int i;
+    if (!gw_handover.enabled) {
+        return;
+    }
+    gw_handover.running = 0;
+    if (gw_handover.has_thread) {
+        pthread_join(gw_handover.thread, NULL);
+    }
+    if (gw_handover.taken_over) {
+        // the path belongs to the new process now
+        write_all(gw_handover.peer, "RELEASED\n");
+        close(gw_handover.peer);
+    } else if (gw_handover.listener != -1 && gw_handover.path[0] != '@') {
+        unlink(gw_handover.path);
+    }
+    if (gw_handover.listener != -1) {
+        close(gw_handover.listener);
+    }
+    for (i = 0; i < gw_handover.socket_count; i++) {
+        close(gw_handover.sockets[i].fd);
+    }
+    for (i = 0; i < gw_handover.inherited_count; i++) {
+        if (gw_handover.inherited[i].fd != -1) {
+            close(gw_handover.inherited[i].fd);
+        }
+    }
+    memset(&gw_handover, 0, sizeof(gw_handover));
+}
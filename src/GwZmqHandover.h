@@ -0,0 +1,68 @@
+#ifndef GW_HANDOVER_H
+#define GW_HANDOVER_H
+
+#include "czmq.h"
+
+/**
+* Listening sockets one process can hand over to the next one.
+*/
+#define GW_HANDOVER_MAX_SOCKETS 64
+
+#define GW_HANDOVER_MAX_ENDPOINT_SIZE 256
+
+/**
+* Longest time ( in milliseconds ) the new process waits for the old one to be done before starting anyway; the drain
+* of the old one has to fit in it.
+*/
+#define GW_HANDOVER_TIMEOUT_MSEC 30000
+
+/**
+* Hot restart of the adaptor: a new process takes the listening sockets over from the running one, which drains what
+* it already accepted and exits, so a deploy neither refuses connections nor loses the messages in flight.
+*
+* Both processes are given the same Unix socket path. The running one serves it; the new one finds it there when it
+* starts and sends "TAKEOVER". The running one answers "SOCKETS" with the endpoints it bound, passing their listening
+* descriptors along with SCM_RIGHTS, stops accepting new messages, drains the ones it holds to its consumers and
+* answers "RELEASED" before exiting. Only then does the new process open its spool and bind its endpoints, on the
+* descriptors it got: the connections made in between wait in their backlog instead of being refused, and the gateway
+* workers queue their messages on their side of the connection.
+*
+* libzmq can only bind on a descriptor it's given with ZMQ_USE_FD, from ZeroMQ 4.2. With an older libzmq nothing is
+* passed: the old process still drains before exiting, but the endpoints are bound again, and the peers connecting
+* in between retry at their reconnect interval.
+*
+* The descriptors are registered by the main thread while the listener starts, before gw_handover_serve.
+*/
+int
+gw_handover_init(const char *path);
+
+/**
+* Binds a socket to an endpoint, on a descriptor the process can hand over when hot restart is on.
+*/
+int
+gw_handover_bind(void *socket, const char *endpoint);
+
+/**
+* Listening descriptor of a tcp:// or ipc:// endpoint, the one taken over from the previous process if it had it,
+* or -1 when the endpoint isn't one a descriptor can be made for.
+*/
+int
+gw_handover_listen(const char *endpoint);
+
+/**
+* Serves the handover path once the process started; onTakeover is called from the handover thread when a new
+* process took the sockets over, and should make the process drain and exit.
+*/
+int
+gw_handover_serve(void (*onTakeover)(void));
+
+int
+gw_handover_taken_over(void);
+
+/**
+* Stops serving the path; once taken over, tells the new process it can go on.
+*/
+void
+gw_handover_close(void);
+
+#endif
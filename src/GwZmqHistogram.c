@@ -0,0 +1,140 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqHistogram.h"
+#include "GwZmqMetrics.h"
+#include "czmq.h"
+
+#define GW_HISTOGRAM_HALF_BUCKETS (GW_HISTOGRAM_SUB_BUCKETS / 2)
+
+struct _gw_histogram_t {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t counts[GW_HISTOGRAM_BUCKETS];
+} __attribute__((aligned(GW_CACHE_LINE_SIZE)));
+
+static const double gw_histogram_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+gw_histogram_t *
+gw_histogram_new()
+{
+    void *memory = NULL;
+    int result = posix_memalign(&memory, GW_CACHE_LINE_SIZE, sizeof(gw_histogram_t));
+    assert( result == 0 && memory );
+    memset(memory, 0, sizeof(gw_histogram_t));
+    return (gw_histogram_t *) memory;
+}
+
+void
+gw_histogram_destroy(gw_histogram_t **histogram)
+{
+    free(*histogram);
+    *histogram = NULL;
+}
+
+/**
+* Values below GW_HISTOGRAM_SUB_BUCKETS have their own bucket. A larger value is shifted right until it has
+* GW_HISTOGRAM_PRECISION_BITS bits, the top one being set: each shift adds half as many buckets, twice as wide.
+*/
+static int
+bucket_of(uint64_t value)
+{
+    if (value < GW_HISTOGRAM_SUB_BUCKETS) {
+        return (int) value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (GW_HISTOGRAM_PRECISION_BITS - 1);
+    return GW_HISTOGRAM_SUB_BUCKETS + (shift - 1) * GW_HISTOGRAM_HALF_BUCKETS
+            + (int) ((value >> shift) - GW_HISTOGRAM_HALF_BUCKETS);
+}
+
+/**
+* Highest value counted by a bucket.
+*/
+static uint64_t
+value_of(int bucket)
+{
+    if (bucket < GW_HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t) bucket;
+    }
+    int shift = (bucket - GW_HISTOGRAM_SUB_BUCKETS) / GW_HISTOGRAM_HALF_BUCKETS + 1;
+    uint64_t top = (bucket - GW_HISTOGRAM_SUB_BUCKETS) % GW_HISTOGRAM_HALF_BUCKETS + GW_HISTOGRAM_HALF_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+void
+gw_histogram_record(gw_histogram_t *histogram, uint64_t value)
+{
+    uint64_t limit = ((uint64_t) 1 << GW_HISTOGRAM_RANGE_BITS) - 1;
+    if (value > limit) {
+        value = limit;
+    }
+    GW_COUNTER_ADD(histogram->counts[bucket_of(value)], 1);
+    GW_COUNTER_ADD(histogram->count, 1);
+    GW_COUNTER_ADD(histogram->sum, value);
+    if (value > GW_COUNTER_GET(histogram->max)) {
+        GW_COUNTER_SET(histogram->max, value);
+    }
+}
+
+uint64_t
+gw_histogram_quantile(gw_histogram_t *histogram, double quantile)
+{
+    uint64_t count = GW_COUNTER_GET(histogram->count);
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (quantile * count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t cumulative = 0;
+    int bucket;
+    for (bucket = 0; bucket < GW_HISTOGRAM_BUCKETS; bucket++) {
+        cumulative += GW_COUNTER_GET(histogram->counts[bucket]);
+        if (cumulative >= rank) {
+            break;
+        }
+    }
+    uint64_t value = value_of(bucket < GW_HISTOGRAM_BUCKETS ? bucket : GW_HISTOGRAM_BUCKETS - 1);
+    uint64_t max = GW_COUNTER_GET(histogram->max);
+    return value < max ? value : max;
+}
+
+uint64_t
+gw_histogram_count(gw_histogram_t *histogram)
+{
+    return GW_COUNTER_GET(histogram->count);
+}
+
+uint64_t
+gw_histogram_max(gw_histogram_t *histogram)
+{
+    return GW_COUNTER_GET(histogram->max);
+}
+
+void
+gw_histogram_render(FILE *out, const char *name, const char *labels, gw_histogram_t *histogram)
+{
+    int i;
+    for (i = 0; i < (int) (sizeof(gw_histogram_quantiles) / sizeof(gw_histogram_quantiles[0])); i++) {
+        fprintf(out, "%s{%s,quantile=\"%g\"} %llu\n", name, labels, gw_histogram_quantiles[i],
+                (unsigned long long) gw_histogram_quantile(histogram, gw_histogram_quantiles[i]));
+    }
+    fprintf(out, "%s_sum{%s} %llu\n", name, labels, (unsigned long long) GW_COUNTER_GET(histogram->sum));
+    fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long) GW_COUNTER_GET(histogram->count));
+    fprintf(out, "%s_max{%s} %llu\n", name, labels, (unsigned long long) GW_COUNTER_GET(histogram->max));
+}
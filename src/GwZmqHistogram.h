@@ -0,0 +1,55 @@
+#ifndef GW_HISTOGRAM_H
+#define GW_HISTOGRAM_H
+
+#include "czmq.h"
+
+/**
+* Values are recorded with GW_HISTOGRAM_PRECISION_BITS significant bits, i.e. within 1 / 2^(bits - 1) = 3% of
+* their value, up to 2^GW_HISTOGRAM_RANGE_BITS - 1; larger values are recorded as that.
+*/
+#define GW_HISTOGRAM_PRECISION_BITS 6
+
+#define GW_HISTOGRAM_RANGE_BITS 40
+
+#define GW_HISTOGRAM_SUB_BUCKETS (1 << GW_HISTOGRAM_PRECISION_BITS)
+
+#define GW_HISTOGRAM_BUCKETS \
+    (GW_HISTOGRAM_SUB_BUCKETS + (GW_HISTOGRAM_RANGE_BITS - GW_HISTOGRAM_PRECISION_BITS) * (GW_HISTOGRAM_SUB_BUCKETS / 2))
+
+typedef struct _gw_histogram_t gw_histogram_t;
+
+/**
+* Histogram with a bounded relative error, in the spirit of HdrHistogram: values below GW_HISTOGRAM_SUB_BUCKETS are
+* counted exactly, larger ones in buckets whose width doubles with each power of 2, so the quantiles stay within a
+* few percent from microseconds to days with a fixed array of counters.
+* A histogram is recorded by a single thread and can be read by any thread.
+*/
+gw_histogram_t *
+gw_histogram_new();
+
+void
+gw_histogram_destroy(gw_histogram_t **histogram);
+
+void
+gw_histogram_record(gw_histogram_t *histogram, uint64_t value);
+
+/**
+* Returns the highest value equivalent to the one below which quantile of the recorded values fall, 0 when empty.
+*/
+uint64_t
+gw_histogram_quantile(gw_histogram_t *histogram, double quantile);
+
+uint64_t
+gw_histogram_count(gw_histogram_t *histogram);
+
+uint64_t
+gw_histogram_max(gw_histogram_t *histogram);
+
+/**
+* Renders the histogram as a Prometheus summary called name, with the 0.5, 0.9, 0.99 and 0.999 quantiles, followed
+* by a name_max gauge. labels is a comma separated list of label="value" pairs.
+*/
+void
+gw_histogram_render(FILE *out, const char *name, const char *labels, gw_histogram_t *histogram);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqAdaptor.h"
+#include "GwZmqMetrics.h"
+#include "czmq.h"
+
+/**
+* All the metrics currently registered. The lock is only taken when a thread registers its metrics,
+* when it goes away, and when the reporter renders them; never on the forwarding path.
+*/
+static gw_metrics_t *gw_metrics_registry = NULL;
+
+static pthread_mutex_t gw_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    gw_metrics_collector_fn *collector;
+    void *args;
+} gw_metrics_collector_t;
+
+static gw_metrics_collector_t gw_metrics_collectors[GW_METRICS_MAX_COLLECTORS];
+
+static int gw_metrics_collector_count = 0;
+
+struct _gw_metrics_reporter_t {
+    void *socket;
+    int http;
+    char endpoint[256];
+    volatile int running;
+    pthread_t thread;
+};
+
+gw_metrics_t *
+gw_metrics_new(const char *thread, const char *socket)
+{
+    void *memory = NULL;
+    int result = posix_memalign(&memory, GW_CACHE_LINE_SIZE, sizeof(gw_metrics_t));
+    assert( result == 0 && memory );
+
+    gw_metrics_t *metrics = (gw_metrics_t *) memory;
+    memset(metrics, 0, sizeof(gw_metrics_t));
+    snprintf(metrics->thread, sizeof(metrics->thread), "%s", thread);
+    snprintf(metrics->socket, sizeof(metrics->socket), "%s", socket);
+
+    pthread_mutex_lock(&gw_metrics_lock);
+    metrics->next = gw_metrics_registry;
+    gw_metrics_registry = metrics;
+    pthread_mutex_unlock(&gw_metrics_lock);
+
+    return metrics;
+}
+
+void
+gw_metrics_destroy(gw_metrics_t **metrics)
+{
+    pthread_mutex_lock(&gw_metrics_lock);
+    gw_metrics_t **link = &gw_metrics_registry;
+    while (*link != NULL && *link != *metrics) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = (*metrics)->next;
+    }
+    pthread_mutex_unlock(&gw_metrics_lock);
+
+    free(*metrics);
+    *metrics = NULL;
+}
+
+void
+gw_metrics_add_collector(gw_metrics_collector_fn *collector, void *args)
+{
+    pthread_mutex_lock(&gw_metrics_lock);
+    assert( gw_metrics_collector_count < GW_METRICS_MAX_COLLECTORS );
+    gw_metrics_collectors[gw_metrics_collector_count].collector = collector;
+    gw_metrics_collectors[gw_metrics_collector_count].args = args;
+    gw_metrics_collector_count++;
+    pthread_mutex_unlock(&gw_metrics_lock);
+}
+
+void
+gw_metrics_remove_collector(gw_metrics_collector_fn *collector, void *args)
+{
+    pthread_mutex_lock(&gw_metrics_lock);
+    int i;
+    for (i = 0; i < gw_metrics_collector_count; i++) {
+        if (gw_metrics_collectors[i].collector == collector && gw_metrics_collectors[i].args == args) {
+            gw_metrics_collectors[i] = gw_metrics_collectors[--gw_metrics_collector_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gw_metrics_lock);
+}
+
+static void
+render_counter(FILE *out, const char *name, const char *help, const char *type, size_t offset)
+{
+    gw_metrics_t *metrics;
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (metrics = gw_metrics_registry; metrics != NULL; metrics = metrics->next) {
+        uint64_t *counter = (uint64_t *) ((char *) metrics + offset);
+        fprintf(out, "%s{thread=\"%s\",socket=\"%s\"} %lld\n", name, metrics->thread, metrics->socket,
+                (long long) GW_COUNTER_GET(*counter));
+    }
+}
+
+static void
+render_batch_histogram(FILE *out)
+{
+    gw_metrics_t *metrics;
+    const char *name = "gw_zmq_batch_size";
+
+    fprintf(out, "# HELP %s Messages drained on each wakeup of a forwarding thread\n# TYPE %s histogram\n", name, name);
+    for (metrics = gw_metrics_registry; metrics != NULL; metrics = metrics->next) {
+        uint64_t cumulative = 0;
+        uint64_t bound = 1;
+        int bucket;
+
+        for (bucket = 0; bucket <= GW_METRICS_BATCH_BUCKETS; bucket++, bound <<= 2) {
+            cumulative += GW_COUNTER_GET(metrics->batch_buckets[bucket]);
+            if (bucket < GW_METRICS_BATCH_BUCKETS) {
+                fprintf(out, "%s_bucket{thread=\"%s\",socket=\"%s\",le=\"%llu\"} %llu\n", name, metrics->thread,
+                        metrics->socket, (unsigned long long) bound, (unsigned long long) cumulative);
+            } else {
+                fprintf(out, "%s_bucket{thread=\"%s\",socket=\"%s\",le=\"+Inf\"} %llu\n", name, metrics->thread,
+                        metrics->socket, (unsigned long long) cumulative);
+            }
+        }
+        fprintf(out, "%s_sum{thread=\"%s\",socket=\"%s\"} %llu\n", name, metrics->thread, metrics->socket,
+                (unsigned long long) GW_COUNTER_GET(metrics->messages_in));
+        fprintf(out, "%s_count{thread=\"%s\",socket=\"%s\"} %llu\n", name, metrics->thread, metrics->socket,
+                (unsigned long long) GW_COUNTER_GET(metrics->batches));
+    }
+}
+
+/**
+* Renders every registered metric in the Prometheus text exposition format.
+* The caller frees the returned buffer.
+*/
+char *
+gw_metrics_render(size_t *length)
+{
+    char *buffer = NULL;
+    FILE *out = open_memstream(&buffer, length);
+    assert( out );
+
+    pthread_mutex_lock(&gw_metrics_lock);
+    render_counter(out, "gw_zmq_messages_in_total", "Messages received", "counter", offsetof(gw_metrics_t, messages_in));
+    render_counter(out, "gw_zmq_bytes_in_total", "Bytes received", "counter", offsetof(gw_metrics_t, bytes_in));
+    render_counter(out, "gw_zmq_messages_out_total", "Messages forwarded", "counter", offsetof(gw_metrics_t, messages_out));
+    render_counter(out, "gw_zmq_bytes_out_total", "Bytes forwarded", "counter", offsetof(gw_metrics_t, bytes_out));
+    render_counter(out, "gw_zmq_dropped_hwm_total", "Messages refused at the high water mark ( the XPUB only refuses them with --xpub-nodrop )", "counter", offsetof(gw_metrics_t, dropped_hwm));
+    render_counter(out, "gw_zmq_dropped_unsubscribed_total", "Messages dropped because nobody subscribed to them", "counter", offsetof(gw_metrics_t, dropped_unsubscribed));
+    render_counter(out, "gw_zmq_dropped_rate_limited_total", "Messages dropped over the rate limit of their ingress endpoint", "counter", offsetof(gw_metrics_t, dropped_rate_limited));
+    render_counter(out, "gw_zmq_subscriptions", "Topics subscribed on the XPUB socket", "gauge", offsetof(gw_metrics_t, subscriptions));
+    render_counter(out, "gw_zmq_busy_microseconds_total", "Time spent forwarding messages", "counter", offsetof(gw_metrics_t, busy_usec));
+    render_counter(out, "gw_zmq_spin_microseconds_total", "Time spent polling for messages without sleeping", "counter", offsetof(gw_metrics_t, spin_usec));
+    render_counter(out, "gw_zmq_blocked_microseconds_total", "Time spent sleeping until messages arrive", "counter", offsetof(gw_metrics_t, blocked_usec));
+    render_counter(out, "gw_zmq_spin_budget_microseconds", "Time the thread polls for messages before sleeping", "gauge", offsetof(gw_metrics_t, spin_budget_usec));
+    render_batch_histogram(out);
+
+    int i;
+    for (i = 0; i < gw_metrics_collector_count; i++) {
+        gw_metrics_collectors[i].collector(out, gw_metrics_collectors[i].args);
+    }
+    pthread_mutex_unlock(&gw_metrics_lock);
+
+    fclose(out);
+    return buffer;
+}
+
+static void
+reply_http(void *socket, zmq_msg_t *identity, const char *body, size_t length)
+{
+    char header[256];
+    int headerLength = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+            length);
+
+    zmq_send(socket, zmq_msg_data(identity), zmq_msg_size(identity), ZMQ_SNDMORE);
+    zmq_send(socket, header, headerLength, ZMQ_SNDMORE);
+    zmq_send(socket, body, length, 0);
+
+    // an empty frame closes the connection
+    zmq_send(socket, zmq_msg_data(identity), zmq_msg_size(identity), ZMQ_SNDMORE);
+    zmq_send(socket, "", 0, 0);
+}
+
+/**
+* Serves the metrics: over HTTP ( ZMQ_STREAM ) for tcp endpoints so Prometheus can scrape them directly,
+* or as the reply of a REP socket for ipc and inproc endpoints.
+*/
+static void*
+metrics_reporter_thread(void *args)
+{
+    gw_metrics_reporter_t *reporter = (gw_metrics_reporter_t *) args;
+    zmq_pollitem_t items[] = { { reporter->socket, 0, ZMQ_POLLIN, 0 } };
+
+    while (reporter->running) {
+        if (zmq_poll(items, 1, GW_POLL_TIMEOUT_MSEC) == -1) {
+            if (zmq_errno() == ETERM) {
+                break;
+            }
+            continue;
+        }
+        if (!(items[0].revents & ZMQ_POLLIN)) {
+            continue;
+        }
+
+        zmq_msg_t identity;
+        zmq_msg_t request;
+        zmq_msg_init(&identity);
+        zmq_msg_init(&request);
+
+        if (reporter->http) {
+            if (zmq_msg_recv(&identity, reporter->socket, 0) != -1
+                    && zmq_msg_recv(&request, reporter->socket, 0) > 0
+                    && zmq_msg_size(&request) >= 4 && memcmp(zmq_msg_data(&request), "GET ", 4) == 0) {
+                size_t length;
+                char *body = gw_metrics_render(&length);
+                reply_http(reporter->socket, &identity, body, length);
+                free(body);
+            }
+        } else if (zmq_msg_recv(&request, reporter->socket, 0) != -1) {
+            while (zmq_msg_more(&request)) {
+                zmq_msg_recv(&request, reporter->socket, 0);
+            }
+            size_t length;
+            char *body = gw_metrics_render(&length);
+            zmq_send(reporter->socket, body, length, 0);
+            free(body);
+        }
+
+        zmq_msg_close(&identity);
+        zmq_msg_close(&request);
+    }
+    return NULL;
+}
+
+gw_metrics_reporter_t *
+gw_metrics_reporter_start(zctx_t *ctx, const char *endpoint)
+{
+    gw_metrics_reporter_t *reporter = (gw_metrics_reporter_t *) calloc(1, sizeof(gw_metrics_reporter_t));
+    assert( reporter );
+
+    reporter->http = strncmp(endpoint, "tcp://", 6) == 0;
+    reporter->running = 1;
+    snprintf(reporter->endpoint, sizeof(reporter->endpoint), "%s", endpoint);
+
+    reporter->socket = zsocket_new (ctx, reporter->http ? ZMQ_STREAM : ZMQ_REP);
+    int bindResult = zsocket_bind (reporter->socket, "%s", endpoint);
+    assert( bindResult >= 0 );
+
+    int result = pthread_create(&reporter->thread, NULL, metrics_reporter_thread, reporter);
+    assert( result == 0 );
+
+    return reporter;
+}
+
+void
+gw_metrics_reporter_stop(gw_metrics_reporter_t **reporter)
+{
+    (*reporter)->running = 0;
+    pthread_join((*reporter)->thread, NULL);
+    free(*reporter);
+    *reporter = NULL;
+}
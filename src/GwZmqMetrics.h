@@ -0,0 +1,106 @@
+#ifndef GW_METRICS_H
+#define GW_METRICS_H
+
+#include "czmq.h"
+
+#define GW_CACHE_LINE_SIZE 64
+
+/**
+* Upper bounds of the batch size histogram buckets; the last bucket is +Inf.
+*/
+#define GW_METRICS_BATCH_BUCKETS 7
+
+/**
+* Counters written by a single thread and read by others. The relaxed load/store pair compiles to a plain add
+* on the owning thread while still giving the reader a consistent value.
+*/
+#define GW_COUNTER_ADD(counter, value) \
+    __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (value), __ATOMIC_RELAXED)
+
+#define GW_COUNTER_SET(counter, value) __atomic_store_n(&(counter), (value), __ATOMIC_RELAXED)
+
+#define GW_COUNTER_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+typedef struct _gw_metrics_t gw_metrics_t;
+
+/**
+* Counters of one forwarding thread.
+* Each thread owns its own instance, aligned on a cache line, so updating them never bounces a cache line
+* between cores and doesn't need any lock or atomic read-modify-write.
+*/
+struct _gw_metrics_t {
+    uint64_t messages_in;
+    uint64_t bytes_in;
+    uint64_t messages_out;
+    uint64_t bytes_out;
+    /** messages the output socket refused because it reached its high water mark; the XPUB only refuses them with
+        ZMQ_XPUB_NODROP, by default libzmq drops them silently and they aren't counted */
+    uint64_t dropped_hwm;
+    /** messages dropped before the XPUB because no consumer subscribed to them */
+    uint64_t dropped_unsubscribed;
+    /** messages dropped because their ingress endpoint went over its rate limit */
+    uint64_t dropped_rate_limited;
+    /** distinct topics consumers subscribed to on the XPUB */
+    int64_t subscriptions;
+    uint64_t batches;
+    uint64_t batch_buckets[GW_METRICS_BATCH_BUCKETS + 1];
+    /** time spent forwarding, spinning for messages and blocked waiting for them, in microseconds */
+    uint64_t busy_usec;
+    uint64_t spin_usec;
+    uint64_t blocked_usec;
+    /** how long the thread spins before blocking, adapted to the arrival of the messages */
+    int64_t spin_budget_usec;
+    char thread[32];
+    char socket[256];
+    gw_metrics_t *next;
+} __attribute__((aligned(GW_CACHE_LINE_SIZE)));
+
+typedef struct _gw_metrics_reporter_t gw_metrics_reporter_t;
+
+/**
+* Renders additional metrics, i.e. the ones kept by a pipeline stage, after the counters of the threads.
+*/
+typedef void (gw_metrics_collector_fn) (FILE *out, void *args);
+
+#define GW_METRICS_MAX_COLLECTORS 32
+
+gw_metrics_t *
+gw_metrics_new(const char *thread, const char *socket);
+
+void
+gw_metrics_destroy(gw_metrics_t **metrics);
+
+/**
+* Records the number of messages drained on one wakeup.
+*/
+static inline void
+gw_metrics_record_batch(gw_metrics_t *metrics, uint64_t messages)
+{
+    int bucket = 0;
+    uint64_t bound = 1;
+
+    // buckets are powers of 4: 1, 4, 16, 64, 256, 1024, 4096, +Inf
+    while (bucket < GW_METRICS_BATCH_BUCKETS && messages > bound) {
+        bound <<= 2;
+        bucket++;
+    }
+    GW_COUNTER_ADD(metrics->batches, 1);
+    GW_COUNTER_ADD(metrics->batch_buckets[bucket], 1);
+}
+
+void
+gw_metrics_add_collector(gw_metrics_collector_fn *collector, void *args);
+
+void
+gw_metrics_remove_collector(gw_metrics_collector_fn *collector, void *args);
+
+char *
+gw_metrics_render(size_t *length);
+
+gw_metrics_reporter_t *
+gw_metrics_reporter_start(zctx_t *ctx, const char *endpoint);
+
+void
+gw_metrics_reporter_stop(gw_metrics_reporter_t **reporter);
+
+#endif
@@ -0,0 +1,437 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqMonitor.h"
+#include "GwZmqAdaptor.h"
+#include "GwZmqMetrics.h"
+#include "czmq.h"
+#include "time.h"
+
+/**
+* How often ( in milliseconds ) the logger drains the ring.
+*/
+#define GW_MONITOR_LOG_INTERVAL_MSEC 100
+
+/**
+* Minimum interval ( in milliseconds ) between two summaries of the events which weren't logged.
+*/
+#define GW_MONITOR_SUMMARY_INTERVAL_MSEC 1000
+
+#define GW_MONITOR_UNKNOWN_EVENT (GW_MONITOR_EVENT_TYPES - 1)
+
+/**
+* An event as written into the ring.
+*/
+typedef struct {
+    int64_t time;
+    int socket;
+    int event;
+    int value;
+    char address[GW_MONITOR_MAX_ADDRESS_SIZE];
+} gw_monitor_event_t;
+
+typedef struct {
+    char name[256];
+    /** inproc endpoint the socket monitor publishes its events on */
+    char endpoint[128];
+    /** PAIR connected to the endpoint, owned by the monitor thread */
+    void *pipe;
+    gw_monitor_event_fn *handler;
+    void *handler_args;
+    uint64_t events[GW_MONITOR_EVENT_TYPES];
+    /** connections opened or closed since the start of the churn window */
+    uint64_t churn_events;
+    /** connections opened or closed per second over the last window, in thousandths */
+    uint64_t churn_milli;
+} gw_monitored_socket_t;
+
+struct _gw_monitor_t {
+    zctx_t *ctx;
+    int log_rate;
+    volatile int running;
+    volatile int logging;
+    int started;
+    pthread_t thread;
+    pthread_t logger;
+    gw_monitored_socket_t sockets[GW_MONITOR_MAX_SOCKETS];
+    int socket_count;
+    gw_monitor_tick_fn *tick;
+    void *tick_args;
+    /** events the logger didn't keep up with */
+    uint64_t ring_dropped;
+    /** events over the log rate */
+    uint64_t log_suppressed;
+    /** records written by the monitor thread */
+    uint64_t head __attribute__((aligned(GW_CACHE_LINE_SIZE)));
+    /** records read by the logger thread */
+    uint64_t tail __attribute__((aligned(GW_CACHE_LINE_SIZE)));
+    gw_monitor_event_t ring[GW_MONITOR_RING_SIZE] __attribute__((aligned(GW_CACHE_LINE_SIZE)));
+};
+
+static const char *gw_monitor_event_names[GW_MONITOR_EVENT_TYPES] = {
+    "connected", "connect_delayed", "connect_retried", "listening", "bind_failed", "accepted", "accept_failed",
+    "closed", "close_failed", "disconnected", "monitor_stopped", "unknown"
+};
+
+gw_monitor_t *
+gw_monitor_new(zctx_t *ctx, int logRate)
+{
+    void *memory = NULL;
+    int result = posix_memalign(&memory, GW_CACHE_LINE_SIZE, sizeof(gw_monitor_t));
+    assert( result == 0 && memory );
+
+    gw_monitor_t *monitor = (gw_monitor_t *) memory;
+    memset(monitor, 0, sizeof(gw_monitor_t));
+    monitor->ctx = ctx;
+    monitor->log_rate = logRate;
+    return monitor;
+}
+
+void
+gw_monitor_destroy(gw_monitor_t **monitor)
+{
+    if ((*monitor)->started) {
+        (*monitor)->running = 0;
+        pthread_join((*monitor)->thread, NULL);
+        if ((*monitor)->log_rate > 0) {
+            // stopped after the monitor thread, so the logger sees its last events
+            (*monitor)->logging = 0;
+            pthread_join((*monitor)->logger, NULL);
+        }
+    }
+    free(*monitor);
+    *monitor = NULL;
+}
+
+/**
+* Starts the socket monitor of socket on endpoint. It has to be called before gw_monitor_start, and before the socket
+* is handed over to its forwarding thread. name labels the events of the socket, i.e. its address.
+* Returns the index of the socket in the monitor.
+*/
+int
+gw_monitor_add(gw_monitor_t *monitor, void *socket, const char *name, const char *endpoint)
+{
+    assert( !monitor->started && monitor->socket_count < GW_MONITOR_MAX_SOCKETS );
+    gw_monitored_socket_t *monitored = &monitor->sockets[monitor->socket_count];
+    snprintf(monitored->name, sizeof(monitored->name), "%s", name);
+    snprintf(monitored->endpoint, sizeof(monitored->endpoint), "%s", endpoint);
+
+    int result = zmq_socket_monitor(socket, endpoint, ZMQ_EVENT_ALL);
+    assert( result == 0 );
+    return monitor->socket_count++;
+}
+
+void
+gw_monitor_set_handler(gw_monitor_t *monitor, int socketIndex, gw_monitor_event_fn *handler, void *args)
+{
+    monitor->sockets[socketIndex].handler = handler;
+    monitor->sockets[socketIndex].handler_args = args;
+}
+
+/**
+* Sets a function called on the monitor thread at least every GW_POLL_TIMEOUT_MSEC.
+*/
+void
+gw_monitor_set_tick(gw_monitor_t *monitor, gw_monitor_tick_fn *tick, void *args)
+{
+    monitor->tick = tick;
+    monitor->tick_args = args;
+}
+
+/**
+* The ZMQ_EVENT_* codes are single bits, counted by the position of their bit.
+*/
+static int
+event_type(int event)
+{
+    if (event > 0 && (event & (event - 1)) == 0 && __builtin_ctz(event) < GW_MONITOR_UNKNOWN_EVENT) {
+        return __builtin_ctz(event);
+    }
+    return GW_MONITOR_UNKNOWN_EVENT;
+}
+
+const char *
+gw_monitor_event_name(int event)
+{
+    return gw_monitor_event_names[event_type(event)];
+}
+
+/**
+* Reads an event without waiting: a frame holding the event and its value, followed by a frame with the address.
+* Returns 0 on success, -1 when there's no event to read.
+*/
+static int
+read_event(void *pipe, zmq_event_t *event, char *address, size_t size)
+{
+    zmq_msg_t binary;
+    zmq_msg_init(&binary);
+    if (zmq_msg_recv(&binary, pipe, ZMQ_DONTWAIT) == -1) {
+        zmq_msg_close(&binary);
+        return -1;
+    }
+    const char *data = (const char *) zmq_msg_data(&binary);
+    memcpy(&event->event, data, sizeof(event->event));
+    memcpy(&event->value, data + sizeof(event->event), sizeof(event->value));
+    zmq_msg_close(&binary);
+
+    zmq_msg_t endpoint;
+    zmq_msg_init(&endpoint);
+    // both frames are delivered together
+    if (zmq_msg_recv(&endpoint, pipe, 0) == -1) {
+        zmq_msg_close(&endpoint);
+        return -1;
+    }
+    size_t length = zmq_msg_size(&endpoint) < size - 1 ? zmq_msg_size(&endpoint) : size - 1;
+    memcpy(address, zmq_msg_data(&endpoint), length);
+    address[length] = 0;
+    zmq_msg_close(&endpoint);
+    return 0;
+}
+
+static void
+record_event(gw_monitor_t *monitor, int index, zmq_event_t *event, const char *address)
+{
+    gw_monitored_socket_t *socket = &monitor->sockets[index];
+
+    GW_COUNTER_ADD(socket->events[event_type(event->event)], 1);
+    if (event->event == ZMQ_EVENT_ACCEPTED || event->event == ZMQ_EVENT_CONNECTED
+            || event->event == ZMQ_EVENT_DISCONNECTED) {
+        socket->churn_events++;
+    }
+    if (socket->handler != NULL) {
+        socket->handler(socket->handler_args, event->event, event->value, address);
+    }
+    if (monitor->log_rate == 0) {
+        return;
+    }
+
+    uint64_t head = monitor->head;
+    if (head - __atomic_load_n(&monitor->tail, __ATOMIC_ACQUIRE) == GW_MONITOR_RING_SIZE) {
+        GW_COUNTER_ADD(monitor->ring_dropped, 1);
+        return;
+    }
+    gw_monitor_event_t *record = &monitor->ring[head % GW_MONITOR_RING_SIZE];
+    record->time = zclock_time();
+    record->socket = index;
+    record->event = event->event;
+    record->value = event->value;
+    snprintf(record->address, sizeof(record->address), "%s", address);
+    __atomic_store_n(&monitor->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void
+update_churn(gw_monitor_t *monitor, int64_t elapsed)
+{
+    int i;
+    for (i = 0; i < monitor->socket_count; i++) {
+        gw_monitored_socket_t *socket = &monitor->sockets[i];
+        GW_COUNTER_SET(socket->churn_milli, socket->churn_events * 1000000 / elapsed);
+        socket->churn_events = 0;
+    }
+}
+
+static void*
+monitor_thread(void *args)
+{
+    gw_monitor_t *monitor = (gw_monitor_t *) args;
+    zmq_pollitem_t items[GW_MONITOR_MAX_SOCKETS];
+    char address[GW_MONITOR_MAX_ADDRESS_SIZE];
+    zmq_event_t event;
+    int i;
+
+    for (i = 0; i < monitor->socket_count; i++) {
+        gw_monitored_socket_t *socket = &monitor->sockets[i];
+        socket->pipe = zsocket_new(monitor->ctx, ZMQ_PAIR);
+        assert( socket->pipe );
+        int result = zmq_connect(socket->pipe, socket->endpoint);
+        assert( result == 0 );
+        zmq_pollitem_t item = { socket->pipe, 0, ZMQ_POLLIN, 0 };
+        items[i] = item;
+    }
+
+    int64_t churnAt = zclock_time();
+    while (monitor->running) {
+        if (monitor->tick != NULL) {
+            monitor->tick(monitor->tick_args);
+        }
+        int64_t now = zclock_time();
+        if (now - churnAt >= GW_MONITOR_CHURN_WINDOW_MSEC) {
+            update_churn(monitor, now - churnAt);
+            churnAt = now;
+        }
+
+        if (zmq_poll(items, monitor->socket_count, GW_POLL_TIMEOUT_MSEC) == -1) {
+            if (zmq_errno() == ETERM) {
+                break;
+            }
+            continue;
+        }
+        for (i = 0; i < monitor->socket_count; i++) {
+            if (!(items[i].revents & ZMQ_POLLIN)) {
+                continue;
+            }
+            while (read_event(monitor->sockets[i].pipe, &event, address, sizeof(address)) == 0) {
+                record_event(monitor, i, &event, address);
+            }
+        }
+    }
+
+    for (i = 0; i < monitor->socket_count; i++) {
+        zsocket_destroy(monitor->ctx, monitor->sockets[i].pipe);
+    }
+    return NULL;
+}
+
+/**
+* Formats a time like timestamp() does, without the static buffers asctime and localtime share with the other threads.
+*/
+static void
+format_time(int64_t time, char *buffer, size_t size)
+{
+    struct tm local;
+    time_t seconds = (time_t) (time / 1000);
+
+    localtime_r(&seconds, &local);
+    strftime(buffer, size, "%a %b %e %H:%M:%S %Y", &local);
+}
+
+static void
+log_event(FILE *out, gw_monitor_t *monitor, gw_monitor_event_t *record)
+{
+    char when[64];
+
+    format_time(record->time, when, sizeof(when));
+    fprintf(out, "[%s] - Socket %s: %s, value=%d, address=%s\n", when, monitor->sockets[record->socket].name,
+            gw_monitor_event_name(record->event), record->value, record->address);
+}
+
+/**
+* Drains the ring every GW_MONITOR_LOG_INTERVAL_MSEC. Events are logged while the token bucket, holding one second
+* worth of log_rate, has tokens; the others are summed up at most once per GW_MONITOR_SUMMARY_INTERVAL_MSEC.
+* Each drain is written to stderr at once.
+*/
+static void*
+logger_thread(void *args)
+{
+    gw_monitor_t *monitor = (gw_monitor_t *) args;
+    double tokens = monitor->log_rate;
+    int64_t refilledAt = zclock_time();
+    int64_t summarizedAt = refilledAt;
+    uint64_t suppressed = 0;
+
+    for (;;) {
+        int stopping = !monitor->logging;
+        if (!stopping) {
+            zclock_sleep(GW_MONITOR_LOG_INTERVAL_MSEC);
+        }
+
+        int64_t now = zclock_time();
+        tokens += (now - refilledAt) * monitor->log_rate / 1000.0;
+        if (tokens > monitor->log_rate) {
+            tokens = monitor->log_rate;
+        }
+        refilledAt = now;
+
+        char *buffer = NULL;
+        size_t length = 0;
+        FILE *out = open_memstream(&buffer, &length);
+        assert( out );
+
+        uint64_t head = __atomic_load_n(&monitor->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = monitor->tail;
+        for (; tail != head; tail++) {
+            if (tokens >= 1) {
+                tokens -= 1;
+                log_event(out, monitor, &monitor->ring[tail % GW_MONITOR_RING_SIZE]);
+            } else {
+                suppressed++;
+                GW_COUNTER_ADD(monitor->log_suppressed, 1);
+            }
+        }
+        __atomic_store_n(&monitor->tail, tail, __ATOMIC_RELEASE);
+
+        if (suppressed > 0 && (stopping || now - summarizedAt >= GW_MONITOR_SUMMARY_INTERVAL_MSEC)) {
+            char when[64];
+            format_time(now, when, sizeof(when));
+            fprintf(out, "[%s] - %llu socket events were not logged in the last %lldms, see gw_zmq_socket_events_total\n",
+                    when, (unsigned long long) suppressed, (long long) (now - summarizedAt));
+            suppressed = 0;
+            summarizedAt = now;
+        }
+        fclose(out);
+        if (length > 0) {
+            fwrite(buffer, 1, length, stderr);
+        }
+        free(buffer);
+
+        if (stopping) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+void
+gw_monitor_start(gw_monitor_t *monitor)
+{
+    monitor->running = 1;
+    monitor->started = 1;
+    int result = pthread_create(&monitor->thread, NULL, monitor_thread, monitor);
+    assert( result == 0 );
+
+    if (monitor->log_rate > 0) {
+        monitor->logging = 1;
+        result = pthread_create(&monitor->logger, NULL, logger_thread, monitor);
+        assert( result == 0 );
+    }
+}
+
+/**
+* Number of events of a type reported for a socket.
+*/
+uint64_t
+gw_monitor_events(gw_monitor_t *monitor, int socketIndex, int event)
+{
+    return GW_COUNTER_GET(monitor->sockets[socketIndex].events[event_type(event)]);
+}
+
+void
+gw_monitor_render(FILE *out, void *self)
+{
+    gw_monitor_t *monitor = (gw_monitor_t *) self;
+    int i, type;
+
+    fprintf(out, "# HELP gw_zmq_socket_events_total Events reported by the socket monitors\n"
+                 "# TYPE gw_zmq_socket_events_total counter\n");
+    for (i = 0; i < monitor->socket_count; i++) {
+        for (type = 0; type < GW_MONITOR_EVENT_TYPES; type++) {
+            uint64_t count = GW_COUNTER_GET(monitor->sockets[i].events[type]);
+            if (count > 0) {
+                fprintf(out, "gw_zmq_socket_events_total{socket=\"%s\",event=\"%s\"} %llu\n",
+                        monitor->sockets[i].name, gw_monitor_event_names[type], (unsigned long long) count);
+            }
+        }
+    }
+    fprintf(out, "# HELP gw_zmq_connection_churn Connections opened or closed per second over the last %ds\n"
+                 "# TYPE gw_zmq_connection_churn gauge\n", GW_MONITOR_CHURN_WINDOW_MSEC / 1000);
+    for (i = 0; i < monitor->socket_count; i++) {
+        fprintf(out, "gw_zmq_connection_churn{socket=\"%s\"} %.3f\n", monitor->sockets[i].name,
+                GW_COUNTER_GET(monitor->sockets[i].churn_milli) / 1000.0);
+    }
+    fprintf(out, "# TYPE gw_zmq_monitor_events_dropped_total counter\ngw_zmq_monitor_events_dropped_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(monitor->ring_dropped));
+    fprintf(out, "# TYPE gw_zmq_monitor_log_suppressed_total counter\ngw_zmq_monitor_log_suppressed_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(monitor->log_suppressed));
+}
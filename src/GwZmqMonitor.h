@@ -0,0 +1,81 @@
+#ifndef GW_MONITOR_H
+#define GW_MONITOR_H
+
+#include "czmq.h"
+
+/**
+* Default number of events logged per second; the others are only counted.
+*/
+#define DEFAULT_MONITOR_LOG_RATE 10
+
+/**
+* Sockets one monitor can watch: the XPUB and the XSUB of every shard.
+*/
+#define GW_MONITOR_MAX_SOCKETS 72
+
+/**
+* Event types counted separately: the ZMQ_EVENT_* bits, from ZMQ_EVENT_CONNECTED to ZMQ_EVENT_MONITOR_STOPPED,
+* plus one for the unknown ones.
+*/
+#define GW_MONITOR_EVENT_TYPES 12
+
+/**
+* Events waiting to be logged; when the logger falls behind, new events are counted but not logged.
+*/
+#define GW_MONITOR_RING_SIZE 1024
+
+/**
+* Connection churn is the number of connections opened and closed per second over this window ( in milliseconds ).
+*/
+#define GW_MONITOR_CHURN_WINDOW_MSEC 10000
+
+#define GW_MONITOR_MAX_ADDRESS_SIZE 128
+
+/**
+* Called on the monitor thread for each event of a socket.
+*/
+typedef void (gw_monitor_event_fn) (void *args, int event, int value, const char *address);
+
+/**
+* Called on the monitor thread about once per second.
+*/
+typedef void (gw_monitor_tick_fn) (void *args);
+
+typedef struct _gw_monitor_t gw_monitor_t;
+
+/**
+* Watches the socket monitors of a listener from a single thread.
+*
+* Each event is counted per socket and type, and written as a fixed size record into a single producer, single
+* consumer ring drained by a logger thread. The logger formats the records with thread safe time functions and logs
+* up to logRate of them per second, summing up the ones it skipped, so monitoring can stay on under heavy connection
+* churn without flooding stderr or slowing down the monitor thread. A logRate of 0 only counts the events.
+*/
+gw_monitor_t *
+gw_monitor_new(zctx_t *ctx, int logRate);
+
+void
+gw_monitor_destroy(gw_monitor_t **monitor);
+
+int
+gw_monitor_add(gw_monitor_t *monitor, void *socket, const char *name, const char *endpoint);
+
+void
+gw_monitor_set_handler(gw_monitor_t *monitor, int socketIndex, gw_monitor_event_fn *handler, void *args);
+
+void
+gw_monitor_set_tick(gw_monitor_t *monitor, gw_monitor_tick_fn *tick, void *args);
+
+void
+gw_monitor_start(gw_monitor_t *monitor);
+
+uint64_t
+gw_monitor_events(gw_monitor_t *monitor, int socketIndex, int event);
+
+const char *
+gw_monitor_event_name(int event);
+
+void
+gw_monitor_render(FILE *out, void *monitor);
+
+#endif
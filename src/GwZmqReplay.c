@@ -0,0 +1,652 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqReplay.h"
+#include "GwZmqMetrics.h"
+#include "GwZmqHandover.h"
+#include "czmq.h"
+
+#define GW_REPLAY_ENTRY_HEADER_SIZE 16
+/** more frames of the same message follow this one */
+#define GW_REPLAY_FLAG_MORE 1
+/** first frame of a message */
+#define GW_REPLAY_FLAG_FIRST 2
+/** frame of a message which was cancelled, or too large to be kept */
+#define GW_REPLAY_FLAG_VOID 4
+
+/**
+* Each frame is stored as this header followed by its bytes, padded to 8 bytes.
+*/
+typedef struct {
+    uint64_t sequence;
+    uint32_t size;
+    uint32_t flags;
+} gw_replay_entry_t;
+
+typedef struct {
+    /** bumped each time the slab is recycled, so replays notice their position is gone */
+    uint64_t generation;
+    size_t used;
+    /** sequence number of the first message starting in the slab, 0 if none does */
+    uint64_t first_sequence;
+    /** sequence number of the last message ending in the slab */
+    uint64_t last_sequence;
+    int64_t updated_at;
+} gw_slab_t;
+
+typedef struct {
+    int active;
+    zframe_t *identity;
+    /** last sequence number the consumer got */
+    uint64_t since;
+    /** position of the next entry to look at, valid while the slab keeps its generation */
+    int slab;
+    uint64_t generation;
+    size_t offset;
+    int prefix_count;
+    char prefixes[GW_REPLAY_MAX_PREFIXES][GW_REPLAY_MAX_PREFIX_SIZE];
+    size_t prefix_sizes[GW_REPLAY_MAX_PREFIXES];
+} gw_replay_session_t;
+
+struct _gw_replay_t {
+    zctx_t *ctx;
+    void *socket;
+    unsigned char *arena;
+    gw_slab_t *slabs;
+    int slab_count;
+    int window_secs;
+    /** slab being written */
+    int head;
+    /** slabs holding messages, the oldest one being used_slabs - 1 slabs before head */
+    int used_slabs;
+    int64_t now;
+
+    /** a message is being recorded */
+    int recording;
+    /** the frames left of a message too large for a slab are ignored */
+    int skipping;
+    int oversized;
+    /** where the message being recorded, or the last one committed, starts, to cancel it */
+    int start_slab;
+    size_t start_offset;
+    uint64_t start_first_sequence;
+    /** the last message can still be cancelled */
+    int committed;
+    uint64_t committed_last_sequence;
+
+    gw_replay_session_t sessions[GW_REPLAY_MAX_SESSIONS];
+
+    uint64_t last_sequence;
+    uint64_t oldest_sequence;
+    uint64_t stored_bytes;
+    uint64_t requests;
+    uint64_t replayed;
+    uint64_t gaps;
+    uint64_t skipped;
+    uint64_t refused;
+};
+
+static inline size_t
+entry_size(size_t size)
+{
+    return GW_REPLAY_ENTRY_HEADER_SIZE + ((size + 7) & ~((size_t) 7));
+}
+
+static inline gw_replay_entry_t *
+entry_at(gw_replay_t *replay, int slab, size_t offset)
+{
+    return (gw_replay_entry_t *) (replay->arena + (size_t) slab * GW_REPLAY_SLAB_SIZE + offset);
+}
+
+static inline int
+oldest_slab(gw_replay_t *replay)
+{
+    return (replay->head - replay->used_slabs + 1 + replay->slab_count) % replay->slab_count;
+}
+
+gw_replay_t *
+gw_replay_new(zctx_t *ctx, const char *endpoint, size_t windowBytes, int windowSecs)
+{
+    gw_replay_t *replay = (gw_replay_t *) calloc(1, sizeof(gw_replay_t));
+    assert( replay );
+    replay->ctx = ctx;
+    replay->window_secs = windowSecs;
+    replay->slab_count = (int) ((windowBytes + GW_REPLAY_SLAB_SIZE - 1) / GW_REPLAY_SLAB_SIZE);
+    if (replay->slab_count < 2) {
+        replay->slab_count = 2;
+    }
+
+    void *memory = NULL;
+    int result = posix_memalign(&memory, GW_CACHE_LINE_SIZE, (size_t) replay->slab_count * GW_REPLAY_SLAB_SIZE);
+    assert( result == 0 && memory );
+    // touched now so recording a message never faults a page in
+    memset(memory, 0, (size_t) replay->slab_count * GW_REPLAY_SLAB_SIZE);
+    replay->arena = (unsigned char *) memory;
+    replay->slabs = (gw_slab_t *) calloc(replay->slab_count, sizeof(gw_slab_t));
+    assert( replay->slabs );
+    replay->used_slabs = 1;
+    replay->now = zclock_time();
+    replay->slabs[0].updated_at = replay->now;
+
+    replay->socket = zsocket_new(ctx, ZMQ_ROUTER);
+    assert( replay->socket );
+    // a consumer which can't keep up makes the replay wait instead of losing messages
+    int mandatory = 1;
+    zmq_setsockopt(replay->socket, ZMQ_ROUTER_MANDATORY, &mandatory, sizeof(mandatory));
+    if (gw_handover_bind(replay->socket, endpoint) < 0) {
+        fprintf(stderr, "Could not bind the replay endpoint %s: %s\n", endpoint, zmq_strerror(zmq_errno()));
+        zsocket_destroy(ctx, replay->socket);
+        free(replay->slabs);
+        free(replay->arena);
+        free(replay);
+        return NULL;
+    }
+    return replay;
+}
+
+void
+gw_replay_destroy(gw_replay_t **replay)
+{
+    gw_replay_t *self = *replay;
+    int i;
+    for (i = 0; i < GW_REPLAY_MAX_SESSIONS; i++) {
+        if (self->sessions[i].identity != NULL) {
+            zframe_destroy(&self->sessions[i].identity);
+        }
+    }
+    zsocket_destroy(self->ctx, self->socket);
+    free(self->slabs);
+    free(self->arena);
+    free(self);
+    *replay = NULL;
+}
+
+/**
+* Sequence number of the first message the window still holds.
+*/
+static void
+update_oldest_sequence(gw_replay_t *replay)
+{
+    int i;
+    for (i = 0; i < replay->used_slabs; i++) {
+        gw_slab_t *slab = &replay->slabs[(oldest_slab(replay) + i) % replay->slab_count];
+        if (slab->first_sequence != 0) {
+            GW_COUNTER_SET(replay->oldest_sequence, slab->first_sequence);
+            return;
+        }
+    }
+    GW_COUNTER_SET(replay->oldest_sequence, 0);
+}
+
+static void
+recycle_slab(gw_replay_t *replay, int index)
+{
+    gw_slab_t *slab = &replay->slabs[index];
+    GW_COUNTER_ADD(replay->stored_bytes, -slab->used);
+    slab->generation++;
+    slab->used = 0;
+    slab->first_sequence = 0;
+    slab->last_sequence = 0;
+    slab->updated_at = replay->now;
+}
+
+/**
+* Moves on to the next slab, recycling the oldest one when they're all used.
+*/
+static void
+advance_slab(gw_replay_t *replay)
+{
+    int next = (replay->head + 1) % replay->slab_count;
+    if (replay->used_slabs == replay->slab_count) {
+        // the oldest slab, never the one a message being recorded starts in
+        replay->used_slabs--;
+    }
+    recycle_slab(replay, next);
+    replay->head = next;
+    replay->used_slabs++;
+    update_oldest_sequence(replay);
+}
+
+/**
+* Flags the frames recorded since the beginning of the last message so replays skip them.
+*/
+static void
+void_last_message(gw_replay_t *replay)
+{
+    int slab = replay->start_slab;
+    size_t offset = replay->start_offset;
+
+    while (slab != replay->head || offset < replay->slabs[slab].used) {
+        if (offset >= replay->slabs[slab].used) {
+            slab = (slab + 1) % replay->slab_count;
+            offset = 0;
+            continue;
+        }
+        gw_replay_entry_t *entry = entry_at(replay, slab, offset);
+        entry->flags |= GW_REPLAY_FLAG_VOID;
+        offset += entry_size(entry->size);
+    }
+}
+
+/**
+* Records a frame of the message being published; more tells whether other frames of the same message follow.
+* The message gets its sequence number from gw_replay_commit, once its last frame is recorded.
+* Returns 0 on success or -1 when the message is too large to be kept, in which case it still gets a sequence number.
+*/
+int
+gw_replay_append(gw_replay_t *replay, const void *data, size_t size, int more)
+{
+    int first = !replay->recording;
+    if (first) {
+        replay->recording = 1;
+        replay->oversized = 0;
+        replay->committed = 0;
+    }
+    if (replay->skipping) {
+        replay->skipping = more;
+        return -1;
+    }
+
+    size_t needed = entry_size(size);
+    if (needed > GW_REPLAY_SLAB_SIZE) {
+        if (!first) {
+            void_last_message(replay);
+        }
+        replay->oversized = 1;
+        replay->skipping = more;
+        return -1;
+    }
+
+    gw_slab_t *slab = &replay->slabs[replay->head];
+    if (slab->used + needed > GW_REPLAY_SLAB_SIZE) {
+        advance_slab(replay);
+        slab = &replay->slabs[replay->head];
+    }
+    if (first) {
+        replay->start_slab = replay->head;
+        replay->start_offset = slab->used;
+        replay->start_first_sequence = slab->first_sequence;
+    }
+
+    gw_replay_entry_t *entry = entry_at(replay, replay->head, slab->used);
+    entry->sequence = replay->last_sequence + 1;
+    entry->size = (uint32_t) size;
+    entry->flags = (more ? GW_REPLAY_FLAG_MORE : 0) | (first ? GW_REPLAY_FLAG_FIRST : 0);
+    memcpy((unsigned char *) entry + GW_REPLAY_ENTRY_HEADER_SIZE, data, size);
+    slab->used += needed;
+    GW_COUNTER_ADD(replay->stored_bytes, needed);
+    return 0;
+}
+
+/**
+* Ends the message recorded with gw_replay_append. Returns its sequence number.
+*/
+uint64_t
+gw_replay_commit(gw_replay_t *replay)
+{
+    uint64_t sequence = replay->last_sequence + 1;
+
+    if (replay->oversized) {
+        GW_COUNTER_ADD(replay->skipped, 1);
+    } else {
+        gw_slab_t *start = &replay->slabs[replay->start_slab];
+        if (start->first_sequence == 0) {
+            start->first_sequence = sequence;
+        }
+        replay->committed_last_sequence = replay->slabs[replay->head].last_sequence;
+        replay->slabs[replay->head].last_sequence = sequence;
+        replay->slabs[replay->head].updated_at = replay->now;
+        if (GW_COUNTER_GET(replay->oldest_sequence) == 0) {
+            GW_COUNTER_SET(replay->oldest_sequence, sequence);
+        }
+    }
+    GW_COUNTER_SET(replay->last_sequence, sequence);
+    replay->recording = 0;
+    replay->skipping = 0;
+    replay->committed = 1;
+    return sequence;
+}
+
+/**
+* Forgets the message being recorded, or the one just committed when none is, i.e. because it's spooled instead
+* of being published. Its sequence number goes to the next message.
+*/
+void
+gw_replay_cancel(gw_replay_t *replay)
+{
+    if (!replay->recording && !replay->committed) {
+        return;
+    }
+    if (!replay->oversized) {
+        void_last_message(replay);
+        replay->slabs[replay->start_slab].first_sequence = replay->start_first_sequence;
+        if (replay->committed) {
+            replay->slabs[replay->head].last_sequence = replay->committed_last_sequence;
+            if (GW_COUNTER_GET(replay->oldest_sequence) == replay->last_sequence) {
+                update_oldest_sequence(replay);
+            }
+        }
+    } else if (replay->committed) {
+        GW_COUNTER_ADD(replay->skipped, -1);
+    }
+    if (replay->committed) {
+        GW_COUNTER_SET(replay->last_sequence, replay->last_sequence - 1);
+    }
+    replay->recording = 0;
+    replay->skipping = 0;
+    replay->committed = 0;
+}
+
+/**
+* Builds the sequence frame ( see GW_SEQUENCE_MAGIC ) ending a published message.
+*/
+void
+gw_replay_sequence_frame(zmq_msg_t *frame, uint64_t sequence)
+{
+    zmq_msg_init_size(frame, GW_SEQUENCE_FRAME_SIZE);
+    unsigned char *data = (unsigned char *) zmq_msg_data(frame);
+    memcpy(data, GW_SEQUENCE_MAGIC, 4);
+    int i;
+    for (i = 11; i >= 4; i--) {
+        data[i] = (unsigned char) sequence;
+        sequence >>= 8;
+    }
+}
+
+void *
+gw_replay_socket(gw_replay_t *replay)
+{
+    return replay->socket;
+}
+
+uint64_t
+gw_replay_last_sequence(gw_replay_t *replay)
+{
+    return GW_COUNTER_GET(replay->last_sequence);
+}
+
+static void
+reply(gw_replay_t *replay, zframe_t *identity, const char *word, uint64_t sequence)
+{
+    char number[32];
+    snprintf(number, sizeof(number), "%llu", (unsigned long long) sequence);
+    if (zmq_send(replay->socket, zframe_data(identity), zframe_size(identity), ZMQ_SNDMORE | ZMQ_DONTWAIT) == -1) {
+        return;
+    }
+    zmq_send(replay->socket, word, strlen(word), ZMQ_SNDMORE | ZMQ_DONTWAIT);
+    zmq_send(replay->socket, number, strlen(number), ZMQ_DONTWAIT);
+}
+
+/**
+* Positions a session on the first message it asked for, telling the consumer when some already left the window.
+*/
+static void
+locate(gw_replay_t *replay, gw_replay_session_t *session)
+{
+    int oldest = oldest_slab(replay);
+    int found = -1;
+    int i;
+    for (i = 0; i < replay->used_slabs; i++) {
+        int index = (oldest + i) % replay->slab_count;
+        uint64_t first = replay->slabs[index].first_sequence;
+        if (first != 0 && first <= session->since + 1) {
+            found = index;
+        }
+    }
+
+    uint64_t available = GW_COUNTER_GET(replay->oldest_sequence);
+    if (available == 0) {
+        available = replay->last_sequence + 1;
+    }
+    if (session->since + 1 < available) {
+        GW_COUNTER_ADD(replay->gaps, 1);
+        reply(replay, session->identity, "GAP", available);
+        session->since = available - 1;
+    }
+    session->slab = found >= 0 ? found : oldest;
+    session->generation = replay->slabs[session->slab].generation;
+    session->offset = 0;
+}
+
+static void
+close_session(gw_replay_session_t *session)
+{
+    zframe_destroy(&session->identity);
+    session->active = 0;
+}
+
+/**
+* Reads a replay request from the snapshot socket and opens a session for it.
+* Returns 0, or -1 when the request couldn't be read in which case zmq_errno() tells why.
+*/
+int
+gw_replay_handle_request(gw_replay_t *replay)
+{
+    zmsg_t *request = zmsg_recv(replay->socket);
+    if (request == NULL) {
+        return -1;
+    }
+    GW_COUNTER_ADD(replay->requests, 1);
+
+    zframe_t *identity = zmsg_pop(request);
+    zframe_t *command = zmsg_pop(request);
+    zframe_t *since = zmsg_pop(request);
+    if (identity == NULL || command == NULL || since == NULL || !zframe_streq(command, "SINCE")
+            || zmsg_size(request) > GW_REPLAY_MAX_PREFIXES) {
+        if (identity != NULL) {
+            reply(replay, identity, "ERROR", 0);
+        }
+    } else {
+        gw_replay_session_t *session = NULL;
+        int i;
+        for (i = 0; i < GW_REPLAY_MAX_SESSIONS && session == NULL; i++) {
+            if (!replay->sessions[i].active) {
+                session = &replay->sessions[i];
+            }
+        }
+        if (session == NULL) {
+            GW_COUNTER_ADD(replay->refused, 1);
+            reply(replay, identity, "BUSY", replay->last_sequence);
+        } else {
+            char *number = zframe_strdup(since);
+            session->since = strtoull(number, NULL, 10);
+            free(number);
+            session->prefix_count = 0;
+            zframe_t *prefix;
+            while ((prefix = zmsg_pop(request)) != NULL) {
+                size_t size = zframe_size(prefix);
+                if (size > GW_REPLAY_MAX_PREFIX_SIZE) {
+                    size = GW_REPLAY_MAX_PREFIX_SIZE;
+                }
+                memcpy(session->prefixes[session->prefix_count], zframe_data(prefix), size);
+                session->prefix_sizes[session->prefix_count++] = size;
+                zframe_destroy(&prefix);
+            }
+            session->identity = identity;
+            identity = NULL;
+            session->active = 1;
+            locate(replay, session);
+        }
+    }
+
+    if (identity != NULL) {
+        zframe_destroy(&identity);
+    }
+    zframe_destroy(&command);
+    zframe_destroy(&since);
+    zmsg_destroy(&request);
+    return 0;
+}
+
+static int
+matches(gw_replay_session_t *session, gw_replay_entry_t *entry)
+{
+    if (session->prefix_count == 0) {
+        return 1;
+    }
+    const unsigned char *data = (const unsigned char *) entry + GW_REPLAY_ENTRY_HEADER_SIZE;
+    int i;
+    for (i = 0; i < session->prefix_count; i++) {
+        if (entry->size >= session->prefix_sizes[i] && memcmp(data, session->prefixes[i], session->prefix_sizes[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+* Moves a position to the next entry, crossing over to the next slab at the end of one.
+*/
+static void
+next_entry(gw_replay_t *replay, int *slab, size_t *offset)
+{
+    *offset += entry_size(entry_at(replay, *slab, *offset)->size);
+    if (*offset >= replay->slabs[*slab].used && *slab != replay->head) {
+        *slab = (*slab + 1) % replay->slab_count;
+        *offset = 0;
+    }
+}
+
+/**
+* Sends the message starting at the position of a session.
+* Returns 0 when it's sent, or -1 when the consumer can't take it yet or is gone, in which case zmq_errno() tells why.
+*/
+static int
+send_message(gw_replay_t *replay, gw_replay_session_t *session, gw_replay_entry_t *entry)
+{
+    if (zmq_send(replay->socket, zframe_data(session->identity), zframe_size(session->identity),
+                 ZMQ_SNDMORE | ZMQ_DONTWAIT) == -1) {
+        return -1;
+    }
+    char number[32];
+    snprintf(number, sizeof(number), "%llu", (unsigned long long) entry->sequence);
+    zmq_send(replay->socket, "MSG", 3, ZMQ_SNDMORE);
+    zmq_send(replay->socket, number, strlen(number), ZMQ_SNDMORE);
+
+    int slab = session->slab;
+    size_t offset = session->offset;
+    for (;;) {
+        entry = entry_at(replay, slab, offset);
+        int more = entry->flags & GW_REPLAY_FLAG_MORE;
+        zmq_send(replay->socket, (unsigned char *) entry + GW_REPLAY_ENTRY_HEADER_SIZE, entry->size,
+                 more ? ZMQ_SNDMORE : 0);
+        next_entry(replay, &slab, &offset);
+        if (!more) {
+            break;
+        }
+    }
+    session->slab = slab;
+    session->offset = offset;
+    session->generation = replay->slabs[slab].generation;
+    return 0;
+}
+
+static void
+serve_session(gw_replay_t *replay, gw_replay_session_t *session, int maxMessages)
+{
+    int sent = 0;
+
+    while (sent < maxMessages) {
+        if (session->generation != replay->slabs[session->slab].generation) {
+            // recycled while the consumer was catching up
+            locate(replay, session);
+        }
+        gw_slab_t *slab = &replay->slabs[session->slab];
+        if (session->offset >= slab->used) {
+            if (session->slab == replay->head) {
+                // every message up to the last one was looked at, even those not matching the prefixes
+                reply(replay, session->identity, "END", replay->last_sequence);
+                close_session(session);
+                break;
+            }
+            session->slab = (session->slab + 1) % replay->slab_count;
+            session->generation = replay->slabs[session->slab].generation;
+            session->offset = 0;
+            continue;
+        }
+
+        gw_replay_entry_t *entry = entry_at(replay, session->slab, session->offset);
+        if (!(entry->flags & GW_REPLAY_FLAG_FIRST) || (entry->flags & GW_REPLAY_FLAG_VOID)
+                || entry->sequence <= session->since || !matches(session, entry)) {
+            // the following frames of a skipped message aren't first frames, so they're skipped too
+            next_entry(replay, &session->slab, &session->offset);
+            session->generation = replay->slabs[session->slab].generation;
+            continue;
+        }
+
+        uint64_t sequence = entry->sequence;
+        if (send_message(replay, session, entry) == -1) {
+            if (zmq_errno() != EAGAIN) {
+                close_session(session);
+            }
+            break;
+        }
+        session->since = sequence;
+        sent++;
+    }
+    GW_COUNTER_ADD(replay->replayed, sent);
+}
+
+/**
+* Recycles the slabs older than the window, then sends up to maxMessages messages to each consumer catching up.
+* Called by the thread owning the XPUB each time it wakes up, between two batches.
+* Returns 1 when consumers are still catching up, in which case the caller polls without waiting.
+*/
+int
+gw_replay_serve(gw_replay_t *replay, int maxMessages)
+{
+    replay->now = zclock_time();
+    replay->committed = 0;
+
+    int64_t expiredBefore = replay->now - (int64_t) replay->window_secs * 1000;
+    while (replay->used_slabs > 1 && replay->slabs[oldest_slab(replay)].updated_at < expiredBefore) {
+        recycle_slab(replay, oldest_slab(replay));
+        replay->used_slabs--;
+        update_oldest_sequence(replay);
+    }
+
+    int pending = 0;
+    int i;
+    for (i = 0; i < GW_REPLAY_MAX_SESSIONS; i++) {
+        if (replay->sessions[i].active) {
+            serve_session(replay, &replay->sessions[i], maxMessages);
+            pending |= replay->sessions[i].active;
+        }
+    }
+    return pending;
+}
+
+void
+gw_replay_render(FILE *out, void *self)
+{
+    gw_replay_t *replay = (gw_replay_t *) self;
+
+    fprintf(out, "# TYPE gw_zmq_replay_last_sequence gauge\ngw_zmq_replay_last_sequence %llu\n",
+            (unsigned long long) GW_COUNTER_GET(replay->last_sequence));
+    fprintf(out, "# TYPE gw_zmq_replay_oldest_sequence gauge\ngw_zmq_replay_oldest_sequence %llu\n",
+            (unsigned long long) GW_COUNTER_GET(replay->oldest_sequence));
+    fprintf(out, "# TYPE gw_zmq_replay_window_bytes gauge\ngw_zmq_replay_window_bytes %llu\n",
+            (unsigned long long) GW_COUNTER_GET(replay->stored_bytes));
+    fprintf(out, "# TYPE gw_zmq_replay_requests_total counter\ngw_zmq_replay_requests_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(replay->requests));
+    fprintf(out, "# TYPE gw_zmq_replay_messages_total counter\ngw_zmq_replay_messages_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(replay->replayed));
+    fprintf(out, "# TYPE gw_zmq_replay_gaps_total counter\ngw_zmq_replay_gaps_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(replay->gaps));
+    fprintf(out, "# TYPE gw_zmq_replay_skipped_total counter\ngw_zmq_replay_skipped_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(replay->skipped));
+    fprintf(out, "# TYPE gw_zmq_replay_refused_total counter\ngw_zmq_replay_refused_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(replay->refused));
+}
@@ -0,0 +1,89 @@
+#ifndef GW_REPLAY_H
+#define GW_REPLAY_H
+
+#include "czmq.h"
+
+/**
+* Default size of the replay window, in bytes.
+*/
+#define DEFAULT_REPLAY_WINDOW_BYTES (64 * 1024 * 1024)
+
+/**
+* Default age of the oldest messages kept in the replay window, in seconds.
+*/
+#define DEFAULT_REPLAY_WINDOW_SECS 60
+
+/**
+* The window is made of slabs of this size, recycled oldest first; a message larger than a slab isn't kept.
+*/
+#define GW_REPLAY_SLAB_SIZE (1024 * 1024)
+
+/**
+* Consumers catching up at the same time.
+*/
+#define GW_REPLAY_MAX_SESSIONS 16
+
+#define GW_REPLAY_MAX_PREFIXES 8
+
+#define GW_REPLAY_MAX_PREFIX_SIZE 64
+
+/**
+* Sequence frame ending each message the XPUB publishes when the replay window is on: "GWQ1", then the sequence
+* number of the message as a 64 bits big endian integer. Sequence numbers start at 1 and grow by one for every message
+* the adaptor receives, so a consumer subscribed to some topics only sees gaps.
+*/
+#define GW_SEQUENCE_MAGIC "GWQ1"
+
+#define GW_SEQUENCE_FRAME_SIZE 12
+
+typedef struct _gw_replay_t gw_replay_t;
+
+/**
+* In-memory window of the last messages published, from which consumers reconnecting after a short outage catch up.
+*
+* Messages are copied into slabs carved out of one preallocated arena of windowBytes, so recording a message is a
+* memcpy; the oldest slab is recycled when the window is full, or when its messages are older than windowSecs.
+*
+* The snapshot endpoint is a ROUTER, as in the Clone pattern of the guide: a DEALER sends "SINCE", the last sequence
+* number it got as a decimal string and, optionally, the topic prefixes it subscribes to. It gets back each message
+* of the window with a larger sequence number as "MSG", its sequence number and its frames, then "END" and the
+* sequence number the replay went up to. When messages it asked for already left the window, the replay starts with
+* "GAP" and the oldest sequence number the window still holds. A consumer subscribes to the XPUB before asking for
+* the replay, and drops the live messages whose sequence numbers it already got from it.
+*
+* The window belongs to the thread owning the XPUB socket, which serves the replays a few messages at a time.
+*/
+gw_replay_t *
+gw_replay_new(zctx_t *ctx, const char *endpoint, size_t windowBytes, int windowSecs);
+
+void
+gw_replay_destroy(gw_replay_t **replay);
+
+int
+gw_replay_append(gw_replay_t *replay, const void *data, size_t size, int more);
+
+uint64_t
+gw_replay_commit(gw_replay_t *replay);
+
+void
+gw_replay_cancel(gw_replay_t *replay);
+
+void
+gw_replay_sequence_frame(zmq_msg_t *frame, uint64_t sequence);
+
+void *
+gw_replay_socket(gw_replay_t *replay);
+
+int
+gw_replay_handle_request(gw_replay_t *replay);
+
+int
+gw_replay_serve(gw_replay_t *replay, int maxMessages);
+
+uint64_t
+gw_replay_last_sequence(gw_replay_t *replay);
+
+void
+gw_replay_render(FILE *out, void *replay);
+
+#endif
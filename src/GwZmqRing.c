@@ -0,0 +1,428 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqRing.h"
+#include "GwZmqMetrics.h"
+#include "czmq.h"
+#include <sched.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+/**
+* A side waiting for the other one spins this many times, then yields its CPU, then sleeps.
+*/
+#define GW_RING_SPINS 64
+#define GW_RING_YIELDS 1024
+#define GW_RING_SLEEP_USEC 50
+
+struct _gw_ring_t {
+    /** frames committed by the producer */
+    uint64_t head __attribute__((aligned(GW_CACHE_LINE_SIZE)));
+    /** frames pushed by the producer, committed or not */
+    uint64_t pending;
+    /** the producer's view of tail, refreshed when the ring looks full */
+    uint64_t cached_tail;
+    /** the last frame pushed has more frames following it */
+    int producer_in_message;
+    /** the producer is dropping the rest of a message */
+    int discarding;
+    uint64_t dropped_newest;
+    uint64_t full_waits;
+
+    /** frames taken by the consumer */
+    uint64_t tail __attribute__((aligned(GW_CACHE_LINE_SIZE)));
+    /** the consumer's view of head, refreshed when the ring looks empty */
+    uint64_t cached_head;
+    /** the last frame taken or discarded has more frames following it */
+    int consumer_in_message;
+    /** the consumer is discarding the oldest messages */
+    int shedding;
+    uint64_t dropped_oldest;
+    /** stamp of the last frame taken */
+    uint64_t popped_stamp;
+
+    /** set by the consumer before it sleeps, cleared by whoever wakes it up */
+    int waiting __attribute__((aligned(GW_CACHE_LINE_SIZE)));
+    /** set by the producer when it finds the ring full with the drop-oldest policy */
+    int shed_requested;
+    int closed;
+
+    size_t size __attribute__((aligned(GW_CACHE_LINE_SIZE)));
+    uint64_t mask;
+    int policy;
+    /** read and write ends of the wakeup descriptor, the same eventfd on Linux */
+    int fds[2];
+    zmq_msg_t *slots;
+    /** stamp of each slot, 0 for most frames, NULL unless gw_ring_enable_stamps was called */
+    uint64_t *stamps;
+};
+
+static const char *gw_ring_policies[] = { "block", "drop-newest", "drop-oldest" };
+
+gw_ring_t *
+gw_ring_new(size_t size, int policy)
+{
+    size_t capacity = 2;
+    while (capacity < size) {
+        capacity <<= 1;
+    }
+
+    void *memory = NULL;
+    int result = posix_memalign(&memory, GW_CACHE_LINE_SIZE, sizeof(gw_ring_t));
+    assert( result == 0 && memory );
+    gw_ring_t *ring = (gw_ring_t *) memory;
+    memset(ring, 0, sizeof(gw_ring_t));
+    ring->size = capacity;
+    ring->mask = capacity - 1;
+    ring->policy = policy;
+
+    result = posix_memalign(&memory, GW_CACHE_LINE_SIZE, capacity * sizeof(zmq_msg_t));
+    assert( result == 0 && memory );
+    ring->slots = (zmq_msg_t *) memory;
+    size_t i;
+    for (i = 0; i < capacity; i++) {
+        zmq_msg_init(&ring->slots[i]);
+    }
+
+#ifdef __linux__
+    ring->fds[0] = ring->fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert( ring->fds[0] >= 0 );
+#else
+    result = pipe(ring->fds);
+    assert( result == 0 );
+    fcntl(ring->fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(ring->fds[1], F_SETFL, O_NONBLOCK);
+#endif
+    return ring;
+}
+
+void
+gw_ring_destroy(gw_ring_t **ring)
+{
+    size_t i;
+    for (i = 0; i < (*ring)->size; i++) {
+        zmq_msg_close(&(*ring)->slots[i]);
+    }
+    close((*ring)->fds[0]);
+    if ((*ring)->fds[1] != (*ring)->fds[0]) {
+        close((*ring)->fds[1]);
+    }
+    free((*ring)->slots);
+    free((*ring)->stamps);
+    free(*ring);
+    *ring = NULL;
+}
+
+/**
+* Lets the producer attach a stamp to some frames, which the consumer gets back with gw_ring_popped_stamp.
+* Must be called before the threads using the ring start.
+*/
+void
+gw_ring_enable_stamps(gw_ring_t *ring)
+{
+    ring->stamps = (uint64_t *) calloc(ring->size, sizeof(uint64_t));
+    assert( ring->stamps );
+}
+
+/**
+* Returns the policy called name, or -1 if there's none.
+*/
+int
+gw_ring_policy(const char *name)
+{
+    int policy;
+    for (policy = GW_RING_BLOCK; policy <= GW_RING_DROP_OLDEST; policy++) {
+        if (strcmp(name, gw_ring_policies[policy]) == 0) {
+            return policy;
+        }
+    }
+    return -1;
+}
+
+const char *
+gw_ring_policy_name(int policy)
+{
+    return gw_ring_policies[policy];
+}
+
+static void
+ring_pause(int spins)
+{
+    if (spins < GW_RING_SPINS) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else if (spins < GW_RING_YIELDS) {
+        sched_yield();
+    } else {
+        usleep(GW_RING_SLEEP_USEC);
+    }
+}
+
+static int
+ring_full(gw_ring_t *ring)
+{
+    if (ring->pending - ring->cached_tail < ring->size) {
+        return 0;
+    }
+    ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return ring->pending - ring->cached_tail == ring->size;
+}
+
+/**
+* Moves a frame into the ring, leaving frame empty. Called by the producer only; the consumer doesn't see the frame
+* until gw_ring_commit.
+* Returns 0 when the frame was queued, 1 when it was dropped by the policy of the ring, along with the rest of its
+* message, or -1 when the ring was shut down while waiting for room, in which case the frame is closed.
+*/
+int
+gw_ring_push(gw_ring_t *ring, zmq_msg_t *frame)
+{
+    int more = zmq_msg_more(frame);
+
+    if (ring->discarding) {
+        zmq_msg_close(frame);
+        zmq_msg_init(frame);
+        ring->discarding = more;
+        return 1;
+    }
+
+    if (ring_full(ring)) {
+        if (!ring->producer_in_message && ring->policy == GW_RING_DROP_NEWEST) {
+            zmq_msg_close(frame);
+            zmq_msg_init(frame);
+            ring->discarding = more;
+            GW_COUNTER_ADD(ring->dropped_newest, 1);
+            return 1;
+        }
+        if (!ring->producer_in_message && ring->policy == GW_RING_DROP_OLDEST) {
+            __atomic_store_n(&ring->shed_requested, 1, __ATOMIC_RELEASE);
+        }
+        GW_COUNTER_ADD(ring->full_waits, 1);
+        // the consumer only makes room with the frames it can see
+        gw_ring_commit(ring);
+
+        int spins = 0;
+        while (ring_full(ring)) {
+            if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+                zmq_msg_close(frame);
+                zmq_msg_init(frame);
+                return -1;
+            }
+            ring_pause(spins++);
+        }
+    }
+
+    zmq_msg_move(&ring->slots[ring->pending & ring->mask], frame);
+    ring->pending++;
+    ring->producer_in_message = more;
+    return 0;
+}
+
+/**
+* Attaches a non zero stamp to the frame the last successful gw_ring_push queued; it's published by gw_ring_commit
+* along with the frame. The consumer clears the stamps of the slots it frees, so unstamped frames cost nothing.
+*/
+void
+gw_ring_stamp(gw_ring_t *ring, uint64_t stamp)
+{
+    ring->stamps[(ring->pending - 1) & ring->mask] = stamp;
+}
+
+/**
+* Makes the frames pushed so far visible to the consumer, and wakes it up if it's sleeping.
+* The store of head and the load of waiting are sequentially consistent, pairing with gw_ring_prepare_wait:
+* either the consumer sees the new frames before sleeping, or the producer sees it's waiting.
+*/
+void
+gw_ring_commit(gw_ring_t *ring)
+{
+    if (ring->pending == __atomic_load_n(&ring->head, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_store_n(&ring->head, ring->pending, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        ssize_t written = write(ring->fds[1], &one, sizeof(one));
+        (void) written;
+    }
+}
+
+/**
+* Discards the oldest messages until the ring is half empty, for a producer which found it full with the drop-oldest
+* policy. Only whole messages are discarded; when the last frames of a message aren't committed yet, the consumer
+* keeps discarding on the next call.
+*/
+static void
+shed(gw_ring_t *ring)
+{
+    ring->shedding = 1;
+    __atomic_store_n(&ring->shed_requested, 0, __ATOMIC_RELAXED);
+    ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    while (ring->tail != ring->cached_head) {
+        if (!ring->consumer_in_message && ring->cached_head - ring->tail <= ring->size / 2) {
+            break;
+        }
+        zmq_msg_t *slot = &ring->slots[ring->tail & ring->mask];
+        ring->consumer_in_message = zmq_msg_more(slot);
+        if (!ring->consumer_in_message) {
+            GW_COUNTER_ADD(ring->dropped_oldest, 1);
+        }
+        zmq_msg_close(slot);
+        zmq_msg_init(slot);
+        if (ring->stamps != NULL) {
+            ring->stamps[ring->tail & ring->mask] = 0;
+        }
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    }
+    ring->shedding = ring->consumer_in_message;
+}
+
+/**
+* Moves the oldest frame of the ring into frame, releasing what frame held. Called by the consumer only.
+* With wait, which the consumer sets in the middle of a message, spins until the next frame is committed.
+* Returns the size of the frame, or -1 with errno set to EAGAIN when the ring is empty or ETERM when it was shut down.
+*/
+int
+gw_ring_pop(gw_ring_t *ring, zmq_msg_t *frame, int wait)
+{
+    if (ring->shedding
+            || (!ring->consumer_in_message && __atomic_load_n(&ring->shed_requested, __ATOMIC_ACQUIRE))) {
+        shed(ring);
+        if (ring->shedding) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    int spins = 0;
+    while (ring->tail == ring->cached_head) {
+        ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (ring->tail != ring->cached_head) {
+            break;
+        }
+        if (!wait) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+            errno = ETERM;
+            return -1;
+        }
+        ring_pause(spins++);
+    }
+
+    zmq_msg_move(frame, &ring->slots[ring->tail & ring->mask]);
+    ring->consumer_in_message = zmq_msg_more(frame);
+    if (ring->stamps != NULL) {
+        // cleared before tail is released, as the producer may reuse the slot right after
+        ring->popped_stamp = ring->stamps[ring->tail & ring->mask];
+        if (ring->popped_stamp != 0) {
+            ring->stamps[ring->tail & ring->mask] = 0;
+        }
+    }
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    return (int) zmq_msg_size(frame);
+}
+
+/**
+* Stamp of the frame the last gw_ring_pop returned, 0 when it had none. Called by the consumer only.
+*/
+uint64_t
+gw_ring_popped_stamp(gw_ring_t *ring)
+{
+    return ring->popped_stamp;
+}
+
+/**
+* Called by the consumer before it sleeps in zmq_poll on gw_ring_fd(). Returns 1 when frames are already committed,
+* in which case it shouldn't sleep.
+*/
+int
+gw_ring_prepare_wait(gw_ring_t *ring)
+{
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+    if (ring->cached_head != ring->tail) {
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+* Called by the consumer after zmq_poll returns; signaled tells if gw_ring_fd() was readable.
+*/
+void
+gw_ring_clear_wakeup(gw_ring_t *ring, int signaled)
+{
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    if (signaled) {
+        uint64_t value;
+        while (read(ring->fds[0], &value, sizeof(value)) > 0) {
+        }
+    }
+}
+
+int
+gw_ring_fd(gw_ring_t *ring)
+{
+    return ring->fds[0];
+}
+
+/**
+* Stops the waits of both sides, so the threads can be joined even if the other side is gone.
+*/
+void
+gw_ring_shutdown(gw_ring_t *ring)
+{
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+/**
+* Number of committed frames waiting for the consumer; can be called from any thread.
+*/
+size_t
+gw_ring_depth(gw_ring_t *ring)
+{
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return (size_t) (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail);
+}
+
+size_t
+gw_ring_size(gw_ring_t *ring)
+{
+    return ring->size;
+}
+
+/**
+* Messages dropped by either policy.
+*/
+uint64_t
+gw_ring_dropped(gw_ring_t *ring)
+{
+    return GW_COUNTER_GET(ring->dropped_newest) + GW_COUNTER_GET(ring->dropped_oldest);
+}
+
+/**
+* Times the producer found the ring full and waited for room.
+*/
+uint64_t
+gw_ring_full_waits(gw_ring_t *ring)
+{
+    return GW_COUNTER_GET(ring->full_waits);
+}
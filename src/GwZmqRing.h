@@ -0,0 +1,87 @@
+#ifndef GW_RING_H
+#define GW_RING_H
+
+#include "czmq.h"
+
+/**
+* Default number of frames a ring between a shard and the egress thread holds.
+*/
+#define DEFAULT_RING_SIZE 4096
+
+/**
+* What the producer does with a new message when the ring is full.
+* A message whose first frames are already in the ring always waits for room, so consumers never see half a message.
+*/
+/** waits until the consumer makes room */
+#define GW_RING_BLOCK 0
+/** drops the new message */
+#define GW_RING_DROP_NEWEST 1
+/** asks the consumer to discard the oldest messages, until the ring is half empty, and waits for room */
+#define GW_RING_DROP_OLDEST 2
+
+typedef struct _gw_ring_t gw_ring_t;
+
+/**
+* Bounded lock-free queue of zmq_msg_t between one producer thread and one consumer thread.
+*
+* Frames are moved in and out with zmq_msg_move, so only the 64 bytes of the zmq_msg_t are copied, never the payload.
+* The producer and consumer indexes live on their own cache lines, and each side caches the index of the other one
+* so it only reads the shared line when its cached view says the ring is full, or empty.
+* Pushed frames are made visible in bulk by gw_ring_commit. A consumer with nothing to do sleeps in zmq_poll on
+* gw_ring_fd(); the producer only writes to that descriptor when the consumer is asleep, so a busy ring costs no syscall.
+*/
+gw_ring_t *
+gw_ring_new(size_t size, int policy);
+
+void
+gw_ring_destroy(gw_ring_t **ring);
+
+void
+gw_ring_enable_stamps(gw_ring_t *ring);
+
+int
+gw_ring_policy(const char *name);
+
+const char *
+gw_ring_policy_name(int policy);
+
+int
+gw_ring_push(gw_ring_t *ring, zmq_msg_t *frame);
+
+void
+gw_ring_stamp(gw_ring_t *ring, uint64_t stamp);
+
+void
+gw_ring_commit(gw_ring_t *ring);
+
+int
+gw_ring_pop(gw_ring_t *ring, zmq_msg_t *frame, int wait);
+
+uint64_t
+gw_ring_popped_stamp(gw_ring_t *ring);
+
+int
+gw_ring_prepare_wait(gw_ring_t *ring);
+
+void
+gw_ring_clear_wakeup(gw_ring_t *ring, int signaled);
+
+int
+gw_ring_fd(gw_ring_t *ring);
+
+void
+gw_ring_shutdown(gw_ring_t *ring);
+
+size_t
+gw_ring_depth(gw_ring_t *ring);
+
+size_t
+gw_ring_size(gw_ring_t *ring);
+
+uint64_t
+gw_ring_dropped(gw_ring_t *ring);
+
+uint64_t
+gw_ring_full_waits(gw_ring_t *ring);
+
+#endif
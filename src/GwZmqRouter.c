@@ -0,0 +1,535 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "GwZmqRouter.h"
+#include "GwZmqAdaptor.h"
+#include "GwZmqMetrics.h"
+#include "czmq.h"
+#include <sys/stat.h>
+
+#define GW_MATCH_AT 0
+#define GW_MATCH_CONTAINS 1
+
+typedef struct {
+    int type;
+    size_t offset;
+    size_t size;
+    unsigned char value[GW_ROUTE_MAX_VALUE_SIZE];
+} gw_route_match_t;
+
+typedef struct {
+    int egress;
+    int match_count;
+    gw_route_match_t matches[GW_ROUTE_MAX_MATCHES];
+} gw_route_t;
+
+typedef struct {
+    char name[64];
+    int type;
+    char endpoint[256];
+    void *socket;
+    uint64_t messages;
+    /** messages the socket refused because it reached its high water mark */
+    uint64_t dropped;
+} gw_egress_t;
+
+/**
+* A compiled rule file.
+*/
+typedef struct {
+    gw_route_t *routes;
+    int route_count;
+    /**
+    * Routes a message starting with each byte value can match: the ones with a match on the first byte, followed by
+    * the ones without.
+    */
+    int *dispatch[256];
+    int dispatch_count[256];
+    gw_egress_t egresses[GW_ROUTE_MAX_EGRESSES];
+    int egress_count;
+} gw_route_table_t;
+
+struct _gw_router_t {
+    zctx_t *ctx;
+    char *path;
+    time_t loaded_mtime;
+    off_t loaded_size;
+    int64_t checked_at;
+    /** the table is swapped by the thread owning the XPUB and read by the metrics collector */
+    pthread_mutex_t lock;
+    gw_route_table_t *table;
+    /** egresses which refused a frame of the message being routed */
+    uint32_t failed;
+    uint64_t reloads;
+    uint64_t reload_failures;
+};
+
+static void
+free_table(gw_route_table_t *table)
+{
+    int i;
+
+    for (i = 0; i < table->egress_count; i++) {
+        if (table->egresses[i].socket != NULL) {
+            zmq_close(table->egresses[i].socket);
+        }
+    }
+    for (i = 0; i < 256; i++) {
+        free(table->dispatch[i]);
+    }
+    free(table->routes);
+    free(table);
+}
+
+static int
+find_egress(gw_route_table_t *table, const char *name)
+{
+    int i;
+    for (i = 0; i < table->egress_count; i++) {
+        if (strcmp(table->egresses[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+* Parses one match of a route: prefix:<bytes>, at:<offset>:<bytes> or contains:<bytes>.
+*/
+static int
+parse_match(const char *token, gw_route_match_t *match)
+{
+    const char *value;
+
+    if (strncmp(token, "prefix:", 7) == 0) {
+        match->type = GW_MATCH_AT;
+        match->offset = 0;
+        value = token + 7;
+    } else if (strncmp(token, "contains:", 9) == 0) {
+        match->type = GW_MATCH_CONTAINS;
+        match->offset = 0;
+        value = token + 9;
+    } else if (strncmp(token, "at:", 3) == 0) {
+        char *end;
+        match->type = GW_MATCH_AT;
+        match->offset = strtoul(token + 3, &end, 10);
+        if (end == token + 3 || *end != ':') {
+            return -1;
+        }
+        value = end + 1;
+    } else {
+        return -1;
+    }
+
+    match->size = strlen(value);
+    if (match->size == 0 || match->size > GW_ROUTE_MAX_VALUE_SIZE
+            || (match->type == GW_MATCH_CONTAINS && match->size > GW_ROUTE_SCAN_BYTES)) {
+        return -1;
+    }
+    memcpy(match->value, value, match->size);
+    return 0;
+}
+
+/**
+* Builds the first byte dispatch of a table.
+*/
+static void
+compile_table(gw_route_table_t *table)
+{
+    int byte, i, j;
+
+    for (byte = 0; byte < 256; byte++) {
+        table->dispatch[byte] = (int *) malloc(sizeof(int) * (table->route_count + 1));
+        assert( table->dispatch[byte] );
+        table->dispatch_count[byte] = 0;
+    }
+    for (i = 0; i < table->route_count; i++) {
+        gw_route_t *route = &table->routes[i];
+        int firstByte = -1;
+        for (j = 0; j < route->match_count; j++) {
+            if (route->matches[j].type == GW_MATCH_AT && route->matches[j].offset == 0) {
+                firstByte = route->matches[j].value[0];
+                break;
+            }
+        }
+        if (firstByte != -1) {
+            table->dispatch[firstByte][table->dispatch_count[firstByte]++] = i;
+        }
+    }
+    // the routes without a match on the first byte are checked for every message, after the others
+    for (i = 0; i < table->route_count; i++) {
+        gw_route_t *route = &table->routes[i];
+        int anchored = 0;
+        for (j = 0; j < route->match_count; j++) {
+            anchored |= route->matches[j].type == GW_MATCH_AT && route->matches[j].offset == 0;
+        }
+        if (!anchored) {
+            for (byte = 0; byte < 256; byte++) {
+                table->dispatch[byte][table->dispatch_count[byte]++] = i;
+            }
+        }
+    }
+}
+
+/**
+* Reads a rule file into a new table, without opening the egress sockets.
+* Returns NULL if the file can't be read or holds an invalid line.
+*/
+static gw_route_table_t *
+load_table(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "[%s] - Could not open the routing rules %s: %s\n", timestamp(), path, strerror(errno));
+        return NULL;
+    }
+
+    gw_route_table_t *table = (gw_route_table_t *) calloc(1, sizeof(gw_route_table_t));
+    assert( table );
+    int capacity = 0;
+    char line[1024];
+    int lineNumber = 0;
+    int valid = 1;
+
+    while (valid && fgets(line, sizeof(line), file) != NULL) {
+        char *cursor;
+        lineNumber++;
+        char *keyword = strtok_r(line, " \t\r\n", &cursor);
+        if (keyword == NULL || keyword[0] == '#') {
+            continue;
+        }
+
+        if (strcmp(keyword, "egress") == 0) {
+            char *name = strtok_r(NULL, " \t\r\n", &cursor);
+            char *type = strtok_r(NULL, " \t\r\n", &cursor);
+            char *endpoint = strtok_r(NULL, " \t\r\n", &cursor);
+            if (endpoint == NULL || strlen(name) >= sizeof(table->egresses[0].name)
+                    || strlen(endpoint) >= sizeof(table->egresses[0].endpoint)
+                    || table->egress_count == GW_ROUTE_MAX_EGRESSES || find_egress(table, name) != -1
+                    || (strcmp(type, "pub") != 0 && strcmp(type, "push") != 0)) {
+                valid = 0;
+                break;
+            }
+            gw_egress_t *egress = &table->egresses[table->egress_count++];
+            strcpy(egress->name, name);
+            strcpy(egress->endpoint, endpoint);
+            egress->type = strcmp(type, "pub") == 0 ? ZMQ_PUB : ZMQ_PUSH;
+        } else if (strcmp(keyword, "route") == 0) {
+            char *name = strtok_r(NULL, " \t\r\n", &cursor);
+            int egress = name != NULL ? find_egress(table, name) : -1;
+            if (egress == -1) {
+                valid = 0;
+                break;
+            }
+            if (table->route_count == capacity) {
+                capacity = capacity == 0 ? 16 : capacity * 2;
+                table->routes = (gw_route_t *) realloc(table->routes, sizeof(gw_route_t) * capacity);
+                assert( table->routes );
+            }
+            gw_route_t *route = &table->routes[table->route_count];
+            route->egress = egress;
+            route->match_count = 0;
+            char *token;
+            while ((token = strtok_r(NULL, " \t\r\n", &cursor)) != NULL) {
+                if (route->match_count == GW_ROUTE_MAX_MATCHES
+                        || parse_match(token, &route->matches[route->match_count]) == -1) {
+                    valid = 0;
+                    break;
+                }
+                route->match_count++;
+            }
+            if (route->match_count == 0) {
+                valid = 0;
+            }
+            table->route_count++;
+        } else {
+            valid = 0;
+        }
+    }
+    fclose(file);
+
+    if (!valid) {
+        fprintf(stderr, "[%s] - Invalid routing rule at %s:%d\n", timestamp(), path, lineNumber);
+        free_table(table);
+        return NULL;
+    }
+    compile_table(table);
+    return table;
+}
+
+static void *
+open_egress(zctx_t *ctx, gw_egress_t *egress)
+{
+    void *socket = zmq_socket(zctx_underlying(ctx), egress->type);
+    assert( socket );
+    int linger = 0;
+    zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+    if (zmq_bind(socket, egress->endpoint) == -1) {
+        fprintf(stderr, "[%s] - Could not bind the %s egress on %s: %s\n", timestamp(), egress->name,
+                egress->endpoint, zmq_strerror(zmq_errno()));
+        zmq_close(socket);
+        return NULL;
+    }
+    fprintf(stderr, "[%s] - Routing to the %s egress on %s\n", timestamp(), egress->name, egress->endpoint);
+    return socket;
+}
+
+/**
+* Opens the sockets of a new table, taking over the ones of the current table which didn't change.
+* Returns 0 on success or -1 if an egress can't be bound, in which case the current table is left untouched.
+*/
+static int
+open_egresses(gw_router_t *router, gw_route_table_t *table)
+{
+    gw_route_table_t *current = router->table;
+    int kept[GW_ROUTE_MAX_EGRESSES];
+    int i;
+
+    for (i = 0; i < table->egress_count; i++) {
+        gw_egress_t *egress = &table->egresses[i];
+        int previous = current != NULL ? find_egress(current, egress->name) : -1;
+        kept[i] = previous != -1 && current->egresses[previous].type == egress->type
+                && strcmp(current->egresses[previous].endpoint, egress->endpoint) == 0 ? previous : -1;
+        if (kept[i] == -1 && (egress->socket = open_egress(router->ctx, egress)) == NULL) {
+            return -1;
+        }
+    }
+    for (i = 0; i < table->egress_count; i++) {
+        if (kept[i] != -1) {
+            gw_egress_t *previous = &current->egresses[kept[i]];
+            table->egresses[i].socket = previous->socket;
+            table->egresses[i].messages = previous->messages;
+            table->egresses[i].dropped = previous->dropped;
+            previous->socket = NULL;
+        }
+    }
+    return 0;
+}
+
+gw_router_t *
+gw_router_new(zctx_t *ctx, const char *path)
+{
+    gw_router_t *router = (gw_router_t *) calloc(1, sizeof(gw_router_t));
+    assert( router );
+    router->ctx = ctx;
+    router->path = strdup(path);
+    router->checked_at = zclock_time();
+    pthread_mutex_init(&router->lock, NULL);
+
+    if (gw_router_reload(router) == -1) {
+        gw_router_destroy(&router);
+    }
+    return router;
+}
+
+void
+gw_router_destroy(gw_router_t **router)
+{
+    gw_router_t *self = *router;
+
+    if (self->table != NULL) {
+        free_table(self->table);
+    }
+    pthread_mutex_destroy(&self->lock);
+    free(self->path);
+    free(self);
+    *router = NULL;
+}
+
+/**
+* Loads the rule file again. The current rules stay in place if the file is invalid.
+* Returns 0 on success, -1 otherwise.
+*/
+int
+gw_router_reload(gw_router_t *router)
+{
+    struct stat info;
+    if (stat(router->path, &info) == 0) {
+        router->loaded_mtime = info.st_mtime;
+        router->loaded_size = info.st_size;
+    }
+
+    gw_route_table_t *table = load_table(router->path);
+    if (table == NULL || open_egresses(router, table) == -1) {
+        if (table != NULL) {
+            free_table(table);
+        }
+        GW_COUNTER_ADD(router->reload_failures, 1);
+        return -1;
+    }
+
+    pthread_mutex_lock(&router->lock);
+    gw_route_table_t *previous = router->table;
+    router->table = table;
+    router->failed = 0;
+    pthread_mutex_unlock(&router->lock);
+
+    if (previous != NULL) {
+        free_table(previous);
+    }
+    GW_COUNTER_ADD(router->reloads, 1);
+    fprintf(stderr, "[%s] - Loaded %d routes to %d egresses from %s\n", timestamp(), table->route_count,
+            table->egress_count, router->path);
+    return 0;
+}
+
+/**
+* Reloads the rule file if it changed, checking at most every GW_ROUTE_CHECK_INTERVAL_MSEC.
+*/
+void
+gw_router_check(gw_router_t *router)
+{
+    struct stat info;
+    int64_t now = zclock_time();
+
+    if (now - router->checked_at < GW_ROUTE_CHECK_INTERVAL_MSEC) {
+        return;
+    }
+    router->checked_at = now;
+    if (stat(router->path, &info) == -1
+            || (info.st_mtime == router->loaded_mtime && info.st_size == router->loaded_size)) {
+        return;
+    }
+    fprintf(stderr, "[%s] - Routing rules %s changed, reloading them\n", timestamp(), router->path);
+    gw_router_reload(router);
+}
+
+static int
+route_matches(const gw_route_t *route, const unsigned char *data, size_t size)
+{
+    int i;
+
+    for (i = 0; i < route->match_count; i++) {
+        const gw_route_match_t *match = &route->matches[i];
+        if (match->type == GW_MATCH_AT) {
+            if (size < match->offset + match->size
+                    || memcmp(data + match->offset, match->value, match->size) != 0) {
+                return 0;
+            }
+        } else {
+            // memmem is vectorized by the C library
+            size_t scanned = size < GW_ROUTE_SCAN_BYTES ? size : GW_ROUTE_SCAN_BYTES;
+            if (memmem(data, scanned, match->value, match->size) == NULL) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+* Returns the egresses a message goes to, as a bit mask of their indexes; data is its first frame.
+*/
+uint32_t
+gw_router_match(gw_router_t *router, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    gw_route_table_t *table = router->table;
+    uint32_t egresses = 0;
+    int i;
+
+    if (size == 0) {
+        return 0;
+    }
+    int *candidates = table->dispatch[bytes[0]];
+    int count = table->dispatch_count[bytes[0]];
+    for (i = 0; i < count; i++) {
+        gw_route_t *route = &table->routes[candidates[i]];
+        uint32_t egress = 1u << route->egress;
+        if (!(egresses & egress) && route_matches(route, bytes, size)) {
+            egresses |= egress;
+        }
+    }
+    return egresses;
+}
+
+/**
+* Sends a copy of a frame to the egresses of its message, which share its payload.
+* An egress refusing a frame gets none of the next frames of the message.
+*/
+void
+gw_router_send(gw_router_t *router, uint32_t egresses, zmq_msg_t *frame, int more)
+{
+    gw_route_table_t *table = router->table;
+    uint32_t pending = egresses & ~router->failed;
+
+    while (pending != 0) {
+        int i = __builtin_ctz(pending);
+        pending &= pending - 1;
+
+        zmq_msg_t copy;
+        zmq_msg_init(&copy);
+        zmq_msg_copy(&copy, frame);
+        if (zmq_msg_send(&copy, table->egresses[i].socket, (more ? ZMQ_SNDMORE : 0) | ZMQ_DONTWAIT) == -1) {
+            zmq_msg_close(&copy);
+            router->failed |= 1u << i;
+        }
+    }
+    if (more) {
+        return;
+    }
+    pending = egresses;
+    while (pending != 0) {
+        int i = __builtin_ctz(pending);
+        pending &= pending - 1;
+        if (router->failed & (1u << i)) {
+            GW_COUNTER_ADD(table->egresses[i].dropped, 1);
+        } else {
+            GW_COUNTER_ADD(table->egresses[i].messages, 1);
+        }
+    }
+    router->failed = 0;
+}
+
+int
+gw_router_egress_count(gw_router_t *router)
+{
+    return router->table->egress_count;
+}
+
+/**
+* Metrics collector for the routes.
+*/
+void
+gw_router_render(FILE *out, void *self)
+{
+    gw_router_t *router = (gw_router_t *) self;
+    int i;
+
+    pthread_mutex_lock(&router->lock);
+    gw_route_table_t *table = router->table;
+    fprintf(out, "# TYPE gw_zmq_routed_messages_total counter\n");
+    for (i = 0; i < table->egress_count; i++) {
+        fprintf(out, "gw_zmq_routed_messages_total{egress=\"%s\",socket=\"%s\"} %llu\n", table->egresses[i].name,
+                table->egresses[i].endpoint, (unsigned long long) GW_COUNTER_GET(table->egresses[i].messages));
+    }
+    fprintf(out, "# TYPE gw_zmq_routed_dropped_total counter\n");
+    for (i = 0; i < table->egress_count; i++) {
+        fprintf(out, "gw_zmq_routed_dropped_total{egress=\"%s\",socket=\"%s\"} %llu\n", table->egresses[i].name,
+                table->egresses[i].endpoint, (unsigned long long) GW_COUNTER_GET(table->egresses[i].dropped));
+    }
+    fprintf(out, "# TYPE gw_zmq_routes gauge\ngw_zmq_routes %d\n", table->route_count);
+    pthread_mutex_unlock(&router->lock);
+
+    fprintf(out, "# TYPE gw_zmq_route_reloads_total counter\n"
+                 "gw_zmq_route_reloads_total{result=\"success\"} %llu\n"
+                 "gw_zmq_route_reloads_total{result=\"failure\"} %llu\n",
+            (unsigned long long) GW_COUNTER_GET(router->reloads),
+            (unsigned long long) GW_COUNTER_GET(router->reload_failures));
+}
@@ -0,0 +1,72 @@
+#ifndef GW_ROUTER_H
+#define GW_ROUTER_H
+
+#include "czmq.h"
+
+/**
+* Maximum number of egress sockets a rule table can define.
+*/
+#define GW_ROUTE_MAX_EGRESSES 32
+
+/**
+* Maximum number of matches a route can combine.
+*/
+#define GW_ROUTE_MAX_MATCHES 8
+
+#define GW_ROUTE_MAX_VALUE_SIZE 128
+
+/**
+* "contains" matches only scan the first bytes of a message, where the gateway writes the fields worth routing on.
+*/
+#define GW_ROUTE_SCAN_BYTES 512
+
+/**
+* How often ( in milliseconds ) the thread owning the XPUB checks if the rule file changed.
+*/
+#define GW_ROUTE_CHECK_INTERVAL_MSEC 1000
+
+typedef struct _gw_router_t gw_router_t;
+
+/**
+* Sends slices of the stream to additional egress sockets, according to a rule file:
+*
+*   # egress <name> <pub|push> <endpoint>
+*   egress billing push ipc:///tmp/billing
+*   egress security pub tcp://0.0.0.0:6201
+*   # route <egress> <match> [<match> ...]; all the matches of a route have to match
+*   route billing prefix:PUB-A
+*   route security prefix:PUB- at:6:B contains:"blocked":true
+*
+* A match is either prefix:<bytes>, at:<offset>:<bytes> or contains:<bytes>, which looks for the bytes in the first
+* GW_ROUTE_SCAN_BYTES of the message. A message goes to the egress of every route it matches, multipart messages
+* are routed on their first frame. The rules are compiled into a table dispatching on the first byte of the message,
+* so a message is only checked against the routes which can match it.
+*
+* The router belongs to the thread owning the XPUB, which reloads the rule file when it changes. Egress sockets
+* kept by the new rules stay connected.
+*/
+gw_router_t *
+gw_router_new(zctx_t *ctx, const char *path);
+
+void
+gw_router_destroy(gw_router_t **router);
+
+int
+gw_router_reload(gw_router_t *router);
+
+void
+gw_router_check(gw_router_t *router);
+
+uint32_t
+gw_router_match(gw_router_t *router, const void *data, size_t size);
+
+void
+gw_router_send(gw_router_t *router, uint32_t egresses, zmq_msg_t *frame, int more);
+
+int
+gw_router_egress_count(gw_router_t *router);
+
+void
+gw_router_render(FILE *out, void *router);
+
+#endif
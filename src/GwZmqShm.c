@@ -0,0 +1,604 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqShm.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define GW_SHM_LINE_SIZE 64
+
+#define GW_SHM_PAGE_SIZE 4096
+
+/**
+* Beginning of the shared memory object. Nothing in it is written after it's created, but closed and the wakeup
+* line, so it stays in the cache of every worker.
+*/
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t workers;
+    /** set by the adaptor when it stops; the workers get EPIPE and open the new object */
+    uint32_t closed;
+    uint64_t ring_size;
+    /** offset of the first ring's bytes */
+    uint64_t data_offset;
+
+    /** bumped by a worker waking up the adaptor, which sleeps on it */
+    uint32_t wakeups __attribute__((aligned(GW_SHM_LINE_SIZE)));
+    /** set by the adaptor before it sleeps */
+    uint32_t sleeping;
+} gw_shm_header_t;
+
+/**
+* Indexes of a ring, in bytes written and read since the object was created, followed in the object by the
+* headers of the other rings. The bytes of the rings come after all the headers.
+*/
+typedef struct {
+    /** pid of the worker writing to the ring, 0 when the ring is free */
+    int32_t owner __attribute__((aligned(GW_SHM_LINE_SIZE)));
+    /** bytes of whole messages written by the worker */
+    uint64_t head;
+    /** messages the worker dropped because the ring was full */
+    uint64_t dropped;
+
+    /** bytes read by the adaptor */
+    uint64_t tail __attribute__((aligned(GW_SHM_LINE_SIZE)));
+} gw_shm_ring_t;
+
+struct _gw_shm_reader_t {
+    char name[256];
+    int fd;
+    size_t length;
+    char *base;
+    gw_shm_header_t *header;
+    gw_shm_ring_t *rings;
+    int workers;
+    uint64_t size;
+    uint64_t mask;
+    /** the reader's own copy of the tails, published once a frame is released */
+    uint64_t *tails;
+    /** the reader's view of the heads, refreshed when a ring looks empty */
+    uint64_t *cached_heads;
+    /** ring the next frame is read from */
+    int cursor;
+    /** the last frame handed out has more frames following it */
+    int in_message;
+    /** bytes taken in the ring by the frame handed out and not released yet */
+    uint64_t peeked;
+    int spin_usec;
+    /** rings emptied because a worker left them inconsistent */
+    uint64_t corrupted;
+};
+
+struct _gw_shm_writer_t {
+    int fd;
+    size_t length;
+    char *base;
+    gw_shm_header_t *header;
+    gw_shm_ring_t *ring;
+    char *data;
+    uint64_t size;
+    uint64_t mask;
+    /** bytes of whole messages made visible to the adaptor */
+    uint64_t head;
+    /** bytes written, including the frames of the message being written */
+    uint64_t pending;
+    /** bytes of the frames of the message being written, without the padding of a wrap */
+    uint64_t message;
+    /** the writer's view of the tail, refreshed when the ring looks full */
+    uint64_t cached_tail;
+    /** the writer is dropping the rest of a message */
+    int discarding;
+};
+
+/**
+* Maps "shm://gateway" to the name of the shared memory object, "/gateway".
+*/
+static int
+object_name(const char *endpoint, char *name, size_t size)
+{
+    size_t schemeLength = strlen(GW_SHM_SCHEME);
+    if (strncmp(endpoint, GW_SHM_SCHEME, schemeLength) != 0 || endpoint[schemeLength] == 0
+            || strchr(endpoint + schemeLength, '/') != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    int written = snprintf(name, size, "/%s", endpoint + schemeLength);
+    if (written < 0 || (size_t) written >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static inline uint64_t
+record_span(size_t size)
+{
+    return (GW_SHM_RECORD_HEADER_SIZE + size + 7) & ~(uint64_t) 7;
+}
+
+static uint64_t
+monotonic_usecs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+#ifdef __linux__
+static void
+futex_wait(uint32_t *word, uint32_t value, int timeoutMsec)
+{
+    struct timespec timeout = { timeoutMsec / 1000, (long) (timeoutMsec % 1000) * 1000000 };
+    // shared mappings need the non private futex operations
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void
+futex_wake(uint32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+#else
+static void
+futex_wait(uint32_t *word, uint32_t value, int timeoutMsec)
+{
+    // no process shared futex: poll every millisecond
+    int waited;
+    for (waited = 0; waited < timeoutMsec && __atomic_load_n(word, __ATOMIC_ACQUIRE) == value; waited++) {
+        usleep(1000);
+    }
+}
+
+static void
+futex_wake(uint32_t *word)
+{
+}
+#endif
+
+gw_shm_reader_t *
+gw_shm_reader_new(const char *endpoint, int workers, size_t ringSize)
+{
+    char name[256];
+    if (object_name(endpoint, name, sizeof(name)) == -1) {
+        return NULL;
+    }
+    if (workers < 1 || workers > GW_SHM_MAX_WORKERS) {
+        errno = EINVAL;
+        return NULL;
+    }
+    uint64_t size = GW_SHM_MIN_RING_SIZE;
+    while (size < ringSize) {
+        size <<= 1;
+    }
+    uint64_t dataOffset = sizeof(gw_shm_header_t) + workers * sizeof(gw_shm_ring_t);
+    dataOffset = (dataOffset + GW_SHM_PAGE_SIZE - 1) & ~(uint64_t) (GW_SHM_PAGE_SIZE - 1);
+    size_t length = dataOffset + workers * size;
+
+    // workers still attached to a previous object keep it until they get EPIPE; only the user and group of the
+    // adaptor can write to the rings, other users could inject messages
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0660);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (ftruncate(fd, length) == -1) {
+        int error = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = error;
+        return NULL;
+    }
+    char *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        int error = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = error;
+        return NULL;
+    }
+
+    gw_shm_reader_t *reader = (gw_shm_reader_t *) calloc(1, sizeof(gw_shm_reader_t));
+    assert( reader );
+    snprintf(reader->name, sizeof(reader->name), "%s", name);
+    reader->fd = fd;
+    reader->length = length;
+    reader->base = base;
+    reader->header = (gw_shm_header_t *) base;
+    reader->rings = (gw_shm_ring_t *) (base + sizeof(gw_shm_header_t));
+    reader->workers = workers;
+    reader->size = size;
+    reader->mask = size - 1;
+    reader->tails = (uint64_t *) calloc(workers, sizeof(uint64_t));
+    reader->cached_heads = (uint64_t *) calloc(workers, sizeof(uint64_t));
+    assert( reader->tails && reader->cached_heads );
+
+    // ftruncate zeroed the object, the magic number makes it usable by the workers
+    reader->header->version = GW_SHM_VERSION;
+    reader->header->workers = workers;
+    reader->header->ring_size = size;
+    reader->header->data_offset = dataOffset;
+    __atomic_store_n(&reader->header->magic, GW_SHM_MAGIC, __ATOMIC_RELEASE);
+    return reader;
+}
+
+void
+gw_shm_reader_destroy(gw_shm_reader_t **reader)
+{
+    gw_shm_reader_t *self = *reader;
+    __atomic_store_n(&self->header->closed, 1, __ATOMIC_RELEASE);
+    munmap(self->base, self->length);
+    close(self->fd);
+    shm_unlink(self->name);
+    free(self->tails);
+    free(self->cached_heads);
+    free(self);
+    *reader = NULL;
+}
+
+void
+gw_shm_reader_set_spin(gw_shm_reader_t *reader, int spinUsec)
+{
+    reader->spin_usec = spinUsec;
+}
+
+/**
+* Skips everything a worker wrote to its ring, when the ring can't be read any further: the worker is a separate
+* process, and a bug or a crash in the middle of a write mustn't make the adaptor read outside of the ring.
+*/
+static void
+reset_ring(gw_shm_reader_t *reader, int index)
+{
+    reader->tails[index] = reader->cached_heads[index];
+    __atomic_store_n(&reader->rings[index].tail, reader->tails[index], __ATOMIC_RELEASE);
+    __atomic_add_fetch(&reader->corrupted, 1, __ATOMIC_RELAXED);
+}
+
+int
+gw_shm_reader_peek(gw_shm_reader_t *reader, const void **data, size_t *size, int *more)
+{
+    int turns;
+    for (turns = 0; turns < reader->workers; turns++) {
+        int index = reader->cursor;
+        gw_shm_ring_t *ring = &reader->rings[index];
+        uint64_t tail = reader->tails[index];
+
+        if (tail == reader->cached_heads[index]) {
+            reader->cached_heads[index] = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            if (reader->cached_heads[index] - tail > reader->size) {
+                reset_ring(reader, index);
+                tail = reader->tails[index];
+            }
+        }
+        while (tail != reader->cached_heads[index]) {
+            uint64_t offset = tail & reader->mask;
+            const char *record = reader->base + reader->header->data_offset + index * reader->size + offset;
+            uint32_t recordSize = 0;
+            uint32_t flags = ~(uint32_t) 0;
+            // records are 8 bytes aligned, so a valid one always has its header before the end of the ring
+            if (reader->size - offset >= GW_SHM_RECORD_HEADER_SIZE) {
+                memcpy(&recordSize, record, sizeof(recordSize));
+                memcpy(&flags, record + sizeof(recordSize), sizeof(flags));
+            }
+
+            // a frame, or the padding before a wrap, never goes past the end of the ring nor past the head
+            uint64_t span = flags == GW_SHM_FLAG_WRAP ? reader->size - offset : record_span(recordSize);
+            if ((flags != 0 && flags != GW_SHM_FLAG_MORE && flags != GW_SHM_FLAG_WRAP)
+                    || span > reader->size - offset || span > reader->cached_heads[index] - tail) {
+                reset_ring(reader, index);
+                if (reader->in_message) {
+                    // the frames already handed out are followed by an empty last one to end their message
+                    *data = record;
+                    *size = 0;
+                    *more = 0;
+                    reader->in_message = 0;
+                    reader->peeked = 0;
+                    return 1;
+                }
+                break;
+            }
+            if (flags == GW_SHM_FLAG_WRAP) {
+                tail += span;
+                reader->tails[index] = tail;
+                __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+                continue;
+            }
+            *data = record + GW_SHM_RECORD_HEADER_SIZE;
+            *size = recordSize;
+            *more = (flags & GW_SHM_FLAG_MORE) != 0;
+            reader->in_message = *more;
+            reader->peeked = record_span(recordSize);
+            return 1;
+        }
+        // whole messages are written at once, so a ring is never left in the middle of one
+        reader->cursor = (index + 1) % reader->workers;
+    }
+    return 0;
+}
+
+void
+gw_shm_reader_release(gw_shm_reader_t *reader)
+{
+    int index = reader->cursor;
+    reader->tails[index] += reader->peeked;
+    reader->peeked = 0;
+    __atomic_store_n(&reader->rings[index].tail, reader->tails[index], __ATOMIC_RELEASE);
+    if (!reader->in_message) {
+        // one message per ring in turn, so a busy worker can't hold the others back
+        reader->cursor = (index + 1) % reader->workers;
+    }
+}
+
+static int
+has_frames(gw_shm_reader_t *reader)
+{
+    int i;
+    for (i = 0; i < reader->workers; i++) {
+        reader->cached_heads[i] = __atomic_load_n(&reader->rings[i].head, __ATOMIC_ACQUIRE);
+        if (reader->cached_heads[i] != reader->tails[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+gw_shm_reader_wait(gw_shm_reader_t *reader, int timeoutMsec)
+{
+    if (has_frames(reader)) {
+        return 1;
+    }
+    if (reader->spin_usec > 0) {
+        uint64_t deadline = monotonic_usecs() + reader->spin_usec;
+        while (monotonic_usecs() < deadline) {
+            if (has_frames(reader)) {
+                return 1;
+            }
+        }
+    }
+    if (timeoutMsec <= 0) {
+        return 0;
+    }
+
+    gw_shm_header_t *header = reader->header;
+    uint32_t wakeups = __atomic_load_n(&header->wakeups, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&header->sleeping, 1, __ATOMIC_SEQ_CST);
+    // a worker writing after this point sees sleeping, one which wrote before is seen by has_frames
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int ready = has_frames(reader);
+    if (!ready) {
+        futex_wait(&header->wakeups, wakeups, timeoutMsec);
+        ready = has_frames(reader);
+    }
+    __atomic_store_n(&header->sleeping, 0, __ATOMIC_RELAXED);
+    return ready;
+}
+
+int
+gw_shm_reader_workers(gw_shm_reader_t *reader)
+{
+    int count = 0;
+    int i;
+    for (i = 0; i < reader->workers; i++) {
+        count += __atomic_load_n(&reader->rings[i].owner, __ATOMIC_RELAXED) != 0;
+    }
+    return count;
+}
+
+size_t
+gw_shm_reader_depth(gw_shm_reader_t *reader)
+{
+    size_t depth = 0;
+    int i;
+    for (i = 0; i < reader->workers; i++) {
+        depth += __atomic_load_n(&reader->rings[i].head, __ATOMIC_ACQUIRE)
+                - __atomic_load_n(&reader->rings[i].tail, __ATOMIC_ACQUIRE);
+    }
+    return depth;
+}
+
+uint64_t
+gw_shm_reader_dropped(gw_shm_reader_t *reader)
+{
+    uint64_t dropped = 0;
+    int i;
+    for (i = 0; i < reader->workers; i++) {
+        dropped += __atomic_load_n(&reader->rings[i].dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
+
+uint64_t
+gw_shm_reader_corrupted(gw_shm_reader_t *reader)
+{
+    return __atomic_load_n(&reader->corrupted, __ATOMIC_RELAXED);
+}
+
+/**
+* Takes a free ring, or the ring of a worker which died.
+*/
+static gw_shm_ring_t *
+claim_ring(gw_shm_ring_t *rings, int workers)
+{
+    int32_t pid = (int32_t) getpid();
+    int i;
+    for (i = 0; i < workers; i++) {
+        int32_t owner = __atomic_load_n(&rings[i].owner, __ATOMIC_ACQUIRE);
+        if (owner != 0 && (owner == pid || kill(owner, 0) == 0 || errno != ESRCH)) {
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&rings[i].owner, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return &rings[i];
+        }
+    }
+    return NULL;
+}
+
+gw_shm_writer_t *
+gw_shm_writer_open(const char *endpoint)
+{
+    char name[256];
+    if (object_name(endpoint, name, sizeof(name)) == -1) {
+        return NULL;
+    }
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1 || (size_t) info.st_size < sizeof(gw_shm_header_t)) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    size_t length = (size_t) info.st_size;
+    char *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+
+    gw_shm_header_t *header = (gw_shm_header_t *) base;
+    int error = 0;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != GW_SHM_MAGIC || header->version != GW_SHM_VERSION
+            || header->data_offset + header->workers * header->ring_size > length) {
+        error = EPROTO;
+    } else if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE)) {
+        error = ENOENT;
+    }
+    gw_shm_ring_t *ring = error == 0 ? claim_ring((gw_shm_ring_t *) (base + sizeof(gw_shm_header_t)), header->workers)
+                                     : NULL;
+    if (ring == NULL) {
+        munmap(base, length);
+        close(fd);
+        errno = error != 0 ? error : EBUSY;
+        return NULL;
+    }
+
+    gw_shm_writer_t *writer = (gw_shm_writer_t *) calloc(1, sizeof(gw_shm_writer_t));
+    if (writer == NULL) {
+        __atomic_store_n(&ring->owner, 0, __ATOMIC_RELEASE);
+        munmap(base, length);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    writer->fd = fd;
+    writer->length = length;
+    writer->base = base;
+    writer->header = header;
+    writer->ring = ring;
+    writer->size = header->ring_size;
+    writer->mask = header->ring_size - 1;
+    int index = (int) (ring - (gw_shm_ring_t *) (base + sizeof(gw_shm_header_t)));
+    writer->data = base + header->data_offset + index * header->ring_size;
+    // a reclaimed ring goes on from where the dead worker stopped
+    writer->head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    writer->pending = writer->head;
+    writer->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return writer;
+}
+
+int
+gw_shm_writer_send(gw_shm_writer_t *writer, const void *data, size_t size, int more)
+{
+    if (__atomic_load_n(&writer->header->closed, __ATOMIC_ACQUIRE)) {
+        errno = EPIPE;
+        return -1;
+    }
+    if (writer->discarding) {
+        writer->discarding = more != 0;
+        return 1;
+    }
+
+    uint64_t span = record_span(size);
+    uint64_t offset = writer->pending & writer->mask;
+    // a frame is never split, the rest of the ring is skipped when it doesn't fit
+    uint64_t skipped = writer->size - offset < span ? writer->size - offset : 0;
+    uint64_t end = writer->pending + skipped + span;
+
+    // the padding only depends on where the ring stands: a message fitting in half the ring always fits once it's empty
+    if (writer->message + span > writer->size / 2) {
+        writer->pending = writer->head;
+        writer->message = 0;
+        writer->discarding = more != 0;
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (end - writer->cached_tail > writer->size) {
+        writer->cached_tail = __atomic_load_n(&writer->ring->tail, __ATOMIC_ACQUIRE);
+        if (end - writer->cached_tail > writer->size) {
+            writer->pending = writer->head;
+            writer->message = 0;
+            writer->discarding = more != 0;
+            __atomic_add_fetch(&writer->ring->dropped, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+
+    uint32_t header[2];
+    if (skipped > 0) {
+        header[0] = 0;
+        header[1] = GW_SHM_FLAG_WRAP;
+        memcpy(writer->data + offset, header, sizeof(header));
+        offset = 0;
+    }
+    header[0] = (uint32_t) size;
+    header[1] = more ? GW_SHM_FLAG_MORE : 0;
+    memcpy(writer->data + offset, header, sizeof(header));
+    memcpy(writer->data + offset + GW_SHM_RECORD_HEADER_SIZE, data, size);
+    writer->pending = end;
+    writer->message += span;
+    if (more) {
+        return 0;
+    }
+    writer->message = 0;
+
+    writer->head = end;
+    __atomic_store_n(&writer->ring->head, end, __ATOMIC_RELEASE);
+    // pairs with the fence of gw_shm_reader_wait: either the adaptor sees the message, or this sees it sleeping
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&writer->header->sleeping, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&writer->header->wakeups, 1, __ATOMIC_RELEASE);
+        futex_wake(&writer->header->wakeups);
+    }
+    return 0;
+}
+
+void
+gw_shm_writer_close(gw_shm_writer_t **writer)
+{
+    gw_shm_writer_t *self = *writer;
+    __atomic_store_n(&self->ring->owner, 0, __ATOMIC_RELEASE);
+    munmap(self->base, self->length);
+    close(self->fd);
+    free(self);
+    *writer = NULL;
+}
@@ -0,0 +1,132 @@
+#ifndef GW_SHM_H
+#define GW_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+* Shared memory ingress, for gateway workers running on the same host as the adaptor.
+*
+* A -b endpoint such as "shm://gateway" makes the adaptor create the POSIX shared memory object "/gateway", holding
+* one single producer, single consumer ring per gateway worker. A worker claims a free ring with
+* gw_shm_writer_open() and copies its messages straight into it, without any syscall while the adaptor is busy;
+* the shard draining the rings sleeps on a futex when they're all empty, and only then do the workers wake it up.
+*
+* A frame is stored as its size ( 32 bits ), its flags ( 32 bits ) and its bytes, padded to 8 bytes. Frames of a
+* multipart message are made visible to the adaptor at once when its last frame is written, and a message which
+* doesn't fit in the free space of the ring is dropped as a whole.
+*
+* This file and GwZmqShm.c only depend on the C library so the gateway can embed them as they are
+* ( make producer-lib builds them as libgwzmqshm.a ).
+*/
+#define GW_SHM_SCHEME "shm://"
+
+#define GW_SHM_MAGIC 0x48535747
+
+#define GW_SHM_VERSION 1
+
+/**
+* Default number of rings, i.e. of gateway workers which can write at the same time.
+*/
+#define DEFAULT_SHM_WORKERS 32
+
+#define GW_SHM_MAX_WORKERS 1024
+
+/**
+* Default size of each ring ( in bytes ), rounded up to a power of 2.
+*/
+#define DEFAULT_SHM_RING_SIZE (1024 * 1024)
+
+#define GW_SHM_MIN_RING_SIZE 4096
+
+#define GW_SHM_RECORD_HEADER_SIZE 8
+
+/** more frames of the same message follow this one */
+#define GW_SHM_FLAG_MORE 1
+/** the rest of the ring is unused, the next frame starts at the beginning of the ring */
+#define GW_SHM_FLAG_WRAP 2
+
+typedef struct _gw_shm_reader_t gw_shm_reader_t;
+
+typedef struct _gw_shm_writer_t gw_shm_writer_t;
+
+/**
+* Creates the shared memory object of an ingress endpoint, replacing any previous one, with a ring of ringSize
+* bytes for each of the workers. The object can only be opened by the user and the group of the adaptor.
+* Returns NULL on failure, in which case errno tells why.
+*/
+gw_shm_reader_t *
+gw_shm_reader_new(const char *endpoint, int workers, size_t ringSize);
+
+/**
+* Tells the workers the endpoint is closed, then removes the shared memory object.
+*/
+void
+gw_shm_reader_destroy(gw_shm_reader_t **reader);
+
+/**
+* How long gw_shm_reader_wait() polls the rings before sleeping, in microseconds.
+*/
+void
+gw_shm_reader_set_spin(gw_shm_reader_t *reader, int spinUsec);
+
+/**
+* Points data to the next frame, taking the rings in turn one message at a time.
+* Returns 1 if there's a frame, which stays valid until gw_shm_reader_release(), or 0 if the rings are empty.
+* The frames are checked against the bounds of their ring: a ring holding one which isn't valid is emptied and
+* counted by gw_shm_reader_corrupted(), and a message whose first frames were already handed out ends with an
+* empty frame.
+*/
+int
+gw_shm_reader_peek(gw_shm_reader_t *reader, const void **data, size_t *size, int *more);
+
+void
+gw_shm_reader_release(gw_shm_reader_t *reader);
+
+/**
+* Waits up to timeoutMsec for a frame: spins first, then sleeps until a worker writes to one of the rings.
+* Returns 1 when there's a frame to read, 0 otherwise.
+*/
+int
+gw_shm_reader_wait(gw_shm_reader_t *reader, int timeoutMsec);
+
+int
+gw_shm_reader_workers(gw_shm_reader_t *reader);
+
+size_t
+gw_shm_reader_depth(gw_shm_reader_t *reader);
+
+uint64_t
+gw_shm_reader_dropped(gw_shm_reader_t *reader);
+
+/**
+* Number of times a ring was emptied because its indexes or one of its frames were invalid.
+*/
+uint64_t
+gw_shm_reader_corrupted(gw_shm_reader_t *reader);
+
+/**
+* Attaches a gateway worker to the shared memory object of endpoint and claims a ring for it; the rings of the
+* workers which died are reclaimed. Each worker opens its own writer after it's forked, and uses it from one thread.
+* Returns NULL on failure, in which case errno is ENOENT when the adaptor isn't running, EBUSY when all the rings
+* are taken and EPROTO when the adaptor runs another version.
+*/
+gw_shm_writer_t *
+gw_shm_writer_open(const char *endpoint);
+
+/**
+* Writes a frame; more is non zero when other frames of the same message follow it.
+* Returns 0 when the frame is written, 1 when the message is dropped because the ring is full, or -1 on failure in
+* which case errno is EMSGSIZE for a message whose frames take more than half the ring, or EPIPE when the adaptor closed the
+* endpoint: the worker should close the writer and open a new one.
+*/
+int
+gw_shm_writer_send(gw_shm_writer_t *writer, const void *data, size_t size, int more);
+
+/**
+* Releases the ring; a message whose last frame wasn't written is dropped.
+*/
+void
+gw_shm_writer_close(gw_shm_writer_t **writer);
+
+#endif
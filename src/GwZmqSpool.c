@@ -0,0 +1,584 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqSpool.h"
+#include "GwZmqMetrics.h"
+#include "czmq.h"
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#define GW_SPOOL_MAGIC "GWS1"
+#define GW_SPOOL_VERSION 1
+#define GW_SPOOL_HEADER_SIZE 64
+#define GW_SPOOL_RECORD_HEADER_SIZE 4
+#define GW_SPOOL_MORE_FLAG 0x80000000u
+#define GW_SPOOL_SIZE_MASK 0x7fffffffu
+
+/**
+* Header at the beginning of each segment file; offsets are relative to the beginning of the file.
+*/
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t id;
+    uint64_t write_offset;
+    uint64_t read_offset;
+    int64_t created_at;
+    int64_t updated_at;
+} gw_spool_header_t;
+
+typedef struct {
+    uint64_t id;
+    char path[PATH_MAX];
+    int fd;
+    unsigned char *data;
+    gw_spool_header_t *header;
+    /** offsets of the header as last synced, only used by the sync thread */
+    uint64_t synced_offset;
+    uint64_t synced_read_offset;
+} gw_segment_t;
+
+struct _gw_spool_t {
+    char directory[PATH_MAX];
+    size_t segment_size;
+    int max_segments;
+    int retention_secs;
+    int sync_interval_msec;
+    /** protects the list of segments against the sync thread while segments are added or removed */
+    pthread_mutex_t lock;
+    gw_segment_t **segments;
+    int count;
+    uint64_t next_id;
+    int64_t expired_at;
+    volatile int running;
+    pthread_t sync_thread;
+    /** the last frame appended has more frames following it */
+    int in_message;
+    /** the first frames of the message being appended were evicted, the rest of it is discarded */
+    int truncated;
+
+    uint64_t spooled;
+    uint64_t replayed;
+    uint64_t rejected;
+    uint64_t evicted_segments;
+    uint64_t syncs;
+};
+
+static void
+close_segment(gw_spool_t *spool, gw_segment_t *segment, int removeFile)
+{
+    munmap(segment->data, spool->segment_size);
+    close(segment->fd);
+    if (removeFile) {
+        unlink(segment->path);
+    }
+    free(segment);
+}
+
+static gw_segment_t *
+map_segment(gw_spool_t *spool, uint64_t id, int create)
+{
+    gw_segment_t *segment = (gw_segment_t *) calloc(1, sizeof(gw_segment_t));
+    assert( segment );
+    segment->id = id;
+    snprintf(segment->path, sizeof(segment->path), "%s/%020llu.seg", spool->directory, (unsigned long long) id);
+
+    segment->fd = open(segment->path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    if (segment->fd == -1) {
+        fprintf(stderr, "Could not open spool segment %s: %s\n", segment->path, strerror(errno));
+        free(segment);
+        return NULL;
+    }
+    if (create && ftruncate(segment->fd, spool->segment_size) == -1) {
+        fprintf(stderr, "Could not allocate spool segment %s: %s\n", segment->path, strerror(errno));
+        close(segment->fd);
+        unlink(segment->path);
+        free(segment);
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(segment->fd, &info) == -1 || (size_t) info.st_size != spool->segment_size) {
+        fprintf(stderr, "Ignoring spool segment %s which isn't %zu bytes long\n", segment->path, spool->segment_size);
+        close(segment->fd);
+        free(segment);
+        return NULL;
+    }
+
+    segment->data = (unsigned char *) mmap(NULL, spool->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (segment->data == MAP_FAILED) {
+        fprintf(stderr, "Could not map spool segment %s: %s\n", segment->path, strerror(errno));
+        close(segment->fd);
+        free(segment);
+        return NULL;
+    }
+    segment->header = (gw_spool_header_t *) segment->data;
+
+    if (create) {
+        memcpy(segment->header->magic, GW_SPOOL_MAGIC, 4);
+        segment->header->version = GW_SPOOL_VERSION;
+        segment->header->id = id;
+        segment->header->write_offset = GW_SPOOL_HEADER_SIZE;
+        segment->header->read_offset = GW_SPOOL_HEADER_SIZE;
+        segment->header->created_at = zclock_time();
+        segment->header->updated_at = segment->header->created_at;
+    } else if (memcmp(segment->header->magic, GW_SPOOL_MAGIC, 4) != 0
+            || segment->header->write_offset > spool->segment_size
+            || segment->header->read_offset > segment->header->write_offset) {
+        fprintf(stderr, "Ignoring corrupted spool segment %s\n", segment->path);
+        munmap(segment->data, spool->segment_size);
+        close(segment->fd);
+        free(segment);
+        return NULL;
+    }
+    segment->synced_offset = segment->header->write_offset;
+    segment->synced_read_offset = segment->header->read_offset;
+    return segment;
+}
+
+/**
+* Returns 1 when the last frame of a segment has more frames following it, in the next segment.
+*/
+static int
+ends_in_message(gw_segment_t *segment)
+{
+    uint64_t offset = GW_SPOOL_HEADER_SIZE;
+    uint32_t record = 0;
+
+    while (offset < segment->header->write_offset) {
+        memcpy(&record, segment->data + offset, sizeof(record));
+        offset += GW_SPOOL_RECORD_HEADER_SIZE + (record & GW_SPOOL_SIZE_MASK);
+    }
+    return (record & GW_SPOOL_MORE_FLAG) != 0;
+}
+
+/**
+* Moves the read offsets past the frames a message whose beginning was evicted left at the start of the oldest
+* segments, up to and including its last frame. Its frames still to be appended are discarded.
+*/
+static void
+skip_truncated_message(gw_spool_t *spool)
+{
+    int i;
+    for (i = 0; i < spool->count; i++) {
+        gw_segment_t *segment = spool->segments[i];
+        uint64_t offset = segment->header->read_offset;
+        while (offset < segment->header->write_offset) {
+            uint32_t record;
+            memcpy(&record, segment->data + offset, sizeof(record));
+            offset += GW_SPOOL_RECORD_HEADER_SIZE + (record & GW_SPOOL_SIZE_MASK);
+            if (!(record & GW_SPOOL_MORE_FLAG)) {
+                segment->header->read_offset = offset;
+                return;
+            }
+        }
+        segment->header->read_offset = offset;
+    }
+    spool->truncated = spool->in_message;
+}
+
+/**
+* Drops the oldest segment, with the messages it still holds; a message it only holds the beginning of is dropped
+* whole. Called with the lock held.
+*/
+static void
+evict_oldest_segment(gw_spool_t *spool, int replayed)
+{
+    int truncated = !replayed && ends_in_message(spool->segments[0]);
+    close_segment(spool, spool->segments[0], 1);
+
+    memmove(spool->segments, spool->segments + 1, (spool->count - 1) * sizeof(gw_segment_t *));
+    spool->count--;
+    if (!replayed) {
+        GW_COUNTER_ADD(spool->evicted_segments, 1);
+    }
+    // unless it was replayed already, which leaves the next segment read from the end of the message
+    if (truncated && (spool->count == 0 || spool->segments[0]->header->read_offset == GW_SPOOL_HEADER_SIZE)) {
+        skip_truncated_message(spool);
+        GW_COUNTER_ADD(spool->rejected, 1);
+    }
+}
+
+static void
+expire_segments(gw_spool_t *spool)
+{
+    int64_t now = zclock_time();
+
+    // checked at most once per second
+    if (now - spool->expired_at < 1000) {
+        return;
+    }
+    spool->expired_at = now;
+
+    pthread_mutex_lock(&spool->lock);
+    while (spool->count > 1
+            && now - spool->segments[0]->header->updated_at > (int64_t) spool->retention_secs * 1000) {
+        evict_oldest_segment(spool, 0);
+    }
+    pthread_mutex_unlock(&spool->lock);
+}
+
+static gw_segment_t *
+rotate_segment(gw_spool_t *spool)
+{
+    pthread_mutex_lock(&spool->lock);
+    if (spool->count == spool->max_segments) {
+        evict_oldest_segment(spool, 0);
+    }
+    gw_segment_t *segment = map_segment(spool, spool->next_id, 1);
+    if (segment != NULL) {
+        spool->next_id++;
+        spool->segments[spool->count++] = segment;
+    }
+    pthread_mutex_unlock(&spool->lock);
+    return segment;
+}
+
+/**
+* Group commit: syncs what's been appended to each segment since the previous pass, then the header, so the offsets
+* on disk never point past data which isn't there.
+*/
+static void*
+spool_sync_thread(void *args)
+{
+    gw_spool_t *spool = (gw_spool_t *) args;
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    while (spool->running) {
+        zclock_sleep(spool->sync_interval_msec);
+
+        pthread_mutex_lock(&spool->lock);
+        int i;
+        for (i = 0; i < spool->count; i++) {
+            gw_segment_t *segment = spool->segments[i];
+            uint64_t written = __atomic_load_n(&segment->header->write_offset, __ATOMIC_ACQUIRE);
+            uint64_t read = __atomic_load_n(&segment->header->read_offset, __ATOMIC_RELAXED);
+            if (written == segment->synced_offset && read == segment->synced_read_offset) {
+                continue;
+            }
+            // the segment may have been rewound after being replayed; the first page goes with the header
+            uint64_t from = written > segment->synced_offset ? segment->synced_offset : 0;
+            from -= from % pageSize;
+            if (from < (uint64_t) pageSize) {
+                from = pageSize;
+            }
+            if (written > from) {
+                msync(segment->data + from, written - from, MS_SYNC);
+            }
+            msync(segment->data, pageSize, MS_SYNC);
+            segment->synced_offset = written;
+            segment->synced_read_offset = read;
+            GW_COUNTER_ADD(spool->syncs, 1);
+        }
+        pthread_mutex_unlock(&spool->lock);
+    }
+    return NULL;
+}
+
+static int
+compare_ids(const void *a, const void *b)
+{
+    uint64_t first = *(const uint64_t *) a;
+    uint64_t second = *(const uint64_t *) b;
+    return first < second ? -1 : first > second;
+}
+
+static void
+recover_segments(gw_spool_t *spool)
+{
+    DIR *directory = opendir(spool->directory);
+    if (directory == NULL) {
+        return;
+    }
+
+    uint64_t *ids = (uint64_t *) calloc(spool->max_segments, sizeof(uint64_t));
+    int found = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        unsigned long long id;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%20llu.%3s", &id, suffix) == 2 && streq(suffix, "seg") && found < spool->max_segments) {
+            ids[found++] = id;
+        }
+    }
+    closedir(directory);
+
+    qsort(ids, found, sizeof(uint64_t), compare_ids);
+    int i;
+    for (i = 0; i < found; i++) {
+        gw_segment_t *segment = map_segment(spool, ids[i], 0);
+        if (segment != NULL) {
+            spool->segments[spool->count++] = segment;
+            spool->next_id = ids[i] + 1;
+        }
+    }
+    free(ids);
+
+    if (spool->count > 0) {
+        fprintf(stderr, "Recovered %d spool segment(s) from %s\n", spool->count, spool->directory);
+    }
+}
+
+gw_spool_t *
+gw_spool_new(const char *directory, size_t segmentSize, int maxSegments, int retentionSecs, int syncIntervalMsec)
+{
+    if (mkdir(directory, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Could not create the spool directory %s: %s\n", directory, strerror(errno));
+        return NULL;
+    }
+    assert( segmentSize > GW_SPOOL_HEADER_SIZE + GW_SPOOL_RECORD_HEADER_SIZE && maxSegments >= 1 );
+
+    gw_spool_t *spool = (gw_spool_t *) calloc(1, sizeof(gw_spool_t));
+    assert( spool );
+    snprintf(spool->directory, sizeof(spool->directory), "%s", directory);
+    spool->segment_size = segmentSize;
+    spool->max_segments = maxSegments;
+    spool->retention_secs = retentionSecs;
+    spool->sync_interval_msec = syncIntervalMsec;
+    spool->segments = (gw_segment_t **) calloc(maxSegments, sizeof(gw_segment_t *));
+    assert( spool->segments );
+    pthread_mutex_init(&spool->lock, NULL);
+
+    recover_segments(spool);
+
+    spool->running = 1;
+    int result = pthread_create(&spool->sync_thread, NULL, spool_sync_thread, spool);
+    assert( result == 0 );
+    return spool;
+}
+
+void
+gw_spool_destroy(gw_spool_t **spool)
+{
+    gw_spool_t *self = *spool;
+
+    self->running = 0;
+    pthread_join(self->sync_thread, NULL);
+
+    int i;
+    for (i = 0; i < self->count; i++) {
+        gw_segment_t *segment = self->segments[i];
+        msync(segment->data, self->segment_size, MS_SYNC);
+        close_segment(self, segment, 0);
+    }
+    pthread_mutex_destroy(&self->lock);
+    free(self->segments);
+    free(self);
+    *spool = NULL;
+}
+
+/**
+* Appends a frame to the spool. more tells whether other frames of the same message follow.
+* Returns 0 on success or -1 when the frame can't be spooled.
+*/
+int
+gw_spool_append(gw_spool_t *spool, const void *data, size_t size, int more)
+{
+    size_t needed = GW_SPOOL_RECORD_HEADER_SIZE + size;
+    int fits = needed <= spool->segment_size - GW_SPOOL_HEADER_SIZE && size <= GW_SPOOL_SIZE_MASK;
+
+    gw_segment_t *segment = spool->count > 0 ? spool->segments[spool->count - 1] : NULL;
+    if (fits && (segment == NULL || segment->header->write_offset + needed > spool->segment_size)) {
+        // evicting the oldest segment may truncate the message this frame belongs to
+        segment = rotate_segment(spool);
+    }
+    spool->in_message = more;
+    if (spool->truncated) {
+        // already counted as rejected when its beginning was evicted
+        spool->truncated = more;
+        return 0;
+    }
+    if (!fits || segment == NULL) {
+        GW_COUNTER_ADD(spool->rejected, 1);
+        return -1;
+    }
+
+    uint64_t offset = segment->header->write_offset;
+    uint32_t record = (uint32_t) size | (more ? GW_SPOOL_MORE_FLAG : 0);
+    memcpy(segment->data + offset, &record, sizeof(record));
+    memcpy(segment->data + offset + GW_SPOOL_RECORD_HEADER_SIZE, data, size);
+    segment->header->updated_at = zclock_time();
+    __atomic_store_n(&segment->header->write_offset, offset + needed, __ATOMIC_RELEASE);
+
+    if (!more) {
+        GW_COUNTER_ADD(spool->spooled, 1);
+    }
+    return 0;
+}
+
+/**
+* Returns 1 when there are spooled messages left to replay.
+*/
+int
+gw_spool_pending(gw_spool_t *spool)
+{
+    int i;
+
+    expire_segments(spool);
+    for (i = 0; i < spool->count; i++) {
+        if (spool->segments[i]->header->read_offset < spool->segments[i]->header->write_offset) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+* Messages spooled so far, read from any thread.
+*/
+uint64_t
+gw_spool_spooled(gw_spool_t *spool)
+{
+    return GW_COUNTER_GET(spool->spooled);
+}
+
+/**
+* Finds where the message starting at the read offset of the oldest segment ends, its frames may be spread over
+* several segments: sets the segment holding its last frame and the offset right after that frame.
+* Returns 0 when its last frame isn't in the spool.
+*/
+static int
+message_end(gw_spool_t *spool, int *lastSegment, uint64_t *end)
+{
+    int index = 0;
+    uint64_t offset = spool->segments[0]->header->read_offset;
+
+    while (index < spool->count) {
+        gw_segment_t *segment = spool->segments[index];
+        if (offset >= segment->header->write_offset) {
+            if (++index < spool->count) {
+                offset = spool->segments[index]->header->read_offset;
+            }
+            continue;
+        }
+        uint32_t record;
+        memcpy(&record, segment->data + offset, sizeof(record));
+        offset += GW_SPOOL_RECORD_HEADER_SIZE + (record & GW_SPOOL_SIZE_MASK);
+        if (!(record & GW_SPOOL_MORE_FLAG)) {
+            *lastSegment = index;
+            *end = offset;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+* Sends up to maxMessages spooled messages on socket, oldest first, without blocking.
+* The read offsets only move past a message once all its frames are sent, so a message the socket refuses is
+* replayed whole on the next call.
+* Replayed segments are removed; the last one is rewound so it's reused for the next outage.
+* Returns the number of messages sent.
+*/
+int
+gw_spool_replay(gw_spool_t *spool, void *socket, int maxMessages)
+{
+    int replayed = 0;
+    int i;
+
+    while (spool->count > 0 && replayed < maxMessages) {
+        gw_segment_t *segment = spool->segments[0];
+        gw_spool_header_t *header = segment->header;
+
+        if (header->read_offset >= header->write_offset) {
+            if (spool->count > 1) {
+                pthread_mutex_lock(&spool->lock);
+                evict_oldest_segment(spool, 1);
+                pthread_mutex_unlock(&spool->lock);
+                continue;
+            }
+            header->read_offset = GW_SPOOL_HEADER_SIZE;
+            header->write_offset = GW_SPOOL_HEADER_SIZE;
+            break;
+        }
+
+        int lastSegment;
+        uint64_t end;
+        if (!message_end(spool, &lastSegment, &end)) {
+            if (spool->in_message) {
+                // the rest of the message is being spooled
+                break;
+            }
+            // its last frame never made it to the spool: dropped rather than left unfinished on the socket
+            for (i = 0; i < spool->count; i++) {
+                spool->segments[i]->header->read_offset = spool->segments[i]->header->write_offset;
+            }
+            GW_COUNTER_ADD(spool->rejected, 1);
+            continue;
+        }
+
+        int index = 0;
+        uint64_t offset = header->read_offset;
+        int sent = 0;
+        int first = 1;
+        int more = 1;
+        while (more) {
+            gw_segment_t *current = spool->segments[index];
+            if (offset >= current->header->write_offset) {
+                offset = spool->segments[++index]->header->read_offset;
+                continue;
+            }
+            uint32_t record;
+            memcpy(&record, current->data + offset, sizeof(record));
+            size_t size = record & GW_SPOOL_SIZE_MASK;
+            more = (record & GW_SPOOL_MORE_FLAG) != 0;
+
+            // once the first frame is taken the XPUB takes the rest of the message, whatever its high water mark
+            sent = zmq_send(socket, current->data + offset + GW_SPOOL_RECORD_HEADER_SIZE, size,
+                            (first ? ZMQ_DONTWAIT : 0) | (more ? ZMQ_SNDMORE : 0));
+            if (sent == -1) {
+                break;
+            }
+            first = 0;
+            offset += GW_SPOOL_RECORD_HEADER_SIZE + size;
+        }
+        if (sent == -1) {
+            // the consumers can't keep up, try again on the next wakeup
+            break;
+        }
+        for (i = 0; i < lastSegment; i++) {
+            spool->segments[i]->header->read_offset = spool->segments[i]->header->write_offset;
+        }
+        spool->segments[lastSegment]->header->read_offset = end;
+        replayed++;
+    }
+
+    if (replayed > 0) {
+        GW_COUNTER_ADD(spool->replayed, replayed);
+    }
+    return replayed;
+}
+
+/**
+* Metrics collector for the spool.
+*/
+void
+gw_spool_render(FILE *out, void *self)
+{
+    gw_spool_t *spool = (gw_spool_t *) self;
+
+    fprintf(out, "# TYPE gw_zmq_spooled_total counter\ngw_zmq_spooled_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(spool->spooled));
+    fprintf(out, "# TYPE gw_zmq_spool_replayed_total counter\ngw_zmq_spool_replayed_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(spool->replayed));
+    fprintf(out, "# TYPE gw_zmq_spool_rejected_total counter\ngw_zmq_spool_rejected_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(spool->rejected));
+    fprintf(out, "# TYPE gw_zmq_spool_evicted_segments_total counter\ngw_zmq_spool_evicted_segments_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(spool->evicted_segments));
+    fprintf(out, "# TYPE gw_zmq_spool_syncs_total counter\ngw_zmq_spool_syncs_total %llu\n",
+            (unsigned long long) GW_COUNTER_GET(spool->syncs));
+    fprintf(out, "# TYPE gw_zmq_spool_segments gauge\ngw_zmq_spool_segments %d\n", __atomic_load_n(&spool->count, __ATOMIC_RELAXED));
+}
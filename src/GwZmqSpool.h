@@ -0,0 +1,59 @@
+#ifndef GW_SPOOL_H
+#define GW_SPOOL_H
+
+#include "czmq.h"
+
+/**
+* Default size of a spool segment file.
+*/
+#define DEFAULT_SPOOL_SEGMENT_SIZE (64 * 1024 * 1024)
+
+/**
+* Default number of segments kept on disk; when they're all full the oldest one is dropped.
+*/
+#define DEFAULT_SPOOL_SEGMENTS 16
+
+/**
+* Default number of seconds spooled messages are kept for.
+*/
+#define DEFAULT_SPOOL_RETENTION_SECS 3600
+
+/**
+* Default interval between two group commits of the spooled messages to disk.
+*/
+#define DEFAULT_SPOOL_SYNC_INTERVAL_MSEC 100
+
+typedef struct _gw_spool_t gw_spool_t;
+
+/**
+* Append-only disk spool made of fixed-size, memory-mapped segment files.
+*
+* Each frame is stored as a 4 bytes header, holding its size and whether more frames follow, followed by its data.
+* Appending is a memcpy into the mapped segment; a background thread msyncs what's been appended since the
+* previous commit every sync interval, so a burst of appends costs one sync.
+*
+* Appending and replaying belong to the thread owning the XPUB socket. Segments left on disk by a previous run are
+* replayed too.
+*/
+gw_spool_t *
+gw_spool_new(const char *directory, size_t segmentSize, int maxSegments, int retentionSecs, int syncIntervalMsec);
+
+void
+gw_spool_destroy(gw_spool_t **spool);
+
+int
+gw_spool_append(gw_spool_t *spool, const void *data, size_t size, int more);
+
+int
+gw_spool_pending(gw_spool_t *spool);
+
+uint64_t
+gw_spool_spooled(gw_spool_t *spool);
+
+int
+gw_spool_replay(gw_spool_t *spool, void *socket, int maxMessages);
+
+void
+gw_spool_render(FILE *out, void *spool);
+
+#endif
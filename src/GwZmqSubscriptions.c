@@ -0,0 +1,237 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+#include "GwZmqSubscriptions.h"
+#include "GwZmqMetrics.h"
+#include "czmq.h"
+
+/**
+* Bucket 256 holds the empty prefix.
+*/
+#define GW_SUBSCRIPTIONS_BUCKETS 257
+
+typedef struct {
+    unsigned char *prefix;
+    size_t size;
+    uint64_t subscribers;
+    /** messages matching the topic */
+    uint64_t messages;
+    /** copies delivered to the subscribers of the topic */
+    uint64_t deliveries;
+} gw_topic_t;
+
+typedef struct {
+    gw_topic_t *topics;
+    int count;
+    int capacity;
+} gw_bucket_t;
+
+struct _gw_subscriptions_t {
+    pthread_mutex_t lock;
+    gw_bucket_t buckets[GW_SUBSCRIPTIONS_BUCKETS];
+    size_t topic_count;
+};
+
+gw_subscriptions_t *
+gw_subscriptions_new(void)
+{
+    gw_subscriptions_t *subscriptions = (gw_subscriptions_t *) calloc(1, sizeof(gw_subscriptions_t));
+    assert( subscriptions );
+    pthread_mutex_init(&subscriptions->lock, NULL);
+    return subscriptions;
+}
+
+void
+gw_subscriptions_destroy(gw_subscriptions_t **subscriptions)
+{
+    int i, j;
+    for (i = 0; i < GW_SUBSCRIPTIONS_BUCKETS; i++) {
+        gw_bucket_t *bucket = &(*subscriptions)->buckets[i];
+        for (j = 0; j < bucket->count; j++) {
+            free(bucket->topics[j].prefix);
+        }
+        free(bucket->topics);
+    }
+    pthread_mutex_destroy(&(*subscriptions)->lock);
+    free(*subscriptions);
+    *subscriptions = NULL;
+}
+
+static gw_bucket_t *
+bucket_of(gw_subscriptions_t *subscriptions, const unsigned char *prefix, size_t size)
+{
+    return &subscriptions->buckets[size == 0 ? 256 : prefix[0]];
+}
+
+/**
+* Applies a subscription frame received on the XPUB: a first byte of 1 subscribes to the topic that follows,
+* 0 unsubscribes from it.
+* A verboser XPUB sends every unsubscription, each one releases a subscription and the last one removes the topic.
+* Before ZMQ_XPUB_VERBOSER, libzmq only sends the last unsubscription of a topic, which removes it: the subscriber
+* count of a topic can then only grow while it's active, and is the number of subscriptions received since.
+* Returns one of the GW_SUBSCRIPTION_* codes.
+*/
+int
+gw_subscriptions_update(gw_subscriptions_t *subscriptions, const void *frame, size_t size)
+{
+    const unsigned char *data = (const unsigned char *) frame;
+
+    if (size == 0 || data[0] > 1) {
+        return GW_SUBSCRIPTION_IGNORED;
+    }
+
+    int subscribe = data[0] == 1;
+    const unsigned char *prefix = data + 1;
+    size_t prefixSize = size - 1;
+    gw_bucket_t *bucket = bucket_of(subscriptions, prefix, prefixSize);
+
+    int i;
+    for (i = 0; i < bucket->count; i++) {
+        gw_topic_t *topic = &bucket->topics[i];
+        if (topic->size != prefixSize || memcmp(topic->prefix, prefix, prefixSize) != 0) {
+            continue;
+        }
+        if (subscribe) {
+            GW_COUNTER_ADD(topic->subscribers, 1);
+            return GW_SUBSCRIPTION_REFERENCED;
+        }
+#ifdef ZMQ_XPUB_VERBOSER
+        if (topic->subscribers > 1) {
+            GW_COUNTER_ADD(topic->subscribers, -1);
+            return GW_SUBSCRIPTION_RELEASED;
+        }
+#endif
+
+        pthread_mutex_lock(&subscriptions->lock);
+        free(topic->prefix);
+        bucket->topics[i] = bucket->topics[--bucket->count];
+        subscriptions->topic_count--;
+        pthread_mutex_unlock(&subscriptions->lock);
+        return GW_SUBSCRIPTION_REMOVED;
+    }
+
+    if (!subscribe) {
+        return GW_SUBSCRIPTION_IGNORED;
+    }
+
+    pthread_mutex_lock(&subscriptions->lock);
+    if (bucket->count == bucket->capacity) {
+        bucket->capacity = bucket->capacity == 0 ? 4 : bucket->capacity * 2;
+        bucket->topics = (gw_topic_t *) realloc(bucket->topics, bucket->capacity * sizeof(gw_topic_t));
+        assert( bucket->topics );
+    }
+    gw_topic_t *topic = &bucket->topics[bucket->count++];
+    memset(topic, 0, sizeof(gw_topic_t));
+    topic->prefix = (unsigned char *) malloc(prefixSize + 1);
+    assert( topic->prefix );
+    memcpy(topic->prefix, prefix, prefixSize);
+    topic->size = prefixSize;
+    topic->subscribers = 1;
+    subscriptions->topic_count++;
+    pthread_mutex_unlock(&subscriptions->lock);
+
+    return GW_SUBSCRIPTION_ADDED;
+}
+
+static int
+match_bucket(gw_bucket_t *bucket, const unsigned char *data, size_t size)
+{
+    int matches = 0;
+    int i;
+
+    for (i = 0; i < bucket->count; i++) {
+        gw_topic_t *topic = &bucket->topics[i];
+        if (topic->size <= size && memcmp(topic->prefix, data, topic->size) == 0) {
+            GW_COUNTER_ADD(topic->messages, 1);
+            GW_COUNTER_ADD(topic->deliveries, topic->subscribers);
+            matches++;
+        }
+    }
+    return matches;
+}
+
+/**
+* Returns the number of topics matching the first frame of a message, 0 when nobody subscribed to it.
+*/
+int
+gw_subscriptions_match(gw_subscriptions_t *subscriptions, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    int matches = match_bucket(&subscriptions->buckets[256], bytes, size);
+
+    if (size > 0) {
+        matches += match_bucket(&subscriptions->buckets[bytes[0]], bytes, size);
+    }
+    return matches;
+}
+
+size_t
+gw_subscriptions_count(gw_subscriptions_t *subscriptions)
+{
+    return __atomic_load_n(&subscriptions->topic_count, __ATOMIC_RELAXED);
+}
+
+static void
+render_topic_label(FILE *out, gw_topic_t *topic)
+{
+    size_t i;
+    for (i = 0; i < topic->size; i++) {
+        unsigned char c = topic->prefix[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20 || c > 0x7e) {
+            fprintf(out, "\\\\x%02x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+}
+
+static void
+render_topics(FILE *out, gw_subscriptions_t *subscriptions, const char *name, const char *help, const char *type,
+              size_t offset)
+{
+    int i, j;
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (i = 0; i < GW_SUBSCRIPTIONS_BUCKETS; i++) {
+        gw_bucket_t *bucket = &subscriptions->buckets[i];
+        for (j = 0; j < bucket->count; j++) {
+            gw_topic_t *topic = &bucket->topics[j];
+            uint64_t *counter = (uint64_t *) ((char *) topic + offset);
+            fprintf(out, "%s{topic=\"", name);
+            render_topic_label(out, topic);
+            fprintf(out, "\"} %llu\n", (unsigned long long) GW_COUNTER_GET(*counter));
+        }
+    }
+}
+
+/**
+* Metrics collector rendering the subscribers and the fan-out of each topic.
+*/
+void
+gw_subscriptions_render(FILE *out, void *self)
+{
+    gw_subscriptions_t *subscriptions = (gw_subscriptions_t *) self;
+
+    pthread_mutex_lock(&subscriptions->lock);
+    render_topics(out, subscriptions, "gw_zmq_topic_subscribers", "Subscriptions to the topic", "gauge",
+                  offsetof(gw_topic_t, subscribers));
+    render_topics(out, subscriptions, "gw_zmq_topic_messages_total", "Messages matching the topic", "counter",
+                  offsetof(gw_topic_t, messages));
+    render_topics(out, subscriptions, "gw_zmq_topic_fanout_total", "Copies of the messages sent to the subscribers of the topic", "counter",
+                  offsetof(gw_topic_t, deliveries));
+    pthread_mutex_unlock(&subscriptions->lock);
+}
@@ -0,0 +1,50 @@
+#ifndef GW_SUBSCRIPTIONS_H
+#define GW_SUBSCRIPTIONS_H
+
+#include "czmq.h"
+
+/**
+* What a subscription frame did to the index.
+*/
+#define GW_SUBSCRIPTION_IGNORED     -1
+/** first subscription to a topic */
+#define GW_SUBSCRIPTION_ADDED        1
+/** another subscription to a topic which already had subscribers */
+#define GW_SUBSCRIPTION_REFERENCED   2
+/** the topic has no subscribers anymore */
+#define GW_SUBSCRIPTION_REMOVED      3
+/** one of the subscriptions to a topic is gone, others are left */
+#define GW_SUBSCRIPTION_RELEASED     4
+
+typedef struct _gw_subscriptions_t gw_subscriptions_t;
+
+/**
+* Index of the topic prefixes consumers subscribed to on the XPUB socket, built from the subscription frames.
+* Topics are bucketed by their first byte so matching a message only compares the prefixes starting with the
+* same byte, plus the empty prefix which matches everything.
+*
+* The XPUB has to be verbose, and verboser when ZeroMQ has ZMQ_XPUB_VERBOSER ( 4.3+ ), for the index to see every
+* subscription and unsubscription.
+*
+* The index belongs to the thread owning the XPUB socket: only that thread updates and matches it.
+* The lock only protects the buckets against the metrics reporter while topics are added or removed.
+*/
+gw_subscriptions_t *
+gw_subscriptions_new(void);
+
+void
+gw_subscriptions_destroy(gw_subscriptions_t **subscriptions);
+
+int
+gw_subscriptions_update(gw_subscriptions_t *subscriptions, const void *frame, size_t size);
+
+int
+gw_subscriptions_match(gw_subscriptions_t *subscriptions, const void *data, size_t size);
+
+size_t
+gw_subscriptions_count(gw_subscriptions_t *subscriptions);
+
+void
+gw_subscriptions_render(FILE *out, void *subscriptions);
+
+#endif
@@ -14,17 +14,206 @@
 */
 
 #include "GwZmqAdaptor.h"
+#include "GwZmqCoalescer.h"
+#include "GwZmqCompressor.h"
+#include "GwZmqRing.h"
+#include "GwZmqShm.h"
+#include "GwZmqBalancer.h"
+#include "GwZmqHandover.h"
 #include "czmq.h"
 #include "time.h"
+#include <getopt.h>
+
+/**
+* Options which only have a long name.
+*/
+#define OPTION_SPOOL_SEGMENT_SIZE 256
+#define OPTION_SPOOL_SEGMENTS 257
+#define OPTION_SPOOL_RETENTION 258
+#define OPTION_SPOOL_SYNC_INTERVAL 259
+#define OPTION_IO_THREADS 260
+#define OPTION_SNDHWM 261
+#define OPTION_RCVHWM 262
+#define OPTION_SNDBUF 263
+#define OPTION_RCVBUF 264
+#define OPTION_XPUB_AFFINITY 265
+#define OPTION_XSUB_AFFINITY 266
+#define OPTION_TCP_KEEPALIVE 267
+#define OPTION_TCP_KEEPALIVE_IDLE 268
+#define OPTION_TCP_KEEPALIVE_CNT 269
+#define OPTION_TCP_KEEPALIVE_INTVL 270
+#define OPTION_SNDTIMEO 271
+#define OPTION_XPUB_NODROP 272
+#define OPTION_SLOW_CONSUMER_BYTES 273
+#define OPTION_SLOW_CONSUMER_SAMPLES 274
+#define OPTION_COALESCE_BYTES 276
+#define OPTION_COALESCE_DELAY 277
+#define OPTION_COALESCE_TOPIC_SIZE 278
+#define OPTION_COMPRESS 279
+#define OPTION_COMPRESS_WORKERS 280
+#define OPTION_COMPRESS_LEVEL 281
+#define OPTION_COMPRESS_DICTIONARY 282
+#define OPTION_INBOUND_SNDHWM 283
+#define OPTION_INBOUND_RCVHWM 284
+#define OPTION_INBOUND_SNDTIMEO 285
+#define OPTION_ROUTES 286
+#define OPTION_AGGREGATE_PREFIX 287
+#define OPTION_AGGREGATE_DELIMITER 288
+#define OPTION_AGGREGATE_KEY 289
+#define OPTION_AGGREGATE_VALUE 290
+#define OPTION_AGGREGATE_WINDOW 291
+#define OPTION_AGGREGATE_TOPIC 292
+#define OPTION_AGGREGATE_ONLY 293
+#define OPTION_RING_SIZE 294
+#define OPTION_RING_POLICY 295
+#define OPTION_INGRESS_RATE 296
+#define OPTION_MONITOR 297
+#define OPTION_MONITOR_LOG_RATE 298
+#define OPTION_SHM_WORKERS 299
+#define OPTION_SHM_RING_SIZE 300
+#define OPTION_SHM_SPIN 301
+#define OPTION_WAIT_STRATEGY 302
+#define OPTION_SPIN_USEC 303
+#define OPTION_TRACE_SAMPLE 304
+#define OPTION_TRACE_ENVELOPE 305
+#define OPTION_REPLAY_ENDPOINT 306
+#define OPTION_REPLAY_WINDOW 307
+#define OPTION_REPLAY_WINDOW_SECS 308
+#define OPTION_RELAY 309
+#define OPTION_BALANCE_ENDPOINT 310
+#define OPTION_BALANCE_MODE 311
+#define OPTION_BALANCE_KEY_SIZE 312
+#define OPTION_HANDOVER_SOCKET 313
+#define OPTION_DRAIN_TIMEOUT 314
+
+#define SHORT_OPTIONS "b:p:l:u:dtrn:a:i:k:m:s:c:"
+
+/**
+* Every option has a long name, which is also its key in the configuration file given with -c.
+*/
+static struct option long_options[] = {
+    { "subscriber-address",  required_argument, NULL, 'b' },
+    { "publisher-address",   required_argument, NULL, 'p' },
+    { "listener-address",    required_argument, NULL, 'l' },
+    { "push-address",        required_argument, NULL, 'u' },
+    { "debug",               no_argument,       NULL, 'd' },
+    { "shards",              required_argument, NULL, 'n' },
+    { "cpus",                required_argument, NULL, 'a' },
+    { "stats-interval",      required_argument, NULL, 'i' },
+    { "batch-size",          required_argument, NULL, 'k' },
+    { "metrics",             required_argument, NULL, 'm' },
+    { "config",              required_argument, NULL, 'c' },
+    { "spool-dir",           required_argument, NULL, 's' },
+    { "spool-segment-size",  required_argument, NULL, OPTION_SPOOL_SEGMENT_SIZE },
+    { "spool-segments",      required_argument, NULL, OPTION_SPOOL_SEGMENTS },
+    { "spool-retention",     required_argument, NULL, OPTION_SPOOL_RETENTION },
+    { "spool-sync-interval", required_argument, NULL, OPTION_SPOOL_SYNC_INTERVAL },
+    { "io-threads",          required_argument, NULL, OPTION_IO_THREADS },
+    { "sndhwm",              required_argument, NULL, OPTION_SNDHWM },
+    { "rcvhwm",              required_argument, NULL, OPTION_RCVHWM },
+    { "sndbuf",              required_argument, NULL, OPTION_SNDBUF },
+    { "rcvbuf",              required_argument, NULL, OPTION_RCVBUF },
+    { "xpub-affinity",       required_argument, NULL, OPTION_XPUB_AFFINITY },
+    { "xsub-affinity",       required_argument, NULL, OPTION_XSUB_AFFINITY },
+    { "tcp-keepalive",       required_argument, NULL, OPTION_TCP_KEEPALIVE },
+    { "tcp-keepalive-idle",  required_argument, NULL, OPTION_TCP_KEEPALIVE_IDLE },
+    { "tcp-keepalive-cnt",   required_argument, NULL, OPTION_TCP_KEEPALIVE_CNT },
+    { "tcp-keepalive-intvl", required_argument, NULL, OPTION_TCP_KEEPALIVE_INTVL },
+    { "sndtimeo",            required_argument, NULL, OPTION_SNDTIMEO },
+    { "xpub-nodrop",         no_argument,       NULL, OPTION_XPUB_NODROP },
+    { "slow-consumer-bytes", required_argument, NULL, OPTION_SLOW_CONSUMER_BYTES },
+    { "slow-consumer-samples", required_argument, NULL, OPTION_SLOW_CONSUMER_SAMPLES },
+    { "coalesce-bytes",      required_argument, NULL, OPTION_COALESCE_BYTES },
+    { "coalesce-delay",      required_argument, NULL, OPTION_COALESCE_DELAY },
+    { "coalesce-topic-size", required_argument, NULL, OPTION_COALESCE_TOPIC_SIZE },
+    { "compress",            no_argument,       NULL, OPTION_COMPRESS },
+    { "compress-workers",    required_argument, NULL, OPTION_COMPRESS_WORKERS },
+    { "compress-level",      required_argument, NULL, OPTION_COMPRESS_LEVEL },
+    { "compress-dictionary", required_argument, NULL, OPTION_COMPRESS_DICTIONARY },
+    { "inbound-sndhwm",      required_argument, NULL, OPTION_INBOUND_SNDHWM },
+    { "inbound-rcvhwm",      required_argument, NULL, OPTION_INBOUND_RCVHWM },
+    { "inbound-sndtimeo",    required_argument, NULL, OPTION_INBOUND_SNDTIMEO },
+    { "routes",              required_argument, NULL, OPTION_ROUTES },
+    { "aggregate-prefix",    required_argument, NULL, OPTION_AGGREGATE_PREFIX },
+    { "aggregate-delimiter", required_argument, NULL, OPTION_AGGREGATE_DELIMITER },
+    { "aggregate-key",       required_argument, NULL, OPTION_AGGREGATE_KEY },
+    { "aggregate-value",     required_argument, NULL, OPTION_AGGREGATE_VALUE },
+    { "aggregate-window",    required_argument, NULL, OPTION_AGGREGATE_WINDOW },
+    { "aggregate-topic",     required_argument, NULL, OPTION_AGGREGATE_TOPIC },
+    { "aggregate-only",      no_argument,       NULL, OPTION_AGGREGATE_ONLY },
+    { "ring-size",           required_argument, NULL, OPTION_RING_SIZE },
+    { "ring-policy",         required_argument, NULL, OPTION_RING_POLICY },
+    { "ingress-rate",        required_argument, NULL, OPTION_INGRESS_RATE },
+    { "monitor",             no_argument,       NULL, OPTION_MONITOR },
+    { "monitor-log-rate",    required_argument, NULL, OPTION_MONITOR_LOG_RATE },
+    { "shm-workers",         required_argument, NULL, OPTION_SHM_WORKERS },
+    { "shm-ring-size",       required_argument, NULL, OPTION_SHM_RING_SIZE },
+    { "shm-spin",            required_argument, NULL, OPTION_SHM_SPIN },
+    { "wait-strategy",       required_argument, NULL, OPTION_WAIT_STRATEGY },
+    { "spin-usec",           required_argument, NULL, OPTION_SPIN_USEC },
+    { "trace-sample",        required_argument, NULL, OPTION_TRACE_SAMPLE },
+    { "trace-envelope",      no_argument,       NULL, OPTION_TRACE_ENVELOPE },
+    { "replay-endpoint",     required_argument, NULL, OPTION_REPLAY_ENDPOINT },
+    { "replay-window",       required_argument, NULL, OPTION_REPLAY_WINDOW },
+    { "replay-window-secs",  required_argument, NULL, OPTION_REPLAY_WINDOW_SECS },
+    { "relay",               no_argument,       NULL, OPTION_RELAY },
+    { "balance-endpoint",    required_argument, NULL, OPTION_BALANCE_ENDPOINT },
+    { "balance-mode",        required_argument, NULL, OPTION_BALANCE_MODE },
+    { "balance-key-size",    required_argument, NULL, OPTION_BALANCE_KEY_SIZE },
+    { "handover-socket",     required_argument, NULL, OPTION_HANDOVER_SOCKET },
+    { "drain-timeout",       required_argument, NULL, OPTION_DRAIN_TIMEOUT },
+    { NULL, 0, NULL, 0 }
+};
+
+/**
+* Settings of the adaptor, from the command line and the configuration file.
+*/
+typedef struct {
+    /** starts the inbound SUB -> PUSH channel, set by -l, -u or -r */
+    int inbound_flag;
+    int test_flag;
+    int test_black_box_flag;
+    int stats_interval;
+    /** time given to the messages accepted to be forwarded when the adaptor stops, in milliseconds */
+    int drain_timeout;
+    int cpus[GW_MAX_SHARDS + 1];
+    int cpu_count;
+    /** Unix socket path a restarted adaptor takes the listening sockets over on ( see GwZmqHandover.h ) */
+    char *handover_socket;
+    gw_listener_options_t listener;
+    gw_pusher_options_t pusher;
+} adaptor_options_t;
 
 /**
 *  The functions bellow up to the main() are used for debugging or quick testing purposes only
 */
 
+/**
+* Returns the time the adaptor received a message, in microseconds since the epoch, when its last frame is the
+* envelope of a traced message ( --trace-envelope ), 0 otherwise.
+*/
+static uint64_t
+traced_at(zmsg_t *message)
+{
+    zframe_t *frame = zmsg_last(message);
+    if (frame == NULL || zframe_size(frame) != GW_TRACE_ENVELOPE_SIZE
+            || memcmp(zframe_data(frame), GW_TRACE_MAGIC, 4) != 0) {
+        return 0;
+    }
+    uint64_t receivedAt = 0;
+    int i;
+    for (i = 4; i < 12; i++) {
+        receivedAt = (receivedAt << 8) | zframe_data(frame)[i];
+    }
+    return receivedAt;
+}
+
 /**
 * Starts a listener thread in the background just to print all the messages.
 * Use it for debugging purposes.
 * This method is activated with the '-d' flag.
+* The latency is only known for the messages traced with --trace-sample and --trace-envelope: it's the time from
+* the adaptor receiving them to this thread receiving them, both clocks being the same.
 *
 */
 static void
@@ -41,48 +230,48 @@ subscriber_thread (void *args, zctx_t *ctx, void *pipe)
 
     zsocket_set_subscribe (subscriber, "");
 
-
-    void *watch;
-    unsigned long elapsed_counter = 0;
-    unsigned long elapsed ;
-    unsigned long elapsed_since_last_message;
+    int64_t reportedAt = zclock_time();
     double min_latency = DBL_MAX;
     double max_latency = -1;
-    double avg_latency = -1;
+    double total_latency = 0;
     int messages_received_counter = 0;
-    int messages_received_latency = 0;
+    int messages_traced_counter = 0;
 
     while (!zctx_interrupted) {
 
-        watch = zmq_stopwatch_start ();
-        char *string = zstr_recv (subscriber);
-        if (!string) {
+        zmsg_t *message = zmsg_recv (subscriber);
+        if (!message) {
             break;              //  Interrupted
         }
-        elapsed_since_last_message = zmq_stopwatch_stop (watch);
-
-        watch = zmq_stopwatch_start ();
-//        time_t now;
-//        time(&now);
-        //printf("> %s got: [%s]\n", ctime(&now), string);
-        free (string);
-
+        uint64_t receivedAt = traced_at(message);
+        zmsg_destroy (&message);
         messages_received_counter ++;
-        elapsed = zmq_stopwatch_stop (watch);
-        messages_received_latency += elapsed;
 
-        if ( elapsed < min_latency ) min_latency = elapsed;
-        if ( elapsed > max_latency ) max_latency = elapsed;
-        avg_latency = messages_received_latency / messages_received_counter;
+        if ( receivedAt != 0 ) {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            double latency = (double) ((uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000) - (double) receivedAt;
+            if ( latency < min_latency ) min_latency = latency;
+            if ( latency > max_latency ) max_latency = latency;
+            total_latency += latency;
+            messages_traced_counter ++;
+        }
 
-        elapsed_counter += elapsed + elapsed_since_last_message;
-        if ( elapsed_counter >= 1000*1000 ) {
-            fprintf(stderr, " %d messages processed in %lu [ms] with latency min=%.4f[ms], max=%.4f[ms], avg=%.4f[ms]\n", messages_received_counter, elapsed_counter/1000, min_latency/1000, max_latency/1000, avg_latency/1000);
+        int64_t elapsed = zclock_time() - reportedAt;
+        if ( elapsed >= 1000 ) {
+            if ( messages_traced_counter > 0 ) {
+                fprintf(stderr, " %d messages received in %lld [ms], %d traced with latency min=%.4f[ms], max=%.4f[ms], avg=%.4f[ms]\n",
+                        messages_received_counter, (long long) elapsed, messages_traced_counter, min_latency/1000,
+                        max_latency/1000, total_latency/messages_traced_counter/1000);
+            } else {
+                fprintf(stderr, " %d messages received in %lld [ms]\n", messages_received_counter, (long long) elapsed);
+            }
             min_latency = DBL_MAX;
             max_latency = -1;
-            avg_latency = -1;
-            elapsed_counter = 0;
+            total_latency = 0;
+            reportedAt = zclock_time();
             messages_received_counter = 0;
+            messages_traced_counter = 0;
         }
     }
     zsocket_destroy (ctx, subscriber);
@@ -94,9 +283,36 @@ subscriber_thread (void *args, zctx_t *ctx, void *pipe)
 *  The publisher sends random messages starting with A-J:
 *
 */
+static void
+shm_publisher_thread (void *args, zctx_t *ctx, void *pipe)
+{
+    const char *endpoint = (const char *) args;
+    fprintf(stderr, "Starting Test shared memory publisher thread [%s] ... \n", endpoint);
+    gw_shm_writer_t *writer = gw_shm_writer_open(endpoint);
+    if (writer == NULL) {
+        fprintf(stderr, "Can't open %s: %s\n", endpoint, strerror(errno));
+        return;
+    }
+
+    char string [20];
+    while (!zctx_interrupted) {
+        sprintf (string, "PUB-%c-%05d", randof (10) + 'A', randof (100000));
+        if (gw_shm_writer_send(writer, string, strlen(string), 0) == -1) {
+            break;
+        }
+        printf(" ... sending:%s\n", string);
+        zclock_sleep (1000);
+    }
+    gw_shm_writer_close(&writer);
+}
+
 static void
 publisher_thread (void *args, zctx_t *ctx, void *pipe)
 {
+    if (strncmp(args, GW_SHM_SCHEME, strlen(GW_SHM_SCHEME)) == 0) {
+        shm_publisher_thread(args, ctx, pipe);
+        return;
+    }
     fprintf(stderr, "Starting Test publisher thread [%s] ... \n", args);
     void *publisher = zsocket_new (ctx, ZMQ_PUB);
     int socket_bound = zsocket_connect (publisher, "%s", args);
@@ -171,7 +387,6 @@ pull_receiver_thread (void *args, zctx_t *ctx, void *pipe)
         time_t now;
         time(&now);
         printf("> %s receiver got: %s\n", ctime(&now), string);
-        zstr_send(pipe, string);
         free (string);
         //zclock_sleep(1);
     }
@@ -200,6 +415,478 @@ listener_thread (void *args, zctx_t *ctx, void *pipe)
     }
 }
 
+static int
+load_config_file(adaptor_options_t *options, const char *path);
+
+/**
+* Applies one option, given either on the command line or in the configuration file.
+* Returns 0 on success or -1 if the value is invalid.
+*/
+static int
+apply_option(adaptor_options_t *options, int option, const char *value)
+{
+    gw_listener_options_t *listener = &options->listener;
+
+    switch (option)
+    {
+        case 'b':
+            listener->subscriber_address = strdup(value);
+            break;
+        case 'p':
+            listener->publisher_address = strdup(value);
+            break;
+        case 'l':
+            options->pusher.listener_address = strdup(value);
+            options->inbound_flag = 1;
+            break;
+        case 'u':
+            options->pusher.push_address = strdup(value);
+            options->inbound_flag = 1;
+            break;
+        case 'd':
+            listener->debug_flag = 1;
+            fprintf(stderr,"RUNNING IN DEBUGGING MODE\n");
+            break;
+        case 't':
+            listener->debug_flag = 1;
+            options->test_flag = 1;
+            fprintf(stderr,"RUNNING IN TEST MODE & DEBUG MODE for XPUB -> XSUB\n");
+            break;
+        case 'r':
+            listener->debug_flag = 1;
+            options->test_black_box_flag = 1;
+            options->inbound_flag = 1;
+            options->pusher.bind_listener = 1;
+            fprintf(stderr,"RUNNING IN TEST MODE & DEBUG MODE for SUB -> PUSH\n");
+            break;
+        case 'c':
+            return load_config_file(options, value);
+        case 'n':
+            listener->shard_count = atoi(value);
+            if (listener->shard_count < 1 || listener->shard_count > GW_MAX_SHARDS) {
+                fprintf(stderr,"The number of shards must be between 1 and %d\n", GW_MAX_SHARDS);
+                return -1;
+            }
+            break;
+        case 'a':
+            options->cpu_count = gw_parse_cpu_list(value, options->cpus, GW_MAX_SHARDS + 1);
+            if (options->cpu_count < 0) {
+                fprintf(stderr,"Invalid CPU list: %s\n", value);
+                return -1;
+            }
+            break;
+        case 'i':
+            options->stats_interval = atoi(value);
+            break;
+        case OPTION_HANDOVER_SOCKET:
+            options->handover_socket = strdup(value);
+            break;
+        case OPTION_DRAIN_TIMEOUT:
+            options->drain_timeout = atoi(value);
+            if (options->drain_timeout < 0) {
+                fprintf(stderr,"The drain timeout must be 0, to stop right away, or a number of milliseconds\n");
+                return -1;
+            }
+            break;
+        case 'm':
+            listener->metrics_endpoint = strdup(value);
+            break;
+        case 'k':
+            listener->batch_size = atoi(value);
+            if (listener->batch_size < 1 || listener->batch_size > GW_MAX_BATCH_SIZE) {
+                fprintf(stderr,"The batch size must be between 1 and %d\n", GW_MAX_BATCH_SIZE);
+                return -1;
+            }
+            break;
+        case OPTION_WAIT_STRATEGY:
+            listener->wait_strategy = gw_wait_strategy(value);
+            if (listener->wait_strategy < 0) {
+                fprintf(stderr,"The wait strategy must be block, spin or busy-poll\n");
+                return -1;
+            }
+            break;
+        case OPTION_SPIN_USEC:
+            listener->spin_usec = atoi(value);
+            if (listener->spin_usec < 1) {
+                fprintf(stderr,"The spin time must be at least 1 microsecond\n");
+                return -1;
+            }
+            break;
+        case OPTION_RING_SIZE:
+            if (atoi(value) < 2) {
+                fprintf(stderr,"The ring size must be at least 2 frames\n");
+                return -1;
+            }
+            listener->ring_size = strtoul(value, NULL, 10);
+            break;
+        case OPTION_RING_POLICY:
+            listener->ring_policy = gw_ring_policy(value);
+            if (listener->ring_policy < 0) {
+                fprintf(stderr,"The ring policy must be block, drop-newest or drop-oldest\n");
+                return -1;
+            }
+            break;
+        case OPTION_INGRESS_RATE: {
+            int rates[GW_MAX_SHARDS];
+            int count = gw_parse_cpu_list(value, rates, GW_MAX_SHARDS);
+            if (count < 1) {
+                fprintf(stderr,"The ingress rates are a list of up to %d msg/s, one per -b endpoint, i.e. 0,5000\n", GW_MAX_SHARDS);
+                return -1;
+            }
+            int i;
+            for (i = 0; i < GW_MAX_SHARDS; i++) {
+                // a single rate applies to every endpoint
+                listener->ingress_rates[i] = count == 1 ? rates[0] : (i < count ? rates[i] : 0);
+            }
+            break;
+        }
+        case OPTION_SHM_WORKERS:
+            listener->shm_workers = atoi(value);
+            if (listener->shm_workers < 1 || listener->shm_workers > GW_SHM_MAX_WORKERS) {
+                fprintf(stderr,"The number of shared memory rings must be between 1 and %d\n", GW_SHM_MAX_WORKERS);
+                return -1;
+            }
+            break;
+        case OPTION_SHM_RING_SIZE:
+            if (atoi(value) < GW_SHM_MIN_RING_SIZE / 1024) {
+                fprintf(stderr,"The shared memory rings must be at least %d KB\n", GW_SHM_MIN_RING_SIZE / 1024);
+                return -1;
+            }
+            listener->shm_ring_size = (size_t) atoi(value) * 1024;
+            break;
+        case OPTION_SHM_SPIN:
+            listener->shm_spin_usec = atoi(value);
+            if (listener->shm_spin_usec < 0) {
+                fprintf(stderr,"The shared memory spin time can't be negative\n");
+                return -1;
+            }
+            break;
+        case OPTION_MONITOR:
+            listener->monitor_events = 1;
+            break;
+        case OPTION_TRACE_SAMPLE:
+            listener->trace_sample = atoi(value);
+            if (listener->trace_sample < 0) {
+                fprintf(stderr,"The trace sample must be 0, to disable the tracing, or a number of messages\n");
+                return -1;
+            }
+            break;
+        case OPTION_TRACE_ENVELOPE:
+            listener->trace_envelope = 1;
+            break;
+        case OPTION_RELAY:
+            listener->relay = 1;
+            break;
+        case OPTION_MONITOR_LOG_RATE:
+            listener->monitor_log_rate = atoi(value);
+            if (listener->monitor_log_rate < 0) {
+                fprintf(stderr,"The monitor log rate can't be negative\n");
+                return -1;
+            }
+            break;
+        case 's':
+            listener->spool_directory = strdup(value);
+            break;
+        case OPTION_SPOOL_SEGMENT_SIZE:
+            if (atoi(value) < 1) {
+                fprintf(stderr,"The spool segment size must be at least 1 MB\n");
+                return -1;
+            }
+            listener->spool_segment_size = (size_t) atoi(value) * 1024 * 1024;
+            break;
+        case OPTION_REPLAY_ENDPOINT:
+            listener->replay_endpoint = strdup(value);
+            break;
+        case OPTION_REPLAY_WINDOW:
+            if (atoi(value) < 2) {
+                fprintf(stderr,"The replay window must be at least 2 MB\n");
+                return -1;
+            }
+            listener->replay_window_bytes = (size_t) atoi(value) * 1024 * 1024;
+            break;
+        case OPTION_REPLAY_WINDOW_SECS:
+            listener->replay_window_secs = atoi(value);
+            if (listener->replay_window_secs < 1) {
+                fprintf(stderr,"The replay window must keep the messages for at least 1 second\n");
+                return -1;
+            }
+            break;
+        case OPTION_BALANCE_ENDPOINT:
+            listener->balance_endpoint = strdup(value);
+            break;
+        case OPTION_BALANCE_MODE:
+            listener->balance_mode = gw_balance_mode(value);
+            if (listener->balance_mode < 0) {
+                fprintf(stderr,"The balance mode must be rr or hash\n");
+                return -1;
+            }
+            break;
+        case OPTION_BALANCE_KEY_SIZE:
+            if (atoi(value) < 1) {
+                fprintf(stderr,"The balance key must be at least 1 byte\n");
+                return -1;
+            }
+            listener->balance_key_size = (size_t) atoi(value);
+            break;
+        case OPTION_SPOOL_SEGMENTS:
+            listener->spool_segments = atoi(value);
+            if (listener->spool_segments < 1) {
+                fprintf(stderr,"The spool needs at least 1 segment\n");
+                return -1;
+            }
+            break;
+        case OPTION_SPOOL_RETENTION:
+            listener->spool_retention_secs = atoi(value);
+            break;
+        case OPTION_SPOOL_SYNC_INTERVAL:
+            listener->spool_sync_interval_msec = atoi(value);
+            if (listener->spool_sync_interval_msec < 1) {
+                fprintf(stderr,"The spool sync interval must be at least 1 ms\n");
+                return -1;
+            }
+            break;
+        case OPTION_IO_THREADS:
+            listener->io_threads = atoi(value);
+            if (listener->io_threads < 1) {
+                fprintf(stderr,"The number of I/O threads must be at least 1\n");
+                return -1;
+            }
+            break;
+        case OPTION_SNDHWM:
+            listener->send_hwm = atoi(value);
+            break;
+        case OPTION_RCVHWM:
+            listener->receive_hwm = atoi(value);
+            break;
+        case OPTION_SNDBUF:
+            listener->send_buffer = atoi(value);
+            break;
+        case OPTION_RCVBUF:
+            listener->receive_buffer = atoi(value);
+            break;
+        case OPTION_XPUB_AFFINITY:
+            listener->publisher_affinity = strtoull(value, NULL, 0);
+            break;
+        case OPTION_XSUB_AFFINITY:
+            listener->subscriber_affinity = strtoull(value, NULL, 0);
+            break;
+        case OPTION_TCP_KEEPALIVE:
+            listener->tcp_keepalive = atoi(value);
+            break;
+        case OPTION_TCP_KEEPALIVE_IDLE:
+            listener->tcp_keepalive_idle = atoi(value);
+            break;
+        case OPTION_TCP_KEEPALIVE_CNT:
+            listener->tcp_keepalive_cnt = atoi(value);
+            break;
+        case OPTION_TCP_KEEPALIVE_INTVL:
+            listener->tcp_keepalive_intvl = atoi(value);
+            break;
+        case OPTION_SNDTIMEO:
+            listener->send_timeout = atoi(value);
+            break;
+        case OPTION_XPUB_NODROP:
+            listener->xpub_nodrop = 1;
+            break;
+        case OPTION_SLOW_CONSUMER_BYTES:
+            listener->slow_consumer_bytes = strtoul(value, NULL, 10);
+            break;
+        case OPTION_SLOW_CONSUMER_SAMPLES:
+            listener->slow_consumer_samples = atoi(value);
+            if (listener->slow_consumer_samples < 1) {
+                fprintf(stderr,"A consumer has to be sampled at least once to be reported as slow\n");
+                return -1;
+            }
+            break;
+        case OPTION_COALESCE_BYTES:
+            listener->coalesce_bytes = strtoul(value, NULL, 10);
+            break;
+        case OPTION_COALESCE_DELAY:
+            listener->coalesce_delay_usec = atoi(value);
+            if (listener->coalesce_delay_usec < 0) {
+                fprintf(stderr,"The coalescing delay can't be negative\n");
+                return -1;
+            }
+            break;
+        case OPTION_COALESCE_TOPIC_SIZE:
+            listener->coalesce_topic_size = strtoul(value, NULL, 10);
+            if (listener->coalesce_topic_size < 1 || listener->coalesce_topic_size > GW_COALESCE_MAX_TOPIC_SIZE) {
+                fprintf(stderr,"The coalescing topic size must be between 1 and %d\n", GW_COALESCE_MAX_TOPIC_SIZE);
+                return -1;
+            }
+            break;
+        case OPTION_COMPRESS:
+            listener->compress_enabled = 1;
+            break;
+        case OPTION_COMPRESS_WORKERS:
+            listener->compress_workers = atoi(value);
+            if (listener->compress_workers < 1 || listener->compress_workers > GW_MAX_COMPRESSION_WORKERS) {
+                fprintf(stderr,"The number of compression workers must be between 1 and %d\n", GW_MAX_COMPRESSION_WORKERS);
+                return -1;
+            }
+            break;
+        case OPTION_COMPRESS_LEVEL:
+            listener->compress_level = atoi(value);
+            break;
+        case OPTION_COMPRESS_DICTIONARY:
+            listener->compress_dictionary = strdup(value);
+            break;
+        case OPTION_ROUTES:
+            listener->routes_file = strdup(value);
+            break;
+        case OPTION_AGGREGATE_PREFIX:
+            listener->aggregate_prefix = strdup(value);
+            break;
+        case OPTION_AGGREGATE_DELIMITER:
+            if (strlen(value) != 1) {
+                fprintf(stderr,"The aggregation delimiter must be a single character\n");
+                return -1;
+            }
+            listener->aggregate_delimiter = value[0];
+            break;
+        case OPTION_AGGREGATE_KEY:
+            listener->aggregate_key_field_count = gw_parse_cpu_list(value, listener->aggregate_key_fields,
+                                                                    GW_AGGREGATE_MAX_KEY_FIELDS);
+            if (listener->aggregate_key_field_count < 1) {
+                fprintf(stderr,"The aggregation key is a list of up to %d fields, i.e. 1,3\n", GW_AGGREGATE_MAX_KEY_FIELDS);
+                return -1;
+            }
+            break;
+        case OPTION_AGGREGATE_VALUE:
+            listener->aggregate_value_field = atoi(value);
+            break;
+        case OPTION_AGGREGATE_WINDOW:
+            listener->aggregate_window_msec = atoi(value);
+            if (listener->aggregate_window_msec < 1) {
+                fprintf(stderr,"The aggregation window must be at least 1 ms\n");
+                return -1;
+            }
+            break;
+        case OPTION_AGGREGATE_TOPIC:
+            listener->aggregate_topic = strdup(value);
+            break;
+        case OPTION_AGGREGATE_ONLY:
+            listener->aggregate_only = 1;
+            break;
+        case OPTION_INBOUND_SNDHWM:
+            options->pusher.send_hwm = atoi(value);
+            break;
+        case OPTION_INBOUND_RCVHWM:
+            options->pusher.receive_hwm = atoi(value);
+            break;
+        case OPTION_INBOUND_SNDTIMEO:
+            options->pusher.send_timeout = atoi(value);
+            if (options->pusher.send_timeout < 0) {
+                fprintf(stderr,"The inbound send timeout can't be negative, it would block the inbound thread\n");
+                return -1;
+            }
+            break;
+    }
+    return 0;
+}
+
+/**
+* Reads options from a file, one "name = value" per line using the long names of the options, i.e.
+*   # tuning for 200+ subscribers
+*   sndhwm = 100000
+*   io-threads = 4
+* Options given on the command line after -c override the ones from the file.
+* Returns 0 on success or -1 if the file can't be read or holds an invalid option.
+*/
+static int
+load_config_file(adaptor_options_t *options, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr,"Could not read the configuration file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char line[1024];
+    int lineNumber = 0;
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+        lineNumber++;
+        char *name = line + strspn(line, " \t");
+        char *end = name + strcspn(name, "#\r\n");
+        *end = 0;
+        if (*name == 0) {
+            continue;
+        }
+
+        char *value = name + strcspn(name, " \t=");
+        if (*value != 0) {
+            *value++ = 0;
+            value += strspn(value, " \t=");
+        }
+        while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+            *--end = 0;
+        }
+
+        struct option *option;
+        for (option = long_options; option->name != NULL; option++) {
+            if (streq(option->name, name)) {
+                break;
+            }
+        }
+        if (option->name == NULL || (option->has_arg == required_argument && *value == 0)) {
+            fprintf(stderr,"%s:%d: invalid option %s\n", path, lineNumber, name);
+            result = -1;
+        } else if (option->val == 'c') {
+            fprintf(stderr,"%s:%d: configuration files can't be nested\n", path, lineNumber);
+            result = -1;
+        } else {
+            result = apply_option(options, option->val, value);
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+/**
+* Called from the handover thread once a new adaptor took the sockets over: this one stops as on SIGTERM,
+* after draining what it accepted.
+*/
+static void
+hand_over(void)
+{
+#ifdef __linux__
+    kill(getpid(), SIGTERM);
+#else
+    zctx_interrupted = 1;
+#endif
+}
+
+/**
+* Waits for SIGINT or SIGTERM, only waking up to print the throughput of the shards every statsInterval seconds.
+* The signals are blocked in every thread and taken here synchronously, so no thread is interrupted by them.
+*/
+static void
+wait_for_termination(zctx_t *ctx, sigset_t *signals, int statsInterval)
+{
+#ifdef __linux__
+    while (!zctx_interrupted) {
+        struct timespec timeout = { statsInterval > 0 ? statsInterval : 3600, 0 };
+        int received = sigtimedwait(signals, NULL, &timeout);
+        if (received == SIGINT || received == SIGTERM) {
+            zctx_interrupted = 1;
+        } else if (received == -1 && errno == EAGAIN && statsInterval > 0) {
+            gw_zmq_report_shards(ctx);
+        }
+    }
+#else
+    // no sigtimedwait: poll the flag set by the czmq signal handler
+    int64_t reportedAt = zclock_time();
+    while (!zctx_interrupted) {
+        zclock_sleep(500);
+        if (statsInterval > 0 && zclock_time() - reportedAt >= statsInterval * 1000) {
+            gw_zmq_report_shards(ctx);
+            reportedAt = zclock_time();
+        }
+    }
+#endif
+}
+
 /**
 *  .split main thread
 *  The main task starts the subscriber and publisher, and then sets
@@ -207,9 +894,91 @@ listener_thread (void *args, zctx_t *ctx, void *pipe)
 *   usage: api-gateway-zmq-adaptor -d -p tcp://127.0.0.1:6001 -b ipc:///tmp/nginx_listener_queue -l tcp://127.0.0.1:5000 -u ipc:///tmp/nginx_queue_push
 *         -p public address where messages from API Gateway are published. This is where you can listen for messages coming from the API Gateway
 *         -b the local address to listen for messages from API Gateway which are then proxied ( forwarded ) to -p address
+*            or a comma separated list of addresses, i.e. ipc:///tmp/nginx_queue_listen,ipc://@canary, each one with its own shard
+*            shm://name addresses are read from shared memory rings the gateway workers write to ( see GwZmqShm.h )
+*         --shm-workers number of rings of each shm:// address, i.e. of gateway workers writing at the same time ( default 32 )
+*         --shm-ring-size size in KB of each of those rings ( default 1024 )
+*         --shm-spin microseconds a shard keeps polling its shared memory rings before sleeping ( default 0 )
+*         --ingress-rate messages per second accepted from each -b address, i.e. 0,5000; a single value applies to all of them ( default 0, no limit )
+*         --relay connects to the -b addresses, the XPUBs of other adaptors, instead of binding them, and re-publishes their messages on -p
+*            i.e. --relay -b tcp://gw-1:6001,tcp://gw-2:6001; each one gets its own shard and the subscriptions go up hop by hop
 *
 *         -l public address to listen for incoming messages sent to API Gateway
 *         -u local address where messages from -l are pushed ( forwarded ) to the API Gateway
+*            the inbound SUB->PUSH channel only starts when -l, -u or -r is given
+*         --inbound-sndhwm messages queued for each gateway worker connected to -u; a worker at its HWM is skipped ( default 1000 )
+*         --inbound-rcvhwm messages queued on the SUB connected to -l ( default 1000 )
+*         --inbound-sndtimeo milliseconds a message waits for a gateway worker before being dropped ( default 100 )
+*
+*         -n number of forwarding shards; shard N binds the -b address suffixed with -N ( or port + N for tcp )
+*         -a comma separated list of CPUs to pin the shard threads to, i.e. 2,3,4-7. An extra CPU pins the egress thread
+*         -i interval in seconds to print the throughput of each shard
+*         -k maximum number of messages forwarded on each wakeup of a forwarding thread ( default 256 )
+*         --wait-strategy how the shard and egress threads wait for messages: block, spin or busy-poll ( default block )
+*            spin polls for up to --spin-usec before sleeping, as long as messages keep arriving that fast
+*            busy-poll never sleeps, pin the threads with -a
+*         --spin-usec longest spin of the spin strategy, in microseconds ( default 100 )
+*         --ring-size frames each shard can queue for the thread publishing on -p, when -n is above 1 ( default 4096 )
+*         --ring-policy what a shard does when its ring is full: block, drop-newest or drop-oldest ( default block )
+*         -m address serving the metrics in the Prometheus format, i.e. tcp://127.0.0.1:9101 ( HTTP ) or ipc:///tmp/gw_metrics ( REQ/REP )
+*
+*         -c, --config file holding options as "name = value" lines, using the long names of the options
+*
+*         -s, --spool-dir directory where messages are spooled while no consumer is subscribed or consumers can't keep up
+*         --spool-segment-size size in MB of each spool segment file ( default 64 )
+*         --spool-segments number of segments kept on disk, the oldest one is dropped when they're all full ( default 16 )
+*         --spool-retention number of seconds spooled messages are kept for ( default 3600 )
+*         --spool-sync-interval interval in milliseconds between two syncs of the spool to disk ( default 100 )
+*
+*         --replay-endpoint ROUTER address where consumers ask for the messages they missed, i.e. tcp://0.0.0.0:6002 ( see GwZmqReplay.h )
+*            every published message then ends with a frame holding its sequence number
+*         --replay-window size in MB of the in-memory window of the last messages ( default 64 )
+*         --replay-window-secs number of seconds messages are kept in the window ( default 60 )
+*
+*         --balance-endpoint address spreading the messages over a group of workers, next to -p, i.e. tcp://0.0.0.0:6301 ( see GwZmqBalancer.h )
+*         --balance-mode rr deals them round robin to PULL workers, hash sends the same key to the same DEALER worker ( default rr )
+*         --balance-key-size number of bytes at the start of a message hashed in hash mode ( default 16 )
+*
+*         --io-threads number of ZMQ I/O threads ( default 1 )
+*         --sndhwm / --rcvhwm high water marks of the XPUB / XSUB sockets, in messages ( default 1000, 0 for no limit )
+*         --sndbuf / --rcvbuf kernel buffer sizes of the XPUB / XSUB connections, in bytes ( default: OS default )
+*         --xpub-affinity / --xsub-affinity bitmask of the I/O threads serving the XPUB / XSUB, i.e. 0x3
+*         --tcp-keepalive, --tcp-keepalive-idle, --tcp-keepalive-cnt, --tcp-keepalive-intvl TCP keepalive of the XPUB connections
+*         --sndtimeo milliseconds a message refused by the XPUB waits before being spooled or dropped ( default 0 )
+*         --xpub-nodrop the XPUB refuses messages when a consumer reaches its HWM instead of dropping them ( ZeroMQ 4.1+ )
+*
+*         --slow-consumer-bytes reports the consumers with more than this many bytes queued on their connection
+*         --slow-consumer-samples number of samples, one per second, a consumer has to stay above the limit to be reported ( default 3 )
+*
+*         --coalesce-bytes packs small messages with the same topic into coalesced messages of this size ( see GwZmqCoalesced.h )
+*         --coalesce-delay maximum time in microseconds a message waits to be coalesced ( default 1000 )
+*         --coalesce-topic-size messages are grouped by their first bytes ( default 5 )
+*
+*         --compress compresses messages with zstd for the consumers subscribing to "~z/" + topic ( needs a build with WITH_ZSTD=1 )
+*         --compress-workers number of compression threads ( default 2 )
+*         --compress-level zstd compression level ( default 3 )
+*         --compress-dictionary zstd dictionary file, reloaded when it changes ( see zstd --train )
+*
+*         --routes rule file sending slices of the stream to additional PUB or PUSH sockets, reloaded when it changes ( see GwZmqRouter.h )
+*
+*         --aggregate-prefix rolls up the usage records starting with this prefix per key ( see GwZmqAggregator.h )
+*         --aggregate-delimiter field separator of the usage records ( default ; )
+*         --aggregate-key fields making the key of a record, counted from 0, i.e. 1,2 ( default 0 )
+*         --aggregate-value field summed in the rollups ( default: the records are only counted )
+*         --aggregate-window length of a window in milliseconds ( default 1000 )
+*         --aggregate-topic topic the rollups are published on ( default rollup/ )
+*         --aggregate-only publishes the rollups instead of the aggregated records
+*
+*         --monitor counts the events of every socket ( connections, disconnections, ... ) and logs them, like -d does
+*         --monitor-log-rate maximum number of socket events logged per second, the others are only counted ( default 10, 0 only counts them )
+*
+*         --trace-sample times one message in this many from its -b address to -p, exposed as histograms on -m ( default 0, off )
+*         --trace-envelope publishes the traced messages with a last frame telling when they were received ( see GwZmqAdaptor.h )
+*
+*         --drain-timeout milliseconds given to the messages already accepted to reach the consumers on SIGTERM ( default 5000, 0 to stop right away )
+*            with -s what's left once it passed is spooled and replayed by the next run
+*         --handover-socket Unix socket path, i.e. /var/run/gw-zmq-adaptor.sock, a new adaptor started with the same path takes
+*            the listening sockets over from the running one, which drains its messages in flight and exits ( see GwZmqHandover.h )
 *
 *         -d activates debug option, printing the messages on the output
 *         -t test mode simulates a publisher for XSUB/XPUB with random messages : PUB -> XSUB -> XPUB -> SUB
@@ -220,59 +989,79 @@ int main (int argc, char *argv[])
     setbuf(stdout, NULL);
     setbuf(stderr, NULL);
 
+    // blocked before any thread starts, so that every thread inherits the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+#ifdef __linux__
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+#endif
+
     int major, minor, patch, lmajor, lminor, lpatch;
     zmq_version (&major, &minor, &patch);
     zsys_version (&lmajor, &lminor, &lpatch);
     fprintf(stderr, "ZeroMQ version %d.%d.%d (czmq %d.%d.%d) \n", major, minor, patch, lmajor, lminor, lpatch);
 
     // parse command line args
-    char c;
-    char *subscriberAddress = DEFAULT_XSUB;
-    char *publisherAddress = DEFAULT_XPUB;
-    char *listenerAddress = DEFAULT_SUB;
-    char *pushAddress = DEFAULT_PUSH;
-    int debugFlag = 0;
-    int testFlag = 0;
-    int testBlackBoxFlag = 0;
-
-    while ( (c = getopt(argc, argv, "b:p:l:u:dtr") ) != -1)
+    int c;
+    adaptor_options_t options;
+
+    memset(&options, 0, sizeof(options));
+    options.drain_timeout = DEFAULT_DRAIN_TIMEOUT_MSEC;
+    gw_listener_options_init(&options.listener);
+    gw_pusher_options_init(&options.pusher);
+
+    while ( (c = getopt_long(argc, argv, SHORT_OPTIONS, long_options, NULL) ) != -1)
     {
-        switch (c)
-        {
-            case 'b':
-                subscriberAddress = strdup(optarg);
-                break;
-            case 'p':
-                publisherAddress = strdup(optarg);
-                break;
-            case 'l':
-                listenerAddress = strdup(optarg);
-                break;
-            case 'u':
-                pushAddress = strdup(optarg);
-                break;
-            case 'd':
-                debugFlag = 1;
-                fprintf(stderr,"RUNNING IN DEBUGGING MODE\n");
-                break;
-            case 't':
-                debugFlag = 1;
-                testFlag = 1;
-                fprintf(stderr,"RUNNING IN TEST MODE & DEBUG MODE for XPUB -> XSUB\n");
-                break;
-            case 'r':
-                debugFlag = 1;
-                testBlackBoxFlag = 1;
-                fprintf(stderr,"RUNNING IN TEST MODE & DEBUG MODE for SUB -> PUSH\n");
-                break;
-            case '?':
-                fprintf(stderr,"Unrecognized option!\n");
-                break;
+        if (c == '?') {
+            fprintf(stderr,"Unrecognized option!\n");
+            continue;
+        }
+        if (apply_option(&options, c, optarg) == -1) {
+            return 1;
+        }
+    }
+
+    gw_listener_options_t listenerOptions = options.listener;
+    char subscriberAddress[256];
+    char *publisherAddress = listenerOptions.publisher_address;
+    char *listenerAddress = options.pusher.listener_address;
+    char *pushAddress = options.pusher.push_address;
+    int debugFlag = listenerOptions.debug_flag;
+    int testFlag = options.test_flag;
+    int testBlackBoxFlag = options.test_black_box_flag;
+
+    int endpointCount = gw_zmq_endpoint_count(listenerOptions.subscriber_address);
+    if (listenerOptions.relay && endpointCount == 1 && listenerOptions.shard_count != 1) {
+        fprintf(stderr,"-n can't be used with --relay, each upstream adaptor given with -b gets its own shard\n");
+        return 1;
+    }
+    if (endpointCount > 1) {
+        if (listenerOptions.shard_count != 1 && listenerOptions.shard_count != endpointCount) {
+            fprintf(stderr,"-n doesn't match the %d addresses given with -b, each one gets its own shard\n", endpointCount);
+            return 1;
+        }
+        if (endpointCount > GW_MAX_SHARDS) {
+            fprintf(stderr,"-b can't list more than %d addresses\n", GW_MAX_SHARDS);
+            return 1;
         }
+        listenerOptions.shard_count = endpointCount;
+    }
+    // the test publisher sends to the first endpoint
+    if (gw_zmq_shard_endpoint(listenerOptions.subscriber_address, 0, subscriberAddress, sizeof(subscriberAddress)) == -1) {
+        fprintf(stderr,"Invalid -b address: %s\n", listenerOptions.subscriber_address);
+        return 1;
+    }
+
+    // a running adaptor serving the path hands its listening sockets over, and is gone once this returns
+    if (options.handover_socket != NULL && gw_handover_init(options.handover_socket) == -1) {
+        fprintf(stderr,"Could not take over from the adaptor serving %s\n", options.handover_socket);
+        return 1;
     }
 
     //  Set the context for the child threads
-    zctx_t *ctx = gw_zmq_init();
+    zctx_t *ctx = gw_zmq_init_with_options(&listenerOptions);
 
     //
     // Black Box Pattern impl
@@ -283,34 +1072,18 @@ int main (int argc, char *argv[])
     //   CONNECT      ->      BIND
     // -------------------------------------
     //
+    if ( options.inbound_flag == 1 ) {
+        start_gateway_pusher(ctx, &options.pusher);
+
+        if ( testBlackBoxFlag == 1 ) {
+            zthread_fork (ctx, publisher_thread_for_black_box, listenerAddress);
+        }
 
-//    void *listenerSocket = zsocket_new(ctx, ZMQ_SUB);
-//    int listenerSocketResult = -1;
-//    if ( testBlackBoxFlag == 0 ) {
-//        listenerSocketResult = zsocket_connect(listenerSocket, "%s", listenerAddress);
-//    } else {
-//        listenerSocketResult = zsocket_bind(listenerSocket, "%s", listenerAddress);
-//    }
-//    assert( listenerSocketResult >= 0 );
-//
-//    zsocket_set_subscribe (listenerSocket, ""); // NOTE: Don't miss this directive, otherwise the SUB doesn't get anything
-//
-//    void *pushSocket = zsocket_new(ctx, ZMQ_PUSH);
-//    int pushSocketResult = zsocket_bind(pushSocket, "%s", pushAddress);
-//    assert( pushSocketResult >= 0 );
-//
-//
-//    fprintf(stderr,"\nStarting SUB->PUSH Proxy [%s] -> [%s] \n", listenerAddress, pushAddress );
-//    zproxy_t *sub_push_thread = zproxy_new(ctx, listenerSocket, pushSocket);
-//
-//    if ( testBlackBoxFlag == 1 ) {
-//        zthread_fork (ctx, publisher_thread_for_black_box, listenerAddress);
-//    }
-//
-//    if ( debugFlag == 1 ) {
-//        // you have to have at least 1 socket to PULL to see the messages
-//        zthread_fork (ctx, pull_receiver_thread, pushAddress);
-//    }
+        if ( debugFlag == 1 ) {
+            // you have to have at least 1 socket to PULL to see the messages
+            zthread_fork (ctx, pull_receiver_thread, pushAddress);
+        }
+    }
 
     //
     // Espresso Pattern impl
@@ -322,7 +1095,20 @@ int main (int argc, char *argv[])
     // ---------------------------------------
     //
 
-    start_gateway_listener(ctx, subscriberAddress, publisherAddress, debugFlag);
+    int i;
+    for (i = 0; i < options.cpu_count; i++) {
+        if (i < listenerOptions.shard_count) {
+            listenerOptions.shard_cpus[i] = options.cpus[i];
+        } else {
+            listenerOptions.egress_cpu = options.cpus[i];
+        }
+    }
+
+    start_gateway_listener_with_options(ctx, &listenerOptions);
+
+    if (options.handover_socket != NULL) {
+        gw_handover_serve(hand_over);
+    }
 
     if ( testFlag == 1 ) {
         zthread_fork (ctx, publisher_thread, subscriberAddress);
@@ -340,12 +1126,15 @@ int main (int argc, char *argv[])
     //}
 
     // just making sure the current thread doesn't exit
-    while( !zctx_interrupted ) {
-        zclock_sleep(500);
-    }
+    wait_for_termination(ctx, &signals, options.stats_interval);
 
     fprintf(stderr," ... interrupted");
+    if (options.drain_timeout > 0) {
+        gw_zmq_drain(ctx, options.drain_timeout, NULL);
+    }
     //  Tell attached threads to exit
     gw_zmq_destroy( &ctx );
+    // the new adaptor binds the endpoints once this one closed them
+    gw_handover_close();
     return 0;
 }
@@ -0,0 +1,444 @@
+/*
+* Copyright 2015 Adobe Systems Incorporated. All rights reserved.
+*
+* This file is licensed to you under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*  http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software distributed
+* under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR RESPRESENTATIONS
+* OF ANY KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations under the License.
+*/
+
+/**
+*  Throughput and latency benchmark for the Gateway listener.
+*
+*  M publishers simulate the nginx workers ( PUB -> XSUB ) and N subscribers simulate the tracking services
+*  ( XPUB -> SUB ). Each message carries the monotonic time it was sent at, right after its topic, so the
+*  subscribers measure the end-to-end latency through the adaptor.
+*
+*   usage: api-gateway-zmq-bench [-m publishers] [-n subscribers] [-s size] [-r rate] [-D seconds] [-t ipc|abstract|tcp]
+*                                [-f PUB-A,PUB-B] [-S shards] [-k batch] [-p xpub] [-x adaptor-binary] [-j report.json]
+*         -m number of publishers ( default 4 )
+*         -n number of subscribers ( default 1 )
+*         -s message size in bytes ( default 64 )
+*         -r messages per second sent by each publisher, 0 sends as fast as possible ( default 0 )
+*         -D duration of the run in seconds ( default 10 )
+*         -t transport between the publishers and the adaptor ( default ipc )
+*         -f comma separated subscription filters, the subscribers get everything by default
+*         -S number of shards of the listener, publishers are spread over the shards
+*         -k number of messages drained on each wakeup of the listener
+*         -p address of the XPUB socket ( default tcp://127.0.0.1:6011 )
+*         -x runs the given adaptor binary as a subprocess instead of starting the listener in-process
+*         -j writes the results as JSON to the given file, "-" for stdout
+*/
+
+#include "GwZmqAdaptor.h"
+#include "czmq.h"
+#include "time.h"
+#include <sys/wait.h>
+
+#define BENCH_TOPICS 10
+#define BENCH_MAX_FILTERS 16
+#define BENCH_MAX_LATENCY_SAMPLES (2 * 1024 * 1024)
+#define BENCH_WARMUP_MSEC 500
+#define BENCH_GRACE_MSEC 1000
+
+typedef struct {
+    int publishers;
+    int subscribers;
+    int message_size;
+    int rate;
+    int duration;
+    const char *transport;
+    char *subscriber_address;
+    char *publisher_address;
+    char *filters[BENCH_MAX_FILTERS];
+    int filter_count;
+    int shard_count;
+    int batch_size;
+    const char *adaptor_binary;
+    const char *json_file;
+} bench_options_t;
+
+typedef struct {
+    bench_options_t *options;
+    int index;
+    char endpoint[256];
+    int64_t deadline;
+    uint64_t messages;
+    uint64_t bytes;
+    int64_t *latencies;
+    uint64_t latency_count;
+} bench_client_t;
+
+static int64_t
+now_nsec()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void
+sleep_until_nsec(int64_t when)
+{
+    int64_t delay = when - now_nsec();
+    if (delay <= 0) {
+        return;
+    }
+    struct timespec pause = { delay / 1000000000LL, delay % 1000000000LL };
+    nanosleep(&pause, NULL);
+}
+
+/**
+* Sends messages shaped like the gateway's ones: "<topic> <8 bytes send time><padding>".
+*/
+static void
+bench_publisher_thread (void *args, zctx_t *ctx, void *pipe)
+{
+    bench_client_t *client = (bench_client_t *) args;
+    bench_options_t *options = client->options;
+
+    void *publisher = zsocket_new (ctx, ZMQ_PUB);
+    zsocket_set_sndhwm (publisher, 0);
+    int socket_connected = zsocket_connect (publisher, "%s", client->endpoint);
+    assert( socket_connected == 0 );
+
+    // let the subscriptions reach the publisher
+    zclock_sleep(BENCH_WARMUP_MSEC);
+
+    char topic[16];
+    snprintf(topic, sizeof(topic), "PUB-%c ", 'A' + client->index % BENCH_TOPICS);
+    size_t topicSize = strlen(topic);
+    size_t size = options->message_size;
+    if (size < topicSize + sizeof(int64_t)) {
+        size = topicSize + sizeof(int64_t);
+    }
+
+    char *payload = (char *) malloc(size);
+    assert( payload );
+    memset(payload, 'x', size);
+    memcpy(payload, topic, topicSize);
+
+    int64_t interval = options->rate > 0 ? 1000000000LL / options->rate : 0;
+    int64_t next = now_nsec();
+
+    while (!zctx_interrupted && zclock_time() < client->deadline) {
+        if (interval > 0) {
+            sleep_until_nsec(next);
+            next += interval;
+        }
+        int64_t sent = now_nsec();
+        memcpy(payload + topicSize, &sent, sizeof(sent));
+        if (zmq_send(publisher, payload, size, 0) == -1) {
+            break;
+        }
+        client->messages++;
+        client->bytes += size;
+    }
+
+    free(payload);
+    zsocket_destroy (ctx, publisher);
+    zstr_send (pipe, "done");
+}
+
+static void
+bench_subscriber_thread (void *args, zctx_t *ctx, void *pipe)
+{
+    bench_client_t *client = (bench_client_t *) args;
+    bench_options_t *options = client->options;
+
+    void *subscriber = zsocket_new (ctx, ZMQ_SUB);
+    zsocket_set_rcvhwm (subscriber, 0);
+    zsocket_set_rcvtimeo (subscriber, 100);
+    int socket_connected = zsocket_connect (subscriber, "%s", client->endpoint);
+    assert( socket_connected == 0 );
+
+    int i;
+    if (options->filter_count == 0) {
+        zsocket_set_subscribe (subscriber, "");
+    }
+    for (i = 0; i < options->filter_count; i++) {
+        zsocket_set_subscribe (subscriber, options->filters[i]);
+    }
+
+    zmq_msg_t message;
+    zmq_msg_init(&message);
+    while (!zctx_interrupted && zclock_time() < client->deadline) {
+        int size = zmq_msg_recv(&message, subscriber, 0);
+        if (size == -1) {
+            continue;
+        }
+        int64_t received = now_nsec();
+        const char *data = (const char *) zmq_msg_data(&message);
+        const char *separator = memchr(data, ' ', size);
+
+        client->messages++;
+        client->bytes += size;
+
+        if (separator != NULL && separator + 1 + sizeof(int64_t) <= data + size
+                && client->latency_count < BENCH_MAX_LATENCY_SAMPLES) {
+            int64_t sent;
+            memcpy(&sent, separator + 1, sizeof(sent));
+            client->latencies[client->latency_count++] = received - sent;
+        }
+    }
+    zmq_msg_close(&message);
+
+    zsocket_destroy (ctx, subscriber);
+    zstr_send (pipe, "done");
+}
+
+static int
+compare_latencies(const void *a, const void *b)
+{
+    int64_t first = *(const int64_t *) a;
+    int64_t second = *(const int64_t *) b;
+    return first < second ? -1 : first > second;
+}
+
+static double
+percentile_usec(int64_t *sorted, uint64_t count, double percentile)
+{
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t index = (uint64_t) (percentile / 100.0 * (count - 1));
+    return sorted[index] / 1000.0;
+}
+
+static pid_t
+start_adaptor_process(bench_options_t *options)
+{
+    char shards[16];
+    char batch[16];
+    snprintf(shards, sizeof(shards), "%d", options->shard_count);
+    snprintf(batch, sizeof(batch), "%d", options->batch_size);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(options->adaptor_binary, options->adaptor_binary,
+              "-b", options->subscriber_address, "-p", options->publisher_address,
+              "-n", shards, "-k", batch, (char *) NULL);
+        fprintf(stderr, "Could not start %s: %s\n", options->adaptor_binary, strerror(errno));
+        _exit(127);
+    }
+    return pid;
+}
+
+static void
+write_report(bench_options_t *options, FILE *out, double seconds, uint64_t sent, uint64_t received,
+             uint64_t receivedBytes, int64_t *latencies, uint64_t latencyCount)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"transport\": \"%s\",\n", options->transport);
+    fprintf(out, "  \"mode\": \"%s\",\n", options->adaptor_binary ? "subprocess" : "in-process");
+    fprintf(out, "  \"publishers\": %d,\n", options->publishers);
+    fprintf(out, "  \"subscribers\": %d,\n", options->subscribers);
+    fprintf(out, "  \"shards\": %d,\n", options->shard_count);
+    fprintf(out, "  \"batch_size\": %d,\n", options->batch_size);
+    fprintf(out, "  \"message_size\": %d,\n", options->message_size);
+    fprintf(out, "  \"rate\": %d,\n", options->rate);
+    fprintf(out, "  \"duration_sec\": %.3f,\n", seconds);
+    fprintf(out, "  \"sent\": %llu,\n", (unsigned long long) sent);
+    fprintf(out, "  \"received\": %llu,\n", (unsigned long long) received);
+    fprintf(out, "  \"sent_msg_per_sec\": %.0f,\n", sent / seconds);
+    fprintf(out, "  \"received_msg_per_sec\": %.0f,\n", received / seconds);
+    fprintf(out, "  \"received_mb_per_sec\": %.3f,\n", receivedBytes / seconds / (1024 * 1024));
+    fprintf(out, "  \"latency_usec\": { \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f, \"samples\": %llu }\n",
+            percentile_usec(latencies, latencyCount, 50),
+            percentile_usec(latencies, latencyCount, 99),
+            percentile_usec(latencies, latencyCount, 99.9),
+            percentile_usec(latencies, latencyCount, 100),
+            (unsigned long long) latencyCount);
+    fprintf(out, "}\n");
+}
+
+int main (int argc, char *argv[])
+{
+    bench_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.publishers = 4;
+    options.subscribers = 1;
+    options.message_size = 64;
+    options.duration = 10;
+    options.transport = "ipc";
+    options.publisher_address = "tcp://127.0.0.1:6011";
+    options.shard_count = DEFAULT_SHARD_COUNT;
+    options.batch_size = DEFAULT_BATCH_SIZE;
+
+    int c;
+    char *filter;
+    while ( (c = getopt(argc, argv, "m:n:s:r:D:t:f:S:k:p:x:j:") ) != -1)
+    {
+        switch (c)
+        {
+            case 'm':
+                options.publishers = atoi(optarg);
+                break;
+            case 'n':
+                options.subscribers = atoi(optarg);
+                break;
+            case 's':
+                options.message_size = atoi(optarg);
+                break;
+            case 'r':
+                options.rate = atoi(optarg);
+                break;
+            case 'D':
+                options.duration = atoi(optarg);
+                break;
+            case 't':
+                options.transport = strdup(optarg);
+                break;
+            case 'f':
+                for (filter = strtok(strdup(optarg), ","); filter != NULL && options.filter_count < BENCH_MAX_FILTERS; filter = strtok(NULL, ",")) {
+                    options.filters[options.filter_count++] = filter;
+                }
+                break;
+            case 'S':
+                options.shard_count = atoi(optarg);
+                break;
+            case 'k':
+                options.batch_size = atoi(optarg);
+                break;
+            case 'p':
+                options.publisher_address = strdup(optarg);
+                break;
+            case 'x':
+                options.adaptor_binary = strdup(optarg);
+                break;
+            case 'j':
+                options.json_file = strdup(optarg);
+                break;
+            case '?':
+                fprintf(stderr,"Unrecognized option!\n");
+                return 1;
+        }
+    }
+
+    if (streq(options.transport, "ipc")) {
+        options.subscriber_address = "ipc:///tmp/gw_bench_listen";
+    } else if (streq(options.transport, "abstract")) {
+        options.subscriber_address = "ipc://@gw_bench_listen";
+    } else if (streq(options.transport, "tcp")) {
+        options.subscriber_address = "tcp://127.0.0.1:5560";
+    } else {
+        fprintf(stderr, "Unknown transport %s, use ipc, abstract or tcp\n", options.transport);
+        return 1;
+    }
+    if (options.publishers < 1 || options.subscribers < 1 || options.duration < 1
+            || options.shard_count < 1 || options.shard_count > GW_MAX_SHARDS) {
+        fprintf(stderr, "Invalid benchmark options\n");
+        return 1;
+    }
+
+    zctx_t *ctx = gw_zmq_init();
+    pid_t adaptor = 0;
+
+    if (options.adaptor_binary != NULL) {
+        adaptor = start_adaptor_process(&options);
+        zclock_sleep(BENCH_WARMUP_MSEC);
+    } else {
+        gw_listener_options_t listenerOptions;
+        gw_listener_options_init(&listenerOptions);
+        listenerOptions.subscriber_address = options.subscriber_address;
+        listenerOptions.publisher_address = options.publisher_address;
+        listenerOptions.shard_count = options.shard_count;
+        listenerOptions.batch_size = options.batch_size;
+        start_gateway_listener_with_options(ctx, &listenerOptions);
+    }
+
+    fprintf(stderr, "Benchmarking %d publisher(s) over %s -> %d subscriber(s) for %d seconds ...\n",
+            options.publishers, options.transport, options.subscribers, options.duration);
+
+    int clientCount = options.publishers + options.subscribers;
+    bench_client_t *clients = (bench_client_t *) calloc(clientCount, sizeof(bench_client_t));
+    void **pipes = (void **) calloc(clientCount, sizeof(void *));
+    assert( clients && pipes );
+
+    int64_t started = zclock_time();
+    int i;
+    for (i = 0; i < clientCount; i++) {
+        bench_client_t *client = &clients[i];
+        client->options = &options;
+        if (i < options.subscribers) {
+            client->index = i;
+            client->deadline = started + BENCH_WARMUP_MSEC + options.duration * 1000 + BENCH_GRACE_MSEC;
+            client->latencies = (int64_t *) malloc(BENCH_MAX_LATENCY_SAMPLES * sizeof(int64_t));
+            assert( client->latencies );
+            snprintf(client->endpoint, sizeof(client->endpoint), "%s", options.publisher_address);
+            pipes[i] = zthread_fork (ctx, bench_subscriber_thread, client);
+        } else {
+            client->index = i - options.subscribers;
+            client->deadline = started + BENCH_WARMUP_MSEC + options.duration * 1000;
+            gw_zmq_shard_endpoint(options.subscriber_address, client->index % options.shard_count,
+                                  client->endpoint, sizeof(client->endpoint));
+            pipes[i] = zthread_fork (ctx, bench_publisher_thread, client);
+        }
+        assert( pipes[i] );
+    }
+
+    for (i = 0; i < clientCount; i++) {
+        free(zstr_recv(pipes[i]));
+    }
+
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t receivedBytes = 0;
+    uint64_t latencyCount = 0;
+    for (i = 0; i < clientCount; i++) {
+        if (i < options.subscribers) {
+            received += clients[i].messages;
+            receivedBytes += clients[i].bytes;
+            latencyCount += clients[i].latency_count;
+        } else {
+            sent += clients[i].messages;
+        }
+    }
+
+    int64_t *latencies = (int64_t *) malloc((latencyCount + 1) * sizeof(int64_t));
+    assert( latencies );
+    uint64_t offset = 0;
+    for (i = 0; i < options.subscribers; i++) {
+        memcpy(latencies + offset, clients[i].latencies, clients[i].latency_count * sizeof(int64_t));
+        offset += clients[i].latency_count;
+        free(clients[i].latencies);
+    }
+    qsort(latencies, latencyCount, sizeof(int64_t), compare_latencies);
+
+    double seconds = options.duration;
+    fprintf(stderr, "sent %llu messages ( %.0f msg/s ), received %llu messages ( %.0f msg/s, %.3f MB/s )\n",
+            (unsigned long long) sent, sent / seconds, (unsigned long long) received, received / seconds,
+            receivedBytes / seconds / (1024 * 1024));
+    fprintf(stderr, "latency p50=%.1f[us] p99=%.1f[us] p999=%.1f[us] max=%.1f[us]\n",
+            percentile_usec(latencies, latencyCount, 50), percentile_usec(latencies, latencyCount, 99),
+            percentile_usec(latencies, latencyCount, 99.9), percentile_usec(latencies, latencyCount, 100));
+
+    if (options.json_file != NULL) {
+        FILE *out = streq(options.json_file, "-") ? stdout : fopen(options.json_file, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Could not write %s: %s\n", options.json_file, strerror(errno));
+        } else {
+            write_report(&options, out, seconds, sent, received, receivedBytes, latencies, latencyCount);
+            if (out != stdout) {
+                fclose(out);
+            }
+        }
+    }
+
+    if (adaptor > 0) {
+        kill(adaptor, SIGINT);
+        waitpid(adaptor, NULL, 0);
+    }
+
+    free(latencies);
+    free(clients);
+    free(pipes);
+    gw_zmq_destroy( &ctx );
+    return 0;
+}
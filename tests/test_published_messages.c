@@ -17,6 +17,26 @@
 #include <check.h>
 #include "zmq.h"
 #include "../src/GwZmqAdaptor.h"
+#include "../src/GwZmqMetrics.h"
+#include "../src/GwZmqSubscriptions.h"
+#include "../src/GwZmqSpool.h"
+#include "../src/GwZmqConsumers.h"
+#include "../src/GwZmqCoalescer.h"
+#include "../src/GwZmqCoalesced.h"
+#include "../src/GwZmqCompressor.h"
+#include "../src/GwZmqRouter.h"
+#include "../src/GwZmqAggregator.h"
+#include "../src/GwZmqRing.h"
+#include "../src/GwZmqShm.h"
+#include "../src/GwZmqHistogram.h"
+#include "../src/GwZmqReplay.h"
+#include "../src/GwZmqBalancer.h"
+#include "../src/GwZmqHandover.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 START_TEST(test_zmq_context_lifecycle)
 {
@@ -175,7 +195,1523 @@ START_TEST(test_gateway_listener_over_abstract_socket)
 }
 END_TEST
 
+START_TEST(test_multipart_larger_than_batch)
+{
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+
+    gw_listener_options_t options;
+    gw_listener_options_init(&options);
+    options.subscriber_address = "ipc:///tmp/gw_multipart_batch";
+    options.publisher_address = "tcp://127.0.0.1:6001";
+    // a message spreads over 3 batches
+    options.batch_size = 4;
+
+    start_gateway_listener_with_options(ctx, &options);
+
+    void *consumer = zsocket_new(ctx, ZMQ_SUB);
+    zsocket_set_rcvtimeo(consumer, 1000);
+    zsocket_set_subscribe(consumer, "PUB-");
+    zsocket_connect(consumer, "%s", options.publisher_address);
+    void *gateway = zsocket_new(ctx, ZMQ_PUB);
+    zsocket_connect(gateway, "%s", options.subscriber_address);
+    zclock_sleep(300);
+
+    char frame[32];
+    int i, j;
+    for (i = 0; i < 6; i++) {
+        // multipart messages of 10 frames between single frame ones
+        int frames = i % 2 ? 1 : 10;
+        for (j = 0; j < frames; j++) {
+            snprintf(frame, sizeof(frame), "PUB-A-%05d-%02d", i, j);
+            zmq_send(gateway, frame, strlen(frame), j < frames - 1 ? ZMQ_SNDMORE : 0);
+        }
+    }
+
+    for (i = 0; i < 6; i++) {
+        zmsg_t *message = zmsg_recv(consumer);
+        ck_assert_msg(message != NULL, "The consumer should receive every message");
+        ck_assert_int_eq(zmsg_size(message), i % 2 ? 1 : 10);
+        zframe_t *part = zmsg_first(message);
+        for (j = 0; part != NULL; j++, part = zmsg_next(message)) {
+            // the frames keep their order across the batches
+            snprintf(frame, sizeof(frame), "PUB-A-%05d-%02d", i, j);
+            ck_assert_msg(zframe_streq(part, frame), "Frame %d of message %d is out of order", j, i);
+        }
+        zmsg_destroy(&message);
+    }
+
+    gw_zmq_destroy(&ctx);
+    ck_assert_msg(ctx == NULL, "ZMQ Context should be destroyed. ");
+}
+END_TEST
+
+#ifdef ZMQ_XPUB_NODROP
+START_TEST(test_nodrop_refuses_whole_messages)
+{
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+
+    gw_listener_options_t options;
+    gw_listener_options_init(&options);
+    options.subscriber_address = "ipc:///tmp/gw_nodrop";
+    options.publisher_address = "tcp://127.0.0.1:6001";
+    options.xpub_nodrop = 1;
+    options.send_hwm = 10;
+
+    start_gateway_listener_with_options(ctx, &options);
+
+    // a consumer which doesn't read
+    void *consumer = zsocket_new(ctx, ZMQ_SUB);
+    zsocket_set_rcvhwm(consumer, 1);
+    zsocket_set_rcvbuf(consumer, 4096);
+    zsocket_set_subscribe(consumer, "PUB-");
+    zsocket_connect(consumer, "%s", options.publisher_address);
+    void *gateway = zsocket_new(ctx, ZMQ_PUB);
+    zsocket_connect(gateway, "%s", options.subscriber_address);
+    zclock_sleep(300);
+
+    char topic[32];
+    char body[4096];
+    memset(body, 'x', sizeof(body));
+    int i;
+    for (i = 0; i < 2000; i++) {
+        snprintf(topic, sizeof(topic), "PUB-A-%05d", i);
+        zmq_send(gateway, topic, strlen(topic), ZMQ_SNDMORE);
+        zmq_send(gateway, "header", 6, ZMQ_SNDMORE);
+        zmq_send(gateway, body, sizeof(body), 0);
+        if (i % 100 == 0) {
+            zclock_sleep(1);
+        }
+    }
+    zclock_sleep(500);
+
+    gw_shard_stats_t stats;
+    ck_assert_int_eq(gw_zmq_shard_stats(ctx, 0, &stats), 0);
+    ck_assert_msg(stats.dropped > 0, "The XPUB should refuse messages");
+    // refused messages are counted once, and none of their frames is published
+    ck_assert_msg(stats.messages_out + stats.dropped == stats.messages, "%llu published and %llu refused out of %llu",
+                  (unsigned long long) stats.messages_out, (unsigned long long) stats.dropped,
+                  (unsigned long long) stats.messages);
+
+    // the thread still forwards
+    uint64_t forwarded = stats.messages;
+    for (i = 0; i < 10; i++) {
+        zmq_send(gateway, "PUB-B", 5, ZMQ_SNDMORE);
+        zmq_send(gateway, "header", 6, ZMQ_SNDMORE);
+        zmq_send(gateway, "body", 4, 0);
+    }
+    zclock_sleep(200);
+    ck_assert_int_eq(gw_zmq_shard_stats(ctx, 0, &stats), 0);
+    ck_assert_int_eq(stats.messages, forwarded + 10);
+
+    // whatever reaches the consumer is a whole message
+    zsocket_set_rcvtimeo(consumer, 200);
+    zmsg_t *message;
+    while ((message = zmsg_recv(consumer)) != NULL) {
+        ck_assert_int_eq(zmsg_size(message), 3);
+        char *first = zmsg_popstr(message);
+        ck_assert_int_eq(strncmp(first, "PUB-", 4), 0);
+        free(first);
+        zmsg_destroy(&message);
+    }
+
+    gw_zmq_destroy(&ctx);
+    ck_assert_msg(ctx == NULL, "ZMQ Context should be destroyed. ");
+}
+END_TEST
+#endif
+
+START_TEST(test_shard_endpoints)
+{
+    char endpoint[256];
+
+    ck_assert_int_eq(gw_zmq_shard_endpoint("ipc:///tmp/nginx_queue_listen", 0, endpoint, sizeof(endpoint)), 0);
+    ck_assert_str_eq(endpoint, "ipc:///tmp/nginx_queue_listen");
+
+    ck_assert_int_eq(gw_zmq_shard_endpoint("ipc:///tmp/nginx_queue_listen", 3, endpoint, sizeof(endpoint)), 0);
+    ck_assert_str_eq(endpoint, "ipc:///tmp/nginx_queue_listen-3");
+
+    ck_assert_int_eq(gw_zmq_shard_endpoint("ipc://@nginx_queue_listen", 1, endpoint, sizeof(endpoint)), 0);
+    ck_assert_str_eq(endpoint, "ipc://@nginx_queue_listen-1");
+
+    ck_assert_int_eq(gw_zmq_shard_endpoint("tcp://127.0.0.1:5100", 2, endpoint, sizeof(endpoint)), 0);
+    ck_assert_str_eq(endpoint, "tcp://127.0.0.1:5102");
+
+    ck_assert_int_eq(gw_zmq_shard_endpoint("tcp://*:*", 1, endpoint, sizeof(endpoint)), -1);
+
+    int cpus[8];
+    ck_assert_int_eq(gw_parse_cpu_list("2,4-6", cpus, 8), 4);
+    ck_assert_int_eq(cpus[0], 2);
+    ck_assert_int_eq(cpus[3], 6);
+    ck_assert_int_eq(gw_parse_cpu_list("2,x", cpus, 8), -1);
+}
+END_TEST
+
+START_TEST(test_sharded_gateway_listener)
+{
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+    ck_assert_msg(ctx != NULL, "ZMQ Context can't be null. ");
+
+    gw_listener_options_t options;
+    gw_listener_options_init(&options);
+    options.subscriber_address = "ipc:///tmp/nginx_queue_listen_sharded";
+    options.publisher_address = "tcp://127.0.0.1:6001";
+    options.shard_count = 2;
+
+    start_gateway_listener_with_options(ctx, &options);
+
+    // simulate a consumer
+    void *pipe2 = zthread_fork (ctx, mock_subscriber_thread, options.publisher_address);
+    ck_assert_msg(pipe2 != NULL, "Subscriber Thread should have been created. ");
+
+    zclock_sleep (100);
+
+    // simulate a gateway worker hashed to the second shard
+    static char shardAddress[256];
+    gw_zmq_shard_endpoint(options.subscriber_address, 1, shardAddress, sizeof(shardAddress));
+    void *pipe = zthread_fork (ctx, mock_gateway_publisher_thread, shardAddress);
+    ck_assert_msg(pipe != NULL, "Publisher Thread should have been created. ");
+
+    // wait for some messages to be passed
+    zclock_sleep(400);
+    zctx_interrupted = true;
+
+    char s_counter[100] = "";
+    int expected_min_messages = 15;
+    sprintf(s_counter, "The consumer should have received at least [%d] messages, but got [%d]", expected_min_messages, messages_received_counter);
+    ck_assert_msg( messages_received_counter >= expected_min_messages, s_counter);
+
+    gw_shard_stats_t stats;
+    ck_assert_int_eq(gw_zmq_shard_stats(ctx, 1, &stats), 0);
+    ck_assert_msg(stats.messages >= expected_min_messages, "The second shard should have forwarded the messages");
+    ck_assert_int_eq(gw_zmq_shard_stats(ctx, 0, &stats), 0);
+    ck_assert_msg(stats.messages == 0, "The first shard should not have received any message");
+
+    gw_zmq_destroy( &ctx );
+    ck_assert_msg(ctx == NULL, "ZMQ Context should be destroyed. ");
+}
+END_TEST
+
+START_TEST(test_ingress_endpoint_list)
+{
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+
+    char endpoint[256];
+    const char *addresses = "ipc:///tmp/gw_ingress_main,ipc://@gw_ingress_canary";
+    ck_assert_int_eq(gw_zmq_endpoint_count(addresses), 2);
+    ck_assert_int_eq(gw_zmq_shard_endpoint(addresses, 1, endpoint, sizeof(endpoint)), 0);
+    ck_assert_str_eq(endpoint, "ipc://@gw_ingress_canary");
+    ck_assert_int_eq(gw_zmq_shard_endpoint(addresses, 2, endpoint, sizeof(endpoint)), -1);
+
+    gw_listener_options_t options;
+    gw_listener_options_init(&options);
+    options.subscriber_address = (char *) addresses;
+    options.publisher_address = "tcp://127.0.0.1:6001";
+    // the canary publishes 50 msg/s but only gets 10
+    options.ingress_rates[1] = 10;
+
+    start_gateway_listener_with_options(ctx, &options);
+
+    void *subscriber = zthread_fork (ctx, mock_subscriber_thread, options.publisher_address);
+    ck_assert_msg(subscriber != NULL, "Subscriber Thread should have been created. ");
+    zclock_sleep (100);
+
+    zthread_fork (ctx, mock_gateway_publisher_thread, "ipc:///tmp/gw_ingress_main");
+    zthread_fork (ctx, mock_gateway_publisher_thread, "ipc://@gw_ingress_canary");
+
+    zclock_sleep(1000);
+    zctx_interrupted = true;
+
+    gw_shard_stats_t primary;
+    gw_shard_stats_t canary;
+    ck_assert_int_eq(gw_zmq_shard_stats(ctx, 0, &primary), 0);
+    ck_assert_int_eq(gw_zmq_shard_stats(ctx, 1, &canary), 0);
+    ck_assert_msg(primary.messages >= 30 && canary.messages >= 30, "Both endpoints should have received messages");
+    ck_assert_msg(primary.rate_limited == 0, "The main endpoint has no rate limit");
+    ck_assert_msg(canary.rate_limited >= 15, "The canary should have been rate limited");
+    ck_assert_msg(messages_received_counter <= (int) (primary.messages + canary.messages - canary.rate_limited),
+                  "Messages over the rate limit shouldn't be published");
+
+    gw_zmq_destroy( &ctx );
+}
+END_TEST
+
+START_TEST(test_wait_strategies)
+{
+    ck_assert_int_eq(gw_wait_strategy("busy-poll"), GW_WAIT_BUSY_POLL);
+    ck_assert_int_eq(gw_wait_strategy("poll"), -1);
+
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+
+    gw_listener_options_t options;
+    gw_listener_options_init(&options);
+    options.subscriber_address = "ipc:///tmp/gw_wait_spin";
+    options.publisher_address = "tcp://127.0.0.1:6001";
+    options.wait_strategy = GW_WAIT_SPIN;
+    options.spin_usec = 50;
+
+    start_gateway_listener_with_options(ctx, &options);
+
+    void *subscriber = zthread_fork (ctx, mock_subscriber_thread, options.publisher_address);
+    ck_assert_msg(subscriber != NULL, "Subscriber Thread should have been created. ");
+    zthread_fork (ctx, mock_gateway_publisher_thread, options.subscriber_address);
+    zclock_sleep(1000);
+    zctx_interrupted = true;
+
+    gw_shard_stats_t stats;
+    ck_assert_int_eq(gw_zmq_shard_stats(ctx, 0, &stats), 0);
+    ck_assert_msg(stats.messages > 0, "The shard should have forwarded messages");
+    ck_assert_msg(stats.spin_usec > 0, "The shard should have spun before its first sleep");
+    // messages arrive in bursts every 100ms, far beyond the longest spin
+    ck_assert_msg(stats.blocked_usec > 10 * stats.spin_usec, "The shard should mostly sleep at this rate");
+
+    size_t length;
+    char *metrics = gw_metrics_render(&length);
+    ck_assert_msg(strstr(metrics, "gw_zmq_spin_budget_microseconds{thread=\"shard-0\",socket=\"ipc:///tmp/gw_wait_spin\"} 0\n") != NULL,
+                  "Spinning doesn't pay off at this rate");
+    free(metrics);
+
+    gw_zmq_destroy( &ctx );
+}
+END_TEST
+
+START_TEST(test_latency_tracing)
+{
+    gw_histogram_t *histogram = gw_histogram_new();
+    uint64_t value;
+    for (value = 1; value <= 1000; value++) {
+        gw_histogram_record(histogram, value);
+    }
+    ck_assert_int_eq(gw_histogram_count(histogram), 1000);
+    ck_assert_msg(gw_histogram_quantile(histogram, 0.5) >= 500 && gw_histogram_quantile(histogram, 0.5) <= 515,
+                  "The median should be within 3%");
+    ck_assert_int_eq(gw_histogram_quantile(histogram, 0.999), 1000);
+    gw_histogram_destroy(&histogram);
+
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+
+    gw_listener_options_t options;
+    gw_listener_options_init(&options);
+    options.subscriber_address = "ipc:///tmp/gw_trace";
+    options.publisher_address = "tcp://127.0.0.1:6001";
+    options.shard_count = 2;
+    options.trace_sample = 2;
+    options.trace_envelope = 1;
+
+    start_gateway_listener_with_options(ctx, &options);
+
+    void *consumer = zsocket_new(ctx, ZMQ_SUB);
+    zsocket_set_rcvtimeo(consumer, 1000);
+    zsocket_set_subscribe(consumer, "PUB-");
+    zsocket_connect(consumer, "%s", options.publisher_address);
+    // the messages go through the ring of the second shard
+    char shardAddress[256];
+    gw_zmq_shard_endpoint(options.subscriber_address, 1, shardAddress, sizeof(shardAddress));
+    void *gateway = zsocket_new(ctx, ZMQ_PUB);
+    zsocket_connect(gateway, "%s", shardAddress);
+    zclock_sleep(300);
+
+    char topic[32];
+    int i;
+    for (i = 0; i < 10; i++) {
+        snprintf(topic, sizeof(topic), "PUB-A-%05d", i);
+        zstr_sendm(gateway, topic);
+        zstr_send(gateway, "body");
+    }
+
+    int traced = 0;
+    for (i = 0; i < 10; i++) {
+        zmsg_t *message = zmsg_recv(consumer);
+        ck_assert_msg(message != NULL, "The consumer should receive every message");
+        zframe_t *last = zmsg_last(message);
+        if (zframe_size(last) == GW_TRACE_ENVELOPE_SIZE && memcmp(zframe_data(last), GW_TRACE_MAGIC, 4) == 0) {
+            ck_assert_int_eq(zmsg_size(message), 3);
+            ck_assert_msg(memcmp(zframe_data(last) + 4, zframe_data(last) + 12, 8) <= 0,
+                          "A message is published after it's received");
+            traced++;
+        } else {
+            ck_assert_int_eq(zmsg_size(message), 2);
+        }
+        zmsg_destroy(&message);
+    }
+    ck_assert_int_eq(traced, 5);
+
+    size_t length;
+    char *metrics = gw_metrics_render(&length);
+    char expected[256];
+    snprintf(expected, sizeof(expected), "gw_zmq_trace_ingress_residence_microseconds_count{ingress=\"%s\"} 5\n",
+             shardAddress);
+    ck_assert_msg(strstr(metrics, expected) != NULL, "The second shard should have 5 traced messages");
+    ck_assert_msg(strstr(metrics, "gw_zmq_trace_egress_residence_microseconds_count{egress=\"tcp://127.0.0.1:6001\"} 5\n") != NULL,
+                  "The XPUB should have 5 traced messages");
+    ck_assert_msg(strstr(metrics, "gw_zmq_trace_egress_residence_microseconds{egress=\"tcp://127.0.0.1:6001\",quantile=\"0.999\"}") != NULL,
+                  "The residence should be exposed with its quantiles");
+    free(metrics);
+
+    zctx_interrupted = true;
+    gw_zmq_destroy( &ctx );
+}
+END_TEST
+
+START_TEST(test_shm_ingress)
+{
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+
+    ck_assert_msg(gw_shm_writer_open("shm://gw_test_ingress") == NULL && errno == ENOENT,
+                  "Workers can't write before the adaptor starts");
+
+    gw_listener_options_t options;
+    gw_listener_options_init(&options);
+    options.subscriber_address = "shm://gw_test_ingress";
+    options.publisher_address = "tcp://127.0.0.1:6001";
+    options.shm_workers = 2;
+    options.shm_ring_size = 4096;
+
+    start_gateway_listener_with_options(ctx, &options);
+
+    void *subscriber = zthread_fork (ctx, mock_subscriber_thread, options.publisher_address);
+    ck_assert_msg(subscriber != NULL, "Subscriber Thread should have been created. ");
+    zclock_sleep (100);
+
+    gw_shm_writer_t *first = gw_shm_writer_open("shm://gw_test_ingress");
+    gw_shm_writer_t *second = gw_shm_writer_open("shm://gw_test_ingress");
+    ck_assert_msg(first != NULL && second != NULL, "Each worker should get its own ring");
+    ck_assert_msg(gw_shm_writer_open("shm://gw_test_ingress") == NULL && errno == EBUSY, "All the rings are taken");
+
+    char message[64];
+    int i;
+    for (i = 0; i < 100; i++) {
+        snprintf(message, sizeof(message), "PUB-A-%05d", i);
+        ck_assert_int_eq(gw_shm_writer_send(i % 2 ? first : second, message, strlen(message), 0), 0);
+        zclock_sleep(5);
+    }
+    char large[3000];
+    memset(large, 'x', sizeof(large));
+    ck_assert_int_eq(gw_shm_writer_send(first, large, sizeof(large), 0), -1);
+    ck_assert_int_eq(errno, EMSGSIZE);
+    zclock_sleep(200);
+
+    gw_shard_stats_t stats;
+    ck_assert_int_eq(gw_zmq_shard_stats(ctx, 0, &stats), 0);
+    ck_assert_msg(stats.messages == 100, "Every message written should have been read");
+    ck_assert_msg(messages_received_counter == 100, "Every message should have been published");
+
+    zctx_interrupted = true;
+    gw_zmq_destroy( &ctx );
+
+    ck_assert_int_eq(gw_shm_writer_send(first, message, strlen(message), 0), -1);
+    ck_assert_msg(errno == EPIPE, "Workers should know the adaptor is gone");
+    gw_shm_writer_close(&first);
+    gw_shm_writer_close(&second);
+}
+END_TEST
+
+START_TEST(test_shm_corrupted_ring)
+{
+    gw_shm_reader_t *reader = gw_shm_reader_new("shm://gw_test_corrupted", 1, 4096);
+    gw_shm_writer_t *writer = gw_shm_writer_open("shm://gw_test_corrupted");
+    ck_assert_msg(reader != NULL && writer != NULL, "The ring should be open");
+    ck_assert_int_eq(gw_shm_writer_send(writer, "first", 5, 1), 0);
+    ck_assert_int_eq(gw_shm_writer_send(writer, "second", 6, 0), 0);
+
+    // a worker overwrites the size of the second frame; the bytes of the only ring start at the first page
+    int fd = shm_open("/gw_test_corrupted", O_RDWR, 0);
+    ck_assert_msg(fd != -1, "The shared memory object should exist");
+    char *base = mmap(NULL, 8192, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ck_assert_msg(base != MAP_FAILED, "The shared memory object should be mapped");
+    uint32_t size = 1 << 30;
+    memcpy(base + 4096 + 16, &size, sizeof(size));
+
+    const void *data;
+    size_t frameSize;
+    int more;
+    ck_assert_int_eq(gw_shm_reader_peek(reader, &data, &frameSize, &more), 1);
+    ck_assert_msg(frameSize == 5 && more, "The first frame is valid");
+    gw_shm_reader_release(reader);
+    ck_assert_int_eq(gw_shm_reader_peek(reader, &data, &frameSize, &more), 1);
+    ck_assert_msg(frameSize == 0 && !more, "The message should be ended with an empty frame");
+    gw_shm_reader_release(reader);
+    ck_assert_int_eq(gw_shm_reader_peek(reader, &data, &frameSize, &more), 0);
+    ck_assert_int_eq(gw_shm_reader_corrupted(reader), 1);
+
+    // the ring goes on with the next message
+    ck_assert_int_eq(gw_shm_writer_send(writer, "third", 5, 0), 0);
+    ck_assert_int_eq(gw_shm_reader_peek(reader, &data, &frameSize, &more), 1);
+    ck_assert_msg(frameSize == 5 && memcmp(data, "third", 5) == 0, "The ring should be read again");
+    gw_shm_reader_release(reader);
+
+    munmap(base, 8192);
+    close(fd);
+    gw_shm_writer_close(&writer);
+    gw_shm_reader_destroy(&reader);
+}
+END_TEST
+
+START_TEST(test_shm_wrapped_message)
+{
+    gw_shm_reader_t *reader = gw_shm_reader_new("shm://gw_test_wrapped", 1, 4096);
+    gw_shm_writer_t *writer = gw_shm_writer_open("shm://gw_test_wrapped");
+    ck_assert_msg(reader != NULL && writer != NULL, "The ring should be open");
+
+    char message[2048];
+    memset(message, 'x', sizeof(message));
+    const void *data;
+    size_t size;
+    int more;
+    int i;
+    // leaves 96 bytes before the end of the ring
+    for (i = 0; i < 2; i++) {
+        ck_assert_int_eq(gw_shm_writer_send(writer, message, 1992, 0), 0);
+        ck_assert_int_eq(gw_shm_reader_peek(reader, &data, &size, &more), 1);
+        gw_shm_reader_release(reader);
+    }
+    // the padding of the wrap doesn't count against the size of the message
+    ck_assert_int_eq(gw_shm_writer_send(writer, message, 2000, 0), 0);
+    ck_assert_int_eq(gw_shm_reader_peek(reader, &data, &size, &more), 1);
+    ck_assert_int_eq(size, 2000);
+    gw_shm_reader_release(reader);
+
+    // but all the frames of the message do
+    ck_assert_int_eq(gw_shm_writer_send(writer, message, 1000, 1), 0);
+    ck_assert_int_eq(gw_shm_writer_send(writer, message, 1100, 0), -1);
+    ck_assert_int_eq(errno, EMSGSIZE);
+
+    gw_shm_writer_close(&writer);
+    gw_shm_reader_destroy(&reader);
+}
+END_TEST
+
+START_TEST(test_ring_drop_newest)
+{
+    ck_assert_int_eq(gw_ring_policy("drop-oldest"), GW_RING_DROP_OLDEST);
+    ck_assert_int_eq(gw_ring_policy("newest"), -1);
+
+    gw_ring_t *ring = gw_ring_new(3, GW_RING_DROP_NEWEST);
+    ck_assert_int_eq(gw_ring_size(ring), 4);
+
+    zmq_msg_t frame;
+    zmq_msg_init(&frame);
+    int i;
+    for (i = 0; i < 6; i++) {
+        zmq_msg_init_size(&frame, i + 1);
+        ck_assert_int_eq(gw_ring_push(ring, &frame), i < 4 ? 0 : 1);
+        ck_assert_int_eq(zmq_msg_size(&frame), 0);
+    }
+    ck_assert_msg(gw_ring_prepare_wait(ring) == 0, "Frames shouldn't be visible before they're committed");
+    ck_assert_int_eq(gw_ring_pop(ring, &frame, 0), -1);
+    ck_assert_int_eq(errno, EAGAIN);
+
+    gw_ring_commit(ring);
+    ck_assert_int_eq(gw_ring_depth(ring), 4);
+    ck_assert_int_eq(gw_ring_dropped(ring), 2);
+    gw_ring_clear_wakeup(ring, 1);
+
+    // the oldest frames are kept
+    for (i = 0; i < 4; i++) {
+        ck_assert_int_eq(gw_ring_pop(ring, &frame, 0), i + 1);
+    }
+    ck_assert_int_eq(gw_ring_pop(ring, &frame, 0), -1);
+    ck_assert_int_eq(gw_ring_depth(ring), 0);
+
+    zmq_msg_close(&frame);
+    gw_ring_destroy(&ring);
+    ck_assert_msg(ring == NULL, "Ring should be destroyed. ");
+}
+END_TEST
+
+START_TEST(test_socket_monitor)
+{
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+
+    gw_listener_options_t options;
+    gw_listener_options_init(&options);
+    options.subscriber_address = "ipc:///tmp/nginx_queue_listen_monitored";
+    options.publisher_address = "tcp://127.0.0.1:6001";
+    options.monitor_events = 1;
+    options.monitor_log_rate = 1;
+
+    start_gateway_listener_with_options(ctx, &options);
+
+    // consumers reconnecting over and over
+    int i;
+    for (i = 0; i < 5; i++) {
+        void *consumer = zsocket_new(ctx, ZMQ_SUB);
+        zsocket_connect(consumer, "%s", options.publisher_address);
+        zclock_sleep(50);
+        zsocket_destroy(ctx, consumer);
+    }
+    zclock_sleep(300);
+
+    size_t length;
+    char *metrics = gw_metrics_render(&length);
+    ck_assert_msg(strstr(metrics, "gw_zmq_socket_events_total{socket=\"tcp://127.0.0.1:6001\",event=\"accepted\"} 5\n") != NULL,
+                  "Every connection of the consumers should have been counted");
+    ck_assert_msg(strstr(metrics, "gw_zmq_connection_churn{socket=\"ipc:///tmp/nginx_queue_listen_monitored\"}") != NULL,
+                  "The XSUB should be monitored too");
+    ck_assert_msg(strstr(metrics, "gw_zmq_monitor_log_suppressed_total 0\n") == NULL,
+                  "The events over the log rate should only have been counted");
+    free(metrics);
+
+    gw_zmq_destroy( &ctx );
+}
+END_TEST
+
+START_TEST(test_metrics_render)
+{
+    gw_metrics_t *metrics = gw_metrics_new("shard-0", "ipc:///tmp/nginx_queue_listen");
+    GW_COUNTER_ADD(metrics->messages_in, 42);
+    gw_metrics_record_batch(metrics, 42);
+
+    size_t length;
+    char *text = gw_metrics_render(&length);
+    ck_assert_msg(strstr(text, "gw_zmq_messages_in_total{thread=\"shard-0\",socket=\"ipc:///tmp/nginx_queue_listen\"} 42") != NULL,
+                  "The messages received should be rendered");
+    ck_assert_msg(strstr(text, "gw_zmq_batch_size_bucket{thread=\"shard-0\",socket=\"ipc:///tmp/nginx_queue_listen\",le=\"64\"} 1") != NULL,
+                  "The batch should be counted in the 64 bucket");
+    free(text);
+
+    gw_metrics_destroy(&metrics);
+    ck_assert_msg(metrics == NULL, "Metrics should be destroyed. ");
+}
+END_TEST
+
+START_TEST(test_subscription_index)
+{
+    gw_subscriptions_t *subscriptions = gw_subscriptions_new();
+
+    ck_assert_msg(gw_subscriptions_match(subscriptions, "PUB-A-00001", 11) == 0, "Nobody subscribed yet");
+
+    ck_assert_int_eq(gw_subscriptions_update(subscriptions, "\001PUB-A", 6), GW_SUBSCRIPTION_ADDED);
+    ck_assert_int_eq(gw_subscriptions_update(subscriptions, "\001PUB-A", 6), GW_SUBSCRIPTION_REFERENCED);
+    ck_assert_int_eq(gw_subscriptions_update(subscriptions, "\001PUB-B-1", 8), GW_SUBSCRIPTION_ADDED);
+    ck_assert_int_eq(gw_subscriptions_update(subscriptions, "\002PUB", 4), GW_SUBSCRIPTION_IGNORED);
+    ck_assert_int_eq(gw_subscriptions_count(subscriptions), 2);
+
+    ck_assert_int_eq(gw_subscriptions_match(subscriptions, "PUB-A-00001", 11), 1);
+    ck_assert_int_eq(gw_subscriptions_match(subscriptions, "PUB-B-00001", 11), 0);
+    ck_assert_int_eq(gw_subscriptions_match(subscriptions, "PUB-B-12345", 11), 1);
+    ck_assert_int_eq(gw_subscriptions_match(subscriptions, "PUB", 3), 0);
+
+    // everything matches the empty prefix
+    ck_assert_int_eq(gw_subscriptions_update(subscriptions, "\001", 1), GW_SUBSCRIPTION_ADDED);
+    ck_assert_int_eq(gw_subscriptions_match(subscriptions, "SEND-00001", 10), 1);
+    ck_assert_int_eq(gw_subscriptions_match(subscriptions, "PUB-A-00001", 11), 2);
+
+#ifdef ZMQ_XPUB_VERBOSER
+    // the other subscriber of the topic is still there
+    ck_assert_int_eq(gw_subscriptions_update(subscriptions, "\000PUB-A", 6), GW_SUBSCRIPTION_RELEASED);
+    ck_assert_int_eq(gw_subscriptions_match(subscriptions, "PUB-A-00001", 11), 2);
+#endif
+    ck_assert_int_eq(gw_subscriptions_update(subscriptions, "\000PUB-A", 6), GW_SUBSCRIPTION_REMOVED);
+    ck_assert_int_eq(gw_subscriptions_update(subscriptions, "\000", 1), GW_SUBSCRIPTION_REMOVED);
+    ck_assert_int_eq(gw_subscriptions_match(subscriptions, "PUB-A-00001", 11), 0);
+    ck_assert_int_eq(gw_subscriptions_count(subscriptions), 1);
+
+    gw_subscriptions_destroy(&subscriptions);
+    ck_assert_msg(subscriptions == NULL, "Subscriptions should be destroyed. ");
+}
+END_TEST
+
+START_TEST(test_upstream_subscriptions_are_merged)
+{
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+    char *publisherAddress = "tcp://127.0.0.1:6001";
+    char *subscriberAddress = "ipc:///tmp/nginx_queue_listen_merged";
+
+    start_gateway_listener(ctx, subscriberAddress, publisherAddress, 0);
+
+    // an XPUB in place of the gateway sees the subscriptions sent upstream
+    void *gateway = zsocket_new (ctx, ZMQ_XPUB);
+    zsocket_set_xpub_verbose (gateway, 1);
+    zsocket_set_rcvtimeo (gateway, 1000);
+    ck_assert_int_eq(zsocket_connect (gateway, "%s", subscriberAddress), 0);
+
+    void *consumer1 = zsocket_new (ctx, ZMQ_SUB);
+    void *consumer2 = zsocket_new (ctx, ZMQ_SUB);
+    zsocket_connect (consumer1, "%s", publisherAddress);
+    zsocket_connect (consumer2, "%s", publisherAddress);
+    zsocket_set_subscribe (consumer1, "PUB-A");
+    zsocket_set_subscribe (consumer2, "PUB-A");
+
+    zframe_t *frame = zframe_recv (gateway);
+    ck_assert_msg(frame != NULL, "The gateway should have received the subscription");
+    ck_assert_int_eq(zframe_size(frame), 6);
+    ck_assert_msg(memcmp(zframe_data(frame), "\001PUB-A", 6) == 0, "The gateway should be subscribed to PUB-A");
+    zframe_destroy(&frame);
+
+    // once both consumers are gone the gateway should stop publishing the topic
+    zsocket_destroy (ctx, consumer1);
+    zsocket_destroy (ctx, consumer2);
+
+    frame = zframe_recv (gateway);
+    ck_assert_msg(frame != NULL, "The gateway should have received the unsubscription");
+    ck_assert_msg(memcmp(zframe_data(frame), "\000PUB-A", 6) == 0, "The gateway should be unsubscribed from PUB-A");
+    zframe_destroy(&frame);
+
+    zctx_interrupted = true;
+    gw_zmq_destroy( &ctx );
+}
+END_TEST
+
+
+START_TEST(test_spool_replay)
+{
+    zctx_t *ctx = gw_zmq_init();
+    char directory[] = "/tmp/gw_spool_test_XXXXXX";
+    ck_assert_msg(mkdtemp(directory) != NULL, "The spool directory should be created");
+
+    gw_spool_t *spool = gw_spool_new(directory, 4096, 4, 60, 10);
+    ck_assert_int_eq(gw_spool_append(spool, "PUB-A", 5, 1), 0);
+    ck_assert_int_eq(gw_spool_append(spool, "first", 5, 0), 0);
+    ck_assert_int_eq(gw_spool_append(spool, "PUB-B second", 12, 0), 0);
+    gw_spool_destroy(&spool);
+    ck_assert_msg(spool == NULL, "Spool should be destroyed. ");
+
+    // the messages survive a restart
+    spool = gw_spool_new(directory, 4096, 4, 60, 10);
+    ck_assert_int_eq(gw_spool_pending(spool), 1);
+
+    // nobody to send to yet: the messages stay spooled
+    void *sender = zsocket_new(ctx, ZMQ_PAIR);
+    ck_assert_int_eq(gw_spool_replay(spool, sender, 10), 0);
+    ck_assert_int_eq(gw_spool_pending(spool), 1);
+
+    void *receiver = zsocket_new(ctx, ZMQ_PAIR);
+    zsocket_bind(receiver, "inproc://spool-test");
+    zsocket_connect(sender, "inproc://spool-test");
+
+    ck_assert_int_eq(gw_spool_replay(spool, sender, 10), 2);
+    ck_assert_int_eq(gw_spool_pending(spool), 0);
+
+    zmsg_t *msg = zmsg_recv(receiver);
+    ck_assert_int_eq(zmsg_size(msg), 2);
+    char *topic = zmsg_popstr(msg);
+    ck_assert_str_eq(topic, "PUB-A");
+    free(topic);
+    zmsg_destroy(&msg);
+    char *second = zstr_recv(receiver);
+    ck_assert_str_eq(second, "PUB-B second");
+    free(second);
+
+    // a frame larger than a segment is rejected instead of being split
+    char large[8192];
+    memset(large, 'x', sizeof(large));
+    ck_assert_int_eq(gw_spool_append(spool, large, sizeof(large), 0), -1);
+
+    // the frames of a message spread over two segments are replayed together
+    ck_assert_int_eq(gw_spool_append(spool, "PUB-C", 5, 1), 0);
+    ck_assert_int_eq(gw_spool_append(spool, large, 3000, 1), 0);
+    ck_assert_int_eq(gw_spool_append(spool, large, 3000, 0), 0);
+    ck_assert_int_eq(gw_spool_replay(spool, sender, 10), 1);
+    msg = zmsg_recv(receiver);
+    ck_assert_int_eq(zmsg_size(msg), 3);
+    zmsg_destroy(&msg);
+    ck_assert_int_eq(gw_spool_pending(spool), 0);
+
+    gw_spool_destroy(&spool);
+    gw_zmq_destroy(&ctx);
+
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf %s", directory);
+    ck_assert_int_eq(system(command), 0);
+}
+END_TEST
+
+START_TEST(test_spool_eviction)
+{
+    zctx_t *ctx = gw_zmq_init();
+    char directory[] = "/tmp/gw_spool_test_XXXXXX";
+    ck_assert_msg(mkdtemp(directory) != NULL, "The spool directory should be created");
+
+    void *receiver = zsocket_new(ctx, ZMQ_PAIR);
+    zsocket_bind(receiver, "inproc://spool-eviction");
+    void *sender = zsocket_new(ctx, ZMQ_PAIR);
+    zsocket_connect(sender, "inproc://spool-eviction");
+
+    gw_spool_t *spool = gw_spool_new(directory, 4096, 2, 60, 10);
+    char large[3000];
+    memset(large, 'x', sizeof(large));
+
+    // PUB-A starts in the first segment and ends in the second one, before PUB-B
+    ck_assert_int_eq(gw_spool_append(spool, "PUB-A", 5, 1), 0);
+    ck_assert_int_eq(gw_spool_append(spool, large, 3000, 1), 0);
+    ck_assert_int_eq(gw_spool_append(spool, large, 2000, 0), 0);
+    ck_assert_int_eq(gw_spool_append(spool, "PUB-B", 5, 0), 0);
+    // evicts the first segment: the end of PUB-A is skipped along with it
+    ck_assert_int_eq(gw_spool_append(spool, large, 3000, 0), 0);
+    ck_assert_int_eq(gw_spool_replay(spool, sender, 10), 2);
+    char *first = zstr_recv(receiver);
+    ck_assert_str_eq(first, "PUB-B");
+    free(first);
+    zmsg_t *msg = zmsg_recv(receiver);
+    ck_assert_int_eq(zmsg_size(msg), 1);
+    zmsg_destroy(&msg);
+
+    // PUB-C spreads over three segments: its beginning is evicted while it's appended, the rest of it is discarded
+    ck_assert_int_eq(gw_spool_append(spool, "PUB-C", 5, 1), 0);
+    ck_assert_int_eq(gw_spool_append(spool, large, 3000, 1), 0);
+    ck_assert_int_eq(gw_spool_append(spool, large, 3000, 1), 0);
+    ck_assert_int_eq(gw_spool_append(spool, large, 3000, 0), 0);
+    ck_assert_int_eq(gw_spool_append(spool, "PUB-D", 5, 0), 0);
+    ck_assert_int_eq(gw_spool_replay(spool, sender, 10), 1);
+    char *last = zstr_recv(receiver);
+    ck_assert_str_eq(last, "PUB-D");
+    free(last);
+    ck_assert_int_eq(gw_spool_pending(spool), 0);
+
+    char *text = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&text, &length);
+    gw_spool_render(out, spool);
+    fclose(out);
+    ck_assert_msg(strstr(text, "gw_zmq_spool_rejected_total 2\n") != NULL, "Both truncated messages should be rejected");
+    free(text);
+
+    gw_spool_destroy(&spool);
+    gw_zmq_destroy(&ctx);
+
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf %s", directory);
+    ck_assert_int_eq(system(command), 0);
+}
+END_TEST
+
+START_TEST(test_slow_consumer_detection)
+{
+    int pair[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+
+    gw_consumers_t *consumers = gw_consumers_new(64, 2);
+    gw_consumers_event(consumers, ZMQ_EVENT_ACCEPTED, pair[0], "ipc:///tmp/test_xpub");
+    ck_assert_int_eq(gw_consumers_count(consumers), 1);
+
+    // the consumer doesn't read what's sent to it
+    char data[256];
+    memset(data, 'x', sizeof(data));
+    ck_assert_int_eq(write(pair[0], data, sizeof(data)), sizeof(data));
+
+    ck_assert_int_eq(gw_consumers_sample(consumers, 1024, 0), 0);
+    ck_assert_int_eq(gw_consumers_sample(consumers, 1024, 0), 1);
+    // it's reported once, and charged with the messages the XPUB refused meanwhile
+    ck_assert_int_eq(gw_consumers_sample(consumers, 1024, 7), 0);
+
+    char *text = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&text, &length);
+    gw_consumers_render(out, consumers);
+    fclose(out);
+    ck_assert_msg(strstr(text, "gw_zmq_consumer_dropped_total{peer=\"") != NULL, "Consumer drops should be rendered");
+    ck_assert_msg(strstr(text, ",socket=\"ipc:///tmp/test_xpub\"} 7\n") != NULL, "The slow consumer should be charged with the drops");
+    ck_assert_msg(strstr(text, "gw_zmq_consumer_unattributed_dropped_total 0\n") != NULL, "No drop should be left unattributed");
+    free(text);
+    // the connection is left alone
+    ck_assert_int_eq(write(pair[0], data, sizeof(data)), sizeof(data));
+
+    gw_consumers_event(consumers, ZMQ_EVENT_CLOSED, pair[0], "ipc:///tmp/test_xpub");
+    ck_assert_int_eq(gw_consumers_count(consumers), 0);
+
+    gw_consumers_destroy(&consumers);
+    ck_assert_msg(consumers == NULL, "Consumers should be destroyed. ");
+    close(pair[0]);
+    close(pair[1]);
+}
+END_TEST
+
+static int
+collect_record(const void *record, size_t size, void *args)
+{
+    char *records = (char *) args;
+    strncat(records, (const char *) record, size);
+    strcat(records, ",");
+    return 0;
+}
+
+START_TEST(test_coalesced_messages)
+{
+    zctx_t *ctx = gw_zmq_init();
+    void *receiver = zsocket_new(ctx, ZMQ_PAIR);
+    zsocket_bind(receiver, "inproc://coalescer-test");
+    void *sender = zsocket_new(ctx, ZMQ_PAIR);
+    zsocket_connect(sender, "inproc://coalescer-test");
+
+    gw_coalescer_t *coalescer = gw_coalescer_new(5, 1024, 1000000);
+    ck_assert_int_eq(gw_coalescer_add(coalescer, sender, "PUB-A-00001", 11, 0), 0);
+    ck_assert_int_eq(gw_coalescer_add(coalescer, sender, "PUB-B-00002", 11, 0), 0);
+    ck_assert_int_eq(gw_coalescer_add(coalescer, sender, "PUB-A-00003", 11, 0), 0);
+    // nothing is published before the delay or the size limit
+    ck_assert_msg(zstr_recv_nowait(receiver) == NULL, "Messages should wait to be coalesced");
+    ck_assert_int_eq(gw_coalescer_timeout(coalescer) > 0, 1);
+    ck_assert_int_eq(gw_coalescer_flush(coalescer, sender), 0);
+
+    char records[256] = "";
+    int i;
+    for (i = 0; i < 2; i++) {
+        zmsg_t *msg = zmsg_recv(receiver);
+        ck_assert_int_eq(zmsg_size(msg), 2);
+        zframe_t *batch = zmsg_last(msg);
+        ck_assert_int_eq(gw_coalesced_is_batch(zframe_data(batch), zframe_size(batch)), 1);
+        ck_assert_int_ne(gw_coalesced_decode(zframe_data(batch), zframe_size(batch), collect_record, records), -1);
+        zmsg_destroy(&msg);
+    }
+    ck_assert_msg(strstr(records, "PUB-A-00001,PUB-A-00003,") != NULL, "Records of a topic should keep their order");
+    ck_assert_msg(strstr(records, "PUB-B-00002,") != NULL, "Each topic should be coalesced on its own");
+
+    ck_assert_int_eq(gw_coalesced_is_batch("PUB-A-00001", 11), 0);
+
+    gw_coalescer_destroy(&coalescer);
+    ck_assert_msg(coalescer == NULL, "Coalescer should be destroyed. ");
+    gw_zmq_destroy(&ctx);
+}
+END_TEST
+
+START_TEST(test_inbound_pusher)
+{
+    zctx_t *ctx = gw_zmq_init();
+    void *publisher = zsocket_new(ctx, ZMQ_PUB);
+    zsocket_bind(publisher, "inproc://inbound-test");
 
+    gw_pusher_options_t options;
+    gw_pusher_options_init(&options);
+    options.listener_address = "inproc://inbound-test";
+    options.push_address = "inproc://inbound-push";
+    options.send_hwm = 100;
+    start_gateway_pusher(ctx, &options);
+
+    // two gateway workers
+    void *workers[2];
+    int received[2] = { 0, 0 };
+    int i;
+    for (i = 0; i < 2; i++) {
+        workers[i] = zsocket_new(ctx, ZMQ_PULL);
+        zsocket_set_rcvtimeo(workers[i], 1000);
+        zsocket_connect(workers[i], "inproc://inbound-push");
+    }
+    // let the SUB subscribe
+    zclock_sleep(100);
+
+    char string[20];
+    for (i = 0; i < 100; i++) {
+        sprintf(string, "BLOCK-%05d", i);
+        zstr_send(publisher, string);
+    }
+    for (i = 0; i < 2; i++) {
+        char *message;
+        while (received[i] < 50 && (message = zstr_recv(workers[i])) != NULL) {
+            ck_assert_int_eq(strncmp(message, "BLOCK-", 6), 0);
+            free(message);
+            received[i]++;
+        }
+    }
+    // the PUSH deals the messages round robin
+    ck_assert_int_eq(received[0], 50);
+    ck_assert_int_eq(received[1], 50);
+    // the counters are published once the batch is forwarded
+    zclock_sleep(50);
+
+    gw_pusher_stats_t stats;
+    ck_assert_int_eq(gw_zmq_pusher_stats(ctx, &stats), 0);
+    ck_assert_int_eq(stats.messages_out, 100);
+    ck_assert_int_eq(stats.dropped, 0);
+    ck_assert_int_eq(stats.latency_count, 100);
+    ck_assert_msg(stats.latency_max_usec >= stats.latency_p99_usec,
+                  "The maximum latency can't be lower than the 99th percentile");
+
+    gw_zmq_destroy(&ctx);
+    ck_assert_msg(ctx == NULL, "ZMQ Context should be destroyed. ");
+}
+END_TEST
+
+START_TEST(test_inbound_pusher_without_workers)
+{
+    zctx_t *ctx = gw_zmq_init();
+    void *publisher = zsocket_new(ctx, ZMQ_PUB);
+    zsocket_bind(publisher, "inproc://inbound-idle");
+
+    gw_pusher_options_t options;
+    gw_pusher_options_init(&options);
+    options.listener_address = "inproc://inbound-idle";
+    options.push_address = "inproc://inbound-idle-push";
+    options.send_timeout = 200;
+    start_gateway_pusher(ctx, &options);
+    // let the SUB subscribe
+    zclock_sleep(100);
+
+    // no gateway worker takes the message, it waits for the send timeout and is dropped
+    int64_t start = zclock_time();
+    zstr_send(publisher, "BLOCK-00000");
+    gw_pusher_stats_t stats;
+    do {
+        zclock_sleep(10);
+        ck_assert_int_eq(gw_zmq_pusher_stats(ctx, &stats), 0);
+    } while (stats.dropped == 0 && zclock_time() - start < 2000);
+    int64_t elapsed = zclock_time() - start;
+
+    ck_assert_int_eq(stats.dropped, 1);
+    ck_assert_int_eq(stats.messages_out, 0);
+    ck_assert_msg(elapsed >= 180 && elapsed < 1000, "The message should wait for the send timeout, not %lld ms",
+                  (long long) elapsed);
+
+    gw_zmq_destroy(&ctx);
+    ck_assert_msg(ctx == NULL, "ZMQ Context should be destroyed. ");
+}
+END_TEST
+
+static void
+write_rules(const char *path, const char *rules)
+{
+    FILE *file = fopen(path, "w");
+    ck_assert_msg(file != NULL, "The rule file should be writable");
+    fputs(rules, file);
+    fclose(file);
+}
+
+START_TEST(test_routing_rules)
+{
+    zctx_t *ctx = gw_zmq_init();
+    char path[] = "/tmp/gw-routes-XXXXXX";
+    int fd = mkstemp(path);
+    ck_assert_int_ne(fd, -1);
+    close(fd);
+    write_rules(path, "# slices of the stream\n"
+                      "egress billing push inproc://route-billing\n"
+                      "egress security push inproc://route-security\n"
+                      "route billing prefix:PUB-A\n"
+                      "route security contains:BLOCK\n"
+                      "route security prefix:PUB- at:4:B\n");
+
+    gw_router_t *router = gw_router_new(ctx, path);
+    ck_assert_msg(router != NULL, "The rules should be loaded");
+    ck_assert_int_eq(gw_router_egress_count(router), 2);
+    ck_assert_int_eq(gw_router_match(router, "PUB-A-00001", 11), 1);
+    ck_assert_int_eq(gw_router_match(router, "PUB-B-00002", 11), 2);
+    ck_assert_int_eq(gw_router_match(router, "PUB-A-BLOCK", 11), 3);
+    ck_assert_int_eq(gw_router_match(router, "XYZ", 3), 0);
+    ck_assert_int_eq(gw_router_match(router, "", 0), 0);
+
+    void *billing = zsocket_new(ctx, ZMQ_PULL);
+    zsocket_set_rcvtimeo(billing, 1000);
+    zsocket_connect(billing, "inproc://route-billing");
+    zmq_msg_t frame;
+    zmq_msg_init_size(&frame, 11);
+    memcpy(zmq_msg_data(&frame), "PUB-A-00001", 11);
+    gw_router_send(router, gw_router_match(router, zmq_msg_data(&frame), 11), &frame, 0);
+    // the router sends copies, the frame is still ours
+    ck_assert_int_eq(zmq_msg_size(&frame), 11);
+    zmq_msg_close(&frame);
+    char *message = zstr_recv(billing);
+    ck_assert_str_eq(message, "PUB-A-00001");
+    free(message);
+
+    // an invalid file leaves the rules in place
+    write_rules(path, "route nowhere prefix:PUB-A\n");
+    ck_assert_int_eq(gw_router_reload(router), -1);
+    ck_assert_int_eq(gw_router_match(router, "PUB-A-00001", 11), 1);
+
+    write_rules(path, "egress billing push inproc://route-billing\n"
+                      "route billing prefix:PUB-C\n");
+    ck_assert_int_eq(gw_router_reload(router), 0);
+    ck_assert_int_eq(gw_router_egress_count(router), 1);
+    ck_assert_int_eq(gw_router_match(router, "PUB-A-00001", 11), 0);
+    ck_assert_int_eq(gw_router_match(router, "PUB-C-00003", 11), 1);
+
+    // the billing egress didn't change so its consumers stay connected
+    zmq_msg_init_size(&frame, 11);
+    memcpy(zmq_msg_data(&frame), "PUB-C-00003", 11);
+    gw_router_send(router, 1, &frame, 0);
+    zmq_msg_close(&frame);
+    message = zstr_recv(billing);
+    ck_assert_msg(message != NULL, "The billing egress should have been kept");
+    ck_assert_str_eq(message, "PUB-C-00003");
+    free(message);
+
+    gw_router_destroy(&router);
+    ck_assert_msg(router == NULL, "Router should be destroyed. ");
+    unlink(path);
+    gw_zmq_destroy(&ctx);
+}
+END_TEST
+
+START_TEST(test_usage_rollups)
+{
+    zctx_t *ctx = gw_zmq_init();
+    void *receiver = zsocket_new(ctx, ZMQ_PAIR);
+    zsocket_bind(receiver, "inproc://aggregator-test");
+    void *sender = zsocket_new(ctx, ZMQ_PAIR);
+    zsocket_connect(sender, "inproc://aggregator-test");
+
+    gw_aggregate_format_t format = { "usage;", ';', { 1 }, 1, 2 };
+    gw_aggregator_t *aggregator = gw_aggregator_new(&format, 60000, "rollup/");
+    ck_assert_int_eq(gw_aggregator_add(aggregator, "usage;key-1;10", 14), 1);
+    ck_assert_int_eq(gw_aggregator_add(aggregator, "usage;key-2;5", 13), 1);
+    ck_assert_int_eq(gw_aggregator_add(aggregator, "usage;key-1;3", 13), 1);
+    // other messages and malformed records are left alone
+    ck_assert_int_eq(gw_aggregator_add(aggregator, "PUB-A-00001", 11), 0);
+    ck_assert_int_eq(gw_aggregator_add(aggregator, "usage;key-3;abc", 15), 0);
+    ck_assert_int_eq(gw_aggregator_add(aggregator, "usage;key-3", 11), 0);
+    ck_assert_int_eq(gw_aggregator_keys(aggregator), 2);
+    ck_assert_int_eq(gw_aggregator_flush_expired(aggregator, sender), 0);
+    ck_assert_msg(zstr_recv_nowait(receiver) == NULL, "The window isn't over yet");
+
+    ck_assert_int_eq(gw_aggregator_flush(aggregator, sender), 0);
+    ck_assert_int_eq(gw_aggregator_keys(aggregator), 0);
+    zmsg_t *msg = zmsg_recv(receiver);
+    ck_assert_int_eq(zmsg_size(msg), 2);
+    char *topic = zmsg_popstr(msg);
+    ck_assert_str_eq(topic, "rollup/");
+    free(topic);
+    char *rollup = zmsg_popstr(msg);
+    ck_assert_msg(strstr(rollup, "\nkey-1\t2\t13\n") != NULL, "key-1 should be rolled up");
+    ck_assert_msg(strstr(rollup, "\nkey-2\t1\t5\n") != NULL, "key-2 should be rolled up");
+    free(rollup);
+    zmsg_destroy(&msg);
+
+    // enough keys to grow the table and split the rollup
+    char record[32];
+    int i;
+    for (i = 0; i < 5000; i++) {
+        int size = sprintf(record, "usage;key-%05d;1", i);
+        gw_aggregator_add(aggregator, record, size);
+    }
+    ck_assert_int_eq(gw_aggregator_keys(aggregator), 5000);
+    ck_assert_int_eq(gw_aggregator_flush(aggregator, sender), 0);
+    int keys = 0;
+    int rollups = 0;
+    zsocket_set_rcvtimeo(receiver, 100);
+    while ((msg = zmsg_recv(receiver)) != NULL) {
+        zframe_t *body = zmsg_last(msg);
+        ck_assert_msg(zframe_size(body) <= GW_AGGREGATE_MAX_ROLLUP_SIZE, "Rollups should be split");
+        size_t j;
+        for (j = 0; j < zframe_size(body); j++) {
+            keys += zframe_data(body)[j] == '\n';
+        }
+        // minus the header line
+        keys--;
+        rollups++;
+        zmsg_destroy(&msg);
+    }
+    ck_assert_int_eq(keys, 5000);
+    ck_assert_msg(rollups > 1, "The rollup should have been split");
+
+    gw_aggregator_destroy(&aggregator);
+    ck_assert_msg(aggregator == NULL, "Aggregator should be destroyed. ");
+    gw_zmq_destroy(&ctx);
+}
+END_TEST
+
+START_TEST(test_compressed_subscriptions)
+{
+    zmq_msg_t subscription;
+    zmq_msg_init_size(&subscription, 9);
+    memcpy(zmq_msg_data(&subscription), "\x01~z/PUB-A", 9);
+    ck_assert_int_eq(gw_compressor_strip_prefix(&subscription), 1);
+    ck_assert_int_eq(zmq_msg_size(&subscription), 6);
+    ck_assert_int_eq(memcmp(zmq_msg_data(&subscription), "\x01PUB-A", 6), 0);
+    // raw topics go upstream as they are
+    ck_assert_int_eq(gw_compressor_strip_prefix(&subscription), 0);
+    zmq_msg_close(&subscription);
+
+    zmq_msg_init_size(&subscription, 9);
+    memcpy(zmq_msg_data(&subscription), "\x00~z/PUB-A", 9);
+    ck_assert_int_eq(gw_compressor_strip_prefix(&subscription), 1);
+    ck_assert_int_eq(memcmp(zmq_msg_data(&subscription), "\x00PUB-A", 6), 0);
+    zmq_msg_close(&subscription);
+
+#ifndef HAVE_LIBZSTD
+    zctx_t *ctx = gw_zmq_init();
+    gw_subscriptions_t *subscriptions = gw_subscriptions_new();
+    ck_assert_msg(gw_compressor_new(ctx, 1, 1, 3, NULL, subscriptions, 5) == NULL,
+                  "Compression should be off without libzstd");
+    gw_subscriptions_destroy(&subscriptions);
+    gw_zmq_destroy(&ctx);
+#endif
+}
+END_TEST
+
+#ifdef HAVE_LIBZSTD
+START_TEST(test_compressed_messages)
+{
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+
+    gw_listener_options_t options;
+    gw_listener_options_init(&options);
+    options.subscriber_address = "ipc:///tmp/gw_compressed";
+    options.publisher_address = "tcp://127.0.0.1:6001";
+    options.compress_enabled = 1;
+    options.compress_workers = 1;
+
+    start_gateway_listener_with_options(ctx, &options);
+
+    void *consumer = zsocket_new(ctx, ZMQ_SUB);
+    zsocket_set_rcvtimeo(consumer, 1000);
+    zsocket_set_subscribe(consumer, GW_COMPRESSED_TOPIC_PREFIX "PUB-A");
+    zsocket_connect(consumer, "%s", options.publisher_address);
+    void *gateway = zsocket_new(ctx, ZMQ_PUB);
+    zsocket_connect(gateway, "%s", options.subscriber_address);
+    zclock_sleep(300);
+
+    char message[256];
+    memset(message, 'x', sizeof(message));
+    memcpy(message, "PUB-A-00001 ", 12);
+    zmq_send(gateway, message, sizeof(message), 0);
+
+    zmsg_t *compressed = zmsg_recv(consumer);
+    ck_assert_msg(compressed != NULL, "The consumer should receive the compressed message");
+    ck_assert_int_eq(zmsg_size(compressed), 2);
+    char *topic = zmsg_popstr(compressed);
+    ck_assert_str_eq(topic, GW_COMPRESSED_TOPIC_PREFIX "PUB-A");
+    free(topic);
+    zframe_t *frame = zmsg_first(compressed);
+    ck_assert_msg(gw_compressed_is_compressed(zframe_data(frame), zframe_size(frame)), "The frame should be compressed");
+    ck_assert_int_eq(gw_compressed_dictionary_id(zframe_data(frame), zframe_size(frame)), 0);
+    ck_assert_int_eq(gw_compressed_raw_size(zframe_data(frame), zframe_size(frame)), sizeof(message));
+    ck_assert_msg(zframe_size(frame) < sizeof(message), "The message should shrink");
+
+    char raw[256];
+    ck_assert_int_eq(gw_compressed_decode(zframe_data(frame), zframe_size(frame), raw, sizeof(raw), NULL, 0), 0);
+    ck_assert_int_eq(memcmp(raw, message, sizeof(message)), 0);
+    // a truncated frame isn't decoded
+    ck_assert_int_eq(gw_compressed_decode(zframe_data(frame), zframe_size(frame) - 1, raw, sizeof(raw), NULL, 0), -1);
+    zmsg_destroy(&compressed);
+
+    gw_zmq_destroy(&ctx);
+    ck_assert_msg(ctx == NULL, "ZMQ Context should be destroyed. ");
+}
+END_TEST
+#endif
+
+START_TEST(test_replay_window)
+{
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+
+    gw_listener_options_t options;
+    gw_listener_options_init(&options);
+    options.subscriber_address = "ipc:///tmp/gw_replay";
+    options.publisher_address = "tcp://127.0.0.1:6001";
+    options.replay_endpoint = "tcp://127.0.0.1:6003";
+
+    start_gateway_listener_with_options(ctx, &options);
+
+    void *consumer = zsocket_new(ctx, ZMQ_SUB);
+    zsocket_set_rcvtimeo(consumer, 1000);
+    zsocket_set_subscribe(consumer, "PUB-");
+    zsocket_connect(consumer, "%s", options.publisher_address);
+    void *gateway = zsocket_new(ctx, ZMQ_PUB);
+    zsocket_connect(gateway, "%s", options.subscriber_address);
+    zclock_sleep(300);
+
+    char topic[32];
+    int i;
+    for (i = 0; i < 5; i++) {
+        snprintf(topic, sizeof(topic), "PUB-%c-%05d", i % 2 ? 'B' : 'A', i);
+        zstr_sendm(gateway, topic);
+        zstr_send(gateway, "body");
+    }
+
+    // the live messages end with their sequence number
+    for (i = 0; i < 5; i++) {
+        zmsg_t *message = zmsg_recv(consumer);
+        ck_assert_msg(message != NULL, "The consumer should receive every message");
+        ck_assert_int_eq(zmsg_size(message), 3);
+        zframe_t *last = zmsg_last(message);
+        ck_assert_int_eq(zframe_size(last), GW_SEQUENCE_FRAME_SIZE);
+        ck_assert_msg(memcmp(zframe_data(last), GW_SEQUENCE_MAGIC, 4) == 0, "The last frame should be a sequence frame");
+        ck_assert_int_eq(zframe_data(last)[11], i + 1);
+        zmsg_destroy(&message);
+    }
+
+    // a consumer which got the first message catches up on the others of topic PUB-A
+    void *snapshot = zsocket_new(ctx, ZMQ_DEALER);
+    zsocket_set_rcvtimeo(snapshot, 1000);
+    zsocket_connect(snapshot, "%s", options.replay_endpoint);
+    zstr_sendm(snapshot, "SINCE");
+    zstr_sendm(snapshot, "1");
+    zstr_send(snapshot, "PUB-A");
+
+    int expected[] = { 3, 5 };
+    for (i = 0; i < 2; i++) {
+        zmsg_t *message = zmsg_recv(snapshot);
+        ck_assert_msg(message != NULL, "The replay should send the missed messages");
+        ck_assert_int_eq(zmsg_size(message), 4);
+        char *kind = zmsg_popstr(message);
+        char *sequence = zmsg_popstr(message);
+        char *replayed = zmsg_popstr(message);
+        ck_assert_str_eq(kind, "MSG");
+        ck_assert_int_eq(atoi(sequence), expected[i]);
+        snprintf(topic, sizeof(topic), "PUB-A-%05d", expected[i] - 1);
+        ck_assert_str_eq(replayed, topic);
+        free(kind);
+        free(sequence);
+        free(replayed);
+        zmsg_destroy(&message);
+    }
+    char *end = zstr_recv(snapshot);
+    ck_assert_str_eq(end, "END");
+    char *last = zstr_recv(snapshot);
+    ck_assert_str_eq(last, "5");
+    free(end);
+    free(last);
+
+    size_t length;
+    char *metrics = gw_metrics_render(&length);
+    ck_assert_msg(strstr(metrics, "gw_zmq_replay_last_sequence 5\n") != NULL, "The window should hold 5 messages");
+    ck_assert_msg(strstr(metrics, "gw_zmq_replay_messages_total 2\n") != NULL, "2 messages should have been replayed");
+    free(metrics);
+
+    zctx_interrupted = true;
+    gw_zmq_destroy( &ctx );
+}
+END_TEST
+
+START_TEST(test_relay)
+{
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+
+    // the adaptor of a gateway node, tracing every message and numbering them
+    gw_listener_options_t edgeOptions;
+    gw_listener_options_init(&edgeOptions);
+    edgeOptions.subscriber_address = "ipc:///tmp/gw_relay_edge";
+    edgeOptions.publisher_address = "tcp://127.0.0.1:6004";
+    edgeOptions.trace_sample = 1;
+    edgeOptions.trace_envelope = 1;
+    edgeOptions.replay_endpoint = "inproc://gw-relay-edge-replay";
+    start_gateway_listener_with_options(ctx, &edgeOptions);
+
+    gw_listener_options_t relayOptions;
+    gw_listener_options_init(&relayOptions);
+    relayOptions.subscriber_address = edgeOptions.publisher_address;
+    relayOptions.publisher_address = "tcp://127.0.0.1:6005";
+    relayOptions.relay = 1;
+    start_gateway_listener_with_options(ctx, &relayOptions);
+
+    void *consumer = zsocket_new(ctx, ZMQ_SUB);
+    zsocket_set_rcvtimeo(consumer, 1000);
+    zsocket_set_subscribe(consumer, "PUB-A");
+    zsocket_connect(consumer, "%s", relayOptions.publisher_address);
+    void *gateway = zsocket_new(ctx, ZMQ_PUB);
+    zsocket_connect(gateway, "%s", edgeOptions.subscriber_address);
+    // the subscription goes up to the relay, then to the edge adaptor, then to the gateway
+    zclock_sleep(500);
+
+    char topic[32];
+    int i;
+    for (i = 0; i < 10; i++) {
+        snprintf(topic, sizeof(topic), "PUB-%c-%05d", i % 2 ? 'B' : 'A', i);
+        zstr_sendm(gateway, topic);
+        zstr_send(gateway, "body");
+    }
+
+    for (i = 0; i < 5; i++) {
+        zmsg_t *message = zmsg_recv(consumer);
+        ck_assert_msg(message != NULL, "The consumer should receive the messages relayed from the edge");
+        // the envelope and the sequence frame of the edge adaptor are stripped by the relay
+        ck_assert_int_eq(zmsg_size(message), 2);
+        char *received = zmsg_popstr(message);
+        snprintf(topic, sizeof(topic), "PUB-A-%05d", i * 2);
+        ck_assert_str_eq(received, topic);
+        free(received);
+        zmsg_destroy(&message);
+    }
+
+    size_t length;
+    char *metrics = gw_metrics_render(&length);
+    // the PUB-B messages don't leave the edge adaptor
+    ck_assert_msg(strstr(metrics, "gw_zmq_relay_hop_microseconds_count{upstream=\"tcp://127.0.0.1:6004\"} 5\n") != NULL,
+                  "The relay should time the hop of the 5 messages it subscribed to");
+    free(metrics);
+
+    zctx_interrupted = true;
+    gw_zmq_destroy( &ctx );
+}
+END_TEST
+
+START_TEST(test_balanced_workers)
+{
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+
+    gw_listener_options_t options;
+    gw_listener_options_init(&options);
+    options.subscriber_address = "ipc:///tmp/gw_balance";
+    options.publisher_address = "tcp://127.0.0.1:6001";
+    options.balance_endpoint = "tcp://127.0.0.1:6301";
+    options.balance_mode = GW_BALANCE_HASH;
+    options.balance_key_size = 5;
+
+    start_gateway_listener_with_options(ctx, &options);
+
+    void *workers[2];
+    int i;
+    for (i = 0; i < 2; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "worker-%c", 'a' + i);
+        workers[i] = zsocket_new(ctx, ZMQ_DEALER);
+        zsocket_set_rcvtimeo(workers[i], 200);
+        zsocket_connect(workers[i], "%s", options.balance_endpoint);
+        zstr_sendm(workers[i], "READY");
+        zstr_sendm(workers[i], "100");
+        zstr_send(workers[i], name);
+    }
+    void *gateway = zsocket_new(ctx, ZMQ_PUB);
+    zsocket_connect(gateway, "%s", options.subscriber_address);
+    zclock_sleep(300);
+
+    char topic[32];
+    for (i = 0; i < 40; i++) {
+        snprintf(topic, sizeof(topic), "KEY-%c-%05d", 'A' + i % 4, i);
+        zstr_send(gateway, topic);
+    }
+
+    // each message goes to a single worker, always the same one for a key
+    int received = 0;
+    int owners[4] = { -1, -1, -1, -1 };
+    for (i = 0; i < 2; i++) {
+        char *message;
+        while ((message = zstr_recv(workers[i])) != NULL) {
+            int key = message[4] - 'A';
+            ck_assert_msg(owners[key] == -1 || owners[key] == i, "A key should stick to its worker");
+            owners[key] = i;
+            received++;
+            free(message);
+        }
+    }
+    ck_assert_int_eq(received, 40);
+
+    size_t length;
+    char *metrics = gw_metrics_render(&length);
+    ck_assert_msg(strstr(metrics, "gw_zmq_balance_workers 2\n") != NULL, "Both workers should be registered");
+    ck_assert_msg(strstr(metrics, "gw_zmq_balanced_messages_total 40\n") != NULL, "Every message should be balanced");
+    free(metrics);
+
+    zctx_interrupted = true;
+    gw_zmq_destroy( &ctx );
+}
+END_TEST
+
+START_TEST(test_drain_on_shutdown)
+{
+    zctx_t *ctx = gw_zmq_init();
+    zctx_interrupted = false;
+
+    gw_listener_options_t options;
+    gw_listener_options_init(&options);
+    options.subscriber_address = "tcp://127.0.0.1:6401";
+    options.publisher_address = "tcp://127.0.0.1:6001";
+
+    start_gateway_listener_with_options(ctx, &options);
+
+    void *consumer = zsocket_new(ctx, ZMQ_SUB);
+    zsocket_set_subscribe(consumer, "");
+    zsocket_set_rcvtimeo(consumer, 500);
+    zsocket_connect(consumer, "%s", options.publisher_address);
+    void *gateway = zsocket_new(ctx, ZMQ_PUB);
+    zsocket_connect(gateway, "%s", options.subscriber_address);
+    zclock_sleep(300);
+
+    int i;
+    for (i = 0; i < 100; i++) {
+        zstr_sendf(gateway, "DRAIN-%03d", i);
+    }
+    zclock_sleep(100);
+
+    gw_drain_stats_t stats;
+    ck_assert_int_eq(gw_zmq_drain(ctx, 2000, &stats), 0);
+    ck_assert_int_eq(stats.dropped, 0);
+    ck_assert_int_eq(stats.spilled, 0);
+    ck_assert_int_eq(stats.left, 0);
+
+    // nothing accepted before the drain is lost
+    int received = 0;
+    char *message;
+    while ((message = zstr_recv(consumer)) != NULL) {
+        received++;
+        free(message);
+    }
+    ck_assert_int_eq(received, 100);
+
+    // the ingress endpoint was released, and what the gateway sends now waits on its side
+    void *next = zsocket_new(ctx, ZMQ_XSUB);
+    ck_assert_int_ne(zsocket_bind(next, "%s", options.subscriber_address), -1);
+    zstr_send(gateway, "AFTER");
+    ck_assert_msg(zstr_recv(consumer) == NULL, "The adaptor should not take messages in anymore");
+
+    zctx_interrupted = true;
+    gw_zmq_destroy( &ctx );
+}
+END_TEST
+
+static volatile int handover_taken = 0;
+
+static void
+on_handover(void)
+{
+    handover_taken = 1;
+}
+
+START_TEST(test_hot_restart_handover)
+{
+    const char *path = "/tmp/gw_handover_test.sock";
+    const char *endpoint = "ipc:///tmp/gw_handover_test";
+    int i;
+
+    unlink(path);
+    pid_t old = fork();
+    ck_assert_msg(old != -1, "Could not start the old process");
+    if (old == 0) {
+        // the old process, serving a listening socket
+        if (gw_handover_init(path) != 0 || gw_handover_listen(endpoint) == -1 || gw_handover_serve(on_handover) != 0) {
+            _exit(1);
+        }
+        for (i = 0; i < 500 && !handover_taken; i++) {
+            zclock_sleep(10);
+        }
+        gw_handover_close();
+        _exit(handover_taken ? 0 : 2);
+    }
+
+    int result = 0;
+    for (i = 0; i < 100 && result != 1; i++) {
+        result = gw_handover_init(path);
+        if (result != 1) {
+            gw_handover_close();
+            zclock_sleep(10);
+        }
+    }
+    ck_assert_int_eq(result, 1);
+
+    int status;
+    waitpid(old, &status, 0);
+    ck_assert_msg(WIFEXITED(status) && WEXITSTATUS(status) == 0, "The old process should hand over and exit");
+
+    // the socket outlives the old process, still listening on the same path
+    int fd = gw_handover_listen(endpoint);
+    ck_assert_int_ne(fd, -1);
+    int listening = 0;
+    socklen_t length = sizeof(listening);
+    getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length);
+    ck_assert_int_eq(listening, 1);
+    struct sockaddr_un address;
+    length = sizeof(address);
+    getsockname(fd, (struct sockaddr *) &address, &length);
+    ck_assert_str_eq(address.sun_path, "/tmp/gw_handover_test");
+
+    // the new process serves the path for the next one
+    ck_assert_int_eq(gw_handover_serve(NULL), 0);
+    ck_assert_int_eq(gw_handover_taken_over(), 0);
+    gw_handover_close();
+    ck_assert_int_ne(access(path, F_OK), 0);
+}
+END_TEST
 
 Suite * adaptor_suite(void)
 {
@@ -190,6 +1726,40 @@ Suite * adaptor_suite(void)
     tcase_add_test(tc_core, test_zmq_context_lifecycle);
     tcase_add_test(tc_core, test_gateway_listener);
     tcase_add_test(tc_core, test_gateway_listener_over_abstract_socket);
+    tcase_add_test(tc_core, test_multipart_larger_than_batch);
+#ifdef ZMQ_XPUB_NODROP
+    tcase_add_test(tc_core, test_nodrop_refuses_whole_messages);
+#endif
+    tcase_add_test(tc_core, test_shard_endpoints);
+    tcase_add_test(tc_core, test_sharded_gateway_listener);
+    tcase_add_test(tc_core, test_ingress_endpoint_list);
+    tcase_add_test(tc_core, test_relay);
+    tcase_add_test(tc_core, test_wait_strategies);
+    tcase_add_test(tc_core, test_latency_tracing);
+    tcase_add_test(tc_core, test_shm_ingress);
+    tcase_add_test(tc_core, test_shm_corrupted_ring);
+    tcase_add_test(tc_core, test_shm_wrapped_message);
+    tcase_add_test(tc_core, test_ring_drop_newest);
+    tcase_add_test(tc_core, test_socket_monitor);
+    tcase_add_test(tc_core, test_metrics_render);
+    tcase_add_test(tc_core, test_subscription_index);
+    tcase_add_test(tc_core, test_upstream_subscriptions_are_merged);
+    tcase_add_test(tc_core, test_spool_replay);
+    tcase_add_test(tc_core, test_spool_eviction);
+    tcase_add_test(tc_core, test_replay_window);
+    tcase_add_test(tc_core, test_slow_consumer_detection);
+    tcase_add_test(tc_core, test_coalesced_messages);
+    tcase_add_test(tc_core, test_compressed_subscriptions);
+#ifdef HAVE_LIBZSTD
+    tcase_add_test(tc_core, test_compressed_messages);
+#endif
+    tcase_add_test(tc_core, test_inbound_pusher);
+    tcase_add_test(tc_core, test_inbound_pusher_without_workers);
+    tcase_add_test(tc_core, test_routing_rules);
+    tcase_add_test(tc_core, test_balanced_workers);
+    tcase_add_test(tc_core, test_drain_on_shutdown);
+    tcase_add_test(tc_core, test_hot_restart_handover);
+    tcase_add_test(tc_core, test_usage_rollups);
     suite_add_tcase(s, tc_core);
 
     return s;